@@ -0,0 +1,269 @@
+/* Loopback benchmark client for bench_server.
+ *
+ * 1. TCP connect N rooms to 127.0.0.1
+ * 2. Auth and heartbeat like ex6
+ * 3. Decode, inflate and route every message on the same path as ex6
+ * 4. Report throughput, CPU per message and latency percentiles
+ *
+ * Usage: bench_client [connections] [seconds] [port] [uv|epoll|uring]
+ *
+ * The transport is an ex_io backend, so the same client measures what
+ * libuv's layering costs per message against a bare epoll loop and
+ * io_uring. `uring` runs on epoll where io_uring is not available.
+ *
+ * Latency is from the uv_hrtime() the server stamped into the message to
+ * the moment it has been routed by `cmd` (see ex_cmd.h) and its `ts`
+ * field extracted here; both ends share the monotonic clock. The first EX_BENCH_WARMUP_MS are not counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/resource.h>
+
+#include <uv.h>
+
+#include "ex_cmd.h"
+#include "ex_frame.h"
+#include "ex_hist.h"
+#include "ex_inflate.h"
+#include "ex_io.h"
+#include "ex_json.h"
+#include "ex_mock.h"
+
+#define EX_BENCH_WARMUP_MS    1000
+#define EX_HEARTBEAT_MS       30000
+
+typedef struct ex_bench_s {
+  ex_io_t *io;
+  ex_io_timer_t warmup;
+  ex_io_timer_t done;
+  ex_io_timer_t heartbeat;
+  ex_inflate_t inflater;
+
+  int measuring;
+  uint64_t start_ns;
+  struct rusage start_ru;
+  uint64_t start_reads;
+  uint64_t start_wakeups;
+  uint64_t start_syscalls;
+  uint64_t messages;
+  uint64_t unknown;         /* Of those, with a cmd not in ex_cmd.def */
+  uint64_t bytes;
+  uint64_t errors;
+  ex_hist_t latency;
+} ex_bench_t;
+
+typedef struct ex_room_s {
+  ex_io_conn_t conn;
+  ex_bench_t *bench;
+  ex_frame_decoder_t decoder;
+  int tcp_on;
+} ex_room_t;
+
+void ex_connect_cb(ex_io_conn_t *conn, int status);
+void ex_read_cb(ex_io_conn_t *conn, ssize_t nread, const uint8_t *data);
+void ex_warmup_cb(ex_io_timer_t *timer);
+void ex_done_cb(ex_io_timer_t *timer);
+void ex_heartbeat_cb(ex_io_timer_t *timer);
+int ex_decode_cb(const ex_frame_t *frame, void *arg);
+int ex_room_write(ex_room_t *room, const uint8_t *data, size_t len);
+
+const uint8_t web_handshake[] = {0,0,0,16, 0,16, 0,1, 0,0,0,7, 0,0,0,1};
+const uint8_t web_heartbeat[] = {0,0,0,16, 0,16, 0,1, 0,0,0,2, 0,0,0,1};
+
+static ex_room_t *rooms;
+static int nrooms;
+
+int
+main(int argc, char *argv[]) {
+  static ex_io_t io;
+  ex_bench_t bench;
+  struct sockaddr_in addr;
+  int seconds = argc > 2 ? atoi(argv[2]) : 5;
+  int port = argc > 3 ? atoi(argv[3]) : EX_MOCK_PORT;
+  const char *backend = argc > 4 ? argv[4] : "uv";
+  const ex_io_ops_t *ops = ex_io_backend(backend);
+  int rc = 0;
+
+  if (!ops) {
+    fprintf(stderr, "bench_client: no such backend: %s\n", backend);
+    return EXIT_FAILURE;
+  }
+
+  nrooms = argc > 1 ? atoi(argv[1]) : 100;
+  if (nrooms <= 0)
+    nrooms = 1;
+  if (seconds <= 0)
+    seconds = 5;
+  rooms = calloc(nrooms, sizeof(*rooms));
+  assert(rooms && "failed at calloc()");
+
+  rc = ex_io_init(&io, ops);
+  assert(rc >= 0 && "failed at ex_io_init()");
+
+  memset(&bench, 0, sizeof(bench));
+  bench.io = &io;
+  ex_hist_reset(&bench.latency);
+  rc = ex_inflate_init(&bench.inflater, 0);
+  assert(rc >= 0 && "failed at ex_inflate_init()");
+
+  rc = uv_ip4_addr("127.0.0.1", port, &addr);
+  assert(rc >= 0 && "failed at uv_ip4_addr()");
+  for (int i = 0; i < nrooms; ++i) {
+    rooms[i].bench = &bench;
+    ex_frame_decoder_init(&rooms[i].decoder, 0);
+    rooms[i].conn.data = &rooms[i];
+    rooms[i].tcp_on = 1;
+    rc = ex_io_connect(&io, &rooms[i].conn, (const struct sockaddr *)&addr, ex_connect_cb);
+    assert(rc >= 0 && "failed at ex_io_connect()");
+  }
+
+  ex_io_timer_init(&io, &bench.warmup);
+  ex_io_timer_init(&io, &bench.done);
+  ex_io_timer_init(&io, &bench.heartbeat);
+  bench.warmup.data = bench.done.data = bench.heartbeat.data = &bench;
+  ex_io_timer_start(&bench.warmup, ex_warmup_cb, EX_BENCH_WARMUP_MS, 0);
+  ex_io_timer_start(&bench.done, ex_done_cb, EX_BENCH_WARMUP_MS + seconds * 1000, 0);
+  ex_io_timer_start(&bench.heartbeat, ex_heartbeat_cb, EX_HEARTBEAT_MS, EX_HEARTBEAT_MS);
+
+  rc = ex_io_run(&io);
+  assert(rc >= 0 && "failed at ex_io_run()");
+
+  for (int i = 0; i < nrooms; ++i)
+    ex_frame_decoder_free(&rooms[i].decoder);
+  free(rooms);
+  ex_inflate_free(&bench.inflater);
+  ex_io_free(&io);
+  return bench.messages && !bench.errors ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void
+ex_connect_cb(ex_io_conn_t *conn, int status) {
+  ex_room_t *room = conn->data;
+
+  if (status < 0) {
+    fprintf(stderr, "bench_client: connect: %s\n", uv_strerror(status));
+    room->bench->errors++;
+    return;
+  }
+  ex_room_write(room, web_handshake, sizeof(web_handshake));
+  ex_io_read_start(conn, ex_read_cb);
+}
+
+int
+ex_room_write(ex_room_t *room, const uint8_t *data, size_t len) {
+  struct iovec iov = { (void *)data, len };
+
+  return ex_io_writev(&room->conn, &iov, 1);
+}
+
+void
+ex_read_cb(ex_io_conn_t *conn, ssize_t nread, const uint8_t *data) {
+  ex_room_t *room = conn->data;
+  ex_bench_t *bench = room->bench;
+  int rc = 0;
+
+  if (nread > 0) {
+    if (bench->measuring)
+      bench->bytes += nread;
+    rc = ex_frame_feed(&room->decoder, data, nread, ex_decode_cb, room);
+    if (rc == 0)
+      return;
+    fprintf(stderr, "bench_client: decode: %s\n", uv_strerror(rc));
+  }
+  bench->errors++;
+  room->tcp_on = 0;
+  ex_io_close(conn, NULL);
+}
+
+int
+ex_decode_cb(const ex_frame_t *frame, void *arg) {
+  ex_room_t *room = arg;
+  ex_bench_t *bench = room->bench;
+  const char *colon = NULL;
+  ex_json_val_t name, ts;
+  uint64_t sent = 0;
+  int cmd = EX_CMD_UNKNOWN;
+
+  if (frame->ver == EX_VER_ZLIB)
+    return ex_inflate_frame(&bench->inflater, frame, ex_decode_cb, room);
+  if (frame->op != EX_OP_MESSAGE || !bench->measuring)
+    return 0;
+
+  /* Routed as ex6 does, on `cmd` alone, before the body is looked at */
+  if (ex_json_cmd((const char *)frame->body, frame->body_len, &name) != 1)
+    return UV_EPROTO;
+  colon = memchr(name.data, ':', name.len);
+  cmd = ex_cmd_lookup(name.data, colon ? (size_t)(colon - name.data) : name.len);
+  if (cmd == EX_CMD_UNKNOWN)
+    bench->unknown++;
+
+  if (ex_json_get((const char *)frame->body, frame->body_len, "ts", &ts) != 1)
+    return UV_EPROTO;
+  for (size_t i = 0; i < ts.len; ++i)
+    sent = sent * 10 + (ts.data[i] - '0');
+
+  ex_hist_record(&bench->latency, uv_hrtime() - sent);
+  bench->messages++;
+  return 0;
+}
+
+void
+ex_warmup_cb(ex_io_timer_t *timer) {
+  ex_bench_t *bench = timer->data;
+
+  bench->measuring = 1;
+  bench->start_ns = uv_hrtime();
+  bench->start_reads = bench->io->reads;
+  bench->start_wakeups = bench->io->wakeups;
+  bench->start_syscalls = bench->io->syscalls;
+  getrusage(RUSAGE_SELF, &bench->start_ru);
+}
+
+void
+ex_heartbeat_cb(ex_io_timer_t *timer) {
+  for (int i = 0; i < nrooms; ++i) {
+    if (rooms[i].tcp_on)
+      ex_room_write(&rooms[i], web_heartbeat, sizeof(web_heartbeat));
+  }
+}
+
+static double
+cpu_ns(const struct rusage *a, const struct rusage *b) {
+  return ((b->ru_utime.tv_sec - a->ru_utime.tv_sec) + (b->ru_stime.tv_sec - a->ru_stime.tv_sec)) * 1e9 +
+      ((b->ru_utime.tv_usec - a->ru_utime.tv_usec) + (b->ru_stime.tv_usec - a->ru_stime.tv_usec)) * 1e3;
+}
+
+void
+ex_done_cb(ex_io_timer_t *timer) {
+  ex_bench_t *bench = timer->data;
+  double secs = (uv_hrtime() - bench->start_ns) / 1e9;
+  uint64_t reads = bench->io->reads - bench->start_reads;
+  uint64_t wakeups = bench->io->wakeups - bench->start_wakeups;
+  struct rusage ru;
+  ex_hist_t *lat = &bench->latency;
+
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%s, rooms %d, %.1f s: %.0f msgs/s, %.1f MB/s, %.0f ns cpu/msg\n",
+      bench->io->ops->name, nrooms, secs, bench->messages / secs, bench->bytes / secs / 1e6,
+      bench->messages ? cpu_ns(&bench->start_ru, &ru) / bench->messages : 0.0);
+  printf("reads %lu (%.1f msgs each), wakeups %lu (%.1f reads each), syscalls %lu\n",
+      reads, reads ? (double)bench->messages / reads : 0.0,
+      wakeups, wakeups ? (double)reads / wakeups : 0.0, bench->io->syscalls - bench->start_syscalls);
+  printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f (%lu msgs, %lu with an unknown cmd)\n",
+      ex_hist_percentile(lat, 50) / 1e3, ex_hist_percentile(lat, 99) / 1e3,
+      ex_hist_percentile(lat, 99.9) / 1e3, lat->max / 1e3, lat->count, bench->unknown);
+
+  bench->measuring = 0;
+  for (int i = 0; i < nrooms; ++i) {
+    if (rooms[i].tcp_on) {
+      rooms[i].tcp_on = 0;
+      ex_io_close(&rooms[i].conn, NULL);
+    }
+  }
+  ex_io_timer_stop(&bench->heartbeat);
+}
@@ -0,0 +1,296 @@
+/* Mock live server for the loopback benchmark.
+ *
+ * 1. Accept on 127.0.0.1
+ * 2. Reply to auth and heartbeats like broadcastlv does
+ * 3. Push op=5 messages to every authed connection at a fixed rate
+ *
+ * Usage: bench_server [port] [rate] [size] [batch]
+ *
+ * `rate` is messages per second per connection (0 for as fast as the
+ * socket drains), `size` the message body length and `batch` how many
+ * messages share a zlib frame (0 for plain frames). Each connection is one
+ * room. Connections that fall behind are not queued for without bound:
+ * ticks are skipped while their write queue is over EX_BENCH_QUEUE_MAX.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+
+#include <uv.h>
+
+#include "ex_frame.h"
+#include "ex_mock.h"
+
+#define EX_BENCH_TICK_MS      1
+#define EX_BENCH_QUEUE_MAX    (4 << 20)
+#define EX_BENCH_BURST_MAX    4096      /* Messages per connection per tick */
+
+typedef struct ex_server_s ex_server_t;
+
+typedef struct ex_peer_s {
+  uv_tcp_t tcp;
+  ex_server_t *server;
+  struct ex_peer_s *next;
+  struct ex_peer_s **pprev;
+  ex_frame_decoder_t decoder;
+  int authed;
+  uint64_t start_ms;
+  uint64_t due;           /* Messages owed since start_ms */
+} ex_peer_t;
+
+typedef struct ex_write_s {
+  uv_write_t req;
+  ex_mock_buf_t buf;
+} ex_write_t;
+
+struct ex_server_s {
+  uv_loop_t *loop;
+  uv_tcp_t listener;
+  uv_timer_t ticker;
+  uv_signal_t sigint;
+  uv_signal_t sigterm;
+  ex_peer_t *peers;
+  ex_mock_t mock;
+  uint32_t rate;
+  uint8_t rdbuf[65536];
+
+  uint64_t accepted;
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t stalls;
+};
+
+void ex_connection_cb(uv_stream_t *listener, int status);
+void ex_alloc_cb(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+void ex_read_cb(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf);
+void ex_write_cb(uv_write_t *req, int status);
+void ex_close_cb(uv_handle_t *handle);
+void ex_tick_cb(uv_timer_t *handle);
+void ex_signal_cb(uv_signal_t *handle, int signum);
+int ex_peer_send(ex_peer_t *peer, ex_mock_buf_t *buf);
+int ex_peer_frame_cb(const ex_frame_t *frame, void *arg);
+
+int
+main(int argc, char *argv[]) {
+  uv_loop_t loop;
+  ex_server_t server;
+  struct sockaddr_in addr;
+  int port = argc > 1 ? atoi(argv[1]) : EX_MOCK_PORT;
+  int rc = 0;
+
+  memset(&server, 0, sizeof(server));
+  server.rate = argc > 2 ? atoi(argv[2]) : 1000;
+  rc = ex_mock_init(&server.mock, argc > 3 ? atoi(argv[3]) : 256, argc > 4 ? atoi(argv[4]) : 0);
+  assert(rc >= 0 && "failed at ex_mock_init()");
+
+  rc = uv_loop_init(&loop);
+  assert(rc >= 0 && "failed at uv_loop_init()");
+  server.loop = &loop;
+
+  rc = uv_ip4_addr("127.0.0.1", port, &addr);
+  assert(rc >= 0 && "failed at uv_ip4_addr()");
+  rc = uv_tcp_init(&loop, &server.listener);
+  assert(rc >= 0 && "failed at uv_tcp_init()");
+  server.listener.data = &server;
+  rc = uv_tcp_bind(&server.listener, (const struct sockaddr *)&addr, 0);
+  assert(rc >= 0 && "failed at uv_tcp_bind()");
+  rc = uv_listen((uv_stream_t *)&server.listener, 1024, ex_connection_cb);
+  assert(rc >= 0 && "failed at uv_listen()");
+
+  uv_timer_init(&loop, &server.ticker);
+  server.ticker.data = &server;
+  uv_timer_start(&server.ticker, ex_tick_cb, EX_BENCH_TICK_MS, EX_BENCH_TICK_MS);
+
+  uv_signal_init(&loop, &server.sigint);
+  uv_signal_init(&loop, &server.sigterm);
+  server.sigint.data = server.sigterm.data = &server;
+  uv_signal_start(&server.sigint, ex_signal_cb, SIGINT);
+  uv_signal_start(&server.sigterm, ex_signal_cb, SIGTERM);
+
+  fprintf(stderr, "bench_server: 127.0.0.1:%d, %u msgs/s per room, %u bytes, batch %u\n",
+      port, server.rate, server.mock.size, server.mock.batch);
+
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run()");
+
+  fprintf(stderr, "bench_server: %lu rooms, %lu messages, %lu bytes, %lu stalled ticks\n",
+      server.accepted, server.messages, server.bytes, server.stalls);
+  ex_mock_free(&server.mock);
+  uv_loop_close(&loop);
+  return EXIT_SUCCESS;
+}
+
+void
+ex_connection_cb(uv_stream_t *listener, int status) {
+  ex_server_t *server = listener->data;
+  ex_peer_t *peer = NULL;
+
+  if (status < 0)
+    return;
+
+  peer = calloc(1, sizeof(*peer));
+  assert(peer && "failed at calloc()");
+  uv_tcp_init(server->loop, &peer->tcp);
+  peer->tcp.data = peer;
+  peer->server = server;
+  ex_frame_decoder_init(&peer->decoder, 0);
+
+  if (uv_accept(listener, (uv_stream_t *)&peer->tcp) < 0) {
+    uv_close((uv_handle_t *)&peer->tcp, ex_close_cb);
+    return;
+  }
+  uv_tcp_nodelay(&peer->tcp, 1);
+
+  peer->next = server->peers;
+  if (peer->next)
+    peer->next->pprev = &peer->next;
+  peer->pprev = &server->peers;
+  server->peers = peer;
+  server->accepted++;
+
+  uv_read_start((uv_stream_t *)&peer->tcp, ex_alloc_cb, ex_read_cb);
+}
+
+void
+ex_alloc_cb(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+  ex_peer_t *peer = handle->data;
+
+  buf->base = (char *)peer->server->rdbuf;
+  buf->len = sizeof(peer->server->rdbuf);
+}
+
+void
+ex_read_cb(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf) {
+  ex_peer_t *peer = strm->data;
+
+  if (nread > 0 && ex_frame_feed(&peer->decoder, (uint8_t *)buf->base, nread, ex_peer_frame_cb, peer) == 0)
+    return;
+  if (nread == 0)
+    return;
+  if (!uv_is_closing((uv_handle_t *)strm))
+    uv_close((uv_handle_t *)strm, ex_close_cb);
+}
+
+/* Auth and heartbeats from the client */
+int
+ex_peer_frame_cb(const ex_frame_t *frame, void *arg) {
+  static const char auth_ok[] = "{\"code\":0}";
+  static const uint8_t popularity[] = {0, 0, 0, 1};
+  ex_peer_t *peer = arg;
+  ex_mock_buf_t out = {0};
+
+  switch (frame->op) {
+  case EX_OP_AUTH:
+    ex_mock_reply(&out, EX_OP_AUTH_REPLY, auth_ok, sizeof(auth_ok) - 1);
+    peer->authed = 1;
+    peer->start_ms = uv_now(peer->server->loop);
+    peer->due = 0;
+    break;
+  case EX_OP_HEARTBEAT:
+    ex_mock_reply(&out, EX_OP_HEARTBEAT_REPLY, popularity, sizeof(popularity));
+    break;
+  default:
+    return 0;
+  }
+  return ex_peer_send(peer, &out);
+}
+
+/* Takes over `buf` */
+int
+ex_peer_send(ex_peer_t *peer, ex_mock_buf_t *buf) {
+  ex_write_t *w = NULL;
+  uv_buf_t b = uv_buf_init((char *)buf->data, buf->len);
+  int rc = 0;
+
+  w = malloc(sizeof(*w));
+  if (!w) {
+    ex_mock_buf_free(buf);
+    return UV_ENOMEM;
+  }
+  w->buf = *buf;
+  w->req.data = w;
+  peer->server->bytes += buf->len;
+  rc = uv_write(&w->req, (uv_stream_t *)&peer->tcp, &b, 1, ex_write_cb);
+  if (rc < 0) {
+    ex_mock_buf_free(&w->buf);
+    free(w);
+  }
+  return rc;
+}
+
+void
+ex_write_cb(uv_write_t *req, int status) {
+  ex_write_t *w = req->data;
+
+  ex_mock_buf_free(&w->buf);
+  free(w);
+}
+
+void
+ex_close_cb(uv_handle_t *handle) {
+  ex_peer_t *peer = handle->data;
+
+  if (peer->pprev) {
+    *peer->pprev = peer->next;
+    if (peer->next)
+      peer->next->pprev = peer->pprev;
+  }
+  ex_frame_decoder_free(&peer->decoder);
+  free(peer);
+}
+
+/* Tops every room up to what it is owed by now */
+void
+ex_tick_cb(uv_timer_t *handle) {
+  ex_server_t *server = handle->data;
+  uint64_t now = uv_now(server->loop);
+  uint64_t owed = 0;
+  uint32_t count = 0;
+  ex_mock_buf_t out;
+
+  for (ex_peer_t *peer = server->peers; peer; peer = peer->next) {
+    if (!peer->authed || uv_is_closing((uv_handle_t *)&peer->tcp))
+      continue;
+    if (peer->tcp.write_queue_size > EX_BENCH_QUEUE_MAX) {
+      server->stalls++;
+      continue;
+    }
+
+    if (server->rate) {
+      owed = server->rate * (now - peer->start_ms) / 1000;
+      count = owed - peer->due > EX_BENCH_BURST_MAX ? EX_BENCH_BURST_MAX : owed - peer->due;
+    }
+    else {
+      count = EX_BENCH_BURST_MAX / 16;
+    }
+    if (!count)
+      continue;
+
+    memset(&out, 0, sizeof(out));
+    if (ex_mock_messages(&server->mock, &out, count, uv_hrtime()) < 0) {
+      ex_mock_buf_free(&out);
+      continue;
+    }
+    peer->due += count;
+    server->messages += count;
+    ex_peer_send(peer, &out);
+  }
+}
+
+void
+ex_signal_cb(uv_signal_t *handle, int signum) {
+  ex_server_t *server = handle->data;
+
+  for (ex_peer_t *peer = server->peers; peer; peer = peer->next) {
+    if (!uv_is_closing((uv_handle_t *)&peer->tcp))
+      uv_close((uv_handle_t *)&peer->tcp, ex_close_cb);
+  }
+  uv_close((uv_handle_t *)&server->listener, NULL);
+  uv_close((uv_handle_t *)&server->ticker, NULL);
+  uv_close((uv_handle_t *)&server->sigint, NULL);
+  uv_close((uv_handle_t *)&server->sigterm, NULL);
+}
@@ -0,0 +1,519 @@
+/* An epoll example. A mock live server for load tests.
+ *
+ * 1. Accept on 127.0.0.1, one SO_REUSEPORT listener per thread
+ * 2. Edge-triggered epoll: read and write until EAGAIN, never block
+ * 3. Reply to auth and heartbeats like broadcastlv does
+ * 4. Push op=5 messages to every authed connection (see ex_mock.h)
+ *
+ * Usage: ex0 [port] [scenario] [rate] [size] [batch] [threads]
+ *
+ * Scenarios, each connection on its own:
+ *
+ *   stream    `rate` messages per second (0: as fast as the socket drains)
+ *   burst     `rate` messages at once, every EX0_BURST_MS
+ *   drip      one byte of the stream per tick, frames split every which way
+ *   halfopen  auth reply, then nothing: no reads, no writes, no FIN
+ *   rst       stream for EX0_RST_MS, then reset the connection
+ *
+ * and one where they share:
+ *
+ *   room      `rate` messages per second, the same ones to every connection
+ *             on a thread, like one live room; a connection that has not
+ *             taken the last ones misses them
+ *
+ * Each thread owns its connections outright, so nothing on the data path
+ * is shared. Point the clients at it with EX_HOST=127.0.0.1 EX_PORT=<port>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "ex_frame.h"
+#include "ex_mock.h"
+
+#define EX0_TICK_MS       1
+#define EX0_EVENTS        256
+#define EX0_RDBUF_LEN     65536
+#define EX0_OUT_MAX       (1 << 20)   /* Stop topping up past this much unsent */
+#define EX0_BURST_MAX     4096        /* Messages per connection per tick */
+#define EX0_BURST_MS      1000
+#define EX0_RST_MS        2000
+#define EX0_STATUS_MS     1000
+
+enum ex0_scenario {
+  EX0_STREAM = 0,
+  EX0_BURST,
+  EX0_DRIP,
+  EX0_HALFOPEN,
+  EX0_RST,
+  EX0_ROOM,
+};
+
+static const char *const scenarios[] = { "stream", "burst", "drip", "halfopen", "rst", "room" };
+
+typedef struct ex0_conn_s {
+  int fd;
+  size_t index;               /* In the worker's connection array */
+  ex_frame_decoder_t decoder;
+  ex_mock_buf_t out;
+  size_t out_off;
+  int authed;
+  int dark;                   /* halfopen: left alone for good */
+  uint64_t drip_ms;           /* drip: when the last byte went out */
+  uint64_t start_ms;
+  uint64_t due;               /* Messages sent since start_ms */
+} ex0_conn_t;
+
+typedef struct ex0_worker_s {
+  pthread_t thread;
+  int epfd;
+  int lfd;
+  ex_mock_t mock;
+  ex_mock_buf_t room;         /* room: this tick's messages, for everyone */
+  uint64_t room_start_ms;
+  uint64_t room_due;
+  ex0_conn_t **conns;
+  size_t nconns;
+  size_t cap;
+  uint8_t rdbuf[EX0_RDBUF_LEN];
+
+  /* Read by the status thread */
+  uint64_t accepted;
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t resets;
+} ex0_worker_t;
+
+static int port = EX_MOCK_PORT;
+static int scenario = EX0_STREAM;
+static uint32_t rate = 1000;
+static uint32_t msg_size = 256;
+static uint32_t batch = 0;
+static volatile sig_atomic_t stopping;
+
+void *ex0_worker_run(void *arg);
+int ex0_listen(void);
+void ex0_accept(ex0_worker_t *w);
+void ex0_read(ex0_worker_t *w, ex0_conn_t *c);
+int ex0_flush(ex0_worker_t *w, ex0_conn_t *c);
+void ex0_tick(ex0_worker_t *w, uint64_t now);
+void ex0_close(ex0_worker_t *w, ex0_conn_t *c, int reset);
+int ex0_frame_cb(const ex_frame_t *frame, void *arg);
+void ex0_signal(int signum);
+
+static uint64_t
+now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+main(int argc, char *argv[]) {
+  ex0_worker_t *workers = NULL;
+  int nthreads = argc > 6 ? atoi(argv[6]) : 1;
+  struct rlimit rl;
+  uint64_t last[2] = {0, 0};
+  uint64_t totals[4];
+  int rc = 0;
+
+  if (argc > 1)
+    port = atoi(argv[1]);
+  if (argc > 2) {
+    for (scenario = 0; scenario < (int)(sizeof(scenarios)/sizeof(scenarios[0])); ++scenario) {
+      if (strcmp(argv[2], scenarios[scenario]) == 0)
+        break;
+    }
+    if (scenario == (int)(sizeof(scenarios)/sizeof(scenarios[0]))) {
+      fprintf(stderr, "ex0: unknown scenario %s\n", argv[2]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc > 3)
+    rate = atoi(argv[3]);
+  if (argc > 4)
+    msg_size = atoi(argv[4]);
+  if (argc > 5)
+    batch = atoi(argv[5]);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  /* Tens of thousands of sockets need more than the default 1024 fds. */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, ex0_signal);
+  signal(SIGTERM, ex0_signal);
+
+  workers = calloc(nthreads, sizeof(*workers));
+  assert(workers && "failed at calloc()");
+  for (int i = 0; i < nthreads; ++i) {
+    workers[i].lfd = ex0_listen();
+    assert(workers[i].lfd >= 0 && "failed at ex0_listen()");
+    rc = ex_mock_init(&workers[i].mock, msg_size, batch);
+    assert(rc >= 0 && "failed at ex_mock_init()");
+    rc = pthread_create(&workers[i].thread, NULL, ex0_worker_run, &workers[i]);
+    assert(rc == 0 && "failed at pthread_create()");
+  }
+
+  fprintf(stderr, "ex0: 127.0.0.1:%d, %s, rate %u, %u bytes, batch %u, %d threads\n",
+      port, scenarios[scenario], rate, workers[0].mock.size, batch, nthreads);
+
+  /* Status once a second until SIGINT/SIGTERM */
+  while (!stopping) {
+    usleep(EX0_STATUS_MS * 1000);
+    memset(totals, 0, sizeof(totals));
+    for (int i = 0; i < nthreads; ++i) {
+      totals[0] += __atomic_load_n(&workers[i].accepted, __ATOMIC_RELAXED);
+      totals[1] += __atomic_load_n(&workers[i].messages, __ATOMIC_RELAXED);
+      totals[2] += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+      totals[3] += __atomic_load_n(&workers[i].resets, __ATOMIC_RELAXED);
+    }
+    fprintf(stderr, "ex0: %lu accepted, %lu msgs/s, %.1f MB/s, %lu resets\n",
+        totals[0], totals[1] - last[0], (totals[2] - last[1]) / 1e6, totals[3]);
+    last[0] = totals[1];
+    last[1] = totals[2];
+  }
+
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    ex_mock_free(&workers[i].mock);
+    ex_mock_buf_free(&workers[i].room);
+  }
+  free(workers);
+  return EXIT_SUCCESS;
+}
+
+void
+ex0_signal(int signum) {
+  stopping = 1;
+}
+
+int
+ex0_listen(void) {
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int on = 1;
+
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void *
+ex0_worker_run(void *arg) {
+  ex0_worker_t *w = arg;
+  struct epoll_event events[EX0_EVENTS];
+  struct epoll_event ev;
+  uint64_t next_tick = now_ns() / 1000000 + EX0_TICK_MS;
+  uint64_t now = 0;
+  ex0_conn_t *c = NULL;
+  int n = 0;
+
+  w->epfd = epoll_create1(EPOLL_CLOEXEC);
+  assert(w->epfd >= 0 && "failed at epoll_create1()");
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL;     /* The listener */
+  epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->lfd, &ev);
+
+  while (!stopping) {
+    now = now_ns() / 1000000;
+    n = epoll_wait(w->epfd, events, EX0_EVENTS, next_tick > now ? (int)(next_tick - now) : 0);
+    if (n < 0 && errno != EINTR)
+      break;
+
+    for (int i = 0; i < n; ++i) {
+      c = events[i].data.ptr;
+      if (!c) {
+        ex0_accept(w);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ex0_read(w, c);
+        if (c->fd < 0) {
+          free(c);
+          continue;
+        }
+      }
+      if (events[i].events & EPOLLOUT && ex0_flush(w, c) < 0) {
+        ex0_close(w, c, 0);
+        free(c);
+      }
+    }
+
+    now = now_ns() / 1000000;
+    if (now >= next_tick) {
+      ex0_tick(w, now);
+      next_tick = now + EX0_TICK_MS;
+    }
+  }
+
+  while (w->nconns > 0) {
+    c = w->conns[w->nconns - 1];
+    ex0_close(w, c, 0);
+    free(c);
+  }
+  free(w->conns);
+  close(w->lfd);
+  close(w->epfd);
+  return NULL;
+}
+
+/* Edge-triggered: drain the accept queue */
+void
+ex0_accept(ex0_worker_t *w) {
+  struct epoll_event ev;
+  ex0_conn_t *c = NULL;
+  void *conns = NULL;
+  int on = 1;
+  int fd = -1;
+
+  for (;;) {
+    fd = accept4(w->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+
+    if (w->nconns == w->cap) {
+      conns = realloc(w->conns, (w->cap ? w->cap * 2 : 1024) * sizeof(*w->conns));
+      if (!conns) {
+        close(fd);
+        continue;
+      }
+      w->conns = conns;
+      w->cap = w->cap ? w->cap * 2 : 1024;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    ex_frame_decoder_init(&c->decoder, 0);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      ex_frame_decoder_free(&c->decoder);
+      close(fd);
+      free(c);
+      continue;
+    }
+    c->index = w->nconns;
+    w->conns[w->nconns++] = c;
+    __atomic_fetch_add(&w->accepted, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* Edge-triggered: read until EAGAIN, or the peer is gone */
+void
+ex0_read(ex0_worker_t *w, ex0_conn_t *c) {
+  ssize_t n = 0;
+
+  for (;;) {
+    n = read(c->fd, w->rdbuf, sizeof(w->rdbuf));
+    if (n > 0) {
+      if (ex_frame_feed(&c->decoder, w->rdbuf, n, ex0_frame_cb, c) < 0)
+        break;
+      if (c->dark)
+        return;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      if (ex0_flush(w, c) < 0)
+        break;
+      return;
+    }
+    break;
+  }
+  ex0_close(w, c, 0);
+}
+
+/* Auth and heartbeats from the client */
+int
+ex0_frame_cb(const ex_frame_t *frame, void *arg) {
+  static const char auth_ok[] = "{\"code\":0}";
+  static const uint8_t popularity[] = {0, 0, 0, 1};
+  ex0_conn_t *c = arg;
+
+  switch (frame->op) {
+  case EX_OP_AUTH:
+    c->authed = 1;
+    c->start_ms = now_ns() / 1000000;
+    c->due = 0;
+    return ex_mock_reply(&c->out, EX_OP_AUTH_REPLY, auth_ok, sizeof(auth_ok) - 1);
+  case EX_OP_HEARTBEAT:
+    return ex_mock_reply(&c->out, EX_OP_HEARTBEAT_REPLY, popularity, sizeof(popularity));
+  default:
+    return 0;
+  }
+}
+
+/* Writes until done or EAGAIN; EPOLLOUT brings us back for the rest. */
+int
+ex0_flush(ex0_worker_t *w, ex0_conn_t *c) {
+  size_t limit = 0;
+  ssize_t n = 0;
+  uint64_t now = 0;
+
+  if (c->dark)
+    return 0;
+  if (scenario == EX0_DRIP && c->authed) {
+    now = now_ns() / 1000000;
+    if (now - c->drip_ms < EX0_TICK_MS)
+      return 0;
+    c->drip_ms = now;
+  }
+
+  while (c->out_off < c->out.len) {
+    /* drip: a byte per tick, so frames straddle every read */
+    limit = scenario == EX0_DRIP && c->authed ? 1 : c->out.len - c->out_off;
+    n = write(c->fd, c->out.data + c->out_off, limit);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return errno == EAGAIN ? 0 : -1;
+    c->out_off += n;
+    __atomic_fetch_add(&w->bytes, n, __ATOMIC_RELAXED);
+    if (scenario == EX0_DRIP && c->authed)
+      break;
+  }
+  if (c->out_off == c->out.len)
+    c->out_off = c->out.len = 0;
+
+  /* halfopen: the auth reply is out; go dark without a FIN. */
+  if (scenario == EX0_HALFOPEN && c->authed && c->out.len == 0) {
+    c->dark = 1;
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  }
+  return 0;
+}
+
+void
+ex0_tick(ex0_worker_t *w, uint64_t now) {
+  ex0_conn_t *c = NULL;
+  uint64_t owed = 0;
+  uint32_t count = 0;
+  uint32_t room_count = 0;
+
+  /* Built once, copied to each connection below */
+  if (scenario == EX0_ROOM) {
+    if (!w->room_start_ms)
+      w->room_start_ms = now;
+    owed = rate ? (uint64_t)rate * (now - w->room_start_ms) / 1000 : w->room_due + EX0_BURST_MAX / 16;
+    room_count = owed - w->room_due > EX0_BURST_MAX ? EX0_BURST_MAX : owed - w->room_due;
+    w->room.len = 0;
+    if (room_count > 0 && ex_mock_messages(&w->mock, &w->room, room_count, now_ns()) == 0)
+      w->room_due += room_count;
+    else
+      room_count = 0;
+  }
+
+  for (size_t i = 0; i < w->nconns; ++i) {
+    c = w->conns[i];
+    if (!c->authed || c->dark)
+      continue;
+
+    if (scenario == EX0_RST && now - c->start_ms >= EX0_RST_MS) {
+      ex0_close(w, c, 1);
+      free(c);
+      i--;
+      continue;
+    }
+
+    /* Top up only what the socket has taken */
+    count = 0;
+    if (c->out.len - c->out_off < EX0_OUT_MAX) {
+      switch (scenario) {
+      case EX0_STREAM:
+      case EX0_RST:
+        if (!rate) {
+          count = EX0_BURST_MAX / 16;
+          break;
+        }
+        owed = (uint64_t)rate * (now - c->start_ms) / 1000;
+        count = owed - c->due > EX0_BURST_MAX ? EX0_BURST_MAX : owed - c->due;
+        break;
+      case EX0_BURST:
+        if ((now - c->start_ms) / EX0_BURST_MS >= c->due / (rate ? rate : 1))
+          count = rate ? rate : 1;
+        break;
+      case EX0_DRIP:
+        count = c->out.len == c->out_off;
+        break;
+      case EX0_ROOM:
+        if (room_count && ex_mock_buf_reserve(&c->out, w->room.len) == 0) {
+          memcpy(c->out.data + c->out.len, w->room.data, w->room.len);
+          c->out.len += w->room.len;
+          __atomic_fetch_add(&w->messages, room_count, __ATOMIC_RELAXED);
+        }
+        break;
+      }
+    }
+
+    if (count > 0 && ex_mock_messages(&w->mock, &c->out, count, now_ns()) == 0) {
+      c->due += count;
+      __atomic_fetch_add(&w->messages, count, __ATOMIC_RELAXED);
+    }
+    if (c->out_off < c->out.len && ex0_flush(w, c) < 0) {
+      ex0_close(w, c, 0);
+      free(c);
+      i--;
+    }
+  }
+}
+
+/* Unlinks and closes; the caller frees. A reset skips the FIN. */
+void
+ex0_close(ex0_worker_t *w, ex0_conn_t *c, int reset) {
+  struct linger lg = { 1, 0 };
+
+  if (c->fd < 0)
+    return;
+  if (reset) {
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    __atomic_fetch_add(&w->resets, 1, __ATOMIC_RELAXED);
+  }
+  close(c->fd);
+  c->fd = -1;
+
+  w->conns[c->index] = w->conns[--w->nconns];
+  w->conns[c->index]->index = c->index;
+  ex_frame_decoder_free(&c->decoder);
+  ex_mock_buf_free(&c->out);
+}
@@ -1,6 +1,11 @@
 /* A minimal libuv example.
  *
  * 1. Timer (x10000)
+ *
+ * Usage: ex2 [heap|wheel] [count]
+ *
+ * With an argument, benchmarks heartbeat-style periodic timers on one
+ * uv_timer_t per handle (libuv's timer heap) against the shared timing wheel.
  */
 
 #include <stdio.h>
@@ -11,8 +16,25 @@
 
 #include <uv.h>
 
+#include "ex_wheel.h"
+
+#define EX_BENCH_PERIOD_MS  100
+#define EX_BENCH_JITTER_MS  100
+#define EX_BENCH_ROUNDS     10
+
+typedef struct ex_bench_timer_s {
+  uv_timer_t timer;
+  ex_wheel_entry_t entry;
+  int rounds;
+} ex_bench_timer_t;
+
 void on_timer(uv_timer_t *handle);
 void on_close(uv_handle_t *handle);
+int bench(const char *mode, int count);
+void on_bench_heap(uv_timer_t *handle);
+void on_bench_wheel(ex_wheel_entry_t *entry);
+
+static ex_wheel_t *bench_wheel;
 
 int
 main(int argc, char *argv[]) {
@@ -21,6 +43,11 @@ main(int argc, char *argv[]) {
   int wait_ms = 0;
   int rc = 0;
 
+  if (argc > 1) {
+    rc = bench(argv[1], argc > 2 ? atoi(argv[2]) : 100000);
+    exit(rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
   /* Acquire event loop */
   rc = uv_loop_init(&loop);
   assert(rc >= 0 && "failed at uv_loop_init");
@@ -74,3 +101,114 @@ on_close(uv_handle_t *handle) {
   printf("(%p) Closed w/ data (%p)\n", handle, handle->data);
 }
 
+
+void
+on_bench_heap(uv_timer_t *handle) {
+  ex_bench_timer_t *t = handle->data;
+  if (--t->rounds > 0)
+    uv_timer_start(&t->timer, on_bench_heap, EX_BENCH_PERIOD_MS + rand() % (EX_BENCH_JITTER_MS + 1), 0);
+}
+
+void
+on_bench_wheel(ex_wheel_entry_t *entry) {
+  ex_bench_timer_t *t = entry->data;
+  if (--t->rounds > 0)
+    ex_wheel_arm_jitter(bench_wheel, &t->entry, EX_BENCH_PERIOD_MS, EX_BENCH_JITTER_MS);
+}
+
+int
+bench(const char *mode, int count) {
+  uv_loop_t loop;
+  ex_wheel_t wheel;
+  ex_bench_timer_t *timers = NULL;
+  uv_rusage_t ru_start, ru_end;
+  uint64_t t0 = 0, t_arm = 0, t_churn = 0, t_run = 0;
+  double cpu_ms = 0;
+  int use_wheel = 0;
+  int rc = 0;
+
+  if (strcmp(mode, "wheel") == 0) {
+    use_wheel = 1;
+  } else if (strcmp(mode, "heap") != 0) {
+    fprintf(stderr, "usage: ex2 [heap|wheel] [count]\n");
+    return UV_EINVAL;
+  }
+  if (count <= 0)
+    return UV_EINVAL;
+
+  timers = calloc(count, sizeof(*timers));
+  if (!timers)
+    return UV_ENOMEM;
+
+  rc = uv_loop_init(&loop);
+  assert(rc >= 0 && "failed at uv_loop_init");
+
+  if (use_wheel) {
+    rc = ex_wheel_init(&wheel, &loop, EX_WHEEL_TICK_MS);
+    assert(rc >= 0 && "failed at ex_wheel_init");
+    bench_wheel = &wheel;
+  }
+
+  /* Arm every connection's heartbeat */
+  t0 = uv_hrtime();
+  for (int i = 0; i < count; ++i) {
+    timers[i].rounds = EX_BENCH_ROUNDS;
+    if (use_wheel) {
+      ex_wheel_entry_init(&timers[i].entry, on_bench_wheel, &timers[i]);
+      ex_wheel_arm_jitter(&wheel, &timers[i].entry, EX_BENCH_PERIOD_MS, EX_BENCH_JITTER_MS);
+    } else {
+      uv_timer_init(&loop, &timers[i].timer);
+      timers[i].timer.data = &timers[i];
+      uv_timer_start(&timers[i].timer, on_bench_heap, EX_BENCH_PERIOD_MS + rand() % (EX_BENCH_JITTER_MS + 1), 0);
+    }
+  }
+  t_arm = uv_hrtime() - t0;
+
+  /* Cancel + re-arm, as an idle deadline does on every read */
+  t0 = uv_hrtime();
+  for (int i = 0; i < count; ++i) {
+    if (use_wheel) {
+      ex_wheel_cancel(&timers[i].entry);
+      ex_wheel_arm_jitter(&wheel, &timers[i].entry, EX_BENCH_PERIOD_MS, EX_BENCH_JITTER_MS);
+    } else {
+      uv_timer_stop(&timers[i].timer);
+      uv_timer_start(&timers[i].timer, on_bench_heap, EX_BENCH_PERIOD_MS + rand() % (EX_BENCH_JITTER_MS + 1), 0);
+    }
+  }
+  t_churn = uv_hrtime() - t0;
+
+  /* Fire every heartbeat EX_BENCH_ROUNDS times */
+  uv_getrusage(&ru_start);
+  t0 = uv_hrtime();
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run");
+  t_run = uv_hrtime() - t0;
+  uv_getrusage(&ru_end);
+
+  cpu_ms = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) * 1e3 +
+      (ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) / 1e3 +
+      (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) * 1e3 +
+      (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec) / 1e3;
+
+  printf("%s: %d timers x %d rounds\n", mode, count, EX_BENCH_ROUNDS);
+  printf("  arm:          %8.1f ns/op\n", (double)t_arm / count);
+  printf("  cancel+arm:   %8.1f ns/op\n", (double)t_churn / count);
+  printf("  run:          %8.1f ms wall, %.1f ms cpu, %.1f ns cpu/fire\n",
+      t_run / 1e6, cpu_ms, cpu_ms * 1e6 / ((double)count * EX_BENCH_ROUNDS));
+
+  if (use_wheel) {
+    ex_wheel_close(&wheel, NULL);
+  } else {
+    for (int i = 0; i < count; ++i)
+      uv_close((uv_handle_t *)&timers[i].timer, NULL);
+  }
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run");
+
+  rc = uv_loop_close(&loop);
+  if (rc < 0) {
+    fprintf(stderr, "(%d) %s\n", rc, uv_strerror(rc));
+  }
+  free(timers);
+  return 0;
+}
@@ -46,6 +46,12 @@ main(int argc, char *argv[]) {
   ex_liveconn_t liveconn;
   int rc = 0;
 
+  /* Point at a local mock server (see ex0.c) instead */
+  if (getenv("EX_HOST"))
+    host = getenv("EX_HOST");
+  if (getenv("EX_PORT"))
+    port = getenv("EX_PORT");
+
   /* Acquire event loop */
   rc = uv_loop_init(&loop);
   assert(rc >= 0 && "failed at uv_loop_init()");
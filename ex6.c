@@ -2,11 +2,18 @@
  *
  * 1. DNS resolve
  * 2. TCP connect
- * 3. TCP write
+ * 3. TCP write (coalesced)
  * 4. TCP read
- * 5. TCP close
+ * 5. TCP heartbeat (shared timing wheel)
+ * 6. TCP close (drain, then FIN)
  *
- * Note: The TCP Connection should normally stop in about 1 minute. 
+ * With EX_HUB set to a path, every decoded message is also served to local
+ * subscribers on a unix socket there, so they need no connection of their
+ * own (see ex_hub.h).
+ *
+ * Usage: ex6 [connections] [hex|none|<trace file>] [cmd,cmd,...]
+ *
+ * Note: Without heartbeats the server drops the connection in about 1 minute.
  */
 
 #include <stdio.h>
@@ -15,6 +22,8 @@
 #include <stdint.h>
 #include <assert.h>
 #include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,76 +31,299 @@
 
 #include <uv.h>
 
-typedef struct ex_write_req_s {
-  uv_write_t writer;
-  uv_buf_t buf;
-  int needs_free;
-} ex_write_req_t;
-
-typedef struct ex_liveconn_s {
+#include "ex_backoff.h"
+#include "ex_dns.h"
+#include "ex_eyeballs.h"
+#include "ex_frame.h"
+#include "ex_hex.h"
+#include "ex_hub.h"
+#include "ex_log.h"
+#include "ex_loopmon.h"
+#include "ex_outq.h"
+#include "ex_pool.h"
+#include "ex_rec.h"
+#include "ex_route.h"
+#include "ex_state.h"
+#include "ex_trace.h"
+#include "ex_wheel.h"
+
+#define EX_HEARTBEAT_MS         30000
+#define EX_HEARTBEAT_JITTER_MS  3000
+#define EX_READ_SLAB_LEN        65536
+#define EX_READ_SLABS           4
+#define EX_STALL_MS             50
+#define EX_REPLAY_BATCH         4096
+
+typedef struct ex_liveconn_s ex_liveconn_t;
+
+/* State shared by every connection on a loop */
+typedef struct ex_liveloop_s {
   uv_loop_t *loop;
+  ex_liveconn_t *conns;
+  int count;
+  uv_signal_t sigint;
+  uv_signal_t sigterm;
+  ex_wheel_t wheel;
+  ex_dns_cache_t dns;
+  ex_outq_loop_t outq;
+  ex_eyeballs_pool_t eyeballs;
+  ex_pool_t slabs;
+
+  /* Debug output */
+  int dump_hex;
+  ex_hexbuf_t hex;
+  ex_trace_t trace;
+  ex_rec_t rec;
+  uint32_t next_id;
+
+  /* Local subscribers to every message */
+  ex_hub_t hub;
+
+  /* Command messages, and their stage latency */
+  ex_route_t route;
+  ex_loopmon_t mon;
+
+} ex_liveloop_t;
+
+struct ex_liveconn_s {
+  uint32_t id;
+  int state;
+  int stopping;
+  uv_loop_t *loop;
+  ex_liveloop_t *shared;
+  ex_wheel_entry_t heartbeat;
+  ex_wheel_entry_t deadline;
+  ex_wheel_entry_t retry;
+  ex_backoff_t backoff;
+  uint64_t last_read_ms;
+  ex_outq_t outq;
   uv_tcp_t *conn;
-  uv_connect_t *connector;
-  uv_shutdown_t *closer;
-  uv_getaddrinfo_t *resolver;
-  uint8_t *read_buf;
-  ssize_t read_buf_len;
+  ex_eyeballs_t *race;
+  uv_shutdown_t closer;
+  ex_dns_req_t resolver;
+  ex_dns_result_t *dns;
+  ex_frame_decoder_t decoder;
+  ex_route_src_t src;
   struct addrinfo *addrs;
-  struct addrinfo *addr_in_use;
-} ex_liveconn_t;
+  const struct addrinfo *addr_in_use;
+};
 
-int liveconn_init(uv_loop_t* loop, ex_liveconn_t *conn);
+int liveconn_init(ex_liveloop_t *shared, ex_liveconn_t *conn);
 int liveconn_free(ex_liveconn_t *liveconn);
 int liveconn_start(ex_liveconn_t *liveconn);
+int liveconn_event(ex_liveconn_t *liveconn, int event);
+int liveconn_resolve(ex_liveconn_t *liveconn);
 int liveconn_connect(ex_liveconn_t *liveconn);
+int liveconn_handshake(ex_liveconn_t *liveconn);
+int liveconn_stream(ex_liveconn_t *liveconn);
+int liveconn_drain(ex_liveconn_t *liveconn);
+int liveconn_teardown(ex_liveconn_t *liveconn);
 int liveconn_close(ex_liveconn_t *liveconn);
+int liveconn_write(ex_liveconn_t *liveconn, const uint8_t *data, size_t len);
 void on_close(uv_handle_t *handle);
-void on_dns_resolve(uv_getaddrinfo_t *info, int status, struct addrinfo *res);
-void on_tcp_connect(uv_connect_t *connector, int status);
-void on_write_done(uv_write_t *writer, int status);
+void on_shutdown(uv_shutdown_t *closer, int status);
+void on_deadline(ex_wheel_entry_t *entry);
+void on_retry(ex_wheel_entry_t *entry);
+void on_signal(uv_signal_t *handle, int signum);
+void on_dns_resolve(ex_dns_req_t *req, int status, ex_dns_result_t *res);
+void on_tcp_connect(ex_eyeballs_t *race, int status, uv_tcp_t *tcp, const struct addrinfo *addr);
+void on_write_error(ex_outq_t *q, int status);
 void on_data(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf);
 void make_buffer(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+void on_heartbeat(ex_wheel_entry_t *entry);
+int on_packet(const ex_frame_t *frame, void *arg);
+int on_control(ex_route_src_t *src, const ex_frame_t *frame);
+void on_stall(ex_loopmon_t *mon, const char *what, uint64_t ns, int running);
+void log_hist(const char *name, const ex_hist_t *h);
 
 const char *host = "broadcastlv.chat.bilibili.com";
 const char *port = "2243";
 const uint8_t web_handshake[] = {0,0,0,16, 0,16, 0,1, 0,0,0,7, 0,0,0,1};
 const uint8_t web_heartbeat[] = {0,0,0,16, 0,16, 0,1, 0,0,0,2, 0,0,0,1};
 
+/* What to do on entering each state */
+int (*const liveconn_enter[EX_ST_COUNT])(ex_liveconn_t *liveconn) = {
+  [EX_ST_RESOLVING]   = liveconn_resolve,
+  [EX_ST_CONNECTING]  = liveconn_connect,
+  [EX_ST_HANDSHAKING] = liveconn_handshake,
+  [EX_ST_STREAMING]   = liveconn_stream,
+  [EX_ST_DRAINING]    = liveconn_drain,
+  [EX_ST_CLOSED]      = liveconn_teardown,
+};
+
 int
 main(int argc, char *argv[]) {
   uv_loop_t loop;
-  ex_liveconn_t liveconn;
+  ex_liveloop_t shared;
+  ex_liveconn_t *liveconns = NULL;
+  int count = argc > 1 ? atoi(argv[1]) : 1;
+  const char *mode = NULL;
   int rc = 0;
 
+  /* Point at a local mock server (see ex0.c) instead */
+  if (getenv("EX_HOST"))
+    host = getenv("EX_HOST");
+  if (getenv("EX_PORT"))
+    port = getenv("EX_PORT");
+
+  if (count <= 0)
+    count = 1;
+  liveconns = calloc(count, sizeof(*liveconns));
+  assert(liveconns && "failed at calloc()");
+
   /* Acquire event loop */
   rc = uv_loop_init(&loop);
   assert(rc >= 0 && "failed at uv_loop_init()");
 
-  /* Allocate liveconn memory */
-  rc = liveconn_init(&loop, &liveconn);
-  assert(rc >= 0 && "failed at liveconn_init()");
+  /* One timer drives the heartbeats of every connection */
+  memset(&shared, 0, sizeof(shared));
+  shared.loop = &loop;
+  rc = ex_wheel_init(&shared.wheel, &loop, EX_WHEEL_TICK_MS);
+  assert(rc >= 0 && "failed at ex_wheel_init()");
+
+  /* One resolver cache serves every connection */
+  rc = ex_dns_cache_init(&shared.dns, &loop, EX_DNS_TTL_MS, EX_DNS_NEG_TTL_MS);
+  assert(rc >= 0 && "failed at ex_dns_cache_init()");
+
+  /* Writes queued in one iteration go out together before the loop blocks */
+  rc = ex_outq_loop_init(&shared.outq, &loop);
+  assert(rc >= 0 && "failed at ex_outq_loop_init()");
+
+  /* Connect races come from a per-loop free list */
+  rc = ex_eyeballs_pool_init(&shared.eyeballs);
+  assert(rc >= 0 && "failed at ex_eyeballs_pool_init()");
+
+  /* Reads borrow a slab only for the length of the read callback */
+  rc = ex_pool_init(&shared.slabs, EX_READ_SLAB_LEN, EX_READ_SLABS);
+  assert(rc >= 0 && "failed at ex_pool_init()");
+
+  /* Iteration timing, and a watchdog on the read callback */
+  rc = ex_loopmon_init(&shared.mon, &loop, EX_STALL_MS, on_stall);
+  assert(rc >= 0 && "failed at ex_loopmon_init()");
+
+  /* Close down in order on SIGINT/SIGTERM; reconnects never stop otherwise */
+  shared.conns = liveconns;
+  shared.count = count;
+  rc = uv_signal_init(&loop, &shared.sigint);
+  assert(rc >= 0 && "failed at uv_signal_init()");
+  rc = uv_signal_init(&loop, &shared.sigterm);
+  assert(rc >= 0 && "failed at uv_signal_init()");
+  shared.sigint.data = shared.sigterm.data = &shared;
+  uv_signal_start(&shared.sigint, on_signal, SIGINT);
+  uv_signal_start(&shared.sigterm, on_signal, SIGTERM);
+
+  /* Debug output: hex dump, nothing, or a binary trace */
+  mode = argc > 2 ? argv[2] : "hex";
+  shared.dump_hex = strcmp(mode, "hex") == 0;
+  if (!shared.dump_hex && strcmp(mode, "none") != 0) {
+    rc = ex_trace_open(&shared.trace, mode);
+    assert(rc >= 0 && "failed at ex_trace_open()");
+  }
+  /* Every frame also kept in time-indexed segments, for ex9 to play back */
+  if (getenv("EX_REC")) {
+    rc = ex_rec_open(&shared.rec, &loop, getenv("EX_REC"), 0);
+    assert(rc >= 0 && "failed at ex_rec_open()");
+  }
+  /* Only the listed commands, or all of them if none are, reach a handler */
+  rc = ex_route_init(&shared.route, argc > 3 ? argv[3] : NULL, on_control);
+  assert(rc >= 0 && "failed at ex_route_init()");
+  if (getenv("EX_HUB")) {
+    rc = ex_hub_serve(&shared.hub, &loop, getenv("EX_HUB"));
+    assert(rc >= 0 && "failed at ex_hub_serve()");
+    shared.route.hub = &shared.hub;
+    /* A subscriber gone mid-write is an error on its pipe, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  /* Log lines are written by a background thread, never by the loop */
+  rc = ex_log_start(STDOUT_FILENO, STDERR_FILENO, shared.dump_hex ? EX_LOG_DEBUG : EX_LOG_INFO);
+  assert(rc >= 0 && "failed at ex_log_start()");
+  if (shared.dump_hex)
+    ex_log(EX_LOG_INFO, "Hex dump using %s", ex_hex_impl());
 
-  /* Initiate the connection */
-  rc = liveconn_start(&liveconn);
-  assert(rc >= 0 && "failed at liveconn_start()");
+  for (int i = 0; i < count; ++i) {
+    /* Allocate liveconn memory */
+    rc = liveconn_init(&shared, &liveconns[i]);
+    assert(rc >= 0 && "failed at liveconn_init()");
+
+    /* Initiate the connection */
+    rc = liveconn_start(&liveconns[i]);
+    if (rc < 0) {
+      ex_log(EX_LOG_ERROR, "(%p) liveconn_start: (%d) %s", &liveconns[i], rc, uv_strerror(rc));
+    }
+  }
 
   rc = uv_run(&loop, UV_RUN_DEFAULT);
   assert(rc >= 0 && "failed at uv_run()");
 
+  ex_log(EX_LOG_INFO, "DNS cache: %lu hits, %lu misses, %lu coalesced, %lu refreshes",
+      shared.dns.hits, shared.dns.misses, shared.dns.coalesced, shared.dns.refreshes);
+  ex_log(EX_LOG_INFO, "Writes: %lu packets in %lu flushes, %lu try_writes, %lu queued",
+      shared.outq.packets, shared.outq.flushes, shared.outq.try_writes, shared.outq.fallbacks);
+  ex_log(EX_LOG_INFO, "Read slabs: %lu reads, %zu peak in use", shared.slabs.gets, shared.slabs.peak);
+  ex_log(EX_LOG_INFO, "Messages: %lu, %lu skipped by cmd, %lu unknown",
+      shared.route.messages, shared.route.skipped, shared.route.unknown);
+  log_hist("read to decode", &shared.route.read_decode);
+  log_hist("decode to dispatch", &shared.route.decode_dispatch);
+  log_hist("dispatch to done", &shared.route.dispatch_done);
+  ex_log(EX_LOG_INFO, "Loop: %lu iterations, %lu over %d ms busy, %lu slow reads",
+      shared.mon.iterations, shared.mon.slow_iterations, EX_STALL_MS, shared.mon.stalls);
+  log_hist("iteration", &shared.mon.iteration);
+  log_hist("iteration busy", &shared.mon.busy);
+  log_hist("iteration blocked", &shared.mon.block);
+  for (int i = 0; i < count; ++i) {
+    if (liveconns[i].backoff.outages)
+      ex_log(EX_LOG_INFO, "(%p) %lu outages, longest %lu ms", &liveconns[i],
+          liveconns[i].backoff.outages, liveconns[i].backoff.longest_ms);
+  }
+
   /* Bring down the connection */
-  rc = liveconn_close(&liveconn);
-  assert(rc >= 0 && "failed at liveconn_close()");
+  for (int i = 0; i < count; ++i) {
+    rc = liveconn_close(&liveconns[i]);
+    assert(rc >= 0 && "failed at liveconn_close()");
+  }
 
   rc = uv_run(&loop, UV_RUN_DEFAULT);
   assert(rc >= 0 && "failed at uv_run()");
 
-  rc = liveconn_free(&liveconn);
-  assert(rc >= 0 && "failed at liveconn_free()");
+  for (int i = 0; i < count; ++i) {
+    rc = liveconn_free(&liveconns[i]);
+    assert(rc >= 0 && "failed at liveconn_free()");
+  }
+  free(liveconns);
+
+  ex_dns_cache_free(&shared.dns);
+  ex_wheel_close(&shared.wheel, NULL);
+  ex_outq_loop_close(&shared.outq, NULL);
+  ex_loopmon_close(&shared.mon, NULL);
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run()");
+
+  ex_eyeballs_pool_free(&shared.eyeballs);
+  ex_pool_free(&shared.slabs);
+  ex_route_free(&shared.route);
+  ex_hexbuf_free(&shared.hex);
+  if (shared.hub.subscribers)
+    ex_log(EX_LOG_INFO, "Hub: %lu subscribers, %lu frames published, %lu bytes in %lu writes, %lu dropped, %lu stalled out",
+        shared.hub.subscribers, shared.hub.published, shared.hub.bytes, shared.hub.writes,
+        shared.hub.dropped, shared.hub.kicked);
+  ex_hub_free(&shared.hub);
+  if (shared.trace.records)
+    ex_log(EX_LOG_INFO, "Trace: %lu frames, %lu bytes", shared.trace.records, shared.trace.bytes);
+  ex_trace_close(&shared.trace);
+  if (shared.rec.segments)
+    ex_log(EX_LOG_INFO, "Recorded: %lu frames, %lu bytes in %lu segments, %lu dropped",
+        shared.rec.records, shared.rec.bytes, shared.rec.segments, shared.rec.dropped);
+  ex_rec_close(&shared.rec);
+
+  if (ex_log_dropped())
+    ex_log(EX_LOG_WARN, "Log: %lu records dropped", ex_log_dropped());
+  ex_log_stop();
 
   /* Release memory */
   rc = uv_loop_close(&loop);
   if (rc < 0) {
-    fprintf(stderr, "(%d) %s\n", rc, uv_strerror(rc));
+    ex_log(EX_LOG_ERROR, "(%d) %s", rc, uv_strerror(rc));
   }
 
   exit(EXIT_SUCCESS);
@@ -99,125 +331,236 @@ main(int argc, char *argv[]) {
 
 void
 on_close(uv_handle_t *handle) {
-  printf("(%p) Closed w/ data (%p)\n", handle, handle->data);
+  ex_liveconn_t *liveconn = handle->data;
+
+  ex_log(EX_LOG_DEBUG, "(%p) Closed w/ data (%p)", handle, handle->data);
+  if (liveconn->conn == (uv_tcp_t*)handle)
+    liveconn->conn = NULL;
+  ex_pool_put(handle);
 }
 
 int
 liveconn_start(ex_liveconn_t *liveconn) {
-  struct addrinfo hints;
-  int rc = 0;
-  if (!liveconn)
-    return UV_EINVAL;
-  if (!liveconn->loop)
+  if (!liveconn || !liveconn->loop)
     return UV_EINVAL;
+  return liveconn_event(liveconn, EX_EV_START);
+}
 
-  /* TODO: replace these checks with a state flag. */
+/* Moves to the state `event` leads to, arms that state's deadline and runs
+ * its entry action. A failed action turns into an error event. */
+int
+liveconn_event(ex_liveconn_t *liveconn, int event) {
+  int next = ex_state_next(liveconn->state, event);
+  int rc = 0;
 
-  /* Connection is established, may proceed to transfer. */
-  if (liveconn->connector) {
-    if (liveconn->connector) {
-      free(liveconn->connector);
-      liveconn->connector = NULL;
-    }
-    if (liveconn->addrs) {
-      uv_freeaddrinfo(liveconn->addrs);
-      liveconn->addrs = NULL;
-    }
-    ex_write_req_t *wr_req = malloc(sizeof(*wr_req));
-    if (!wr_req)
-      return UV_EAI_MEMORY;
-    wr_req->needs_free = 0;
-    wr_req->buf.base = (void*)web_handshake;
-    wr_req->buf.len = sizeof(web_handshake)/sizeof(web_handshake[0]);
-    wr_req->writer.data = wr_req;
-    rc = uv_write(&wr_req->writer, (uv_stream_t*)liveconn->conn, &wr_req->buf, 1, on_write_done);
-    assert(rc >= 0 && "failed at uv_write()");
-
-    liveconn->conn->data = liveconn;
-    rc = uv_read_start((uv_stream_t*)liveconn->conn, make_buffer, on_data);
-    assert(rc >= 0 && "failed at uv_read_start()");
-    return rc;
+  if (next < 0) {
+    ex_log(EX_LOG_DEBUG, "(%p) %s ignored while %s",
+        liveconn, ex_event_name(event), ex_state_name(liveconn->state));
+    return next;
+  }
+  ex_log(EX_LOG_DEBUG, "(%p) %s -> %s on %s", liveconn,
+      ex_state_name(liveconn->state), ex_state_name(next), ex_event_name(event));
+
+  liveconn->state = next;
+  ex_wheel_cancel(&liveconn->deadline);
+  if (ex_states[next].deadline_ms)
+    ex_wheel_arm(&liveconn->shared->wheel, &liveconn->deadline, ex_states[next].deadline_ms);
+
+  if (liveconn_enter[next])
+    rc = liveconn_enter[next](liveconn);
+  if (rc < 0 && liveconn->state == next) {
+    ex_log(EX_LOG_ERROR, "(%p) entering %s: (%d) %s", liveconn, ex_state_name(next), rc, uv_strerror(rc));
+    liveconn_event(liveconn, EX_EV_ERROR);
   }
+  return rc;
+}
 
-  /* The TCP addr is ready. Connect. */
-  if (liveconn->addrs) {
-    if (liveconn->resolver) {
-      free(liveconn->resolver);
-      liveconn->resolver = NULL;
-    }
-    if (!liveconn->connector) {
-      liveconn->connector = malloc(sizeof(*liveconn->connector));
-      if (!liveconn->connector)
-        return UV_EAI_MEMORY;
-    }
-    if (!liveconn->conn) {
-      liveconn->conn = malloc(sizeof(*liveconn->conn));
-      if (!liveconn->conn)
-        return UV_EAI_MEMORY;
-    }
+/* DNS, unless the shared cache already has it */
+int
+liveconn_resolve(ex_liveconn_t *liveconn) {
+  ex_dns_result_t *res = NULL;
+  int rc = 0;
 
-    rc = uv_tcp_init(liveconn->loop, liveconn->conn);
-    assert(rc >= 0 && "failed at uv_tcp_init()");
+  liveconn->resolver.data = liveconn;
+  rc = ex_dns_lookup(&liveconn->shared->dns, &liveconn->resolver, host, port, on_dns_resolve, &res);
+  if (rc == 1) {
+    liveconn->dns = res;
+    liveconn->addrs = res->addrs;
+    return liveconn_event(liveconn, EX_EV_RESOLVED);
+  }
+  return rc;
+}
 
-    /* TCP connect */
-    liveconn->conn->data = liveconn;
-    liveconn->connector->data = liveconn;
-    if (!liveconn->addr_in_use) {
-      liveconn->addr_in_use = liveconn->addrs;
-    }
-    rc = uv_tcp_connect(liveconn->connector, liveconn->conn, liveconn->addr_in_use->ai_addr, on_tcp_connect);
+/* Race a connect across every resolved address */
+int
+liveconn_connect(ex_liveconn_t *liveconn) {
+  return ex_eyeballs_start(&liveconn->race, liveconn->loop, &liveconn->shared->eyeballs,
+      liveconn->addrs, EX_EYEBALLS_DELAY_MS, on_tcp_connect, liveconn);
+}
 
-    if (rc < 0) {
-      fprintf(stderr, "(%p) uv_tcp_connect(): (%d) %s\n", liveconn->connector, rc, uv_strerror(rc));
-    }
+int
+liveconn_handshake(ex_liveconn_t *liveconn) {
+  int rc = 0;
+
+  ex_dns_result_unref(liveconn->dns);
+  liveconn->dns = NULL;
+  liveconn->addrs = NULL;
+  liveconn->addr_in_use = NULL;
 
+  /* Auth and the first heartbeat leave in one syscall. */
+  ex_outq_attach(&liveconn->outq, (uv_stream_t*)liveconn->conn);
+  rc = liveconn_write(liveconn, web_handshake, sizeof(web_handshake)/sizeof(web_handshake[0]));
+  if (rc < 0)
+    return rc;
+  rc = liveconn_write(liveconn, web_heartbeat, sizeof(web_heartbeat)/sizeof(web_heartbeat[0]));
+  if (rc < 0)
     return rc;
-  }
 
-  /* No TCP addr or connection. Begin DNS resolve */
-  if (!liveconn->resolver) {
-    liveconn->resolver = malloc(sizeof(*liveconn->resolver));
-    if (!liveconn->resolver)
-      return UV_EAI_MEMORY;
-  }
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_STREAM;    /* Only TCP. Will never be UDP conn. */
-  liveconn->resolver->data = liveconn;
-  rc = uv_getaddrinfo(liveconn->loop, liveconn->resolver, on_dns_resolve, host, port, &hints);
-  assert(rc >= 0 && "failed at uv_getaddrinfo()");
+  rc = ex_wheel_arm_jitter(&liveconn->shared->wheel, &liveconn->heartbeat, EX_HEARTBEAT_MS, EX_HEARTBEAT_JITTER_MS);
+  assert(rc >= 0 && "failed at ex_wheel_arm_jitter()");
 
-  return rc;
+  liveconn->conn->data = liveconn;
+  return uv_read_start((uv_stream_t*)liveconn->conn, make_buffer, on_data);
 }
 
 int
-liveconn_write() {
+liveconn_stream(ex_liveconn_t *liveconn) {
+  ex_outage_t outage;
+
+  liveconn->last_read_ms = uv_now(liveconn->loop);
+  if (ex_backoff_up(&liveconn->backoff, liveconn->last_read_ms, &outage)) {
+    ex_log(EX_LOG_WARN, "(%p) room %u back after %lu ms down, gap %lu.%03lu-%lu.%03lu, %u attempts",
+        liveconn, liveconn->id, outage.end_ms - outage.start_ms,
+        outage.start_ms / 1000, outage.start_ms % 1000, outage.end_ms / 1000, outage.end_ms % 1000,
+        outage.attempts);
+  }
   return 0;
 }
 
+/* Stop reading, let queued writes out, then send FIN */
 int
-liveconn_close(ex_liveconn_t *liveconn) {
-  int rc = 0;
-  if (!liveconn) {
-    return 0;
-  }
+liveconn_drain(ex_liveconn_t *liveconn) {
+  ex_wheel_cancel(&liveconn->heartbeat);
+  uv_read_stop((uv_stream_t*)liveconn->conn);
+  ex_outq_flush(&liveconn->outq);
+
+  liveconn->closer.data = liveconn;
+  return uv_shutdown(&liveconn->closer, (uv_stream_t*)liveconn->conn, on_shutdown);
+}
+
+int
+liveconn_teardown(ex_liveconn_t *liveconn) {
+  uint64_t delay = 0;
+
+  ex_wheel_cancel(&liveconn->heartbeat);
+  ex_outq_reset(&liveconn->outq);
+  ex_dns_cancel(&liveconn->resolver);
+  ex_dns_result_unref(liveconn->dns);
+  liveconn->dns = NULL;
+  liveconn->addrs = NULL;
+  ex_eyeballs_cancel(liveconn->race);
+  liveconn->race = NULL;
+  ex_frame_decoder_reset(&liveconn->decoder);
   if (liveconn->conn && !uv_is_closing((uv_handle_t*)liveconn->conn)) {
-    rc = uv_read_stop((uv_stream_t*)liveconn->conn);
+    uv_read_stop((uv_stream_t*)liveconn->conn);
     uv_close((uv_handle_t*)liveconn->conn, on_close);
   }
+  if (liveconn->stopping)
+    return 0;
+
+  /* Not asked to stop: come back after a jittered, growing delay. */
+  ex_backoff_down(&liveconn->backoff, uv_now(liveconn->loop));
+  delay = ex_backoff_next(&liveconn->backoff);
+  ex_log(EX_LOG_INFO, "(%p) reconnecting in %lu ms (attempt %u)", liveconn, delay, liveconn->backoff.outage.attempts);
+  return ex_wheel_arm(&liveconn->shared->wheel, &liveconn->retry, delay);
+}
+
+void
+on_shutdown(uv_shutdown_t *closer, int status) {
+  liveconn_event(closer->data, EX_EV_DRAINED);
+}
+
+void
+on_deadline(ex_wheel_entry_t *entry) {
+  ex_liveconn_t *liveconn = entry->data;
+  uint64_t idle = uv_now(liveconn->loop) - liveconn->last_read_ms;
+
+  /* Reads push the idle deadline out lazily, only when it comes due. */
+  if (liveconn->state == EX_ST_STREAMING && idle < EX_IDLE_DEADLINE_MS) {
+    ex_wheel_arm(&liveconn->shared->wheel, &liveconn->deadline, EX_IDLE_DEADLINE_MS - idle);
+    return;
+  }
+
+  ex_log(EX_LOG_WARN, "(%p) %s for over %lu ms, giving up", liveconn,
+      ex_state_name(liveconn->state), ex_states[liveconn->state].deadline_ms);
+  liveconn_event(liveconn, EX_EV_TIMEOUT);
+}
+
+void
+on_retry(ex_wheel_entry_t *entry) {
+  liveconn_event(entry->data, EX_EV_START);
+}
+
+void
+on_signal(uv_signal_t *handle, int signum) {
+  ex_liveloop_t *shared = handle->data;
+
+  ex_log(EX_LOG_INFO, "Caught signal %d, closing down", signum);
+  for (int i = 0; i < shared->count; ++i)
+    liveconn_close(&shared->conns[i]);
+  uv_close((uv_handle_t*)&shared->sigint, NULL);
+  uv_close((uv_handle_t*)&shared->sigterm, NULL);
+  ex_hub_close(&shared->hub);
+}
+
+/* Queues `data`, which must outlive the write; see ex_outq.h. */
+int
+liveconn_write(ex_liveconn_t *liveconn, const uint8_t *data, size_t len) {
+  int rc = 0;
+
+  if (!liveconn || !liveconn->conn)
+    return UV_EINVAL;
+
+  rc = ex_outq_write(&liveconn->outq, data, len);
+  if (rc < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) ex_outq_write(): (%d) %s", liveconn, rc, uv_strerror(rc));
+  }
   return rc;
 }
 
+/* Orderly close, for good; a no-op once closed. */
 int
-liveconn_init(uv_loop_t* loop, ex_liveconn_t *liveconn) {
+liveconn_close(ex_liveconn_t *liveconn) {
   if (!liveconn) {
+    return 0;
+  }
+  liveconn->stopping = 1;
+  ex_wheel_cancel(&liveconn->retry);
+  if (liveconn->state == EX_ST_CLOSED)
+    return 0;
+  liveconn_event(liveconn, EX_EV_CLOSE);
+  return 0;
+}
+
+int
+liveconn_init(ex_liveloop_t *shared, ex_liveconn_t *liveconn) {
+  if (!liveconn || !shared) {
     return -1;
   }
 
   memset(liveconn, 0, sizeof(*liveconn));
 
-  liveconn->loop = loop;
-
-  return 0;
+  liveconn->loop = shared->loop;
+  liveconn->shared = shared;
+  liveconn->id = shared->next_id++;
+  ex_route_src_init(&liveconn->src, &shared->route, liveconn->id, liveconn);
+  ex_wheel_entry_init(&liveconn->heartbeat, on_heartbeat, liveconn);
+  ex_wheel_entry_init(&liveconn->deadline, on_deadline, liveconn);
+  ex_wheel_entry_init(&liveconn->retry, on_retry, liveconn);
+  ex_backoff_init(&liveconn->backoff, EX_BACKOFF_BASE_MS, EX_BACKOFF_CAP_MS);
+  ex_outq_init(&liveconn->outq, &shared->outq, on_write_error, liveconn);
+
+  return ex_frame_decoder_init(&liveconn->decoder, 0);
 }
 
 int
@@ -225,120 +568,181 @@ liveconn_free(ex_liveconn_t *liveconn) {
   if (!liveconn) {
     return 0;
   }
-  uv_freeaddrinfo(liveconn->addrs);
-  free(liveconn->conn);
-  free(liveconn->closer);
-  free(liveconn->resolver);
-  free(liveconn->connector);
-  free(liveconn->read_buf);
+  ex_dns_result_unref(liveconn->dns);
+  ex_frame_decoder_free(&liveconn->decoder);
   liveconn->addrs = NULL;
   liveconn->addr_in_use = NULL;
-  liveconn->conn = NULL;
-  liveconn->closer = NULL;
-  liveconn->resolver = NULL;
-  liveconn->connector = NULL;
-  liveconn->read_buf = NULL;
-  liveconn->read_buf_len = 0;
+  liveconn->dns = NULL;
   return 0;
 }
 
 void
-on_dns_resolve(uv_getaddrinfo_t *info, int status, struct addrinfo *res) {
-  int rc = 0;
-  ex_liveconn_t *liveconn = info->data;
+on_dns_resolve(ex_dns_req_t *req, int status, ex_dns_result_t *res) {
+  ex_liveconn_t *liveconn = req->data;
 
-  printf("(%p) DNS resolved addrinfo (%p) w/ status %d\n", info, res, status);
+  ex_log(EX_LOG_DEBUG, "(%p) DNS resolved addrinfo (%p) w/ status %d", req, res, status);
   if (status < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) DNS resolve: (%d) %s", liveconn, status, uv_strerror(status));
+    liveconn_event(liveconn, EX_EV_ERROR);
     return;
   }
-  liveconn->addrs = res;
-  rc = liveconn_start(liveconn);
-  if (rc < 0) {
-    fprintf(stderr, "(%p) liveconn_start: (%d) %s\n", liveconn, rc, uv_strerror(rc));
-  }
+  liveconn->dns = res;
+  liveconn->addrs = res->addrs;
+  liveconn_event(liveconn, EX_EV_RESOLVED);
 }
 
 void
-on_tcp_connect(uv_connect_t *connector, int status) {
-  char dest_addr[32];
+on_tcp_connect(ex_eyeballs_t *race, int status, uv_tcp_t *tcp, const struct addrinfo *addr) {
+  char dest_addr[INET6_ADDRSTRLEN] = "";
   int rc = 0;
-  ex_liveconn_t *liveconn = connector->data;
+  ex_liveconn_t *liveconn = race->data;
 
-  printf("(%p) TCP connection completed w/ status %d\n", connector, status);
+  ex_log(EX_LOG_DEBUG, "(%p) TCP connection completed w/ status %d", race, status);
+  liveconn->race = NULL;
   if (status < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) TCP connect: (%d) %s", liveconn, status, uv_strerror(status));
+    liveconn_event(liveconn, EX_EV_ERROR);
     return;
   }
 
-  (void)dest_addr;
-  rc = uv_ip4_name((struct sockaddr_in*)liveconn->addr_in_use->ai_addr, dest_addr, sizeof(dest_addr)/sizeof(dest_addr[0]));
+  liveconn->conn = tcp;
+  liveconn->conn->data = liveconn;
+  liveconn->addr_in_use = addr;
+  rc = uv_ip_name(liveconn->addr_in_use->ai_addr, dest_addr, sizeof(dest_addr)/sizeof(dest_addr[0]));
   if (rc < 0) {
-    fprintf(stderr, "(%p) liveconn_start: (%d) %s\n", liveconn, rc, uv_strerror(rc));
+    ex_log(EX_LOG_ERROR, "(%p) liveconn_start: (%d) %s", liveconn, rc, uv_strerror(rc));
   }
-  printf("(%p) TCP connection established w/ %s\n", liveconn, dest_addr);
+  ex_log(EX_LOG_INFO, "(%p) TCP connection established w/ %s", liveconn, dest_addr);
 
-  rc = liveconn_start(liveconn);
-  if (rc < 0) {
-    fprintf(stderr, "(%p) liveconn_start: (%d) %s\n", liveconn, rc, uv_strerror(rc));
-  }
+  liveconn_event(liveconn, EX_EV_CONNECTED);
 }
 
 
 void
-on_write_done(uv_write_t *writer, int status) {
-  ex_write_req_t *wr_req = writer->data;
-
-  if (wr_req->needs_free) {
-    free(wr_req->buf.base);
-  }
-  free(wr_req);
+on_write_error(ex_outq_t *q, int status) {
+  ex_liveconn_t *liveconn = q->data;
 
-  printf("(%p) TCP write data w/ status (%d)\n", writer, status);
+  ex_log(EX_LOG_ERROR, "(%p) TCP write failed: (%d) %s", liveconn, status, uv_strerror(status));
+  liveconn_event(liveconn, EX_EV_ERROR);
 }
 
 void
 on_data(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf) {
-  uint8_t hex_map[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
-  uint8_t *out = NULL;
-  ssize_t i = 0, x = 0;
+  ssize_t x = 0;
+  int rc = 0;
   ex_liveconn_t *liveconn = strm->data;
-  printf("(%p) received (%ld) bytes of data\n", strm, nread);
+  ex_liveloop_t *shared = liveconn->shared;
 
-  /* To hex */
+  shared->route.read_ns = ex_loopmon_enter(&shared->mon, "on_data");
   if (nread > 0) {
-    out = malloc(nread * 3);
-    if (!out)
-      return;
-    for (i = 0, x = 0; i < nread; ++i) {
-      out[x++] = hex_map[buf->base[i]/16];
-      out[x++] = hex_map[buf->base[i]%16];
-      out[x++] = ' ';
+    liveconn->last_read_ms = uv_now(liveconn->loop);
+
+    /* To hex, into a buffer reused across reads */
+    if (shared->dump_hex) {
+      ex_log(EX_LOG_DEBUG, "(%p) received (%ld) bytes of data", strm, nread);
+      x = ex_hexbuf_encode(&shared->hex, (uint8_t*)buf->base, nread);
+      if (x > 0) {
+        ex_log_write(EX_LOG_DEBUG, shared->hex.data, x);
+      }
+    }
+
+    /* Split into frames */
+    rc = ex_frame_feed(&liveconn->decoder, (uint8_t*)buf->base, nread, on_packet, liveconn);
+    if (rc < 0) {
+      ex_log(EX_LOG_ERROR, "(%p) ex_frame_feed: (%d) %s", liveconn, rc, uv_strerror(rc));
+      liveconn_event(liveconn, EX_EV_ERROR);
     }
-    printf("%.*s\n", (int)x, out);
-    free(out);
   }
   else if (nread < 0) {
-    liveconn_close(liveconn);
+    if (nread != UV_EOF)
+      ex_log(EX_LOG_ERROR, "(%p) TCP read: (%ld) %s", liveconn, nread, uv_strerror(nread));
+    liveconn_event(liveconn, EX_EV_ERROR);
+  }
+
+  /* Frames are consumed or copied into the tail by now. */
+  ex_pool_put(buf->base);
+  ex_loopmon_leave(&shared->mon);
+}
+
+void
+on_heartbeat(ex_wheel_entry_t *entry) {
+  ex_liveconn_t *liveconn = entry->data;
+  int rc = 0;
+
+  rc = liveconn_write(liveconn, web_heartbeat, sizeof(web_heartbeat)/sizeof(web_heartbeat[0]));
+  if (rc < 0) {
+    liveconn_event(liveconn, EX_EV_ERROR);
+    return;
   }
+  ex_wheel_arm_jitter(&liveconn->shared->wheel, &liveconn->heartbeat, EX_HEARTBEAT_MS, EX_HEARTBEAT_JITTER_MS);
 }
 
+/* Frames as they came off the wire, before any decompression. */
+int
+on_packet(const ex_frame_t *frame, void *arg) {
+  ex_liveconn_t *liveconn = arg;
+  ex_trace_t *trace = &liveconn->shared->trace;
+  ex_rec_t *rec = &liveconn->shared->rec;
+
+  if (trace->fp)
+    ex_trace_frame(trace, liveconn->id, frame->body - frame->header_len, frame->packet_len);
+  if (rec->segments)
+    ex_rec_frame(rec, liveconn->shared->route.read_ns, liveconn->id, frame->body - frame->header_len, frame->packet_len);
+  return ex_route_frame(frame, &liveconn->src);
+}
+
+/* Frames other than messages, inflated already */
+int
+on_control(ex_route_src_t *src, const ex_frame_t *frame) {
+  ex_liveconn_t *liveconn = src->data;
+  uint32_t popularity = 0;
+
+  switch (frame->op) {
+  case EX_OP_HEARTBEAT_REPLY:
+    if (frame->body_len >= 4) {
+      popularity = ((uint32_t)frame->body[0] << 24) | ((uint32_t)frame->body[1] << 16) |
+          ((uint32_t)frame->body[2] << 8) | (uint32_t)frame->body[3];
+      ex_log(EX_LOG_INFO, "(%p) heartbeat reply w/ popularity %u", liveconn, popularity);
+    }
+    break;
+  case EX_OP_AUTH_REPLY:
+    ex_log(EX_LOG_INFO, "(%p) %.*s", liveconn, (int)frame->body_len, (const char*)frame->body);
+    liveconn_event(liveconn, EX_EV_AUTH_REPLY);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+/* Runs on the watchdog thread when `running`; ex_log() is fine there. */
+void
+on_stall(ex_loopmon_t *mon, const char *what, uint64_t ns, int running) {
+  if (running)
+    ex_log(EX_LOG_WARN, "Loop stuck in %s for %lu ms", what, ns / 1000000);
+  else if (what)
+    ex_log(EX_LOG_WARN, "Loop held by %s for %lu ms", what, ns / 1000000);
+  else
+    ex_log(EX_LOG_WARN, "Loop iteration busy for %lu ms", ns / 1000000);
+}
+
+void
+log_hist(const char *name, const ex_hist_t *h) {
+  if (!h->count)
+    return;
+  ex_log(EX_LOG_INFO, "%s: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us over %lu",
+      name, ex_hist_percentile(h, 50) / 1e3, ex_hist_percentile(h, 99) / 1e3,
+      ex_hist_percentile(h, 99.9) / 1e3, h->max / 1e3, h->count);
+}
+
+/* Borrows a loop-wide slab; on_data hands it back. */
 void
 make_buffer(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
   ex_liveconn_t *liveconn = handle->data;
-  size_t len = suggested > 8096 ? 8096 : suggested;
-  void *data = liveconn->read_buf;
+  void *data = ex_pool_get(&liveconn->shared->slabs);
 
-  printf("(%p) suggesting an allocation of (%ld) bytes\n", handle, suggested);
+  ex_log(EX_LOG_DEBUG, "(%p) suggesting an allocation of (%ld) bytes", handle, suggested);
 
-  if (!data) {
-    data = malloc(len);
-  }
-  else if (liveconn->read_buf_len < len) {
-    data = realloc(data, len);
-  }
-  if (!data)
-    len = 0;
-  liveconn->read_buf = data;
-  liveconn->read_buf_len = len;
   buf->base = data;
-  buf->len = len;
+  buf->len = data ? EX_READ_SLAB_LEN : 0;
 }
@@ -1,8 +1,23 @@
 /* A minimal libuv example. Reuses uv handles.
  *
  * 1. DNS resolve
- * 2. TCP connect
- * 3. TCP close
+ * 2. TCP connect, each copy from a different address
+ * 3. TCP write (auth, heartbeats)
+ * 4. TCP read, keeping the first copy of each message
+ * 5. TCP close (drain, then FIN)
+ * 6. Reconnect after a jittered backoff, EX_CONNECTS times in all
+ *
+ * One room is followed over several redundant connections at once, so a
+ * stall or a drop on one path costs nothing as long as another copy gets
+ * there. Each message is delivered once, from whichever connection brought
+ * it first; the later copies are dropped by a bounded filter on the hash
+ * of the message body (see ex_dedup.h).
+ *
+ * Each connection walks the states in ex_state.h. One embedded timer, kept
+ * across reconnects, enforces each state's deadline and waits out the
+ * backoff between sessions; another sends the heartbeats.
+ *
+ * Usage: ex7 [copies]
  */
 
 #include <stdio.h>
@@ -10,6 +25,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -17,72 +34,189 @@
 
 #include <uv.h>
 
+#include "ex_backoff.h"
+#include "ex_dedup.h"
+#include "ex_eyeballs.h"
+#include "ex_frame.h"
+#include "ex_inflate.h"
+#include "ex_log.h"
+#include "ex_pool.h"
+#include "ex_state.h"
 
-typedef struct ex_shared_buf_s {
-  unsigned char buf[65536];
-} ex_shared_buf_t;
+#define EX_CONNECTS             3
+#define EX_COPIES               2
+#define EX_HEARTBEAT_MS         30000
+#define EX_DEDUP_KEYS           65536
 
 typedef struct ex_conn_s {
   uv_loop_t         *loop;
+  int               index;
+  int               state;
   uv_tcp_t          conn;
   uv_timer_t        timeout;
-  uv_connect_t      connector;
+  uv_timer_t        heartbeat;
+  uv_shutdown_t     closer;
   uv_getaddrinfo_t  resolver;
+  ex_eyeballs_t     *race;
+
+  int               resolving;    /* The resolver is on the threadpool */
+  int               resolve_again;  /* Wanted while it still was */
+  uint32_t          resolve_gen;  /* Of the resolve wanted now */
+  uint32_t          resolver_gen; /* and of the one on the threadpool */
 
   int               timeout_on;
   int               tcp_on;
-
-  struct ex_shared_buf_s  rdbuf;
+  int               stopping;
+  int               attempts;
+  ex_backoff_t      backoff;
+  uint64_t          last_read_ms;
 
   struct addrinfo   *addrs;
-  struct addrinfo   *addr_in_use;
+  struct addrinfo   *order;       /* Copies of addrs, from this copy's start round */
+  const struct addrinfo *addr_in_use;
   int               addr_needs_free;
 
+  ex_frame_decoder_t decoder;
+  uint64_t          firsts;       /* Messages this copy delivered */
+  uint64_t          dups;         /* and those another copy beat it to */
 
   void *data;
 } ex_conn_t;
 
+/* One room, followed over `count` connections */
+typedef struct ex_room_s {
+  ex_conn_t         *conns;
+  int               count;
+  ex_dedup_t        dedup;
+  ex_inflate_t      inflater;
+  uv_signal_t       sigint;
+  uint64_t          delivered;
+  unsigned char     rdbuf[65536];
+} ex_room_t;
+
 
 int ex_start(ex_conn_t *conn);
 int ex_conn_init(ex_conn_t *conn, uv_loop_t *loop);
+int ex_conn_event(ex_conn_t *conn, int event);
+int ex_conn_resolve(ex_conn_t *conn);
+int ex_conn_getaddrinfo(ex_conn_t *conn);
+int ex_conn_connect(ex_conn_t *conn);
+int ex_conn_handshake(ex_conn_t *conn);
+int ex_conn_stream(ex_conn_t *conn);
+int ex_conn_drain(ex_conn_t *conn);
+int ex_conn_teardown(ex_conn_t *conn);
 int ex_conn_close(ex_conn_t *conn);
+int ex_conn_write(ex_conn_t *conn, const uint8_t *data, size_t len);
 int ex_conn_free(ex_conn_t *conn);
 void ex_resolve_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res);
-void ex_connect_cb(uv_connect_t *handle, int status);
-
+void ex_connect_cb(ex_eyeballs_t *race, int status, uv_tcp_t *tcp, const struct addrinfo *addr);
+void ex_alloc_cb(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+void ex_read_cb(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf);
+void ex_write_cb(uv_write_t *req, int status);
+void ex_shutdown_cb(uv_shutdown_t *req, int status);
+void ex_timeout_cb(uv_timer_t *handle);
+void ex_retry_cb(uv_timer_t *handle);
+void ex_heartbeat_cb(uv_timer_t *handle);
+void ex_signal_cb(uv_signal_t *handle, int signum);
+int ex_decode_cb(const ex_frame_t *frame, void *arg);
+void ex_deliver(ex_conn_t *conn, const ex_frame_t *frame);
+
+int (*const ex_conn_enter[EX_ST_COUNT])(ex_conn_t *conn) = {
+  [EX_ST_RESOLVING]   = ex_conn_resolve,
+  [EX_ST_CONNECTING]  = ex_conn_connect,
+  [EX_ST_HANDSHAKING] = ex_conn_handshake,
+  [EX_ST_STREAMING]   = ex_conn_stream,
+  [EX_ST_DRAINING]    = ex_conn_drain,
+  [EX_ST_CLOSED]      = ex_conn_teardown,
+};
+
+const char *host = "broadcastlv.chat.bilibili.com";
+const char *port = "2243";
+const uint8_t web_handshake[] = {0,0,0,16, 0,16, 0,1, 0,0,0,7, 0,0,0,1};
+const uint8_t web_heartbeat[] = {0,0,0,16, 0,16, 0,1, 0,0,0,2, 0,0,0,1};
+
+/* Every reconnect reuses the same races, handles and write requests */
+static ex_eyeballs_pool_t eyeballs;
+static ex_pool_t writes;
+static ex_room_t room;
 
 int
 main(int argc, char *argv[]) {
   int rc = 0;
   uv_loop_t loop;
-  ex_conn_t lconn;
+  int copies = argc > 1 ? atoi(argv[1]) : EX_COPIES;
+
+  /* Point at a local mock server (see ex0.c) instead */
+  if (getenv("EX_HOST"))
+    host = getenv("EX_HOST");
+  if (getenv("EX_PORT"))
+    port = getenv("EX_PORT");
+
+  rc = ex_log_start(STDOUT_FILENO, STDERR_FILENO, EX_LOG_INFO);
+  assert(rc >= 0 && "failed at ex_log_start()");
 
   rc = uv_loop_init(&loop);
   assert(rc >= 0 && "failed at uv_loop_init()");
 
-  rc = ex_conn_init(&lconn, &loop);
-  assert(rc >= 0 && "failed at ex_conn_init()");
-
-  for (int i = 0; i < 3; ++i) {
-    rc = ex_start(&lconn);
+  rc = ex_eyeballs_pool_init(&eyeballs);
+  assert(rc >= 0 && "failed at ex_eyeballs_pool_init()");
+  rc = ex_pool_init(&writes, sizeof(uv_write_t), 0);
+  assert(rc >= 0 && "failed at ex_pool_init()");
+
+  /* Shared by the copies: what was already delivered, and the scratch
+   * space for reading and inflating */
+  if (copies <= 0)
+    copies = 1;
+  room.count = copies;
+  room.conns = calloc(copies, sizeof(*room.conns));
+  assert(room.conns && "failed at calloc()");
+  rc = ex_dedup_init(&room.dedup, EX_DEDUP_KEYS, 0);
+  assert(rc >= 0 && "failed at ex_dedup_init()");
+  rc = ex_inflate_init(&room.inflater, 0);
+  assert(rc >= 0 && "failed at ex_inflate_init()");
+
+  /* Stops every copy; never holds the loop by itself */
+  rc = uv_signal_init(&loop, &room.sigint);
+  assert(rc >= 0 && "failed at uv_signal_init()");
+  uv_signal_start(&room.sigint, ex_signal_cb, SIGINT);
+  uv_unref((uv_handle_t *)&room.sigint);
+
+  for (int i = 0; i < copies; ++i) {
+    rc = ex_conn_init(&room.conns[i], &loop);
+    assert(rc >= 0 && "failed at ex_conn_init()");
+    room.conns[i].index = i;
+
+    /* Reconnects are driven from the loop; it returns after the last one */
+    rc = ex_start(&room.conns[i]);
     assert(rc >= 0 && "failed at ex_start()");
+  }
 
-    rc = uv_run(&loop, UV_RUN_DEFAULT);
-    assert(rc >= 0 && "failed at uv_run()");
-
-    rc = ex_conn_close(&lconn);
-    assert(rc >= 0 && "failed at ex_conn_close()");
-
-    rc = uv_run(&loop, UV_RUN_DEFAULT);
-    assert(rc >= 0 && "failed at uv_run()");
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run()");
+
+  ex_log(EX_LOG_INFO, "%lu messages delivered, %lu duplicates dropped",
+      room.delivered, room.dedup.dups);
+  for (int i = 0; i < copies; ++i) {
+    ex_log(EX_LOG_INFO, "copy %d: first with %lu, late with %lu; %d attempts, %lu outages, longest %lu ms",
+        i, room.conns[i].firsts, room.conns[i].dups, room.conns[i].attempts,
+        room.conns[i].backoff.outages, room.conns[i].backoff.longest_ms);
+    rc = ex_conn_free(&room.conns[i]);
+    assert(rc >= 0 && "failed at ex_conn_free()");
   }
+  uv_close((uv_handle_t *)&room.sigint, NULL);
 
-  rc = ex_conn_free(&lconn);
-  assert(rc >= 0 && "failed at ex_conn_free()");
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run()");
+  free(room.conns);
+  ex_dedup_free(&room.dedup);
+  ex_inflate_free(&room.inflater);
+  ex_pool_free(&writes);
+  ex_eyeballs_pool_free(&eyeballs);
+  ex_log_stop();
 
   rc = uv_loop_close(&loop);
   if (rc < 0) {
-    fprintf(stderr, "uv_loop_close(): (%d) %s\n", rc, uv_strerror(rc));
+    ex_log(EX_LOG_ERROR, "uv_loop_close(): (%d) %s", rc, uv_strerror(rc));
   }
 
   exit(EXIT_SUCCESS);
@@ -90,105 +224,412 @@ main(int argc, char *argv[]) {
 
 int
 ex_start(ex_conn_t *conn) {
-  int rc = 0;
-  struct addrinfo hints;
-  const char host[] = "broadcastlv.chat.bilibili.com";
-  const char port[] = "2243";
-
   if (!conn)
     return -1;
+  return ex_conn_event(conn, EX_EV_START);
+}
+
+/* Moves to the state `event` leads to, restarts the deadline timer for it
+ * and runs its entry action. A failed action turns into an error event. */
+int
+ex_conn_event(ex_conn_t *conn, int event) {
+  int next = ex_state_next(conn->state, event);
+  int rc = 0;
 
-  if (!conn->addrs) {
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = SOCK_STREAM;
-    conn->resolver.data = conn;
+  if (next < 0)
+    return next;
 
-    rc = uv_getaddrinfo(conn->loop, &conn->resolver, ex_resolve_cb, host, port, &hints);
-    assert(rc >= 0 && "failed at uv_getaddrinfo()");
-  } else {
-    conn->tcp_on = 1;
-    rc = uv_tcp_init(conn->loop, &conn->conn);
-    assert(rc >= 0 && "failed at uv_tcp_init()");
+  conn->state = next;
+  uv_timer_stop(&conn->timeout);
+  uv_unref((uv_handle_t *)&conn->timeout);
+  if (ex_states[next].deadline_ms)
+    uv_timer_start(&conn->timeout, ex_timeout_cb, ex_states[next].deadline_ms, 0);
 
-    conn->conn.data = conn;
-    conn->connector.data = conn;
-    if (!conn->addr_in_use)
-      conn->addr_in_use = conn->addrs;
+  if (ex_conn_enter[next])
+    rc = ex_conn_enter[next](conn);
+  if (rc < 0 && conn->state == next) {
+    ex_log(EX_LOG_ERROR, "(%p) entering %s: (%d) %s", conn, ex_state_name(next), rc, uv_strerror(rc));
+    ex_conn_event(conn, EX_EV_ERROR);
+  }
+  return rc;
+}
 
-    rc = uv_tcp_connect(&conn->connector, &conn->conn, conn->addr_in_use->ai_addr, ex_connect_cb);
-    assert(rc >= 0 && "failed at uv_tcp_connect()");
+int
+ex_conn_resolve(ex_conn_t *conn) {
+  /* Resolved on an earlier run */
+  conn->attempts++;
+  if (conn->addrs)
+    return ex_conn_event(conn, EX_EV_RESOLVED);
+
+  /* A timed out resolve the cancel came too late for still owns the
+   * request; this one starts from its callback */
+  conn->resolve_gen++;
+  if (conn->resolving) {
+    conn->resolve_again = 1;
+    return 0;
   }
+  return ex_conn_getaddrinfo(conn);
+}
+
+int
+ex_conn_getaddrinfo(ex_conn_t *conn) {
+  struct addrinfo hints;
+  int rc = 0;
 
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  conn->resolver.data = conn;
+  conn->resolver_gen = conn->resolve_gen;
+  rc = uv_getaddrinfo(conn->loop, &conn->resolver, ex_resolve_cb, host, port, &hints);
+  if (rc == 0)
+    conn->resolving = 1;
   return rc;
 }
 
+/* Copies start at different addresses, so with more than one resolved
+ * they take different paths; every other address follows as a fallback,
+ * wrapping round to those before the start. */
+int
+ex_conn_connect(ex_conn_t *conn) {
+  const struct addrinfo *ai = NULL;
+  int naddrs = 0;
+  int start = 0;
+
+  if (!conn->order) {
+    for (ai = conn->addrs; ai; ai = ai->ai_next)
+      naddrs++;
+    if (!naddrs)
+      return UV_EINVAL;
+    conn->order = malloc(naddrs * sizeof(*conn->order));
+    if (!conn->order)
+      return UV_ENOMEM;
+
+    /* The entries share the resolved sockaddrs; only the links are new */
+    start = conn->index % naddrs;
+    ai = conn->addrs;
+    for (int i = 0; i < naddrs; ++i, ai = ai->ai_next) {
+      int k = (i - start + naddrs) % naddrs;
+
+      conn->order[k] = *ai;
+      conn->order[k].ai_next = k + 1 < naddrs ? &conn->order[k + 1] : NULL;
+    }
+  }
+  return ex_eyeballs_start(&conn->race, conn->loop, &eyeballs, conn->order, EX_EYEBALLS_DELAY_MS, ex_connect_cb, conn);
+}
+
+/* Auth and the first heartbeat, then wait for the reply */
+int
+ex_conn_handshake(ex_conn_t *conn) {
+  int rc = 0;
+
+  rc = ex_conn_write(conn, web_handshake, sizeof(web_handshake));
+  if (rc < 0)
+    return rc;
+  rc = ex_conn_write(conn, web_heartbeat, sizeof(web_heartbeat));
+  if (rc < 0)
+    return rc;
+  uv_timer_start(&conn->heartbeat, ex_heartbeat_cb, EX_HEARTBEAT_MS, EX_HEARTBEAT_MS);
+  return uv_read_start((uv_stream_t *)&conn->conn, ex_alloc_cb, ex_read_cb);
+}
+
+int
+ex_conn_stream(ex_conn_t *conn) {
+  ex_outage_t outage;
+
+  conn->last_read_ms = uv_now(conn->loop);
+  if (ex_backoff_up(&conn->backoff, conn->last_read_ms, &outage))
+    ex_log(EX_LOG_INFO, "(%p) back after %lu ms, %u attempts", conn,
+        outage.end_ms - outage.start_ms, outage.attempts);
+  return 0;
+}
+
+int
+ex_conn_drain(ex_conn_t *conn) {
+  uv_timer_stop(&conn->heartbeat);
+  uv_read_stop((uv_stream_t *)&conn->conn);
+  conn->closer.data = conn;
+  return uv_shutdown(&conn->closer, (uv_stream_t *)&conn->conn, ex_shutdown_cb);
+}
+
+int
+ex_conn_teardown(ex_conn_t *conn) {
+  uint64_t delay = 0;
+
+  /* Fails once the lookup is running; its callback is then stale */
+  if (conn->resolving) {
+    uv_cancel((uv_req_t *)&conn->resolver);
+    conn->resolve_gen++;
+    conn->resolve_again = 0;
+  }
+  ex_eyeballs_cancel(conn->race);
+  conn->race = NULL;
+  uv_timer_stop(&conn->heartbeat);
+  ex_frame_decoder_reset(&conn->decoder);
+  if (conn->tcp_on) {
+    conn->tcp_on = 0;
+    if (!uv_is_closing((uv_handle_t *)&conn->conn))
+      uv_close((uv_handle_t *)&conn->conn, NULL);
+  }
+  if (conn->stopping || conn->attempts >= EX_CONNECTS)
+    return 0;
+
+  /* The deadline timer doubles as the retry timer, and holds the loop. */
+  ex_backoff_down(&conn->backoff, uv_now(conn->loop));
+  delay = ex_backoff_next(&conn->backoff);
+  ex_log(EX_LOG_INFO, "(%p) reconnecting in %lu ms", conn, delay);
+  uv_ref((uv_handle_t *)&conn->timeout);
+  return uv_timer_start(&conn->timeout, ex_retry_cb, delay, 0);
+}
+
 void
 ex_resolve_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
-  int rc = 0;
   ex_conn_t *conn = req->data;
+  int rc = 0;
 
+  /* Gave up on it already, and maybe started over meanwhile */
+  conn->resolving = 0;
+  if (conn->resolver_gen != conn->resolve_gen || conn->state != EX_ST_RESOLVING) {
+    uv_freeaddrinfo(res);
+    if (conn->resolve_again && conn->state == EX_ST_RESOLVING) {
+      conn->resolve_again = 0;
+      rc = ex_conn_getaddrinfo(conn);
+      if (rc < 0) {
+        ex_log(EX_LOG_ERROR, "(%p) uv_getaddrinfo(): (%d) %s", conn, rc, uv_strerror(rc));
+        ex_conn_event(conn, EX_EV_ERROR);
+      }
+    }
+    return;
+  }
   if (status < 0) {
-    fprintf(stderr, "(%p) ex_resolve_cb(): (%d) %s\n", conn, status, uv_strerror(status));
+    ex_log(EX_LOG_ERROR, "(%p) ex_resolve_cb(): (%d) %s", conn, status, uv_strerror(status));
+    ex_conn_event(conn, EX_EV_ERROR);
     return;
   }
 
   conn->addrs = res;
   conn->addr_needs_free = 1;
-  rc = ex_start(conn);
-  assert(rc >= 0 && "failed at ex_start()");
+  ex_conn_event(conn, EX_EV_RESOLVED);
 }
 
-void ex_connect_cb(uv_connect_t *handle, int status) {
-  ex_conn_t *conn = handle->data;
+void ex_connect_cb(ex_eyeballs_t *race, int status, uv_tcp_t *tcp, const struct addrinfo *addr) {
+  char dest_addr[INET6_ADDRSTRLEN] = "";
+  int rc = 0;
+  ex_conn_t *conn = race->data;
 
+  conn->race = NULL;
   if (status < 0) {
-    fprintf(stderr, "(%p) ex_connect_cb: (%d) %s\n", conn, status, uv_strerror(status));
+    ex_log(EX_LOG_ERROR, "(%p) ex_connect_cb: (%d) %s", conn, status, uv_strerror(status));
+    ex_conn_event(conn, EX_EV_ERROR);
+    return;
+  }
+
+  /* Move the winning socket onto the embedded handle */
+  conn->tcp_on = 1;
+  rc = uv_tcp_init(conn->loop, &conn->conn);
+  assert(rc >= 0 && "failed at uv_tcp_init()");
+  conn->conn.data = conn;
+
+  rc = ex_eyeballs_adopt(tcp, &conn->conn);
+  if (rc < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) ex_eyeballs_adopt: (%d) %s", conn, rc, uv_strerror(rc));
+    ex_conn_event(conn, EX_EV_ERROR);
+    return;
+  }
+
+  conn->addr_in_use = addr;
+  uv_ip_name(addr->ai_addr, dest_addr, sizeof(dest_addr));
+  ex_log(EX_LOG_INFO, "Connected to %s", dest_addr);
+  ex_conn_event(conn, EX_EV_CONNECTED);
+}
+
+int
+ex_conn_write(ex_conn_t *conn, const uint8_t *data, size_t len) {
+  uv_write_t *req = NULL;
+  uv_buf_t buf = uv_buf_init((char *)data, len);
+  int rc = 0;
+
+  req = ex_pool_get(&writes);
+  if (!req)
+    return UV_ENOMEM;
+  rc = uv_write(req, (uv_stream_t *)&conn->conn, &buf, 1, ex_write_cb);
+  if (rc < 0)
+    ex_pool_put(req);
+  return rc;
+}
+
+void
+ex_write_cb(uv_write_t *req, int status) {
+  ex_pool_put(req);
+}
+
+void
+ex_heartbeat_cb(uv_timer_t *handle) {
+  ex_conn_t *conn = handle->data;
+
+  if (ex_conn_write(conn, web_heartbeat, sizeof(web_heartbeat)) < 0)
+    ex_conn_event(conn, EX_EV_ERROR);
+}
+
+/* Reads on a loop never overlap, so every copy reads into the same buffer. */
+void
+ex_alloc_cb(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+  buf->base = (char *)room.rdbuf;
+  buf->len = sizeof(room.rdbuf);
+}
+
+void
+ex_read_cb(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf) {
+  ex_conn_t *conn = strm->data;
+  int rc = 0;
+
+  if (nread < 0) {
+    if (nread != UV_EOF)
+      ex_log(EX_LOG_ERROR, "(%p) TCP read: (%ld) %s", conn, nread, uv_strerror(nread));
+    ex_conn_event(conn, EX_EV_ERROR);
+    return;
+  }
+
+  conn->last_read_ms = uv_now(conn->loop);
+  rc = ex_frame_feed(&conn->decoder, (uint8_t *)buf->base, nread, ex_decode_cb, conn);
+  if (rc < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) ex_frame_feed: (%d) %s", conn, rc, uv_strerror(rc));
+    ex_conn_event(conn, EX_EV_ERROR);
+  }
+}
+
+int
+ex_decode_cb(const ex_frame_t *frame, void *arg) {
+  ex_conn_t *conn = arg;
+
+  if (frame->ver == EX_VER_ZLIB)
+    return ex_inflate_frame(&room.inflater, frame, ex_decode_cb, conn);
+
+  switch (frame->op) {
+  case EX_OP_AUTH_REPLY:
+    ex_conn_event(conn, EX_EV_AUTH_REPLY);
+    break;
+  case EX_OP_MESSAGE:
+    ex_deliver(conn, frame);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+/* The first copy of a message to arrive goes through; the others stop here. */
+void
+ex_deliver(ex_conn_t *conn, const ex_frame_t *frame) {
+  if (!ex_dedup_first(&room.dedup, ex_dedup_hash(frame->body, frame->body_len), uv_now(conn->loop))) {
+    conn->dups++;
+    return;
+  }
+  conn->firsts++;
+  room.delivered++;
+  ex_log(EX_LOG_DEBUG, "(%p) %.*s", conn, (int)frame->body_len, (const char *)frame->body);
+}
+
+void
+ex_signal_cb(uv_signal_t *handle, int signum) {
+  ex_log(EX_LOG_INFO, "Caught signal %d, closing %d copies", signum, room.count);
+  for (int i = 0; i < room.count; ++i)
+    ex_conn_close(&room.conns[i]);
+  uv_signal_stop(handle);
+}
+
+void
+ex_shutdown_cb(uv_shutdown_t *req, int status) {
+  ex_conn_event(req->data, EX_EV_DRAINED);
+}
+
+void
+ex_timeout_cb(uv_timer_t *handle) {
+  ex_conn_t *conn = handle->data;
+  uint64_t idle = uv_now(conn->loop) - conn->last_read_ms;
+
+  /* Reads push the idle deadline out; only a quiet connection times out */
+  if (conn->state == EX_ST_STREAMING && idle < ex_states[EX_ST_STREAMING].deadline_ms) {
+    uv_timer_start(&conn->timeout, ex_timeout_cb, ex_states[EX_ST_STREAMING].deadline_ms - idle, 0);
     return;
   }
-  printf("Connected\n");
+
+  ex_log(EX_LOG_WARN, "(%p) %s for over %lu ms, giving up", conn,
+      ex_state_name(conn->state), ex_states[conn->state].deadline_ms);
+  ex_conn_event(conn, EX_EV_TIMEOUT);
+}
+
+void
+ex_retry_cb(uv_timer_t *handle) {
+  ex_conn_event(handle->data, EX_EV_START);
 }
 
 int
 ex_conn_init(ex_conn_t *conn, uv_loop_t *loop) {
+  int rc = 0;
+
   if (!conn)
     return -1;
 
-  conn->addrs = NULL;
-  conn->addr_in_use = NULL;
-  conn->addr_needs_free = 0;
+  memset(conn, 0, sizeof(*conn));
   conn->loop = loop;
-  conn->tcp_on = 0;
-  conn->timeout_on = 0;
-  return 0;
+  conn->state = EX_ST_IDLE;
+  ex_backoff_init(&conn->backoff, EX_BACKOFF_BASE_MS, EX_BACKOFF_CAP_MS);
+
+  /* A deadline alone never keeps the loop running. */
+  rc = uv_timer_init(loop, &conn->timeout);
+  if (rc < 0)
+    return rc;
+  uv_unref((uv_handle_t *)&conn->timeout);
+  conn->timeout.data = conn;
+
+  /* Nor do heartbeats; the connection does while it is open */
+  rc = uv_timer_init(loop, &conn->heartbeat);
+  if (rc < 0) {
+    uv_close((uv_handle_t *)&conn->timeout, NULL);
+    return rc;
+  }
+  uv_unref((uv_handle_t *)&conn->heartbeat);
+  conn->heartbeat.data = conn;
+  conn->timeout_on = 1;
+  return ex_frame_decoder_init(&conn->decoder, 0);
 }
 
+/* Orderly close, for good; a no-op once closed. */
 int
 ex_conn_close(ex_conn_t *conn) {
   if (!conn)
     return 0;
 
-  if (conn->tcp_on) {
-    conn->tcp_on = 0;
-    if (!uv_is_closing((uv_handle_t *)&conn->conn))
-      uv_close((uv_handle_t *)&conn->conn, NULL);
-  }
-  if (conn->timeout_on) {
-    conn->timeout_on = 0;
-    if (!uv_is_closing((uv_handle_t *)&conn->timeout))
-      uv_close((uv_handle_t *)&conn->timeout, NULL);
+  conn->stopping = 1;
+  if (conn->state == EX_ST_CLOSED) {
+    uv_timer_stop(&conn->timeout);
+    uv_unref((uv_handle_t *)&conn->timeout);
   }
+
+  if (conn->state != EX_ST_IDLE && conn->state != EX_ST_CLOSED)
+    ex_conn_event(conn, EX_EV_CLOSE);
   return 0;
 }
 
+/* Run the loop afterwards to finish closing the timer. */
 int
 ex_conn_free(ex_conn_t *conn) {
   if (!conn)
     return 0;
 
+  if (conn->timeout_on) {
+    conn->timeout_on = 0;
+    uv_close((uv_handle_t *)&conn->timeout, NULL);
+    uv_close((uv_handle_t *)&conn->heartbeat, NULL);
+  }
+  ex_frame_decoder_free(&conn->decoder);
+
   if (conn->addr_needs_free)
     uv_freeaddrinfo(conn->addrs);
+  free(conn->order);
 
   conn->addrs = NULL;
+  conn->order = NULL;
   conn->addr_in_use = NULL;
   conn->addr_needs_free = 0;
   conn->loop = NULL;
@@ -0,0 +1,657 @@
+/* A libuv example. Shards connections across loop threads.
+ *
+ * 1. DNS resolve (main loop)
+ * 2. Hand connections to N shard loops
+ * 3. TCP connect, write, read, heartbeat (shard loops)
+ * 4. Migrate connections off loops that run hot
+ * 5. TCP close on SIGINT
+ *
+ * Usage: ex8 [threads] [connections] [host] [port]
+ *
+ * Metrics are served in Prometheus text format on the unix socket named by
+ * EX_METRICS (default EX_METRICS_PATH, empty to turn off), e.g.
+ * curl --unix-socket /tmp/ex8.sock http://localhost/metrics
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <assert.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <uv.h>
+
+#include "ex_dns.h"
+#include "ex_eyeballs.h"
+#include "ex_frame.h"
+#include "ex_inflate.h"
+#include "ex_log.h"
+#include "ex_metrics.h"
+#include "ex_pool.h"
+#include "ex_shard.h"
+#include "ex_wheel.h"
+
+#define EX_HEARTBEAT_MS         30000
+#define EX_HEARTBEAT_JITTER_MS  3000
+#define EX_DETACH_DRAIN_MS      5000
+#define EX_STATUS_MS            5000
+#define EX_METRICS_PATH         "/tmp/ex8.sock"
+#define EX_METRICS_WALK_MS      1000
+
+/* Per-shard counters, merged on scrape */
+enum {
+  EX8_M_CONNECTS = 0,
+  EX8_M_DISCONNECTS,
+  EX8_M_CONNECTIONS,
+  EX8_M_BYTES,
+  EX8_M_FRAMES,
+  EX8_M_WRITES,
+  EX8_M_WRITE_ERRORS,
+  EX8_M_COUNT
+};
+
+static const ex_metric_def_t metric_defs[EX8_M_COUNT] = {
+  [EX8_M_CONNECTS] = { "ex8_connects_total", NULL, EX_METRIC_COUNTER, "TCP connections established." },
+  [EX8_M_DISCONNECTS] = { "ex8_disconnects_total", NULL, EX_METRIC_COUNTER, "Connections dropped on read errors." },
+  [EX8_M_CONNECTIONS] = { "ex8_connections", NULL, EX_METRIC_GAUGE, "Open connections." },
+  [EX8_M_BYTES] = { "ex8_read_bytes_total", NULL, EX_METRIC_COUNTER, "Bytes read." },
+  [EX8_M_FRAMES] = { "ex8_frames_total", NULL, EX_METRIC_COUNTER, "Frames decoded, after inflating." },
+  [EX8_M_WRITES] = { "ex8_writes_total", NULL, EX_METRIC_COUNTER, "Writes queued." },
+  [EX8_M_WRITE_ERRORS] = { "ex8_write_errors_total", NULL, EX_METRIC_COUNTER, "Writes that failed." },
+};
+
+/* Per-shard state, shared by every connection on that loop */
+typedef struct ex_shard_ctx_s {
+  ex_wheel_t        wheel;
+  ex_inflate_t      inflater;
+  ex_pool_t         writes;
+  ex_eyeballs_pool_t eyeballs;
+  ex_metrics_set_t  metrics;
+  uv_timer_t        walk;
+  unsigned char     rdbuf[65536];
+} ex_shard_ctx_t;
+
+typedef struct ex_conn_s {
+  uv_loop_t         *loop;
+  ex_shard_item_t   shard;
+  uv_tcp_t          conn;
+  ex_eyeballs_t     *race;
+  ex_wheel_entry_t  heartbeat;
+  ex_frame_decoder_t decoder;
+
+  int               tcp_on;
+  int               detaching;  /* Waiting for queued writes to go out */
+  int               fd;         /* Socket in transit between shards */
+
+  const struct addrinfo *addrs;
+
+  /* Written by the owning shard, read by scrapes on the main loop */
+  uint64_t          frames;
+  uint64_t          bytes;
+  uint64_t          connects;
+  uint64_t          write_queue;
+
+  void *data;
+} ex_conn_t;
+
+int ex_conn_init(ex_conn_t *conn);
+int ex_conn_free(ex_conn_t *conn);
+int ex_conn_write(ex_conn_t *conn, const uint8_t *data, size_t len);
+int ex_shard_init_cb(ex_shard_t *shard);
+void ex_shard_fini_cb(ex_shard_t *shard);
+void ex_attach_cb(ex_shard_item_t *item, ex_shard_t *shard);
+void ex_detach_cb(ex_shard_item_t *item, ex_shard_t *shard);
+void ex_remove_cb(ex_shard_item_t *item, ex_shard_t *shard);
+void ex_resolve_cb(ex_dns_req_t *req, int status, ex_dns_result_t *res);
+void ex_connect_cb(ex_eyeballs_t *race, int status, uv_tcp_t *tcp, const struct addrinfo *addr);
+void ex_alloc_cb(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+void ex_read_cb(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf);
+void ex_write_cb(uv_write_t *req, int status);
+void ex_heartbeat_cb(ex_wheel_entry_t *entry);
+void ex_signal_cb(uv_signal_t *handle, int signum);
+void ex_status_cb(uv_timer_t *handle);
+void ex_walk_cb(uv_timer_t *handle);
+void ex_collect_cb(ex_metrics_t *m, ex_metrics_buf_t *out);
+int ex_decode_cb(const ex_frame_t *frame, void *arg);
+
+const char *host = "broadcastlv.chat.bilibili.com";
+const char *port = "2243";
+const uint8_t web_handshake[] = {0,0,0,16, 0,16, 0,1, 0,0,0,7, 0,0,0,1};
+const uint8_t web_heartbeat[] = {0,0,0,16, 0,16, 0,1, 0,0,0,2, 0,0,0,1};
+
+const ex_shard_ops_t shard_ops = {
+  .shard_init = ex_shard_init_cb,
+  .shard_fini = ex_shard_fini_cb,
+  .attach = ex_attach_cb,
+  .detach = ex_detach_cb,
+  .remove = ex_remove_cb,
+};
+
+static ex_shard_group_t group;
+static ex_dns_cache_t dns;
+static ex_dns_result_t *dns_res;
+static ex_dns_req_t resolver;
+static ex_metrics_t metrics;
+static uv_signal_t sigint;
+static uv_timer_t status;
+static ex_conn_t *conns;
+static int nconns = 1;
+
+
+int
+main(int argc, char *argv[]) {
+  int rc = 0;
+  int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+  uint64_t frames = 0, bytes = 0;
+  const char *metrics_path = getenv("EX_METRICS") ? getenv("EX_METRICS") : EX_METRICS_PATH;
+  uv_loop_t loop;
+
+  nconns = argc > 2 ? atoi(argv[2]) : 16;
+  if (argc > 3)
+    host = argv[3];
+  if (argc > 4)
+    port = argv[4];
+  if (nthreads <= 0)
+    nthreads = 1;
+  if (nconns <= 0)
+    nconns = 1;
+
+  conns = calloc(nconns, sizeof(*conns));
+  assert(conns && "failed at calloc()");
+  for (int i = 0; i < nconns; ++i) {
+    rc = ex_conn_init(&conns[i]);
+    assert(rc >= 0 && "failed at ex_conn_init()");
+  }
+
+  rc = ex_log_start(STDOUT_FILENO, STDERR_FILENO, EX_LOG_INFO);
+  assert(rc >= 0 && "failed at ex_log_start()");
+
+  rc = uv_loop_init(&loop);
+  assert(rc >= 0 && "failed at uv_loop_init()");
+
+  rc = ex_metrics_init(&metrics, metric_defs, EX8_M_COUNT, ex_collect_cb);
+  assert(rc >= 0 && "failed at ex_metrics_init()");
+  if (*metrics_path) {
+    rc = ex_metrics_serve(&metrics, &loop, metrics_path);
+    if (rc < 0)
+      ex_log(EX_LOG_WARN, "No metrics on %s: (%d) %s", metrics_path, rc, uv_strerror(rc));
+    else
+      ex_log(EX_LOG_INFO, "Metrics on unix:%s", metrics_path);
+  }
+
+  rc = ex_shard_group_init(&group, &loop, nthreads, &shard_ops);
+  assert(rc >= 0 && "failed at ex_shard_group_init()");
+
+  rc = ex_shard_group_start(&group);
+  assert(rc >= 0 && "failed at ex_shard_group_start()");
+
+  /* Resolve once on the main loop; shards share the result. */
+  rc = ex_dns_cache_init(&dns, &loop, EX_DNS_TTL_MS, EX_DNS_NEG_TTL_MS);
+  assert(rc >= 0 && "failed at ex_dns_cache_init()");
+
+  rc = ex_dns_lookup(&dns, &resolver, host, port, ex_resolve_cb, &dns_res);
+  assert(rc >= 0 && "failed at ex_dns_lookup()");
+
+  rc = uv_signal_init(&loop, &sigint);
+  assert(rc >= 0 && "failed at uv_signal_init()");
+  rc = uv_signal_start(&sigint, ex_signal_cb, SIGINT);
+  assert(rc >= 0 && "failed at uv_signal_start()");
+  /* A scraper gone mid-write is an error on its pipe, not a signal */
+  signal(SIGPIPE, SIG_IGN);
+
+  rc = uv_timer_init(&loop, &status);
+  assert(rc >= 0 && "failed at uv_timer_init()");
+  rc = uv_timer_start(&status, ex_status_cb, EX_STATUS_MS, EX_STATUS_MS);
+  assert(rc >= 0 && "failed at uv_timer_start()");
+
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run()");
+
+  for (int i = 0; i < nconns; ++i) {
+    frames += conns[i].frames;
+    bytes += conns[i].bytes;
+    ex_conn_free(&conns[i]);
+  }
+  ex_log(EX_LOG_INFO, "%d connections: %lu frames, %lu bytes, %lu migrations in %lu rebalances",
+      nconns, frames, bytes, group.migrations, group.rebalances);
+
+  ex_dns_result_unref(dns_res);
+  ex_dns_cache_free(&dns);
+  ex_shard_group_free(&group);
+  free(conns);
+
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run()");
+  ex_metrics_free(&metrics);
+  ex_log_stop();
+
+  rc = uv_loop_close(&loop);
+  if (rc < 0) {
+    ex_log(EX_LOG_ERROR, "uv_loop_close(): (%d) %s", rc, uv_strerror(rc));
+  }
+
+  exit(EXIT_SUCCESS);
+}
+
+void
+ex_resolve_cb(ex_dns_req_t *req, int status, ex_dns_result_t *res) {
+  int rc = 0;
+
+  if (status < 0) {
+    ex_log(EX_LOG_ERROR, "ex_resolve_cb(): (%d) %s", status, uv_strerror(status));
+    return;
+  }
+
+  dns_res = res;
+  for (int i = 0; i < nconns; ++i) {
+    conns[i].addrs = res->addrs;
+    rc = ex_shard_add(&group, &conns[i].shard);
+    assert(rc >= 0 && "failed at ex_shard_add()");
+  }
+}
+
+void
+ex_signal_cb(uv_signal_t *handle, int signum) {
+  ex_log(EX_LOG_INFO, "Stopping %d shards", group.nshards);
+  ex_dns_cancel(&resolver);
+  ex_shard_group_stop(&group);
+  uv_close((uv_handle_t *)&sigint, NULL);
+  uv_close((uv_handle_t *)&status, NULL);
+  ex_metrics_close(&metrics);
+}
+
+void
+ex_status_cb(uv_timer_t *handle) {
+  for (int i = 0; i < group.nshards; ++i) {
+    ex_log(EX_LOG_INFO, "shard %d: %4d conns, %3d.%d%% busy", i,
+        __atomic_load_n(&group.shards[i].item_count, __ATOMIC_RELAXED),
+        __atomic_load_n(&group.shards[i].busy_permille, __ATOMIC_RELAXED) / 10,
+        __atomic_load_n(&group.shards[i].busy_permille, __ATOMIC_RELAXED) % 10);
+  }
+}
+
+void
+ex_collect_cb(ex_metrics_t *m, ex_metrics_buf_t *out) {
+  static const char *const conn_metrics[][3] = {
+    { "ex8_conn_read_bytes_total", "counter", "Bytes read, per connection." },
+    { "ex8_conn_frames_total", "counter", "Frames decoded, per connection." },
+    { "ex8_conn_connects_total", "counter", "Connects, per connection." },
+    { "ex8_conn_write_queue_bytes", "gauge", "Bytes waiting in the write queue, per connection." },
+  };
+  uint64_t v = 0;
+
+  ex_metrics_printf(out, "# HELP ex8_dns_resolves_total Lookups that went to the resolver.\n"
+      "# TYPE ex8_dns_resolves_total counter\nex8_dns_resolves_total %lu\n", dns.resolves);
+  ex_metrics_printf(out, "# HELP ex8_dns_resolve_milliseconds_total Time spent resolving.\n"
+      "# TYPE ex8_dns_resolve_milliseconds_total counter\nex8_dns_resolve_milliseconds_total %lu\n", dns.resolve_ms);
+  ex_metrics_printf(out, "# HELP ex8_migrations_total Connections moved between shards.\n"
+      "# TYPE ex8_migrations_total counter\nex8_migrations_total %lu\n", group.migrations);
+  ex_metrics_printf(out, "# HELP ex8_shard_busy_ratio Share of the last interval each shard spent busy.\n"
+      "# TYPE ex8_shard_busy_ratio gauge\n");
+  for (int i = 0; i < group.nshards; ++i) {
+    ex_metrics_printf(out, "ex8_shard_busy_ratio{shard=\"%d\"} %.3f\n", i,
+        __atomic_load_n(&group.shards[i].busy_permille, __ATOMIC_RELAXED) / 1000.0);
+  }
+
+  for (size_t k = 0; k < sizeof(conn_metrics) / sizeof(conn_metrics[0]); ++k) {
+    ex_metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+        conn_metrics[k][0], conn_metrics[k][2], conn_metrics[k][0], conn_metrics[k][1]);
+    for (int i = 0; i < nconns; ++i) {
+      switch (k) {
+      case 0: v = __atomic_load_n(&conns[i].bytes, __ATOMIC_RELAXED); break;
+      case 1: v = __atomic_load_n(&conns[i].frames, __ATOMIC_RELAXED); break;
+      case 2: v = __atomic_load_n(&conns[i].connects, __ATOMIC_RELAXED); break;
+      default: v = __atomic_load_n(&conns[i].write_queue, __ATOMIC_RELAXED); break;
+      }
+      ex_metrics_printf(out, "%s{conn=\"%d\"} %lu\n", conn_metrics[k][0], i, v);
+    }
+  }
+}
+
+/* uv_walk() is not thread-safe; each shard summarises its own loop. */
+void
+ex_walk_cb(uv_timer_t *handle) {
+  ex_shard_ctx_t *ctx = handle->data;
+
+  ex_metrics_walk(&ctx->metrics, handle->loop);
+}
+
+static void
+ex_ctx_close_cb(uv_handle_t *handle) {
+  ex_wheel_t *wheel = handle->data;
+  ex_shard_ctx_t *ctx = wheel->data;
+
+  ex_pool_free(&ctx->writes);
+  ex_eyeballs_pool_free(&ctx->eyeballs);
+  free(ctx);
+}
+
+int
+ex_shard_init_cb(ex_shard_t *shard) {
+  ex_shard_ctx_t *ctx = NULL;
+  int rc = 0;
+
+  ctx = malloc(sizeof(*ctx));
+  if (!ctx)
+    return UV_ENOMEM;
+
+  rc = ex_wheel_init(&ctx->wheel, &shard->loop, EX_WHEEL_TICK_MS);
+  assert(rc >= 0 && "failed at ex_wheel_init()");
+  ctx->wheel.data = ctx;
+
+  rc = ex_inflate_init(&ctx->inflater, 0);
+  assert(rc >= 0 && "failed at ex_inflate_init()");
+
+  rc = ex_pool_init(&ctx->writes, sizeof(uv_write_t), 0);
+  assert(rc >= 0 && "failed at ex_pool_init()");
+  rc = ex_eyeballs_pool_init(&ctx->eyeballs);
+  assert(rc >= 0 && "failed at ex_eyeballs_pool_init()");
+
+  rc = ex_metrics_set_init(&metrics, &ctx->metrics);
+  assert(rc >= 0 && "failed at ex_metrics_set_init()");
+  rc = uv_timer_init(&shard->loop, &ctx->walk);
+  assert(rc >= 0 && "failed at uv_timer_init()");
+  ctx->walk.data = ctx;
+  rc = uv_timer_start(&ctx->walk, ex_walk_cb, 0, EX_METRICS_WALK_MS);
+  assert(rc >= 0 && "failed at uv_timer_start()");
+  uv_unref((uv_handle_t *)&ctx->walk);
+
+  shard->data = ctx;
+  return 0;
+}
+
+void
+ex_shard_fini_cb(ex_shard_t *shard) {
+  ex_shard_ctx_t *ctx = shard->data;
+
+  if (!ctx)
+    return;
+  ex_inflate_free(&ctx->inflater);
+  ex_metrics_set_free(&ctx->metrics);
+  uv_close((uv_handle_t *)&ctx->walk, NULL);
+  ex_wheel_close(&ctx->wheel, ex_ctx_close_cb);
+  shard->data = NULL;
+}
+
+void
+ex_attach_cb(ex_shard_item_t *item, ex_shard_t *shard) {
+  ex_conn_t *conn = item->data;
+  ex_shard_ctx_t *ctx = shard->data;
+  int rc = 0;
+
+  conn->loop = &shard->loop;
+
+  /* Fresh connection: race a connect on this loop. */
+  if (conn->fd < 0) {
+    rc = ex_eyeballs_start(&conn->race, conn->loop, &ctx->eyeballs, conn->addrs, EX_EYEBALLS_DELAY_MS, ex_connect_cb, conn);
+    if (rc < 0)
+      ex_log(EX_LOG_ERROR, "(%p) ex_eyeballs_start: (%d) %s", conn, rc, uv_strerror(rc));
+    return;
+  }
+
+  /* Migrated connection: pick the socket back up where it left off. */
+  rc = uv_tcp_init(conn->loop, &conn->conn);
+  assert(rc >= 0 && "failed at uv_tcp_init()");
+  conn->conn.data = conn;
+  conn->tcp_on = 1;
+  ex_metrics_add(&ctx->metrics, EX8_M_CONNECTIONS, 1);
+
+  rc = uv_tcp_open(&conn->conn, conn->fd);
+  if (rc < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) uv_tcp_open: (%d) %s", conn, rc, uv_strerror(rc));
+    close(conn->fd);
+    conn->fd = -1;
+    return;
+  }
+  conn->fd = -1;
+
+  rc = uv_read_start((uv_stream_t *)&conn->conn, ex_alloc_cb, ex_read_cb);
+  assert(rc >= 0 && "failed at uv_read_start()");
+  ex_wheel_arm_jitter(&ctx->wheel, &conn->heartbeat, EX_HEARTBEAT_MS, EX_HEARTBEAT_JITTER_MS);
+}
+
+static void
+ex_detach_close_cb(uv_handle_t *handle) {
+  ex_conn_t *conn = handle->data;
+  ex_shard_detached(&conn->shard);
+}
+
+/* Closing cancels queued writes, so the socket only moves once they are
+ * out; with `keep` 0, or if the dup fails, it starts over on the new loop. */
+static void
+ex_detach_finish(ex_conn_t *conn, int keep) {
+  ex_shard_ctx_t *ctx = conn->shard.owner->data;
+  uv_os_fd_t fd;
+  int rc = 0;
+
+  conn->detaching = 0;
+  ex_wheel_cancel(&conn->heartbeat);
+
+  /* Keep the socket open across the handle close with a dup. */
+  if (keep) {
+    rc = uv_fileno((uv_handle_t *)&conn->conn, &fd);
+    if (rc >= 0) {
+      conn->fd = dup(fd);
+      if (conn->fd < 0)
+        ex_log(EX_LOG_WARN, "(%p) dup: connection dropped on migrate", conn);
+    }
+  }
+  if (conn->fd < 0)
+    ex_frame_decoder_reset(&conn->decoder);
+  conn->tcp_on = 0;
+  ex_metrics_sub(&ctx->metrics, EX8_M_CONNECTIONS, 1);
+  __atomic_store_n(&conn->write_queue, 0, __ATOMIC_RELAXED);
+  uv_close((uv_handle_t *)&conn->conn, ex_detach_close_cb);
+}
+
+void
+ex_detach_cb(ex_shard_item_t *item, ex_shard_t *shard) {
+  ex_conn_t *conn = item->data;
+  ex_shard_ctx_t *ctx = shard->data;
+
+  ex_wheel_cancel(&conn->heartbeat);
+
+  /* Still connecting: start over on the new loop. */
+  if (conn->race) {
+    ex_eyeballs_cancel(conn->race);
+    conn->race = NULL;
+  }
+  if (!conn->tcp_on) {
+    ex_shard_detached(item);
+    return;
+  }
+
+  /* Nothing more is read here; a write half out waits, up to a deadline */
+  uv_read_stop((uv_stream_t *)&conn->conn);
+  if (conn->conn.write_queue_size == 0) {
+    ex_detach_finish(conn, 1);
+    return;
+  }
+  conn->detaching = 1;
+  ex_wheel_arm(&ctx->wheel, &conn->heartbeat, EX_DETACH_DRAIN_MS);
+}
+
+void
+ex_remove_cb(ex_shard_item_t *item, ex_shard_t *shard) {
+  ex_conn_t *conn = item->data;
+  ex_shard_ctx_t *ctx = shard->data;
+
+  ex_wheel_cancel(&conn->heartbeat);
+  ex_eyeballs_cancel(conn->race);
+  conn->race = NULL;
+  conn->detaching = 0;
+  if (conn->tcp_on) {
+    conn->tcp_on = 0;
+    ex_metrics_sub(&ctx->metrics, EX8_M_CONNECTIONS, 1);
+    __atomic_store_n(&conn->write_queue, 0, __ATOMIC_RELAXED);
+    if (!uv_is_closing((uv_handle_t *)&conn->conn))
+      uv_close((uv_handle_t *)&conn->conn, NULL);
+  }
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+void
+ex_connect_cb(ex_eyeballs_t *race, int status, uv_tcp_t *tcp, const struct addrinfo *addr) {
+  ex_conn_t *conn = race->data;
+  ex_shard_ctx_t *ctx = conn->shard.owner->data;
+  int rc = 0;
+
+  conn->race = NULL;
+  if (status < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) ex_connect_cb: (%d) %s", conn, status, uv_strerror(status));
+    return;
+  }
+
+  rc = uv_tcp_init(conn->loop, &conn->conn);
+  assert(rc >= 0 && "failed at uv_tcp_init()");
+  conn->conn.data = conn;
+  conn->tcp_on = 1;
+  __atomic_store_n(&conn->connects, conn->connects + 1, __ATOMIC_RELAXED);
+  ex_metrics_add(&ctx->metrics, EX8_M_CONNECTS, 1);
+  ex_metrics_add(&ctx->metrics, EX8_M_CONNECTIONS, 1);
+
+  rc = ex_eyeballs_adopt(tcp, &conn->conn);
+  if (rc < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) ex_eyeballs_adopt: (%d) %s", conn, rc, uv_strerror(rc));
+    return;
+  }
+
+  ex_conn_write(conn, web_handshake, sizeof(web_handshake));
+  rc = uv_read_start((uv_stream_t *)&conn->conn, ex_alloc_cb, ex_read_cb);
+  assert(rc >= 0 && "failed at uv_read_start()");
+  ex_wheel_arm_jitter(&ctx->wheel, &conn->heartbeat, EX_HEARTBEAT_MS, EX_HEARTBEAT_JITTER_MS);
+}
+
+int
+ex_conn_write(ex_conn_t *conn, const uint8_t *data, size_t len) {
+  ex_shard_ctx_t *ctx = conn->shard.owner->data;
+  uv_write_t *req = NULL;
+  uv_buf_t buf = uv_buf_init((char *)data, len);
+  int rc = 0;
+
+  req = ex_pool_get(&ctx->writes);
+  if (!req)
+    return UV_ENOMEM;
+  rc = uv_write(req, (uv_stream_t *)&conn->conn, &buf, 1, ex_write_cb);
+  if (rc < 0) {
+    ex_pool_put(req);
+    ex_metrics_add(&ctx->metrics, EX8_M_WRITE_ERRORS, 1);
+    return rc;
+  }
+  ex_metrics_add(&ctx->metrics, EX8_M_WRITES, 1);
+  __atomic_store_n(&conn->write_queue, conn->conn.write_queue_size, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* May run after the connection moved on; the request returns to the pool
+ * of the loop that issued it. Only a write not cancelled by a close still
+ * has its handle on this loop. */
+void
+ex_write_cb(uv_write_t *req, int status) {
+  ex_conn_t *conn = NULL;
+
+  if (status != UV_ECANCELED) {
+    conn = req->handle->data;
+    if (status == 0)
+      __atomic_store_n(&conn->write_queue, conn->conn.write_queue_size, __ATOMIC_RELAXED);
+    /* The last of the queue gone, or the socket broken: move on now */
+    if (conn->detaching && (status < 0 || conn->conn.write_queue_size == 0))
+      ex_detach_finish(conn, 1);
+  }
+  ex_pool_put(req);
+}
+
+void
+ex_heartbeat_cb(ex_wheel_entry_t *entry) {
+  ex_conn_t *conn = entry->data;
+  ex_shard_ctx_t *ctx = conn->shard.owner->data;
+
+  /* Armed as the deadline for a detach instead */
+  if (conn->detaching) {
+    ex_log(EX_LOG_WARN, "(%p) writes still queued after %d ms: reconnecting on migrate", conn, EX_DETACH_DRAIN_MS);
+    ex_detach_finish(conn, 0);
+    return;
+  }
+  if (!conn->tcp_on)
+    return;
+  ex_conn_write(conn, web_heartbeat, sizeof(web_heartbeat));
+  ex_wheel_arm_jitter(&ctx->wheel, &conn->heartbeat, EX_HEARTBEAT_MS, EX_HEARTBEAT_JITTER_MS);
+}
+
+/* Reads on a loop never overlap, so one buffer per shard serves them all. */
+void
+ex_alloc_cb(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+  ex_conn_t *conn = handle->data;
+  ex_shard_ctx_t *ctx = conn->shard.owner->data;
+
+  buf->base = (char *)ctx->rdbuf;
+  buf->len = sizeof(ctx->rdbuf);
+}
+
+void
+ex_read_cb(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf) {
+  ex_conn_t *conn = strm->data;
+  ex_shard_ctx_t *ctx = conn->shard.owner->data;
+  int rc = 0;
+
+  if (nread < 0) {
+    ex_metrics_add(&ctx->metrics, EX8_M_DISCONNECTS, 1);
+    uv_read_stop(strm);
+    ex_shard_remove(&conn->shard);
+    return;
+  }
+
+  __atomic_store_n(&conn->bytes, conn->bytes + nread, __ATOMIC_RELAXED);
+  ex_metrics_add(&ctx->metrics, EX8_M_BYTES, nread);
+  conn->shard.load += nread;
+  rc = ex_frame_feed(&conn->decoder, (uint8_t *)buf->base, nread, ex_decode_cb, conn);
+  if (rc < 0) {
+    ex_log(EX_LOG_ERROR, "(%p) ex_frame_feed: (%d) %s", conn, rc, uv_strerror(rc));
+    uv_read_stop(strm);
+    ex_shard_remove(&conn->shard);
+  }
+}
+
+int
+ex_decode_cb(const ex_frame_t *frame, void *arg) {
+  ex_conn_t *conn = arg;
+  ex_shard_ctx_t *ctx = conn->shard.owner->data;
+
+  if (frame->ver == EX_VER_ZLIB)
+    return ex_inflate_frame(&ctx->inflater, frame, ex_decode_cb, conn);
+  __atomic_store_n(&conn->frames, conn->frames + 1, __ATOMIC_RELAXED);
+  ex_metrics_add(&ctx->metrics, EX8_M_FRAMES, 1);
+  return 0;
+}
+
+int
+ex_conn_init(ex_conn_t *conn) {
+  if (!conn)
+    return -1;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = -1;
+  conn->shard.data = conn;
+  ex_wheel_entry_init(&conn->heartbeat, ex_heartbeat_cb, conn);
+  return ex_frame_decoder_init(&conn->decoder, 0);
+}
+
+int
+ex_conn_free(ex_conn_t *conn) {
+  if (!conn)
+    return 0;
+
+  ex_frame_decoder_free(&conn->decoder);
+  conn->addrs = NULL;
+  conn->loop = NULL;
+  return 0;
+}
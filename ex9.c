@@ -0,0 +1,345 @@
+/* A minimal libuv example. Plays back what ex6 recorded.
+ *
+ * 1. Read recorded frames (see ex_rec.h)
+ * 2. Pace them as recorded, scaled, or not at all
+ * 3. Decode and dispatch them as ex6 does a TCP read (see ex_route.h)
+ * 4. Serve every message to local subscribers (see ex_hub.h)
+ * 5. Close down on SIGINT/SIGTERM, or at the end of the recording
+ *
+ * Frames are paced by the time they were recorded at, `speed` times as
+ * fast, or with 0 as fast as the loop goes, which makes the closing figures
+ * a single-core decode throughput. With `follow`, frames are taken as ex6
+ * records them instead, so with EX_HUB set this is a local fan-out of the
+ * live streams that costs upstream nothing. EX_REPLAY_SKIP leaves out that
+ * many wall-clock seconds from the start, across restarts too. Listed
+ * commands go to their handlers; every command is counted.
+ *
+ * Usage: ex9 <dir> [speed|follow] [cmd,cmd,...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+#include "ex_cmd.h"
+#include "ex_frame.h"
+#include "ex_hist.h"
+#include "ex_hub.h"
+#include "ex_log.h"
+#include "ex_rec.h"
+#include "ex_route.h"
+
+#define EX_REPLAY_BATCH     4096
+#define EX_FOLLOW_POLL_MS   5
+
+typedef struct ex_replay_s {
+  uv_loop_t *loop;
+  uv_timer_t timer;
+  uv_idle_t idle;
+  uv_signal_t sigint;
+  uv_signal_t sigterm;
+  int stopped;
+
+  ex_rec_reader_t reader;
+  double speed;             /* 0 for as fast as possible */
+  int follow;
+  const ex_rec_hdr_t *next;
+  const uint8_t *data;
+  uint64_t next_ns;         /* Wall-clock time it was recorded at, */
+  uint64_t skew_ns;         /* plus whatever keeps that from going back */
+  uint64_t first_ns;        /* Same, of the first frame, */
+  uint64_t start_ns;        /* and when it went in */
+  uint64_t end_ns;
+
+  /* One of each per loop: a frame is done with before the next goes in */
+  ex_frame_decoder_t decoder;
+  ex_route_t route;
+  ex_route_src_t src;       /* Its id the room of the frame going in */
+  ex_hub_t hub;
+
+  uint64_t errors;
+  ex_hist_t lag;            /* Behind the recorded pace */
+} ex_replay_t;
+
+int replay_start(ex_replay_t *replay);
+void replay_stop(ex_replay_t *replay);
+int replay_read(ex_replay_t *replay);
+uint64_t replay_due(const ex_replay_t *replay);
+int replay_feed(ex_replay_t *replay, uint64_t now);
+void on_timer(uv_timer_t *timer);
+void on_idle(uv_idle_t *idle);
+void on_signal(uv_signal_t *handle, int signum);
+void log_hist(const char *name, const ex_hist_t *h);
+
+int
+main(int argc, char *argv[]) {
+  uv_loop_t loop;
+  ex_replay_t replay;
+  const char *dir = argc > 1 ? argv[1] : NULL;
+  const char *mode = argc > 2 ? argv[2] : "1";
+  const char *skip = getenv("EX_REPLAY_SKIP");
+  double secs = 0;
+  int rc = 0;
+
+  if (!dir) {
+    fprintf(stderr, "Usage: ex9 <dir> [speed|follow] [cmd,cmd,...]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  rc = uv_loop_init(&loop);
+  assert(rc >= 0 && "failed at uv_loop_init()");
+
+  memset(&replay, 0, sizeof(replay));
+  replay.loop = &loop;
+  replay.follow = strcmp(mode, "follow") == 0;
+  replay.speed = replay.follow ? 0 : atof(mode);
+  if (replay.speed < 0)
+    replay.speed = 0;
+  ex_hist_reset(&replay.lag);
+
+  rc = ex_frame_decoder_init(&replay.decoder, 0);
+  assert(rc >= 0 && "failed at ex_frame_decoder_init()");
+  /* Only the listed commands reach a handler; an empty list is none */
+  rc = ex_route_init(&replay.route, argc > 3 ? argv[3] : "", NULL);
+  assert(rc >= 0 && "failed at ex_route_init()");
+  ex_route_src_init(&replay.src, &replay.route, 0, &replay);
+
+  /* Log lines are written by a background thread, never by the loop */
+  rc = ex_log_start(STDOUT_FILENO, STDERR_FILENO, EX_LOG_INFO);
+  assert(rc >= 0 && "failed at ex_log_start()");
+
+  rc = ex_rec_reader_open(&replay.reader, dir);
+  assert(rc >= 0 && "failed at ex_rec_reader_open()");
+  replay.reader.follow = replay.follow;
+  if (replay.follow) {
+    rc = ex_rec_reader_tail(&replay.reader);
+    assert(rc >= 0 && "failed at ex_rec_reader_tail()");
+  } else if (skip && atof(skip) > 0) {
+    /* Skipped frames are not counted as replayed */
+    rc = ex_rec_reader_next(&replay.reader, &replay.next, &replay.data);
+    assert(rc > 0 && "failed at ex_rec_reader_next()");
+    rc = ex_rec_reader_seek_wall(&replay.reader,
+        ex_rec_reader_wall(&replay.reader, replay.next) + (uint64_t)(atof(skip) * 1e9));
+    assert(rc >= 0 && "failed at ex_rec_reader_seek_wall()");
+    replay.reader.records = replay.reader.bytes = 0;
+  }
+
+  if (getenv("EX_HUB")) {
+    rc = ex_hub_serve(&replay.hub, &loop, getenv("EX_HUB"));
+    assert(rc >= 0 && "failed at ex_hub_serve()");
+    replay.route.hub = &replay.hub;
+  }
+
+  uv_timer_init(&loop, &replay.timer);
+  uv_idle_init(&loop, &replay.idle);
+  uv_signal_init(&loop, &replay.sigint);
+  uv_signal_init(&loop, &replay.sigterm);
+  replay.timer.data = replay.idle.data = &replay;
+  replay.sigint.data = replay.sigterm.data = &replay;
+  uv_signal_start(&replay.sigint, on_signal, SIGINT);
+  uv_signal_start(&replay.sigterm, on_signal, SIGTERM);
+  /* A subscriber gone mid-write is an error on its pipe, not a signal */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (replay.follow)
+    ex_log(EX_LOG_INFO, "Replaying %s as it is recorded", dir);
+  else if (replay.speed)
+    ex_log(EX_LOG_INFO, "Replaying %s at %gx pace", dir, replay.speed);
+  else
+    ex_log(EX_LOG_INFO, "Replaying %s at full speed", dir);
+  rc = replay_start(&replay);
+  if (rc <= 0) {
+    if (rc < 0)
+      ex_log(EX_LOG_ERROR, "Replay: (%d) %s", rc, uv_strerror(rc));
+    replay_stop(&replay);
+  }
+
+  rc = uv_run(&loop, UV_RUN_DEFAULT);
+  assert(rc >= 0 && "failed at uv_run()");
+
+  secs = (replay.end_ns - replay.start_ns) / 1e9;
+  ex_log(EX_LOG_INFO, "Replayed: %lu frames, %lu bytes from %lu segments in %.3f s, %lu bad",
+      replay.reader.records, replay.reader.bytes, replay.reader.segments, secs, replay.errors);
+  if (secs > 0)
+    ex_log(EX_LOG_INFO, "Replay rate: %.0f frames/s, %.1f MB/s, %.0f messages/s",
+        replay.reader.records / secs, replay.reader.bytes / secs / 1e6, replay.route.messages / secs);
+  if (replay.lag.count)
+    ex_log(EX_LOG_INFO, "Behind pace: p50 %.1f us, p99 %.1f us, max %.1f us",
+        ex_hist_percentile(&replay.lag, 50) / 1e3, ex_hist_percentile(&replay.lag, 99) / 1e3,
+        replay.lag.max / 1e3);
+  ex_log(EX_LOG_INFO, "Messages: %lu, %lu without a known cmd", replay.route.messages, replay.route.unknown);
+  for (int i = 0; i < EX_CMD_COUNT; ++i) {
+    if (replay.route.counts[i])
+      ex_log(EX_LOG_INFO, "  %s: %lu", ex_cmd_name(i), replay.route.counts[i]);
+  }
+  log_hist("read to decode", &replay.route.read_decode);
+  log_hist("decode to dispatch", &replay.route.decode_dispatch);
+  log_hist("dispatch to done", &replay.route.dispatch_done);
+  if (replay.hub.subscribers)
+    ex_log(EX_LOG_INFO, "Hub: %lu subscribers, %lu frames published, %lu bytes in %lu writes, %lu dropped, %lu stalled out",
+        replay.hub.subscribers, replay.hub.published, replay.hub.bytes, replay.hub.writes,
+        replay.hub.dropped, replay.hub.kicked);
+
+  ex_hub_free(&replay.hub);
+  ex_rec_reader_close(&replay.reader);
+  ex_route_free(&replay.route);
+  ex_frame_decoder_free(&replay.decoder);
+  ex_log_stop();
+
+  rc = uv_loop_close(&loop);
+  if (rc < 0) {
+    fprintf(stderr, "(%d) %s\n", rc, uv_strerror(rc));
+  }
+  exit(EXIT_SUCCESS);
+}
+
+/* Paced by the timer, or flat out from the idle handle, a batch at a time.
+ * Returns 0 with nothing to replay. */
+int
+replay_start(ex_replay_t *replay) {
+  int rc = 0;
+
+  replay->start_ns = uv_hrtime();
+  if (!replay->follow) {
+    rc = replay_read(replay);
+    if (rc <= 0)
+      return rc;
+    replay->first_ns = replay->next_ns;
+  }
+  if (replay->speed || replay->follow)
+    rc = uv_timer_start(&replay->timer, on_timer, 0, 0);
+  else
+    rc = uv_idle_start(&replay->idle, on_idle);
+  return rc < 0 ? rc : 1;
+}
+
+/* The hub may still be draining; nothing else holds the loop open */
+void
+replay_stop(ex_replay_t *replay) {
+  if (replay->stopped)
+    return;
+  replay->stopped = 1;
+  replay->end_ns = uv_hrtime();
+  uv_close((uv_handle_t*)&replay->timer, NULL);
+  uv_close((uv_handle_t*)&replay->idle, NULL);
+  uv_close((uv_handle_t*)&replay->sigint, NULL);
+  uv_close((uv_handle_t*)&replay->sigterm, NULL);
+  ex_hub_close(&replay->hub);
+}
+
+/* The next frame, and where it goes in time. One recorded before the one
+ * ahead of it, e.g. in a segment of an earlier boot that got a later
+ * number, comes right after that one; the frames after it keep their pace
+ * from there. */
+int
+replay_read(ex_replay_t *replay) {
+  uint64_t wall = 0;
+  int rc = 0;
+
+  rc = ex_rec_reader_next(&replay->reader, &replay->next, &replay->data);
+  if (rc <= 0)
+    return rc;
+  wall = ex_rec_reader_wall(&replay->reader, replay->next) + replay->skew_ns;
+  if (wall < replay->next_ns) {
+    replay->skew_ns += replay->next_ns - wall;
+    wall = replay->next_ns;
+  }
+  replay->next_ns = wall;
+  return 1;
+}
+
+uint64_t
+replay_due(const ex_replay_t *replay) {
+  return replay->start_ns + (uint64_t)((replay->next_ns - replay->first_ns) / replay->speed);
+}
+
+/* Up to a batch of what is due by `now`, the one in hand first: 1 if more
+ * is left, 0 at the end, or for now when following */
+int
+replay_feed(ex_replay_t *replay, uint64_t now) {
+  uint64_t due = 0;
+  int rc = 0;
+
+  for (int n = 0; n < EX_REPLAY_BATCH; ++n) {
+    if (!replay->next) {
+      rc = replay_read(replay);
+      if (rc <= 0) {
+        if (rc < 0)
+          ex_log(EX_LOG_ERROR, "Replay: (%d) %s", rc, uv_strerror(rc));
+        return 0;
+      }
+    }
+    if (replay->speed) {
+      due = replay_due(replay);
+      if (due > now)
+        return 1;
+      ex_hist_record(&replay->lag, now - due);
+    }
+
+    replay->src.id = replay->next->room;
+    replay->route.read_ns = uv_hrtime();
+    rc = ex_frame_feed(&replay->decoder, replay->data, replay->next->len, ex_route_frame, &replay->src);
+    if (rc < 0) {
+      ex_log(EX_LOG_DEBUG, "replayed frame: (%d) %s", rc, uv_strerror(rc));
+      ex_frame_decoder_reset(&replay->decoder);
+      replay->errors++;
+    }
+    replay->next = NULL;
+  }
+  return 1;
+}
+
+void
+on_timer(uv_timer_t *timer) {
+  ex_replay_t *replay = timer->data;
+  uint64_t now = uv_hrtime();
+  uint64_t due = 0;
+  uint64_t delay = 0;
+
+  if (!replay_feed(replay, now)) {
+    if (replay->follow)
+      uv_timer_start(timer, on_timer, EX_FOLLOW_POLL_MS, 0);
+    else
+      replay_stop(replay);
+    return;
+  }
+
+  /* Next due to the ms, or straight away if the batch ran out first */
+  if (replay->speed && replay->next) {
+    due = replay_due(replay);
+    now = uv_hrtime();
+    delay = due > now ? (due - now + 999999) / 1000000 : 0;
+  }
+  uv_timer_start(timer, on_timer, delay, 0);
+}
+
+void
+on_idle(uv_idle_t *idle) {
+  ex_replay_t *replay = idle->data;
+
+  if (!replay_feed(replay, uv_hrtime()))
+    replay_stop(replay);
+}
+
+void
+on_signal(uv_signal_t *handle, int signum) {
+  ex_replay_t *replay = handle->data;
+
+  ex_log(EX_LOG_INFO, "Caught signal %d, closing down", signum);
+  replay_stop(replay);
+}
+
+void
+log_hist(const char *name, const ex_hist_t *h) {
+  if (!h->count)
+    return;
+  ex_log(EX_LOG_INFO, "%s: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us over %lu",
+      name, ex_hist_percentile(h, 50) / 1e3, ex_hist_percentile(h, 99) / 1e3,
+      ex_hist_percentile(h, 99.9) / 1e3, h->max / 1e3, h->count);
+}
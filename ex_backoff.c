@@ -0,0 +1,86 @@
+/* Reconnect delays and outage bookkeeping. */
+
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_backoff.h"
+
+static uint64_t
+wall_ms(void) {
+  uv_timeval64_t tv;
+
+  if (uv_gettimeofday(&tv) < 0)
+    return 0;
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint64_t
+backoff_rand(ex_backoff_t *b) {
+  /* xorshift64 */
+  uint64_t x = b->rand;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  b->rand = x;
+  return x;
+}
+
+void
+ex_backoff_init(ex_backoff_t *b, uint64_t base_ms, uint64_t cap_ms) {
+  memset(b, 0, sizeof(*b));
+  b->base_ms = base_ms ? base_ms : EX_BACKOFF_BASE_MS;
+  b->cap_ms = cap_ms > b->base_ms ? cap_ms : b->base_ms;
+
+  /* Seeded per instance, or every room would draw the same delays. */
+  b->rand = (uv_hrtime() ^ ((uintptr_t)b * 0x9e3779b97f4a7c15ull)) | 1;
+}
+
+/* Delay before the next attempt. */
+uint64_t
+ex_backoff_next(ex_backoff_t *b) {
+  uint64_t ceiling = b->cap_ms;
+
+  /* Compared shifted down, so a large base cannot wrap */
+  if (b->attempt < 32 && b->base_ms <= (b->cap_ms - 1) >> b->attempt)
+    ceiling = b->base_ms << b->attempt;
+  b->attempt++;
+  b->outage.attempts++;
+  if (ceiling == UINT64_MAX)
+    return backoff_rand(b);
+  return backoff_rand(b) % (ceiling + 1);
+}
+
+/* The session dropped, or an attempt failed. */
+void
+ex_backoff_down(ex_backoff_t *b, uint64_t now_ms) {
+  if (b->up_ms && now_ms - b->up_ms >= EX_BACKOFF_STABLE_MS)
+    b->attempt = 0;
+  b->up_ms = 0;
+
+  if (b->down_ms)
+    return;
+  b->down_ms = now_ms ? now_ms : 1;
+  b->outage.start_ms = wall_ms();
+  b->outage.attempts = 0;
+}
+
+/* A session came up. Returns 1 and fills `outage` if it ended one. */
+int
+ex_backoff_up(ex_backoff_t *b, uint64_t now_ms, ex_outage_t *outage) {
+  uint64_t length = 0;
+
+  b->up_ms = now_ms ? now_ms : 1;
+  if (!b->down_ms)
+    return 0;
+
+  length = now_ms - b->down_ms;
+  b->down_ms = 0;
+  b->outage.end_ms = wall_ms();
+  b->outages++;
+  if (length > b->longest_ms)
+    b->longest_ms = length;
+  if (outage)
+    *outage = b->outage;
+  return 1;
+}
@@ -0,0 +1,48 @@
+/* Reconnect delays and outage bookkeeping.
+ *
+ * Delays grow exponentially from `base_ms` up to `cap_ms`, and each one is
+ * drawn uniformly from [0, ceiling] ("full jitter"), so thousands of rooms
+ * dropped by the same server blip come back spread over the whole window
+ * instead of in lockstep. A session that stays up for EX_BACKOFF_STABLE_MS
+ * starts the next outage from the base again; one that flaps does not.
+ *
+ * Each outage runs from the first drop (or failed attempt) to the next
+ * session that comes up, and is reported in wall-clock time so gaps in
+ * the recorded stream can be matched up later.
+ */
+
+#ifndef EX_BACKOFF_H
+#define EX_BACKOFF_H
+
+#include <stdint.h>
+
+#define EX_BACKOFF_BASE_MS    1000
+#define EX_BACKOFF_CAP_MS     60000
+#define EX_BACKOFF_STABLE_MS  30000
+
+typedef struct ex_outage_s {
+  uint64_t start_ms;      /* Wall clock, ms since the epoch */
+  uint64_t end_ms;
+  uint32_t attempts;
+} ex_outage_t;
+
+typedef struct ex_backoff_s {
+  uint64_t base_ms;
+  uint64_t cap_ms;
+  uint32_t attempt;       /* Delays handed out since the last stable session */
+  uint64_t rand;
+
+  uint64_t up_ms;         /* Loop time the session came up, 0 while down */
+  uint64_t down_ms;       /* Loop time the outage began, 0 while up */
+  ex_outage_t outage;
+
+  uint64_t outages;
+  uint64_t longest_ms;
+} ex_backoff_t;
+
+void ex_backoff_init(ex_backoff_t *b, uint64_t base_ms, uint64_t cap_ms);
+uint64_t ex_backoff_next(ex_backoff_t *b);
+void ex_backoff_down(ex_backoff_t *b, uint64_t now_ms);
+int ex_backoff_up(ex_backoff_t *b, uint64_t now_ms, ex_outage_t *outage);
+
+#endif
@@ -0,0 +1,32 @@
+/* Command routing by name in constant time. */
+
+#include <string.h>
+
+#include "ex_cmd.h"
+#include "ex_cmd_table.h"
+
+static const char *const cmd_names[EX_CMD_COUNT] = {
+#define EX_CMD(name) #name,
+#include "ex_cmd.def"
+#undef EX_CMD
+};
+
+static const uint8_t cmd_lens[EX_CMD_COUNT] = {
+#define EX_CMD(name) sizeof(#name) - 1,
+#include "ex_cmd.def"
+#undef EX_CMD
+};
+
+int
+ex_cmd_lookup(const char *name, size_t len) {
+  int cmd = ex_cmd_slots[ex_cmd_hash(name, len, EX_CMD_SEED) & (EX_CMD_SLOTS - 1)];
+
+  if (cmd < 0 || cmd_lens[cmd] != len || memcmp(cmd_names[cmd], name, len) != 0)
+    return EX_CMD_UNKNOWN;
+  return cmd;
+}
+
+const char *
+ex_cmd_name(int cmd) {
+  return cmd >= 0 && cmd < EX_CMD_COUNT ? cmd_names[cmd] : "?";
+}
@@ -0,0 +1,40 @@
+/* Command routing by name in constant time.
+ *
+ * The names in ex_cmd.def are hashed into a perfect hash table at build
+ * time: ex_cmdgen searches for a seed under which no two names share a
+ * slot and writes it out as ex_cmd_table.h. A lookup is one hash over the
+ * name, one slot load and one compare, however many commands there are.
+ * Names not in the list come back as EX_CMD_UNKNOWN.
+ */
+
+#ifndef EX_CMD_H
+#define EX_CMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EX_CMD_UNKNOWN -1
+
+enum ex_cmd {
+#define EX_CMD(name) EX_CMD_##name,
+#include "ex_cmd.def"
+#undef EX_CMD
+  EX_CMD_COUNT,
+};
+
+/* FNV-1a, seeded; shared with the generator. */
+static inline uint32_t
+ex_cmd_hash(const char *name, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (uint8_t)name[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+int ex_cmd_lookup(const char *name, size_t len);
+const char *ex_cmd_name(int cmd);
+
+#endif
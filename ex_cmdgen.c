@@ -0,0 +1,72 @@
+/* Build-time generator for ex_cmd_table.h.
+ *
+ * Tries seeds until every name in ex_cmd.def hashes to its own slot, with
+ * twice as many slots as names to start with and more if no seed is
+ * found. Writes the seed and the slot table to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ex_cmd.h"
+
+#define EX_CMDGEN_TRIES 1000000
+
+static const char *const names[EX_CMD_COUNT] = {
+#define EX_CMD(name) #name,
+#include "ex_cmd.def"
+#undef EX_CMD
+};
+
+static int
+try_seed(uint32_t seed, uint32_t slots, signed char *table) {
+  uint32_t slot = 0;
+
+  memset(table, -1, slots);
+  for (int i = 0; i < EX_CMD_COUNT; ++i) {
+    slot = ex_cmd_hash(names[i], strlen(names[i]), seed) & (slots - 1);
+    if (table[slot] >= 0)
+      return 0;
+    table[slot] = i;
+  }
+  return 1;
+}
+
+int
+main(int argc, char *argv[]) {
+  uint32_t slots = 1;
+  uint32_t seed = 0;
+  signed char *table = NULL;
+
+  if (EX_CMD_COUNT > 127) {
+    fprintf(stderr, "ex_cmdgen: too many commands for a signed char table\n");
+    return EXIT_FAILURE;
+  }
+  while (slots < 2 * EX_CMD_COUNT)
+    slots <<= 1;
+
+  for (; slots <= 4096; slots <<= 1) {
+    table = realloc(table, slots);
+    if (!table)
+      return EXIT_FAILURE;
+    for (seed = 1; seed < EX_CMDGEN_TRIES; ++seed) {
+      if (try_seed(seed, slots, table))
+        goto found;
+    }
+  }
+  fprintf(stderr, "ex_cmdgen: no perfect hash found\n");
+  return EXIT_FAILURE;
+
+found:
+  printf("/* Generated by ex_cmdgen from ex_cmd.def; do not edit. */\n\n");
+  printf("#ifndef EX_CMD_TABLE_H\n#define EX_CMD_TABLE_H\n\n");
+  printf("#define EX_CMD_SEED   0x%08xu\n", seed);
+  printf("#define EX_CMD_SLOTS  %u\n\n", slots);
+  printf("static const signed char ex_cmd_slots[EX_CMD_SLOTS] = {");
+  for (uint32_t i = 0; i < slots; ++i)
+    printf("%s%d,", i % 16 ? " " : "\n  ", table[i]);
+  printf("\n};\n\n#endif\n");
+  free(table);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,39 @@
+/* Bounded first-arrival filter. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_dedup.h"
+
+int
+ex_dedup_init(ex_dedup_t *d, size_t capacity, uint32_t window_ms) {
+  size_t buckets = 1;
+
+  memset(d, 0, sizeof(*d));
+  while (buckets * EX_DEDUP_WAYS < capacity)
+    buckets *= 2;
+  if (buckets > UINT32_MAX)
+    return UV_EINVAL;
+
+  d->keys = aligned_alloc(64, buckets * EX_DEDUP_WAYS * sizeof(uint64_t));
+  d->seen = calloc(buckets * EX_DEDUP_WAYS, sizeof(uint32_t));
+  d->next = calloc(buckets, 1);
+  if (!d->keys || !d->seen || !d->next) {
+    ex_dedup_free(d);
+    return UV_ENOMEM;
+  }
+  memset(d->keys, 0, buckets * EX_DEDUP_WAYS * sizeof(uint64_t));
+  d->mask = buckets - 1;
+  d->window_ms = window_ms ? window_ms : EX_DEDUP_WINDOW_MS;
+  return 0;
+}
+
+void
+ex_dedup_free(ex_dedup_t *d) {
+  free(d->keys);
+  free(d->seen);
+  free(d->next);
+  memset(d, 0, sizeof(*d));
+}
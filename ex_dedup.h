@@ -0,0 +1,98 @@
+/* Bounded first-arrival filter for messages that come in more than once.
+ *
+ * Keys are 64-bit message hashes. The table is set-associative: a key maps
+ * to one bucket of EX_DEDUP_WAYS keys, a single cache line, and a lookup
+ * compares that line and nothing else. A key not found replaces the oldest
+ * one in its bucket, so memory is fixed and nothing is ever rehashed; a
+ * key is remembered for at least as long as its bucket takes to see
+ * EX_DEDUP_WAYS newer ones, i.e. about the capacity in messages.
+ *
+ * A key is also only a duplicate within the window given at init, counted
+ * from its first arrival (uv_now() milliseconds, kept beside the keys):
+ * copies over redundant paths arrive milliseconds apart, so the default
+ * EX_DEDUP_WINDOW_MS is ample for them, and the same body sent again
+ * later, a repeated gift or comment, goes through as a new message.
+ *
+ * Two distinct messages with the same hash make the second look like a
+ * duplicate; with 64 bits that is left to chance.
+ */
+
+#ifndef EX_DEDUP_H
+#define EX_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define EX_DEDUP_WAYS       8       /* 64 bytes of keys per bucket */
+#define EX_DEDUP_WINDOW_MS  5000
+
+typedef struct ex_dedup_s {
+  uint64_t *keys;       /* Bucket after bucket, 0 for an empty way */
+  uint32_t *seen;       /* Per key, when it first arrived, truncated */
+  uint8_t *next;        /* Per bucket, the way to overwrite next */
+  uint32_t mask;
+  uint32_t window_ms;
+
+  uint64_t firsts;
+  uint64_t dups;
+} ex_dedup_t;
+
+/* Room for at least `capacity` keys, rounded up to a power of two, each
+ * a duplicate for `window_ms` after its first arrival; 0 for the default. */
+int ex_dedup_init(ex_dedup_t *d, size_t capacity, uint32_t window_ms);
+void ex_dedup_free(ex_dedup_t *d);
+
+/* Word at a time, with a 64-bit finalizer; never 0. */
+static inline uint64_t
+ex_dedup_hash(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+  uint64_t w = 0;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 29;
+  }
+  if (len) {
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+  }
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h ? h : 1;
+}
+
+/* Returns 1 the first time `key` is seen, or again once the window since
+ * then has passed, and 0 for a duplicate. `now_ms` is uv_now(). */
+static inline int
+ex_dedup_first(ex_dedup_t *d, uint64_t key, uint64_t now_ms) {
+  uint32_t bucket = (uint32_t)(key >> 32) & d->mask;
+  size_t base = (size_t)bucket * EX_DEDUP_WAYS;
+  uint64_t *ways = d->keys + base;
+  uint32_t way = 0;
+
+  for (int i = 0; i < EX_DEDUP_WAYS; ++i) {
+    if (ways[i] == key) {
+      /* Unsigned, so the truncation wraps harmlessly */
+      if ((uint32_t)now_ms - d->seen[base + i] <= d->window_ms) {
+        d->dups++;
+        return 0;
+      }
+      d->seen[base + i] = (uint32_t)now_ms;
+      d->firsts++;
+      return 1;
+    }
+  }
+  way = d->next[bucket];
+  ways[way] = key;
+  d->seen[base + way] = (uint32_t)now_ms;
+  d->next[bucket] = (way + 1) % EX_DEDUP_WAYS;
+  d->firsts++;
+  return 1;
+}
+
+#endif
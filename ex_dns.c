@@ -0,0 +1,261 @@
+/* Shared resolver cache keyed by host/port. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "ex_dns.h"
+
+static void on_resolved(uv_getaddrinfo_t *info, int status, struct addrinfo *res);
+
+static uint64_t
+dns_hash(const char *host, const char *port) {
+  /* FNV-1a */
+  uint64_t h = 14695981039346656037ULL;
+  for (const char *p = host; *p; ++p)
+    h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+  h = (h ^ ':') * 1099511628211ULL;
+  for (const char *p = port; *p; ++p)
+    h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+  return h;
+}
+
+static ex_dns_entry_t *
+dns_find(ex_dns_cache_t *cache, const char *host, const char *port, int create) {
+  uint64_t hash = dns_hash(host, port);
+  ex_dns_entry_t **bucket = &cache->buckets[hash % EX_DNS_BUCKETS];
+  ex_dns_entry_t *entry = NULL;
+
+  for (entry = *bucket; entry; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0)
+      return entry;
+  }
+  if (!create)
+    return NULL;
+
+  entry = calloc(1, sizeof(*entry));
+  if (!entry)
+    return NULL;
+  entry->host = strdup(host);
+  entry->port = strdup(port);
+  if (!entry->host || !entry->port) {
+    free(entry->host);
+    free(entry->port);
+    free(entry);
+    return NULL;
+  }
+  entry->cache = cache;
+  entry->hash = hash;
+  entry->resolver.data = entry;
+  entry->next = *bucket;
+  *bucket = entry;
+  return entry;
+}
+
+static void
+dns_entry_free(ex_dns_entry_t *entry) {
+  ex_dns_result_unref(entry->result);
+  free(entry->host);
+  free(entry->port);
+  free(entry);
+}
+
+static int
+dns_resolve(ex_dns_entry_t *entry) {
+  struct addrinfo hints;
+  int rc = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;    /* Only TCP. Will never be UDP conn. */
+  rc = uv_getaddrinfo(entry->cache->loop, &entry->resolver, on_resolved, entry->host, entry->port, &hints);
+  if (rc < 0)
+    return rc;
+  entry->resolving = 1;
+  entry->started_ms = uv_now(entry->cache->loop);
+  return 0;
+}
+
+static ex_dns_result_t *
+dns_result_new(struct addrinfo *addrs, int status) {
+  ex_dns_result_t *result = malloc(sizeof(*result));
+  if (!result)
+    return NULL;
+  result->addrs = addrs;
+  result->status = status;
+  result->refs = 1;
+  return result;
+}
+
+static void
+on_resolved(uv_getaddrinfo_t *info, int status, struct addrinfo *res) {
+  ex_dns_entry_t *entry = info->data;
+  ex_dns_cache_t *cache = entry->cache;
+  ex_dns_result_t *result = NULL;
+  ex_dns_req_t *waiters = NULL, *req = NULL;
+  uint64_t now = uv_now(cache->loop);
+
+  entry->resolving = 0;
+  cache->resolves++;
+  cache->resolve_ms += now - entry->started_ms;
+
+  if (status >= 0) {
+    result = dns_result_new(res, 0);
+    if (!result) {
+      uv_freeaddrinfo(res);
+      status = UV_ENOMEM;
+    }
+  }
+
+  if (result) {
+    ex_dns_result_unref(entry->result);
+    entry->result = result;
+    entry->expires_ms = now + cache->ttl_ms;
+    entry->refresh_ms = now + cache->ttl_ms / 4 * 3;
+  } else if (entry->result && entry->result->status == 0 && now < entry->expires_ms) {
+    /* A background refresh failed; keep serving what we have. */
+    cache->failures++;
+    entry->refresh_ms = now + cache->neg_ttl_ms;
+  } else {
+    cache->failures++;
+    ex_dns_result_unref(entry->result);
+    entry->result = dns_result_new(NULL, status);
+    entry->expires_ms = now + cache->neg_ttl_ms;
+    entry->refresh_ms = entry->expires_ms;
+  }
+
+  /* Detach first; callbacks may look up again. */
+  waiters = entry->waiters;
+  entry->waiters = NULL;
+  while (waiters) {
+    req = waiters;
+    waiters = req->next;
+    req->next = NULL;
+    req->entry = NULL;
+    if (entry->result && entry->result->status == 0)
+      req->cb(req, 0, ex_dns_result_ref(entry->result));
+    else
+      req->cb(req, entry->result ? entry->result->status : status, NULL);
+  }
+
+  if (cache->closing)
+    dns_entry_free(entry);
+}
+
+int
+ex_dns_cache_init(ex_dns_cache_t *cache, uv_loop_t *loop, uint64_t ttl_ms, uint64_t neg_ttl_ms) {
+  if (!cache || !loop)
+    return UV_EINVAL;
+
+  memset(cache, 0, sizeof(*cache));
+  cache->loop = loop;
+  cache->ttl_ms = ttl_ms ? ttl_ms : EX_DNS_TTL_MS;
+  cache->neg_ttl_ms = neg_ttl_ms ? neg_ttl_ms : EX_DNS_NEG_TTL_MS;
+  return 0;
+}
+
+/* Entries with a lookup in flight are released from its callback, so run
+ * the loop once more after this. */
+void
+ex_dns_cache_free(ex_dns_cache_t *cache) {
+  ex_dns_entry_t *entry = NULL, *next = NULL;
+
+  if (!cache)
+    return;
+
+  cache->closing = 1;
+  for (int i = 0; i < EX_DNS_BUCKETS; ++i) {
+    for (entry = cache->buckets[i]; entry; entry = next) {
+      next = entry->next;
+      if (entry->resolving)
+        uv_cancel((uv_req_t *)&entry->resolver);
+      else
+        dns_entry_free(entry);
+    }
+    cache->buckets[i] = NULL;
+  }
+}
+
+/* Returns 1 with a referenced `*res` on a cache hit, 0 if `cb` will be
+ * called once the lookup completes, or < 0 on error (including a cached
+ * failure). */
+int
+ex_dns_lookup(ex_dns_cache_t *cache, ex_dns_req_t *req, const char *host, const char *port,
+    ex_dns_cb cb, ex_dns_result_t **res) {
+  ex_dns_entry_t *entry = NULL;
+  uint64_t now = 0;
+  int rc = 0;
+
+  if (!cache || !req || !host || !port || !cb || !res)
+    return UV_EINVAL;
+  if (cache->closing)
+    return UV_ECANCELED;
+
+  entry = dns_find(cache, host, port, 1);
+  if (!entry)
+    return UV_ENOMEM;
+
+  now = uv_now(cache->loop);
+  if (entry->result && now < entry->expires_ms) {
+    cache->hits++;
+    if (entry->result->status < 0)
+      return entry->result->status;
+    if (now >= entry->refresh_ms && !entry->resolving) {
+      if (dns_resolve(entry) == 0)
+        cache->refreshes++;
+    }
+    *res = ex_dns_result_ref(entry->result);
+    return 1;
+  }
+
+  if (entry->resolving) {
+    cache->coalesced++;
+  } else {
+    rc = dns_resolve(entry);
+    if (rc < 0)
+      return rc;
+    cache->misses++;
+  }
+
+  req->cb = cb;
+  req->entry = entry;
+  req->next = entry->waiters;
+  entry->waiters = req;
+  return 0;
+}
+
+void
+ex_dns_cancel(ex_dns_req_t *req) {
+  ex_dns_req_t **p = NULL;
+
+  if (!req || !req->entry)
+    return;
+
+  for (p = &req->entry->waiters; *p; p = &(*p)->next) {
+    if (*p == req) {
+      *p = req->next;
+      break;
+    }
+  }
+  req->next = NULL;
+  req->entry = NULL;
+}
+
+ex_dns_result_t *
+ex_dns_result_ref(ex_dns_result_t *res) {
+  if (res)
+    __atomic_add_fetch(&res->refs, 1, __ATOMIC_RELAXED);
+  return res;
+}
+
+void
+ex_dns_result_unref(ex_dns_result_t *res) {
+  if (!res)
+    return;
+  if (__atomic_sub_fetch(&res->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    uv_freeaddrinfo(res->addrs);
+    free(res);
+  }
+}
@@ -0,0 +1,85 @@
+/* Shared resolver cache keyed by host/port.
+ *
+ * Concurrent lookups for the same key collapse into one uv_getaddrinfo().
+ * Results are reference counted and shared by every connection using them,
+ * reused until the TTL runs out and refreshed in the background once 3/4 of
+ * the TTL has passed. Failures are cached for a shorter negative TTL.
+ *
+ * The cache belongs to the loop it was created on; lookups must be made
+ * from that loop. Results may be passed to and released on other loops.
+ */
+
+#ifndef EX_DNS_H
+#define EX_DNS_H
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#define EX_DNS_BUCKETS      256
+#define EX_DNS_TTL_MS       300000
+#define EX_DNS_NEG_TTL_MS   5000
+
+typedef struct ex_dns_cache_s ex_dns_cache_t;
+typedef struct ex_dns_entry_s ex_dns_entry_t;
+typedef struct ex_dns_req_s ex_dns_req_t;
+
+typedef struct ex_dns_result_s {
+  struct addrinfo *addrs;
+  int status;
+  int refs;
+} ex_dns_result_t;
+
+/* On success `res` carries a reference the callee must release. */
+typedef void (*ex_dns_cb)(ex_dns_req_t *req, int status, ex_dns_result_t *res);
+
+struct ex_dns_req_s {
+  ex_dns_req_t *next;
+  ex_dns_entry_t *entry;
+  ex_dns_cb cb;
+  void *data;
+};
+
+struct ex_dns_entry_s {
+  ex_dns_entry_t *next;
+  ex_dns_cache_t *cache;
+  char *host;
+  char *port;
+  uint64_t hash;
+
+  uv_getaddrinfo_t resolver;
+  int resolving;
+  uint64_t started_ms;
+
+  ex_dns_result_t *result;
+  uint64_t expires_ms;
+  uint64_t refresh_ms;
+
+  ex_dns_req_t *waiters;
+};
+
+struct ex_dns_cache_s {
+  uv_loop_t *loop;
+  uint64_t ttl_ms;
+  uint64_t neg_ttl_ms;
+  int closing;
+  ex_dns_entry_t *buckets[EX_DNS_BUCKETS];
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t coalesced;
+  uint64_t refreshes;
+  uint64_t failures;
+  uint64_t resolves;
+  uint64_t resolve_ms;      /* Total time spent in uv_getaddrinfo() */
+};
+
+int ex_dns_cache_init(ex_dns_cache_t *cache, uv_loop_t *loop, uint64_t ttl_ms, uint64_t neg_ttl_ms);
+void ex_dns_cache_free(ex_dns_cache_t *cache);
+int ex_dns_lookup(ex_dns_cache_t *cache, ex_dns_req_t *req, const char *host, const char *port,
+    ex_dns_cb cb, ex_dns_result_t **res);
+void ex_dns_cancel(ex_dns_req_t *req);
+ex_dns_result_t *ex_dns_result_ref(ex_dns_result_t *res);
+void ex_dns_result_unref(ex_dns_result_t *res);
+
+#endif
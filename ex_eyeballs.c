@@ -0,0 +1,303 @@
+/* Happy-eyeballs connect (RFC 8305) across every resolved address. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "ex_eyeballs.h"
+
+static void on_stagger(uv_timer_t *timer);
+static void on_attempt_connect(uv_connect_t *connector, int status);
+
+static void
+race_release(ex_eyeballs_t *race) {
+  if (race->finished && race->handles == 0) {
+    if (race->attempts != race->inline_attempts)
+      free(race->attempts);
+    ex_pool_put(race);
+  }
+}
+
+static void
+on_attempt_close(uv_handle_t *handle) {
+  ex_eyeballs_attempt_t *attempt = handle->data;
+  ex_eyeballs_t *race = attempt->race;
+
+  ex_pool_put(handle);
+  attempt->tcp = NULL;
+  race->handles--;
+  race_release(race);
+}
+
+static void
+on_stagger_close(uv_handle_t *handle) {
+  ex_eyeballs_t *race = handle->data;
+
+  race->handles--;
+  race_release(race);
+}
+
+static void
+on_adopt_close(uv_handle_t *handle) {
+  ex_pool_put(handle);
+}
+
+/* Closes every handle still open except the winner's. */
+static void
+race_stop(ex_eyeballs_t *race, ex_eyeballs_attempt_t *winner) {
+  ex_eyeballs_attempt_t *attempt = NULL;
+
+  race->finished = 1;
+  for (int i = 0; i < race->started; ++i) {
+    attempt = &race->attempts[i];
+    if (attempt == winner || !attempt->tcp)
+      continue;
+    if (!uv_is_closing((uv_handle_t *)attempt->tcp))
+      uv_close((uv_handle_t *)attempt->tcp, on_attempt_close);
+  }
+  if (!uv_is_closing((uv_handle_t *)&race->stagger))
+    uv_close((uv_handle_t *)&race->stagger, on_stagger_close);
+}
+
+static void
+race_finish(ex_eyeballs_t *race, int status, ex_eyeballs_attempt_t *winner) {
+  uv_tcp_t *tcp = NULL;
+  const struct addrinfo *addr = NULL;
+
+  race_stop(race, winner);
+  if (winner) {
+    tcp = winner->tcp;
+    addr = winner->addr;
+    tcp->data = NULL;
+    winner->tcp = NULL;
+    race->handles--;
+  }
+
+  /* Keep the race alive across the callback. */
+  race->handles++;
+  race->cb(race, status, tcp, addr);
+  race->handles--;
+  race_release(race);
+}
+
+static int
+race_last_status(ex_eyeballs_t *race) {
+  for (int i = race->started - 1; i >= 0; --i) {
+    if (race->attempts[i].status < 0)
+      return race->attempts[i].status;
+  }
+  return UV_ECONNREFUSED;
+}
+
+/* Starts the next address. Returns 0 while anything is still in flight. */
+static int
+race_next(ex_eyeballs_t *race) {
+  ex_eyeballs_attempt_t *attempt = NULL;
+  int rc = 0;
+
+  while (race->started < race->count) {
+    attempt = &race->attempts[race->started++];
+    attempt->tcp = ex_pool_get(&race->pool->tcps);
+    if (!attempt->tcp) {
+      attempt->status = UV_ENOMEM;
+      race->failed++;
+      continue;
+    }
+    rc = uv_tcp_init(race->loop, attempt->tcp);
+    if (rc < 0) {
+      ex_pool_put(attempt->tcp);
+      attempt->tcp = NULL;
+      attempt->status = rc;
+      race->failed++;
+      continue;
+    }
+    race->handles++;
+    attempt->tcp->data = attempt;
+    attempt->connector.data = attempt;
+
+    rc = uv_tcp_connect(&attempt->connector, attempt->tcp, attempt->addr->ai_addr, on_attempt_connect);
+    if (rc < 0) {
+      attempt->status = rc;
+      race->failed++;
+      uv_close((uv_handle_t *)attempt->tcp, on_attempt_close);
+      continue;
+    }
+
+    uv_timer_start(&race->stagger, on_stagger, race->delay_ms, 0);
+    return 0;
+  }
+
+  uv_timer_stop(&race->stagger);
+  return race->failed == race->count ? race_last_status(race) : 0;
+}
+
+static void
+on_stagger(uv_timer_t *timer) {
+  ex_eyeballs_t *race = timer->data;
+  int rc = 0;
+
+  rc = race_next(race);
+  if (rc < 0)
+    race_finish(race, rc, NULL);
+}
+
+static void
+on_attempt_connect(uv_connect_t *connector, int status) {
+  ex_eyeballs_attempt_t *attempt = connector->data;
+  ex_eyeballs_t *race = attempt->race;
+  int rc = 0;
+
+  /* Lost the race or cancelled; the handle is already closing. */
+  if (race->finished)
+    return;
+
+  if (status < 0) {
+    attempt->status = status;
+    race->failed++;
+    uv_close((uv_handle_t *)attempt->tcp, on_attempt_close);
+
+    /* Don't wait out the stagger delay after a failure. */
+    rc = race_next(race);
+    if (rc < 0)
+      race_finish(race, rc, NULL);
+    return;
+  }
+
+  race_finish(race, 0, attempt);
+}
+
+int
+ex_eyeballs_pool_init(ex_eyeballs_pool_t *pool) {
+  int rc = 0;
+
+  rc = ex_pool_init(&pool->races, sizeof(ex_eyeballs_t), 0);
+  if (rc < 0)
+    return rc;
+  return ex_pool_init(&pool->tcps, sizeof(uv_tcp_t), 0);
+}
+
+/* Only once every race and handle from the pool has been closed. */
+void
+ex_eyeballs_pool_free(ex_eyeballs_pool_t *pool) {
+  ex_pool_free(&pool->races);
+  ex_pool_free(&pool->tcps);
+}
+
+int
+ex_eyeballs_start(ex_eyeballs_t **out, uv_loop_t *loop, ex_eyeballs_pool_t *pool,
+    const struct addrinfo *addrs, uint64_t delay_ms, ex_eyeballs_cb cb, void *data) {
+  ex_eyeballs_t *race = NULL;
+  const struct addrinfo *p = NULL;
+  const struct addrinfo *v6 = NULL, *v4 = NULL;
+  const struct addrinfo **cursor = NULL;
+  int first_family = 0, family = 0;
+  int count = 0, n = 0;
+  int rc = 0;
+
+  if (!out || !loop || !pool || !addrs || !cb)
+    return UV_EINVAL;
+
+  for (p = addrs; p; p = p->ai_next) {
+    if (p->ai_family == AF_INET || p->ai_family == AF_INET6)
+      count++;
+  }
+  if (count == 0)
+    return UV_EAI_ADDRFAMILY;
+
+  race = ex_pool_get(&pool->races);
+  if (!race)
+    return UV_ENOMEM;
+  memset(race, 0, sizeof(*race));
+  race->attempts = race->inline_attempts;
+  if (count > EX_EYEBALLS_INLINE)
+    race->attempts = calloc(count, sizeof(*race->attempts));
+  if (!race->attempts) {
+    ex_pool_put(race);
+    return UV_ENOMEM;
+  }
+
+  rc = uv_timer_init(loop, &race->stagger);
+  if (rc < 0) {
+    if (race->attempts != race->inline_attempts)
+      free(race->attempts);
+    ex_pool_put(race);
+    return rc;
+  }
+
+  race->loop = loop;
+  race->pool = pool;
+  race->delay_ms = delay_ms ? delay_ms : EX_EYEBALLS_DELAY_MS;
+  race->cb = cb;
+  race->data = data;
+  race->count = count;
+  race->handles = 1;
+  race->stagger.data = race;
+
+  /* Interleave families, starting with whichever the resolver put first. */
+  for (p = addrs; p && !first_family; p = p->ai_next) {
+    if (p->ai_family == AF_INET || p->ai_family == AF_INET6)
+      first_family = p->ai_family;
+  }
+  v6 = addrs;
+  v4 = addrs;
+  while (n < count) {
+    for (int pass = 0; pass < 2 && n < count; ++pass) {
+      family = (pass == 0) == (first_family == AF_INET6) ? AF_INET6 : AF_INET;
+      cursor = family == AF_INET6 ? &v6 : &v4;
+      while (*cursor && (*cursor)->ai_family != family)
+        *cursor = (*cursor)->ai_next;
+      if (*cursor) {
+        race->attempts[n].addr = *cursor;
+        race->attempts[n].race = race;
+        n++;
+        *cursor = (*cursor)->ai_next;
+      }
+    }
+  }
+
+  rc = race_next(race);
+  if (rc < 0) {
+    race_stop(race, NULL);
+    *out = NULL;
+    return rc;
+  }
+
+  *out = race;
+  return 0;
+}
+
+/* Abandons the race without calling back. */
+void
+ex_eyeballs_cancel(ex_eyeballs_t *race) {
+  if (!race || race->finished)
+    return;
+  race_stop(race, NULL);
+}
+
+/* Moves a connected socket onto a caller-owned, initialized handle, for
+ * callers that embed their uv_tcp_t. `from` is closed and returned to its pool either way. */
+int
+ex_eyeballs_adopt(uv_tcp_t *from, uv_tcp_t *to) {
+  uv_os_fd_t fd;
+  int dupfd = -1;
+  int rc = 0;
+
+  rc = uv_fileno((uv_handle_t *)from, &fd);
+  if (rc >= 0) {
+    dupfd = dup(fd);
+    if (dupfd < 0)
+      rc = uv_translate_sys_error(errno);
+  }
+  if (rc >= 0) {
+    rc = uv_tcp_open(to, dupfd);
+    if (rc < 0)
+      close(dupfd);
+  }
+
+  uv_close((uv_handle_t *)from, on_adopt_close);
+  return rc;
+}
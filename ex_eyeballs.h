@@ -0,0 +1,66 @@
+/* Happy-eyeballs connect (RFC 8305) across every resolved address.
+ *
+ * Addresses are tried in order, alternating IPv6 and IPv4, with a new
+ * attempt started every `delay_ms` or as soon as the previous one fails.
+ * The first socket to connect wins and every other attempt is closed.
+ */
+
+#ifndef EX_EYEBALLS_H
+#define EX_EYEBALLS_H
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "ex_pool.h"
+
+#define EX_EYEBALLS_DELAY_MS  250
+#define EX_EYEBALLS_INLINE    8       /* Attempts held in the race itself */
+
+typedef struct ex_eyeballs_s ex_eyeballs_t;
+
+/* On success the callee owns `tcp`: a connected, pooled handle that must
+ * be uv_close()d and then handed to ex_pool_put(). On failure `tcp` and `addr` are NULL.
+ * The race frees itself after the callback; drop any pointer to it. */
+typedef void (*ex_eyeballs_cb)(ex_eyeballs_t *race, int status, uv_tcp_t *tcp, const struct addrinfo *addr);
+
+typedef struct ex_eyeballs_attempt_s {
+  uv_tcp_t *tcp;
+  uv_connect_t connector;
+  const struct addrinfo *addr;
+  ex_eyeballs_t *race;
+  int status;
+} ex_eyeballs_attempt_t;
+
+/* Per-loop pools for races and their handles */
+typedef struct ex_eyeballs_pool_s {
+  ex_pool_t races;
+  ex_pool_t tcps;
+} ex_eyeballs_pool_t;
+
+struct ex_eyeballs_s {
+  uv_loop_t *loop;
+  ex_eyeballs_pool_t *pool;
+  uv_timer_t stagger;
+  uint64_t delay_ms;
+  ex_eyeballs_cb cb;
+
+  int finished;
+  int handles;          /* Handles not yet closed, the timer included */
+  int started;
+  int failed;
+  int count;
+  ex_eyeballs_attempt_t *attempts;
+  ex_eyeballs_attempt_t inline_attempts[EX_EYEBALLS_INLINE];
+
+  void *data;
+};
+
+int ex_eyeballs_pool_init(ex_eyeballs_pool_t *pool);
+void ex_eyeballs_pool_free(ex_eyeballs_pool_t *pool);
+int ex_eyeballs_start(ex_eyeballs_t **race, uv_loop_t *loop, ex_eyeballs_pool_t *pool,
+    const struct addrinfo *addrs, uint64_t delay_ms, ex_eyeballs_cb cb, void *data);
+void ex_eyeballs_cancel(ex_eyeballs_t *race);
+int ex_eyeballs_adopt(uv_tcp_t *from, uv_tcp_t *to);
+
+#endif
@@ -0,0 +1,198 @@
+/* Streaming decoder for the 16-byte live protocol header.
+ *
+ * Frames that sit entirely inside one read are handed out as views into the
+ * read buffer. Only a frame split across reads is copied, into a per-decoder
+ * tail. A small tail is kept for reuse; a large one is released as soon as
+ * its frame is delivered, so idle connections hold no frame memory.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_frame.h"
+
+static inline uint32_t
+load_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint16_t
+load_be16(const uint8_t *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static int
+tail_reserve(ex_frame_decoder_t *dec, size_t len) {
+  size_t cap = dec->tail_cap ? dec->tail_cap : 256;
+  uint8_t *data = NULL;
+
+  if (len <= dec->tail_cap)
+    return 0;
+  while (cap < len)
+    cap *= 2;
+  data = realloc(dec->tail, cap);
+  if (!data)
+    return UV_ENOMEM;
+  dec->tail = data;
+  dec->tail_cap = cap;
+  return 0;
+}
+
+int
+ex_frame_decoder_init(ex_frame_decoder_t *dec, uint32_t max_packet) {
+  if (!dec)
+    return UV_EINVAL;
+
+  memset(dec, 0, sizeof(*dec));
+  dec->max_packet = max_packet ? max_packet : EX_FRAME_MAX_PACKET;
+  return 0;
+}
+
+void
+ex_frame_decoder_reset(ex_frame_decoder_t *dec) {
+  dec->tail_len = 0;
+  dec->need = 0;
+}
+
+void
+ex_frame_decoder_free(ex_frame_decoder_t *dec) {
+  if (!dec)
+    return;
+  free(dec->tail);
+  dec->tail = NULL;
+  dec->tail_len = 0;
+  dec->tail_cap = 0;
+  dec->need = 0;
+}
+
+int
+ex_frame_header(const uint8_t *p, uint32_t max_packet, ex_frame_t *frame) {
+  frame->packet_len = load_be32(p);
+  frame->header_len = load_be16(p + 4);
+  frame->ver = load_be16(p + 6);
+  frame->op = load_be32(p + 8);
+  frame->seq = load_be32(p + 12);
+
+  if (frame->header_len < EX_FRAME_HDR_LEN)
+    return UV_EPROTO;
+  if (frame->packet_len < frame->header_len)
+    return UV_EPROTO;
+  if (frame->packet_len > max_packet)
+    return UV_E2BIG;
+
+  frame->body_len = frame->packet_len - frame->header_len;
+  return 0;
+}
+
+void
+ex_frame_encode(uint8_t *out, uint32_t packet_len, uint16_t ver, uint32_t op, uint32_t seq) {
+  out[0] = packet_len >> 24; out[1] = packet_len >> 16; out[2] = packet_len >> 8; out[3] = packet_len;
+  out[4] = 0; out[5] = EX_FRAME_HDR_LEN;
+  out[6] = ver >> 8; out[7] = ver;
+  out[8] = op >> 24; out[9] = op >> 16; out[10] = op >> 8; out[11] = op;
+  out[12] = seq >> 24; out[13] = seq >> 16; out[14] = seq >> 8; out[15] = seq;
+}
+
+/* Completes the frame held in the tail. Returns the number of bytes of
+ * `data` consumed, or < 0 on error. */
+static ssize_t
+feed_tail(ex_frame_decoder_t *dec, const uint8_t *data, size_t len, ex_frame_cb cb, void *arg) {
+  ex_frame_t frame;
+  size_t used = 0, take = 0;
+  int rc = 0;
+
+  if (dec->tail_len < EX_FRAME_HDR_LEN) {
+    take = EX_FRAME_HDR_LEN - dec->tail_len;
+    if (take > len)
+      take = len;
+    memcpy(dec->tail + dec->tail_len, data, take);
+    dec->tail_len += take;
+    used += take;
+    if (dec->tail_len < EX_FRAME_HDR_LEN)
+      return used;
+
+    rc = ex_frame_header(dec->tail, dec->max_packet, &frame);
+    if (rc < 0)
+      return rc;
+    rc = tail_reserve(dec, frame.packet_len);
+    if (rc < 0)
+      return rc;
+    dec->need = frame.packet_len;
+  }
+
+  take = dec->need - dec->tail_len;
+  if (take > len - used)
+    take = len - used;
+  memcpy(dec->tail + dec->tail_len, data + used, take);
+  dec->tail_len += take;
+  used += take;
+  if (dec->tail_len < dec->need)
+    return used;
+
+  ex_frame_header(dec->tail, dec->max_packet, &frame);
+  frame.body = dec->tail + frame.header_len;
+  dec->tail_len = 0;
+  dec->need = 0;
+  dec->frames++;
+  dec->bytes += frame.packet_len;
+
+  rc = cb(&frame, arg);
+  if (dec->tail_cap > EX_FRAME_TAIL_KEEP) {
+    free(dec->tail);
+    dec->tail = NULL;
+    dec->tail_cap = 0;
+  }
+  return rc < 0 ? rc : (ssize_t)used;
+}
+
+int
+ex_frame_feed(ex_frame_decoder_t *dec, const uint8_t *data, size_t len, ex_frame_cb cb, void *arg) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  ex_frame_t frame;
+  ssize_t used = 0;
+  int rc = 0;
+
+  if (!dec || !cb || (!data && len))
+    return UV_EINVAL;
+
+  /* Finish whatever the previous read left behind. */
+  if (dec->tail_len > 0) {
+    used = feed_tail(dec, p, len, cb, arg);
+    if (used < 0)
+      return (int)used;
+    p += used;
+  }
+
+  /* Every complete frame in the buffer is a view, no copies. */
+  while ((size_t)(end - p) >= EX_FRAME_HDR_LEN) {
+    rc = ex_frame_header(p, dec->max_packet, &frame);
+    if (rc < 0)
+      return rc;
+    if (frame.packet_len > (size_t)(end - p))
+      break;
+
+    frame.body = p + frame.header_len;
+    p += frame.packet_len;
+    dec->frames++;
+    dec->bytes += frame.packet_len;
+
+    rc = cb(&frame, arg);
+    if (rc < 0)
+      return rc;
+  }
+
+  /* Stash the partial frame, if any. */
+  if (p < end) {
+    rc = tail_reserve(dec, EX_FRAME_HDR_LEN);
+    if (rc < 0)
+      return rc;
+    used = feed_tail(dec, p, end - p, cb, arg);
+    if (used < 0)
+      return (int)used;
+  }
+
+  return 0;
+}
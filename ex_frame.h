@@ -0,0 +1,70 @@
+/* Streaming decoder for the 16-byte live protocol header.
+ *
+ *   0               4       6       8               12              16
+ *   +---------------+-------+-------+---------------+---------------+
+ *   |  packet len   |hdr len|  ver  |      op       |      seq      |
+ *   +---------------+-------+-------+---------------+---------------+
+ *
+ * All fields are big-endian. `packet len` covers the header and the body.
+ */
+
+#ifndef EX_FRAME_H
+#define EX_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EX_FRAME_HDR_LEN      16
+#define EX_FRAME_MAX_PACKET   (1 << 24)
+#define EX_FRAME_TAIL_KEEP    256       /* Larger tails are released once drained */
+
+enum ex_frame_op {
+  EX_OP_HEARTBEAT       = 2,
+  EX_OP_HEARTBEAT_REPLY = 3,
+  EX_OP_MESSAGE         = 5,
+  EX_OP_AUTH            = 7,
+  EX_OP_AUTH_REPLY      = 8,
+};
+
+enum ex_frame_ver {
+  EX_VER_JSON   = 0,
+  EX_VER_INT    = 1,
+  EX_VER_ZLIB   = 2,
+  EX_VER_BROTLI = 3,
+};
+
+/* A decoded frame. `body` points into the caller's read buffer (or into the
+ * decoder's tail for a frame that straddled reads) and is only valid for
+ * the duration of the callback. */
+typedef struct ex_frame_s {
+  uint32_t packet_len;
+  uint16_t header_len;
+  uint16_t ver;
+  uint32_t op;
+  uint32_t seq;
+  const uint8_t *body;
+  size_t body_len;
+} ex_frame_t;
+
+/* Return < 0 to stop decoding; the value is handed back by ex_frame_feed(). */
+typedef int (*ex_frame_cb)(const ex_frame_t *frame, void *arg);
+
+typedef struct ex_frame_decoder_s {
+  uint8_t *tail;        /* Bytes of a frame split across reads */
+  size_t tail_len;
+  size_t tail_cap;
+  size_t need;          /* Packet length of the tail, 0 until header is complete */
+  uint32_t max_packet;
+
+  uint64_t frames;
+  uint64_t bytes;
+} ex_frame_decoder_t;
+
+int ex_frame_decoder_init(ex_frame_decoder_t *dec, uint32_t max_packet);
+void ex_frame_decoder_reset(ex_frame_decoder_t *dec);
+void ex_frame_decoder_free(ex_frame_decoder_t *dec);
+int ex_frame_feed(ex_frame_decoder_t *dec, const uint8_t *data, size_t len, ex_frame_cb cb, void *arg);
+int ex_frame_header(const uint8_t *p, uint32_t max_packet, ex_frame_t *frame);
+void ex_frame_encode(uint8_t *out, uint32_t packet_len, uint16_t ver, uint32_t op, uint32_t seq);
+
+#endif
@@ -0,0 +1,161 @@
+/* Hex dump for the debug path, vectorized where the CPU allows. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_hex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EX_HEX_X86 1
+#include <immintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static size_t hex_encode_resolve(char *out, const uint8_t *in, size_t len);
+static size_t (*hex_encode_fn)(char *out, const uint8_t *in, size_t len) = hex_encode_resolve;
+static const char *hex_impl = "scalar";
+
+static size_t
+hex_encode_scalar(char *out, const uint8_t *in, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    out[i * 3] = hex_digits[in[i] >> 4];
+    out[i * 3 + 1] = hex_digits[in[i] & 0x0f];
+    out[i * 3 + 2] = ' ';
+  }
+  return len * 3;
+}
+
+#ifdef EX_HEX_X86
+/* 16 input bytes become 32 digits in two registers of "HLHL..." pairs,
+ * which three shuffles spread over 48 output bytes. Shuffle lanes marked -1
+ * come out zero and are filled with the space. */
+#define EX_HEX_SHUFFLES \
+  const __m128i a0 = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10); \
+  const __m128i a1 = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+  const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, 2, 3, -1, 4, 5); \
+  const __m128i b2 = _mm_setr_epi8(-1, 6, 7, -1, 8, 9, -1, 10, 11, -1, 12, 13, -1, 14, 15, -1); \
+  const __m128i s0 = _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0); \
+  const __m128i s1 = _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0); \
+  const __m128i s2 = _mm_setr_epi8(' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ')
+
+__attribute__((target("ssse3")))
+static size_t
+hex_encode_ssse3(char *out, const uint8_t *in, size_t len) {
+  EX_HEX_SHUFFLES;
+  const __m128i digits = _mm_loadu_si128((const __m128i *)hex_digits);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i v, hi, lo, p0, p1;
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(in + i));
+    hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+    p0 = _mm_unpacklo_epi8(hi, lo);
+    p1 = _mm_unpackhi_epi8(hi, lo);
+
+    _mm_storeu_si128((__m128i *)(out + i * 3),
+        _mm_or_si128(_mm_shuffle_epi8(p0, a0), s0));
+    _mm_storeu_si128((__m128i *)(out + i * 3 + 16),
+        _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, a1), _mm_shuffle_epi8(p1, b1)), s1));
+    _mm_storeu_si128((__m128i *)(out + i * 3 + 32),
+        _mm_or_si128(_mm_shuffle_epi8(p1, b2), s2));
+  }
+  return i * 3 + hex_encode_scalar(out + i * 3, in + i, len - i);
+}
+
+/* Same shuffles, on two 16-byte halves at once (one per 128-bit lane). */
+__attribute__((target("avx2")))
+static size_t
+hex_encode_avx2(char *out, const uint8_t *in, size_t len) {
+  EX_HEX_SHUFFLES;
+  const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_digits));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i a0x = _mm256_broadcastsi128_si256(a0), a1x = _mm256_broadcastsi128_si256(a1);
+  const __m256i b1x = _mm256_broadcastsi128_si256(b1), b2x = _mm256_broadcastsi128_si256(b2);
+  const __m256i s0x = _mm256_broadcastsi128_si256(s0), s1x = _mm256_broadcastsi128_si256(s1);
+  const __m256i s2x = _mm256_broadcastsi128_si256(s2);
+  __m256i v, hi, lo, p0, p1, c0, c1, c2;
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(in + i));
+    hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, nibble));
+    p0 = _mm256_unpacklo_epi8(hi, lo);
+    p1 = _mm256_unpackhi_epi8(hi, lo);
+
+    c0 = _mm256_or_si256(_mm256_shuffle_epi8(p0, a0x), s0x);
+    c1 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(p0, a1x), _mm256_shuffle_epi8(p1, b1x)), s1x);
+    c2 = _mm256_or_si256(_mm256_shuffle_epi8(p1, b2x), s2x);
+
+    _mm_storeu_si128((__m128i *)(out + i * 3), _mm256_castsi256_si128(c0));
+    _mm_storeu_si128((__m128i *)(out + i * 3 + 16), _mm256_castsi256_si128(c1));
+    _mm_storeu_si128((__m128i *)(out + i * 3 + 32), _mm256_castsi256_si128(c2));
+    _mm_storeu_si128((__m128i *)(out + i * 3 + 48), _mm256_extracti128_si256(c0, 1));
+    _mm_storeu_si128((__m128i *)(out + i * 3 + 64), _mm256_extracti128_si256(c1, 1));
+    _mm_storeu_si128((__m128i *)(out + i * 3 + 80), _mm256_extracti128_si256(c2, 1));
+  }
+  return i * 3 + hex_encode_ssse3(out + i * 3, in + i, len - i);
+}
+#endif
+
+static size_t
+hex_encode_resolve(char *out, const uint8_t *in, size_t len) {
+  size_t (*fn)(char *, const uint8_t *, size_t) = hex_encode_scalar;
+
+#ifdef EX_HEX_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    fn = hex_encode_avx2;
+    hex_impl = "avx2";
+  }
+  else if (__builtin_cpu_supports("ssse3")) {
+    fn = hex_encode_ssse3;
+    hex_impl = "ssse3";
+  }
+#endif
+  __atomic_store_n(&hex_encode_fn, fn, __ATOMIC_RELAXED);
+  return fn(out, in, len);
+}
+
+/* Writes exactly len * EX_HEX_CHARS bytes, no terminator. */
+size_t
+ex_hex_encode(char *out, const uint8_t *in, size_t len) {
+  return __atomic_load_n(&hex_encode_fn, __ATOMIC_RELAXED)(out, in, len);
+}
+
+const char *
+ex_hex_impl(void) {
+  if (__atomic_load_n(&hex_encode_fn, __ATOMIC_RELAXED) == hex_encode_resolve)
+    hex_encode_resolve(NULL, NULL, 0);
+  return hex_impl;
+}
+
+ssize_t
+ex_hexbuf_encode(ex_hexbuf_t *buf, const uint8_t *in, size_t len) {
+  size_t need = len * EX_HEX_CHARS;
+  size_t cap = buf->cap ? buf->cap : 4096;
+  char *data = NULL;
+
+  if (need > buf->cap) {
+    while (cap < need)
+      cap *= 2;
+    data = realloc(buf->data, cap);
+    if (!data)
+      return UV_ENOMEM;
+    buf->data = data;
+    buf->cap = cap;
+  }
+  return ex_hex_encode(buf->data, in, len);
+}
+
+void
+ex_hexbuf_free(ex_hexbuf_t *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->cap = 0;
+}
@@ -0,0 +1,29 @@
+/* Hex dump for the debug path: "0A 1B 2C " three characters per byte.
+ *
+ * Encodes 32 bytes per step with AVX2 or 16 with SSSE3, picked once at
+ * runtime from what the CPU supports, with a table-driven scalar fallback.
+ * Output goes into a caller-owned buffer that only grows.
+ */
+
+#ifndef EX_HEX_H
+#define EX_HEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define EX_HEX_CHARS  3       /* Per input byte */
+
+typedef struct ex_hexbuf_s {
+  char *data;
+  size_t cap;
+} ex_hexbuf_t;
+
+size_t ex_hex_encode(char *out, const uint8_t *in, size_t len);
+const char *ex_hex_impl(void);
+
+/* Encodes into `buf`, growing it as needed. Returns the length or < 0. */
+ssize_t ex_hexbuf_encode(ex_hexbuf_t *buf, const uint8_t *in, size_t len);
+void ex_hexbuf_free(ex_hexbuf_t *buf);
+
+#endif
@@ -0,0 +1,61 @@
+/* Log-linear latency histogram, HDR style. */
+
+#include <string.h>
+
+#include "ex_hist.h"
+
+/* Largest value that lands in bucket `i`. */
+static uint64_t
+bucket_top(uint32_t i) {
+  uint32_t shift = 0;
+
+  if (i < (1u << EX_HIST_SUB_BITS))
+    return i;
+  shift = i / EX_HIST_HALF - 1;
+  return (((uint64_t)(i - shift * EX_HIST_HALF) + 1) << shift) - 1;
+}
+
+void
+ex_hist_reset(ex_hist_t *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+void
+ex_hist_merge(ex_hist_t *dst, const ex_hist_t *src) {
+  if (!src->count)
+    return;
+  for (uint32_t i = 0; i < EX_HIST_BUCKETS; ++i)
+    dst->buckets[i] += src->buckets[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/* `p` in [0, 100]. Reports the top of the bucket, clamped to the max. */
+uint64_t
+ex_hist_percentile(const ex_hist_t *h, double p) {
+  uint64_t rank = 0;
+  uint64_t seen = 0;
+  uint64_t top = 0;
+
+  if (!h->count)
+    return 0;
+  rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+
+  for (uint32_t i = 0; i < EX_HIST_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      top = bucket_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
@@ -0,0 +1,51 @@
+/* Log-linear latency histogram, HDR style.
+ *
+ * Values below 2^EX_HIST_SUB_BITS get a bucket each; above that, every
+ * power of two is split into 2^(EX_HIST_SUB_BITS - 1) linear buckets, so
+ * any value is known to within 1/64th (~1.6%) and the whole 64-bit range
+ * fits in a fixed array. Recording is a count-leading-zeros and an
+ * increment; percentiles are a walk over the array.
+ *
+ * Not thread-safe; keep one per thread and merge them to read.
+ */
+
+#ifndef EX_HIST_H
+#define EX_HIST_H
+
+#include <stdint.h>
+
+#define EX_HIST_SUB_BITS  7
+#define EX_HIST_HALF      (1 << (EX_HIST_SUB_BITS - 1))
+#define EX_HIST_BUCKETS   ((66 - EX_HIST_SUB_BITS) * EX_HIST_HALF)
+
+typedef struct ex_hist_s {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[EX_HIST_BUCKETS];
+} ex_hist_t;
+
+void ex_hist_reset(ex_hist_t *h);
+void ex_hist_merge(ex_hist_t *dst, const ex_hist_t *src);
+uint64_t ex_hist_percentile(const ex_hist_t *h, double p);
+
+static inline void
+ex_hist_record(ex_hist_t *h, uint64_t v) {
+  int shift = 0;
+  uint32_t i = (uint32_t)v;
+
+  if (v >= (1u << EX_HIST_SUB_BITS)) {
+    shift = 63 - __builtin_clzll(v) - (EX_HIST_SUB_BITS - 1);
+    i = shift * EX_HIST_HALF + (uint32_t)(v >> shift);
+  }
+  h->buckets[i]++;
+  h->count++;
+  h->sum += v;
+  if (v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+}
+
+#endif
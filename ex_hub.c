@@ -0,0 +1,350 @@
+/* Local fan-out of decoded frames to subscribers on a unix socket. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ex_hub.h"
+#include "ex_sock.h"
+
+static void on_hub_connection(uv_stream_t *server, int status);
+static void on_hub_prepare(uv_prepare_t *prepare);
+static void on_hub_drain(uv_timer_t *timer);
+static void on_hub_stall(uv_timer_t *timer);
+static void on_sub_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+static void on_sub_read(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf);
+static void on_sub_write(uv_write_t *req, int status);
+static void on_sub_close(uv_handle_t *handle);
+
+static void
+buf_unref(ex_hub_buf_t *buf) {
+  if (--buf->refs)
+    return;
+  if (buf->pooled)
+    ex_pool_put(buf);
+  else
+    free(buf);
+}
+
+static void
+hub_shut(ex_hub_t *hub) {
+  if (hub->shut)
+    return;
+  hub->shut = 1;
+  uv_close((uv_handle_t *)&hub->prepare, NULL);
+  uv_close((uv_handle_t *)&hub->drain, NULL);
+  uv_close((uv_handle_t *)&hub->stall, NULL);
+}
+
+static void
+put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void
+sub_queue(ex_hub_sub_t *sub, ex_hub_buf_t *buf) {
+  sub->queue[(sub->head + sub->count) & (EX_HUB_QUEUE - 1)] = buf;
+  sub->count++;
+  sub->bytes += buf->len;
+  buf->refs++;
+}
+
+/* Tells the subscriber how many records it missed */
+static int
+sub_gap(ex_hub_sub_t *sub) {
+  ex_hub_buf_t *gap = NULL;
+
+  if (sub->count == EX_HUB_QUEUE || sub->bytes + EX_HUB_PREFIX + EX_HUB_GAP_LEN > EX_HUB_QUEUE_BYTES)
+    return 0;
+  gap = ex_pool_get(&sub->hub->bufs);
+  if (!gap)
+    return 0;
+  gap->refs = 0;
+  gap->pooled = 1;
+  gap->len = EX_HUB_PREFIX + EX_HUB_GAP_LEN;
+  put_be32(gap->data, EX_HUB_GAP);
+  put_be32(gap->data + 4, EX_HUB_GAP_LEN);
+  put_be32(gap->data + 8, sub->lost >> 32);
+  put_be32(gap->data + 12, sub->lost);
+  sub_queue(sub, gap);
+  sub->lost = 0;
+  return 1;
+}
+
+/* Queues the record, after a gap record if any were dropped before it */
+static int
+sub_push(ex_hub_sub_t *sub, ex_hub_buf_t *buf) {
+  ex_hub_t *hub = sub->hub;
+  size_t need = buf->len + (sub->lost ? EX_HUB_PREFIX + EX_HUB_GAP_LEN : 0);
+
+  if (sub->count + (sub->lost ? 2 : 1) > EX_HUB_QUEUE || sub->bytes + need > EX_HUB_QUEUE_BYTES ||
+      (sub->lost && !sub_gap(sub))) {
+    sub->lost++;
+    sub->dropped++;
+    hub->dropped++;
+    return 0;
+  }
+  sub_queue(sub, buf);
+  sub->records++;
+  return 1;
+}
+
+static void
+sub_close(ex_hub_sub_t *sub) {
+  ex_hub_t *hub = sub->hub;
+
+  if (sub->closing)
+    return;
+  sub->closing = 1;
+  hub->nsubs--;
+  uv_close((uv_handle_t *)&sub->pipe, on_sub_close);
+  if (!hub->serving && !hub->nsubs)
+    hub_shut(hub);
+}
+
+/* The oldest records, as many as one write takes */
+static void
+sub_flush(ex_hub_sub_t *sub) {
+  ex_hub_t *hub = sub->hub;
+  uv_buf_t bufs[EX_HUB_IOV];
+  ex_hub_buf_t *buf = NULL;
+  uint32_t n = 0;
+
+  if (sub->closing || sub->inflight || !sub->count)
+    return;
+  n = sub->count < EX_HUB_IOV ? sub->count : EX_HUB_IOV;
+  for (uint32_t i = 0; i < n; ++i) {
+    buf = sub->queue[(sub->head + i) & (EX_HUB_QUEUE - 1)];
+    bufs[i] = uv_buf_init((char *)buf->data, buf->len);
+  }
+  if (uv_write(&sub->req, (uv_stream_t *)&sub->pipe, bufs, n, on_sub_write) < 0) {
+    sub_close(sub);
+    return;
+  }
+  sub->inflight = n;
+  sub->write_ms = uv_now(hub->loop);
+  hub->writes++;
+}
+
+int
+ex_hub_serve(ex_hub_t *hub, uv_loop_t *loop, const char *path) {
+  int rc = 0;
+
+  memset(hub, 0, sizeof(*hub));
+  if (strlen(path) >= sizeof(hub->path))
+    return UV_ENAMETOOLONG;
+  hub->loop = loop;
+  rc = ex_pool_init(&hub->bufs, sizeof(ex_hub_buf_t) + EX_HUB_BUF_LEN, 0);
+  if (rc < 0)
+    return rc;
+  rc = uv_pipe_init(loop, &hub->server, 0);
+  if (rc < 0)
+    return rc;
+  hub->server.data = hub;
+
+  /* A socket left behind by an earlier run would fail the bind */
+  rc = ex_sock_unlink_stale(path);
+  if (rc == 0)
+    rc = uv_pipe_bind(&hub->server, path);
+  if (rc == 0)
+    rc = uv_listen((uv_stream_t *)&hub->server, 16, on_hub_connection);
+  if (rc < 0) {
+    uv_close((uv_handle_t *)&hub->server, NULL);
+    return rc;
+  }
+  strcpy(hub->path, path);
+
+  uv_prepare_init(loop, &hub->prepare);
+  uv_timer_init(loop, &hub->drain);
+  uv_timer_init(loop, &hub->stall);
+  hub->prepare.data = hub->drain.data = hub->stall.data = hub;
+
+  /* Checks for stalled writes whether or not anything is published */
+  uv_timer_start(&hub->stall, on_hub_stall, EX_HUB_STALL_MS / 4, EX_HUB_STALL_MS / 4);
+  uv_unref((uv_handle_t *)&hub->stall);
+  hub->serving = 1;
+  return 0;
+}
+
+void
+ex_hub_close(ex_hub_t *hub) {
+  if (!hub->serving)
+    return;
+  hub->serving = 0;
+  uv_close((uv_handle_t *)&hub->server, NULL);
+  unlink(hub->path);
+
+  /* Losses at the very end are reported too, if there is room */
+  for (ex_hub_sub_t *sub = hub->subs; sub; sub = sub->next) {
+    sub->draining = 1;
+    if (sub->lost && !sub->closing && sub_gap(sub))
+      sub_flush(sub);
+    if (!sub->count)
+      sub_close(sub);
+  }
+  if (hub->nsubs)
+    uv_timer_start(&hub->drain, on_hub_drain, EX_HUB_STALL_MS, 0);
+  else
+    hub_shut(hub);
+}
+
+void
+ex_hub_free(ex_hub_t *hub) {
+  ex_pool_free(&hub->bufs);
+}
+
+int
+ex_hub_publish(ex_hub_t *hub, uint32_t room, const uint8_t *data, size_t len) {
+  size_t need = EX_HUB_PREFIX + len;
+  ex_hub_buf_t *buf = NULL;
+  ex_hub_sub_t *sub = NULL;
+  int queued = 0;
+
+  if (!hub->serving || !hub->nsubs)
+    return 0;
+  if (len > UINT32_MAX - EX_HUB_PREFIX)
+    return UV_E2BIG;
+
+  if (need <= EX_HUB_BUF_LEN) {
+    buf = ex_pool_get(&hub->bufs);
+    if (buf)
+      buf->pooled = 1;
+  } else {
+    buf = malloc(sizeof(*buf) + need);
+    if (buf)
+      buf->pooled = 0;
+  }
+  if (!buf)
+    return UV_ENOMEM;
+
+  /* Our own reference, until every subscriber has taken theirs */
+  buf->refs = 1;
+  buf->len = need;
+  put_be32(buf->data, room);
+  put_be32(buf->data + 4, len);
+  memcpy(buf->data + EX_HUB_PREFIX, data, len);
+  hub->published++;
+  hub->bytes += need;
+
+  for (sub = hub->subs; sub; sub = sub->next) {
+    if (!sub->closing)
+      queued |= sub_push(sub, buf);
+  }
+  buf_unref(buf);
+
+  if (queued)
+    uv_prepare_start(&hub->prepare, on_hub_prepare);
+  return 0;
+}
+
+static void
+on_hub_connection(uv_stream_t *server, int status) {
+  ex_hub_t *hub = server->data;
+  ex_hub_sub_t *sub = NULL;
+
+  if (status < 0)
+    return;
+  sub = calloc(1, sizeof(*sub));
+  if (!sub)
+    return;
+  sub->hub = hub;
+  sub->req.data = sub;
+  uv_pipe_init(hub->loop, &sub->pipe, 0);
+  sub->pipe.data = sub;
+
+  sub->next = hub->subs;
+  if (sub->next)
+    sub->next->pprev = &sub->next;
+  sub->pprev = &hub->subs;
+  hub->subs = sub;
+  hub->nsubs++;
+  hub->subscribers++;
+
+  if (uv_accept(server, (uv_stream_t *)&sub->pipe) < 0 ||
+      uv_read_start((uv_stream_t *)&sub->pipe, on_sub_alloc, on_sub_read) < 0)
+    sub_close(sub);
+}
+
+/* Everything published this iteration goes out before the loop blocks */
+static void
+on_hub_prepare(uv_prepare_t *prepare) {
+  ex_hub_t *hub = prepare->data;
+
+  for (ex_hub_sub_t *sub = hub->subs; sub; sub = sub->next)
+    sub_flush(sub);
+  uv_prepare_stop(prepare);
+}
+
+static void
+on_hub_stall(uv_timer_t *timer) {
+  ex_hub_t *hub = timer->data;
+  uint64_t now = uv_now(hub->loop);
+  ex_hub_sub_t *next = NULL;
+
+  for (ex_hub_sub_t *sub = hub->subs; sub; sub = next) {
+    next = sub->next;
+    if (!sub->closing && sub->inflight && now - sub->write_ms > EX_HUB_STALL_MS) {
+      hub->kicked++;
+      sub_close(sub);
+    }
+  }
+}
+
+/* Whoever is still draining by now is not going to finish */
+static void
+on_hub_drain(uv_timer_t *timer) {
+  ex_hub_t *hub = timer->data;
+
+  for (ex_hub_sub_t *sub = hub->subs; sub; sub = sub->next)
+    sub_close(sub);
+}
+
+static void
+on_sub_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+  ex_hub_sub_t *sub = handle->data;
+
+  buf->base = sub->hub->discard;
+  buf->len = sizeof(sub->hub->discard);
+}
+
+static void
+on_sub_read(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf) {
+  if (nread < 0)
+    sub_close(strm->data);
+}
+
+/* Also runs, cancelled, for a write still in flight at close */
+static void
+on_sub_write(uv_write_t *req, int status) {
+  ex_hub_sub_t *sub = req->data;
+  ex_hub_buf_t *buf = NULL;
+
+  for (; sub->inflight; sub->inflight--) {
+    buf = sub->queue[sub->head];
+    sub->head = (sub->head + 1) & (EX_HUB_QUEUE - 1);
+    sub->count--;
+    sub->bytes -= buf->len;
+    buf_unref(buf);
+  }
+  if (status < 0 || (sub->draining && !sub->count))
+    sub_close(sub);
+  else
+    sub_flush(sub);
+}
+
+static void
+on_sub_close(uv_handle_t *handle) {
+  ex_hub_sub_t *sub = handle->data;
+
+  for (; sub->count; sub->count--) {
+    buf_unref(sub->queue[sub->head]);
+    sub->head = (sub->head + 1) & (EX_HUB_QUEUE - 1);
+  }
+  *sub->pprev = sub->next;
+  if (sub->next)
+    sub->next->pprev = sub->pprev;
+  free(sub);
+}
@@ -0,0 +1,110 @@
+/* Local fan-out of decoded frames to subscribers on a unix socket.
+ *
+ * Consumers connect to the hub's socket instead of upstream, and from then
+ * on get every frame published, each as a record: the room it came from and
+ * the frame's length, 4 bytes each big-endian, then the frame as decoded,
+ * header included, so an ex_frame decoder reads it straight back.
+ *
+ * A published frame is copied once, into a refcounted ex_hub_buf_t, and a
+ * subscriber queues a pointer to it, never the bytes. Queues are flushed
+ * right before the loop would block, as one vectored uv_write() of up to
+ * EX_HUB_IOV records per subscriber, with one write in flight each; a
+ * buffer goes back to its pool when the last write carrying it completes.
+ *
+ * A subscriber that does not keep up holds up nobody but itself: past
+ * EX_HUB_QUEUE records or EX_HUB_QUEUE_BYTES its new records are dropped,
+ * whole, and counted, and the next one that makes it is preceded by a gap
+ * record: room EX_HUB_GAP, no room a frame comes from, and as its 8 bytes
+ * the number dropped, big-endian. One whose write has not completed in
+ * EX_HUB_STALL_MS, published to or not, is disconnected. Whatever
+ * subscribers send is discarded.
+ */
+
+#ifndef EX_HUB_H
+#define EX_HUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "ex_pool.h"
+
+#define EX_HUB_PREFIX       8
+#define EX_HUB_QUEUE        4096            /* Power of two */
+#define EX_HUB_QUEUE_BYTES  (8 << 20)
+#define EX_HUB_IOV          64
+#define EX_HUB_STALL_MS     5000
+#define EX_HUB_BUF_LEN      2048            /* Pooled up to here, malloc'd past it */
+#define EX_HUB_GAP          UINT32_MAX      /* Room of a gap record */
+#define EX_HUB_GAP_LEN      8
+
+typedef struct ex_hub_s ex_hub_t;
+typedef struct ex_hub_sub_s ex_hub_sub_t;
+
+typedef struct ex_hub_buf_s {
+  uint32_t refs;
+  uint32_t len;             /* Prefix and frame */
+  int pooled;
+  uint8_t data[];
+} ex_hub_buf_t;
+
+struct ex_hub_sub_s {
+  uv_pipe_t pipe;
+  uv_write_t req;
+  ex_hub_t *hub;
+  ex_hub_sub_t *next;
+  ex_hub_sub_t **pprev;
+  int closing;
+  int draining;             /* Close once the queue is out */
+
+  ex_hub_buf_t *queue[EX_HUB_QUEUE];
+  uint32_t head;            /* Oldest queued */
+  uint32_t count;
+  uint32_t inflight;        /* From `head` on, in the write in flight */
+  size_t bytes;
+  uint64_t write_ms;        /* When that write started */
+
+  uint64_t records;
+  uint64_t dropped;
+  uint64_t lost;            /* Dropped since the last record queued */
+};
+
+struct ex_hub_s {
+  uv_loop_t *loop;
+  uv_pipe_t server;
+  uv_prepare_t prepare;
+  uv_timer_t drain;
+  uv_timer_t stall;
+  int serving;
+  int shut;
+  char path[108];
+  char discard[64];
+
+  ex_pool_t bufs;
+  ex_hub_sub_t *subs;
+  int nsubs;
+
+  uint64_t published;       /* Frames, with at least one subscriber */
+  uint64_t bytes;
+  uint64_t writes;
+  uint64_t subscribers;     /* Ever accepted */
+  uint64_t dropped;         /* Records, over all subscribers */
+  uint64_t kicked;          /* Subscribers disconnected as stalled */
+};
+
+/* Serves `path` from `loop`, replacing a stale socket; UV_EADDRINUSE if
+ * anything else is there. */
+int ex_hub_serve(ex_hub_t *hub, uv_loop_t *loop, const char *path);
+
+/* Closes the socket now, and each subscriber once what is queued for it
+ * is written, or after EX_HUB_STALL_MS in any case. */
+void ex_hub_close(ex_hub_t *hub);
+
+/* Once the loop has run the closes. */
+void ex_hub_free(ex_hub_t *hub);
+
+/* Copies the frame once for all subscribers; free with none. */
+int ex_hub_publish(ex_hub_t *hub, uint32_t room, const uint8_t *data, size_t len);
+
+#endif
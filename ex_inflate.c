@@ -0,0 +1,96 @@
+/* Inline zlib decompression for protover-2 batch packets. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_inflate.h"
+
+int
+ex_inflate_init(ex_inflate_t *inf, size_t window_len) {
+  int rc = 0;
+
+  if (!inf)
+    return UV_EINVAL;
+
+  memset(inf, 0, sizeof(*inf));
+  inf->window_len = window_len ? window_len : EX_INFLATE_WINDOW;
+  inf->window = malloc(inf->window_len);
+  if (!inf->window)
+    return UV_ENOMEM;
+
+  rc = inflateInit(&inf->zs);
+  if (rc != Z_OK) {
+    free(inf->window);
+    inf->window = NULL;
+    return UV_ENOMEM;
+  }
+  inf->zs_on = 1;
+
+  return ex_frame_decoder_init(&inf->inner, 0);
+}
+
+void
+ex_inflate_free(ex_inflate_t *inf) {
+  if (!inf)
+    return;
+  if (inf->zs_on)
+    inflateEnd(&inf->zs);
+  inf->zs_on = 0;
+  free(inf->window);
+  inf->window = NULL;
+  ex_frame_decoder_free(&inf->inner);
+}
+
+int
+ex_inflate_frame(ex_inflate_t *inf, const ex_frame_t *frame, ex_frame_cb cb, void *arg) {
+  size_t produced = 0;
+  int zrc = Z_OK;
+  int rc = 0;
+
+  if (!inf || !inf->zs_on || !frame)
+    return UV_EINVAL;
+
+  /* The window is in use by the frames we are handing out. */
+  if (inf->busy)
+    return UV_EBUSY;
+
+  inf->busy = 1;
+  inf->packets++;
+  inf->bytes_in += frame->body_len;
+  inf->zs.next_in = (Bytef*)frame->body;
+  inf->zs.avail_in = frame->body_len;
+
+  do {
+    inf->zs.next_out = inf->window;
+    inf->zs.avail_out = inf->window_len;
+
+    zrc = inflate(&inf->zs, Z_NO_FLUSH);
+    if (zrc != Z_OK && zrc != Z_STREAM_END) {
+      rc = zrc == Z_MEM_ERROR ? UV_ENOMEM : UV_EPROTO;
+      break;
+    }
+
+    produced = inf->window_len - inf->zs.avail_out;
+    if (produced == 0 && zrc != Z_STREAM_END) {
+      /* Truncated body: input is exhausted but the stream did not end. */
+      rc = UV_EPROTO;
+      break;
+    }
+    inf->bytes_out += produced;
+
+    rc = ex_frame_feed(&inf->inner, inf->window, produced, cb, arg);
+    if (rc < 0)
+      break;
+  } while (zrc != Z_STREAM_END);
+
+  /* A batch must end on a frame boundary. */
+  if (rc == 0 && inf->inner.tail_len > 0)
+    rc = UV_EPROTO;
+
+  ex_frame_decoder_reset(&inf->inner);
+  inflateReset(&inf->zs);
+  inf->busy = 0;
+  return rc;
+}
@@ -0,0 +1,36 @@
+/* Inline zlib decompression for protover-2 batch packets.
+ *
+ * One z_stream is kept per connection (or per loop, since a packet is fully
+ * decompressed before the callback returns) and reset between packets rather
+ * than torn down. Output goes through a fixed window straight into an inner
+ * frame decoder, so inner frames are views into the window.
+ */
+
+#ifndef EX_INFLATE_H
+#define EX_INFLATE_H
+
+#include <zlib.h>
+
+#include "ex_frame.h"
+
+#define EX_INFLATE_WINDOW   65536
+
+typedef struct ex_inflate_s {
+  z_stream zs;
+  int zs_on;
+  int busy;
+
+  uint8_t *window;
+  size_t window_len;
+  ex_frame_decoder_t inner;
+
+  uint64_t packets;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} ex_inflate_t;
+
+int ex_inflate_init(ex_inflate_t *inf, size_t window_len);
+int ex_inflate_frame(ex_inflate_t *inf, const ex_frame_t *frame, ex_frame_cb cb, void *arg);
+void ex_inflate_free(ex_inflate_t *inf);
+
+#endif
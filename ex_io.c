@@ -0,0 +1,190 @@
+/* Transport backends: lookup and the parts they share. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ex_io.h"
+
+static const ex_io_ops_t *const backends[] = {
+  &ex_io_uv_ops,
+  &ex_io_epoll_ops,
+  &ex_io_uring_ops,
+};
+
+const ex_io_ops_t *
+ex_io_backend(const char *name) {
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    if (strcmp(backends[i]->name, name) == 0)
+      return backends[i];
+  }
+  return NULL;
+}
+
+int
+ex_io_init(ex_io_t *io, const ex_io_ops_t *ops) {
+  int rc = 0;
+
+  for (; ops; ops = ops->fallback) {
+    memset(io, 0, sizeof(*io));
+    io->ops = ops;
+    rc = ops->init(io);
+    if (rc == 0)
+      break;
+  }
+  return rc;
+}
+
+void
+ex_io_free(ex_io_t *io) {
+  io->ops->free(io);
+}
+
+/* Copies `iov` minus its first `skip` bytes to the end of `out`. */
+int
+ex_io_pending_append(ex_io_pending_t *out, const struct iovec *iov, int iovcnt, size_t skip) {
+  size_t need = 0;
+  size_t cap = 0;
+  uint8_t *data = NULL;
+
+  for (int i = 0; i < iovcnt; ++i)
+    need += iov[i].iov_len;
+  need -= skip;
+  if (!need)
+    return 0;
+
+  /* Reclaim what has been sent before growing */
+  if (out->off && out->off == out->len)
+    out->off = out->len = 0;
+  if (out->len + need > out->cap) {
+    if (out->off) {
+      memmove(out->data, out->data + out->off, out->len - out->off);
+      out->len -= out->off;
+      out->off = 0;
+    }
+    for (cap = out->cap ? out->cap : 4096; cap < out->len + need; cap *= 2)
+      ;
+    if (cap != out->cap) {
+      data = realloc(out->data, cap);
+      if (!data)
+        return UV_ENOMEM;
+      out->data = data;
+      out->cap = cap;
+    }
+  }
+
+  for (int i = 0; i < iovcnt; ++i) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    memcpy(out->data + out->len, (const uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+    out->len += iov[i].iov_len - skip;
+    skip = 0;
+  }
+  return 0;
+}
+
+void
+ex_io_pending_free(ex_io_pending_t *out) {
+  free(out->data);
+  memset(out, 0, sizeof(*out));
+}
+
+uint64_t
+ex_io_clock_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+timer_unlink(ex_io_timer_t *timer) {
+  ex_io_timer_t **pp = &timer->io->timers;
+
+  for (; *pp; pp = &(*pp)->u.list.next) {
+    if (*pp == timer) {
+      *pp = timer->u.list.next;
+      break;
+    }
+  }
+  timer->u.list.armed = 0;
+}
+
+static void
+timer_link(ex_io_timer_t *timer) {
+  ex_io_timer_t **pp = &timer->io->timers;
+
+  while (*pp && (*pp)->u.list.due <= timer->u.list.due)
+    pp = &(*pp)->u.list.next;
+  timer->u.list.next = *pp;
+  *pp = timer;
+  timer->u.list.armed = 1;
+}
+
+void
+ex_io_list_timer_init(ex_io_t *io, ex_io_timer_t *timer) {
+  timer->io = io;
+  timer->u.list.armed = 0;
+}
+
+int
+ex_io_list_timer_start(ex_io_timer_t *timer, ex_io_timer_cb cb, uint64_t timeout, uint64_t repeat) {
+  if (timer->u.list.armed)
+    timer_unlink(timer);
+  timer->cb = cb;
+  timer->u.list.due = timer->io->now + timeout;
+  timer->u.list.repeat = repeat;
+  timer_link(timer);
+  return 0;
+}
+
+void
+ex_io_list_timer_stop(ex_io_timer_t *timer) {
+  if (timer->u.list.armed)
+    timer_unlink(timer);
+}
+
+/* Milliseconds until the next timer is due, or -1 if none is armed. */
+int
+ex_io_list_timeout(ex_io_t *io) {
+  if (!io->timers)
+    return -1;
+  return io->timers->u.list.due > io->now ? io->timers->u.list.due - io->now : 0;
+}
+
+void
+ex_io_list_run_timers(ex_io_t *io) {
+  ex_io_timer_t *timer = NULL;
+
+  while ((timer = io->timers) && timer->u.list.due <= io->now) {
+    io->timers = timer->u.list.next;
+    timer->u.list.armed = 0;
+    if (timer->u.list.repeat) {
+      timer->u.list.due = io->now + timer->u.list.repeat;
+      timer_link(timer);
+    }
+    timer->cb(timer);
+  }
+}
+
+/* `conn` is done with; its close callback runs from the loop. */
+void
+ex_io_list_closed(ex_io_conn_t *conn, ex_io_close_cb cb) {
+  conn->close_cb = cb;
+  conn->next_closed = conn->io->closed;
+  conn->io->closed = conn;
+}
+
+void
+ex_io_list_run_closed(ex_io_t *io) {
+  ex_io_conn_t *conn = NULL;
+
+  while ((conn = io->closed)) {
+    io->closed = conn->next_closed;
+    io->conns--;
+    if (conn->close_cb)
+      conn->close_cb(conn);
+  }
+}
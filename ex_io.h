@@ -0,0 +1,256 @@
+/* Pluggable transport: connect, read, vectored write and timers behind a
+ * small table of functions, so the same client can run on libuv, epoll or
+ * io_uring and they can be measured against each other. Only bench_client
+ * runs on it; the examples stay on libuv.
+ *
+ * Contracts, the same for every backend:
+ *
+ *   - Reads hand out a borrowed, loop-wide buffer that is only valid for
+ *     the duration of the callback. nread < 0 is an error or UV_EOF.
+ *   - ex_io_writev() sends what the socket takes right away and copies
+ *     only the rest, so the caller's buffers need not outlive the call.
+ *     io_uring is the exception: a send is only submitted, so every write
+ *     is copied whole, into `sending` or behind it into `out`.
+ *   - ex_io_close() is deferred: `cb` runs from the loop once the
+ *     connection's memory may be reused.
+ *   - ex_io_run() returns once nothing is left open or armed, or after
+ *     ex_io_stop(). Stopped timers do not keep it running.
+ *   - Connections always have TCP_NODELAY set: the protocol is small
+ *     frames that should not wait on each other.
+ *
+ * Errors are UV_* codes throughout, whatever the backend.
+ */
+
+#ifndef EX_IO_H
+#define EX_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include <uv.h>
+
+#define EX_IO_RDBUF_LEN   65536
+
+typedef struct ex_io_s ex_io_t;
+typedef struct ex_io_ops_s ex_io_ops_t;
+typedef struct ex_io_conn_s ex_io_conn_t;
+typedef struct ex_io_timer_s ex_io_timer_t;
+
+typedef void (*ex_io_connect_cb)(ex_io_conn_t *conn, int status);
+typedef void (*ex_io_read_cb)(ex_io_conn_t *conn, ssize_t nread, const uint8_t *data);
+typedef void (*ex_io_close_cb)(ex_io_conn_t *conn);
+typedef void (*ex_io_timer_cb)(ex_io_timer_t *timer);
+
+struct ex_io_ops_s {
+  const char *name;
+  const ex_io_ops_t *fallback;      /* Tried by ex_io_init() if init fails */
+  int (*init)(ex_io_t *io);
+  void (*free)(ex_io_t *io);
+  int (*run)(ex_io_t *io);
+  void (*stop)(ex_io_t *io);
+  uint64_t (*now)(ex_io_t *io);
+
+  int (*connect)(ex_io_t *io, ex_io_conn_t *conn, const struct sockaddr *addr, ex_io_connect_cb cb);
+  int (*read_start)(ex_io_conn_t *conn, ex_io_read_cb cb);
+  int (*writev)(ex_io_conn_t *conn, const struct iovec *iov, int iovcnt);
+  void (*close)(ex_io_conn_t *conn, ex_io_close_cb cb);
+
+  void (*timer_init)(ex_io_t *io, ex_io_timer_t *timer);
+  int (*timer_start)(ex_io_timer_t *timer, ex_io_timer_cb cb, uint64_t timeout, uint64_t repeat);
+  void (*timer_stop)(ex_io_timer_t *timer);
+};
+
+/* Pending output that the socket did not take at once */
+typedef struct ex_io_pending_s {
+  uint8_t *data;
+  size_t off;
+  size_t len;
+  size_t cap;
+} ex_io_pending_t;
+
+/* The io_uring backend's state exists only with kernel headers from 6.1
+ * on; built against older ones, ex_io_uring_ops fails init instead. */
+#ifdef IORING_SETUP_DEFER_TASKRUN
+typedef struct ex_io_ur_conn_s {
+  int fd;
+  int slot;                         /* Registered file index */
+  int reading;
+  int recv_armed;
+  int closing;
+  unsigned inflight;                /* Requests not completed yet */
+  ex_io_pending_t out;              /* Queued behind `sending` */
+  ex_io_pending_t sending;          /* Owned by the kernel until its CQE */
+  struct sockaddr_storage addr;
+} ex_io_ur_conn_t;
+
+typedef struct ex_io_ur_s {
+  int fd;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t sq_pending;              /* Filled in, not submitted yet */
+  struct io_uring_sqe *sqes;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+  void *ring;
+  size_t ring_len;
+  size_t sqes_len;
+  struct io_uring_buf_ring *bufs;
+  uint8_t *buf_base;
+  uint16_t buf_tail;
+  int *free_slots;
+  int nfree_slots;
+} ex_io_ur_t;
+#endif
+
+struct ex_io_conn_s {
+  ex_io_t *io;
+  ex_io_connect_cb connect_cb;
+  ex_io_read_cb read_cb;
+  ex_io_close_cb close_cb;
+  void *data;
+  ex_io_conn_t *next_closed;
+
+  union {
+    struct {
+      uv_tcp_t tcp;
+      uv_connect_t connector;
+    } uv;
+    struct {
+      int fd;                       /* -1 once closed */
+      int connecting;
+      int reading;
+      int ready;                    /* On the ready list */
+      ex_io_pending_t out;
+      ex_io_conn_t *next_ready;
+    } ep;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    ex_io_ur_conn_t ur;
+#endif
+  } u;
+};
+
+struct ex_io_timer_s {
+  ex_io_t *io;
+  ex_io_timer_cb cb;
+  void *data;
+
+  union {
+    uv_timer_t uv;
+    struct {
+      uint64_t due;
+      uint64_t repeat;
+      int armed;
+      ex_io_timer_t *next;
+    } list;
+  } u;
+};
+
+struct ex_io_s {
+  const ex_io_ops_t *ops;
+  uint8_t rdbuf[EX_IO_RDBUF_LEN];
+
+  /* Loop state of the backends that run their own loop */
+  int stopping;
+  size_t conns;
+  uint64_t now;
+  ex_io_timer_t *timers;            /* Sorted by due */
+  ex_io_conn_t *closed;
+
+  union {
+    struct {
+      uv_loop_t loop;
+      uv_check_t check;
+    } uv;
+    struct {
+      int epfd;
+      ex_io_conn_t *ready;
+    } ep;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    ex_io_ur_t ur;
+#endif
+  } u;
+
+  /* Per-backend counters, for comparing them */
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t wakeups;
+  uint64_t syscalls;                /* For I/O and polling; not counted on uv */
+};
+
+extern const ex_io_ops_t ex_io_uv_ops;
+extern const ex_io_ops_t ex_io_epoll_ops;
+extern const ex_io_ops_t ex_io_uring_ops;
+
+/* By name ("uv", "epoll", "uring"), or NULL if there is no such backend. */
+const ex_io_ops_t *ex_io_backend(const char *name);
+
+int ex_io_init(ex_io_t *io, const ex_io_ops_t *ops);
+void ex_io_free(ex_io_t *io);
+
+static inline int ex_io_run(ex_io_t *io) { return io->ops->run(io); }
+static inline void ex_io_stop(ex_io_t *io) { io->ops->stop(io); }
+static inline uint64_t ex_io_now(ex_io_t *io) { return io->ops->now(io); }
+
+static inline int
+ex_io_connect(ex_io_t *io, ex_io_conn_t *conn, const struct sockaddr *addr, ex_io_connect_cb cb) {
+  return io->ops->connect(io, conn, addr, cb);
+}
+
+static inline int
+ex_io_read_start(ex_io_conn_t *conn, ex_io_read_cb cb) {
+  return conn->io->ops->read_start(conn, cb);
+}
+
+static inline int
+ex_io_writev(ex_io_conn_t *conn, const struct iovec *iov, int iovcnt) {
+  return conn->io->ops->writev(conn, iov, iovcnt);
+}
+
+static inline void
+ex_io_close(ex_io_conn_t *conn, ex_io_close_cb cb) {
+  conn->io->ops->close(conn, cb);
+}
+
+static inline void
+ex_io_timer_init(ex_io_t *io, ex_io_timer_t *timer) {
+  io->ops->timer_init(io, timer);
+}
+
+static inline int
+ex_io_timer_start(ex_io_timer_t *timer, ex_io_timer_cb cb, uint64_t timeout, uint64_t repeat) {
+  return timer->io->ops->timer_start(timer, cb, timeout, repeat);
+}
+
+static inline void
+ex_io_timer_stop(ex_io_timer_t *timer) {
+  timer->io->ops->timer_stop(timer);
+}
+
+/* Shared by the backends */
+int ex_io_pending_append(ex_io_pending_t *out, const struct iovec *iov, int iovcnt, size_t skip);
+void ex_io_pending_free(ex_io_pending_t *out);
+
+/* Shared by the backends that run their own loop */
+uint64_t ex_io_clock_ms(void);
+void ex_io_list_timer_init(ex_io_t *io, ex_io_timer_t *timer);
+int ex_io_list_timer_start(ex_io_timer_t *timer, ex_io_timer_cb cb, uint64_t timeout, uint64_t repeat);
+void ex_io_list_timer_stop(ex_io_timer_t *timer);
+int ex_io_list_timeout(ex_io_t *io);
+void ex_io_list_run_timers(ex_io_t *io);
+void ex_io_list_closed(ex_io_conn_t *conn, ex_io_close_cb cb);
+void ex_io_list_run_closed(ex_io_t *io);
+
+#endif
@@ -0,0 +1,284 @@
+/* Edge-triggered epoll transport backend.
+ *
+ * Each socket is registered once for EPOLLIN | EPOLLOUT | EPOLLET and only
+ * re-armed when its read starts, so the data path is read(), writev() and
+ * epoll_wait() and nothing else.
+ *
+ * An edge is only reported once, so a socket is read until a short read
+ * (for a stream socket, the receive queue was drained) or until
+ * EX_IO_EPOLL_READS reads. In the latter case it goes on a ready list and
+ * is picked up again next iteration, after the other sockets and timers
+ * had their turn.
+ *
+ * Timers are a sorted list; this is for a handful of them, not one per
+ * connection.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ex_io.h"
+
+#define EX_IO_EPOLL_EVENTS  256
+#define EX_IO_EPOLL_READS   16
+
+static int
+epoll_backend_init(ex_io_t *io) {
+  io->u.ep.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (io->u.ep.epfd < 0)
+    return -errno;
+  io->now = ex_io_clock_ms();
+  return 0;
+}
+
+static void
+epoll_backend_free(ex_io_t *io) {
+  close(io->u.ep.epfd);
+}
+
+static void
+conn_flush(ex_io_conn_t *conn) {
+  ex_io_pending_t *out = &conn->u.ep.out;
+  ssize_t n = 0;
+
+  while (out->off < out->len) {
+    n = write(conn->u.ep.fd, out->data + out->off, out->len - out->off);
+    conn->io->syscalls++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      /* EAGAIN waits for the next edge; errors surface through read */
+      return;
+    }
+    out->off += n;
+  }
+  out->off = out->len = 0;
+}
+
+/* Returns 1 if the socket may still have more to read. */
+static int
+conn_read(ex_io_conn_t *conn) {
+  ex_io_t *io = conn->io;
+  ssize_t n = 0;
+
+  for (int i = 0; i < EX_IO_EPOLL_READS; ++i) {
+    if (!conn->u.ep.reading || conn->u.ep.fd < 0)
+      return 0;
+    n = read(conn->u.ep.fd, io->rdbuf, sizeof(io->rdbuf));
+    io->syscalls++;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      return 0;
+
+    io->reads++;
+    if (n <= 0) {
+      conn->u.ep.reading = 0;
+      conn->read_cb(conn, n == 0 ? UV_EOF : -errno, io->rdbuf);
+      return 0;
+    }
+    conn->read_cb(conn, n, io->rdbuf);
+    if (n < (ssize_t)sizeof(io->rdbuf))
+      return 0;
+  }
+  return conn->u.ep.reading && conn->u.ep.fd >= 0;
+}
+
+static void
+conn_read_more(ex_io_conn_t *conn) {
+  ex_io_t *io = conn->io;
+
+  if (conn_read(conn) && !conn->u.ep.ready) {
+    conn->u.ep.ready = 1;
+    conn->u.ep.next_ready = io->u.ep.ready;
+    io->u.ep.ready = conn;
+  }
+}
+
+/* Sockets that hit the read limit last time round */
+static void
+run_ready(ex_io_t *io) {
+  ex_io_conn_t *conn = io->u.ep.ready;
+  ex_io_conn_t *next = NULL;
+
+  io->u.ep.ready = NULL;
+  for (; conn; conn = next) {
+    next = conn->u.ep.next_ready;
+    conn->u.ep.ready = 0;
+    conn_read_more(conn);
+  }
+}
+
+static void
+conn_event(ex_io_conn_t *conn, uint32_t events) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (conn->u.ep.connecting) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+    conn->u.ep.connecting = 0;
+    if (getsockopt(conn->u.ep.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+      err = errno;
+    conn->connect_cb(conn, -err);
+    return;
+  }
+
+  if ((events & EPOLLOUT) && conn->u.ep.out.len)
+    conn_flush(conn);
+  if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !conn->u.ep.ready)
+    conn_read_more(conn);
+}
+
+static int
+epoll_backend_run(ex_io_t *io) {
+  struct epoll_event events[EX_IO_EPOLL_EVENTS];
+  ex_io_conn_t *conn = NULL;
+  int timeout = 0;
+  int n = 0;
+
+  io->stopping = 0;
+  while (!io->stopping && (io->conns || io->timers)) {
+    timeout = io->closed || io->u.ep.ready ? 0 : ex_io_list_timeout(io);
+    n = epoll_wait(io->u.ep.epfd, events, EX_IO_EPOLL_EVENTS, timeout);
+    if (n < 0 && errno != EINTR)
+      return -errno;
+    io->wakeups++;
+    io->syscalls++;
+    io->now = ex_io_clock_ms();
+
+    run_ready(io);
+    for (int i = 0; i < n; ++i) {
+      conn = events[i].data.ptr;
+      if (conn->u.ep.fd >= 0)
+        conn_event(conn, events[i].events);
+    }
+    ex_io_list_run_timers(io);
+    ex_io_list_run_closed(io);
+  }
+  return 0;
+}
+
+static void
+epoll_backend_stop(ex_io_t *io) {
+  io->stopping = 1;
+}
+
+static uint64_t
+epoll_backend_now(ex_io_t *io) {
+  return io->now;
+}
+
+static int
+epoll_backend_connect(ex_io_t *io, ex_io_conn_t *conn, const struct sockaddr *addr, ex_io_connect_cb cb) {
+  struct epoll_event ev;
+  socklen_t len = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  int one = 1;
+  int fd = -1;
+  int rc = 0;
+
+  conn->io = io;
+  conn->connect_cb = cb;
+  memset(&conn->u.ep, 0, sizeof(conn->u.ep));
+  conn->u.ep.fd = -1;
+
+  fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, addr, len) < 0 && errno != EINPROGRESS) {
+    rc = -errno;
+    close(fd);
+    return rc;
+  }
+
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = conn;
+  if (epoll_ctl(io->u.ep.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    rc = -errno;
+    close(fd);
+    return rc;
+  }
+  conn->u.ep.fd = fd;
+  conn->u.ep.connecting = 1;
+  io->conns++;
+  return 0;
+}
+
+/* Re-arming an edge-triggered fd reports it again if it is readable now,
+ * so bytes that came in before the read started are not lost. */
+static int
+epoll_backend_read_start(ex_io_conn_t *conn, ex_io_read_cb cb) {
+  struct epoll_event ev;
+
+  conn->read_cb = cb;
+  conn->u.ep.reading = 1;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = conn;
+  return epoll_ctl(conn->io->u.ep.epfd, EPOLL_CTL_MOD, conn->u.ep.fd, &ev) < 0 ? -errno : 0;
+}
+
+static int
+epoll_backend_writev(ex_io_conn_t *conn, const struct iovec *iov, int iovcnt) {
+  ssize_t n = 0;
+
+  if (conn->u.ep.fd < 0)
+    return UV_EBADF;
+  conn->io->writes++;
+  if (conn->u.ep.out.len)
+    return ex_io_pending_append(&conn->u.ep.out, iov, iovcnt, 0);
+
+  do {
+    n = writev(conn->u.ep.fd, iov, iovcnt);
+    conn->io->syscalls++;
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && errno != EAGAIN)
+    return -errno;
+  return ex_io_pending_append(&conn->u.ep.out, iov, iovcnt, n > 0 ? n : 0);
+}
+
+static void
+epoll_backend_close(ex_io_conn_t *conn, ex_io_close_cb cb) {
+  ex_io_t *io = conn->io;
+
+  if (conn->u.ep.fd < 0)
+    return;
+  if (conn->u.ep.ready) {
+    for (ex_io_conn_t **pp = &io->u.ep.ready; *pp; pp = &(*pp)->u.ep.next_ready) {
+      if (*pp == conn) {
+        *pp = conn->u.ep.next_ready;
+        break;
+      }
+    }
+    conn->u.ep.ready = 0;
+  }
+  close(conn->u.ep.fd);
+  conn->u.ep.fd = -1;
+  conn->u.ep.reading = 0;
+  ex_io_pending_free(&conn->u.ep.out);
+  ex_io_list_closed(conn, cb);
+}
+
+const ex_io_ops_t ex_io_epoll_ops = {
+  .name = "epoll",
+  .init = epoll_backend_init,
+  .free = epoll_backend_free,
+  .run = epoll_backend_run,
+  .stop = epoll_backend_stop,
+  .now = epoll_backend_now,
+  .connect = epoll_backend_connect,
+  .read_start = epoll_backend_read_start,
+  .writev = epoll_backend_writev,
+  .close = epoll_backend_close,
+  .timer_init = ex_io_list_timer_init,
+  .timer_start = ex_io_list_timer_start,
+  .timer_stop = ex_io_list_timer_stop,
+};
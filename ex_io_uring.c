@@ -0,0 +1,562 @@
+/* io_uring transport backend, on the raw syscalls.
+ *
+ * - Every socket is a registered file, so requests skip the fd lookup.
+ * - Each connection has one multishot recv armed, drawing from a ring of
+ *   kernel-provided buffers: data lands in a buffer the kernel picked, the
+ *   read callback borrows it in place and it goes back on the ring right
+ *   after. A read is a CQE; no syscall, no copy.
+ * - Writes are queued as SQEs and go in with the next io_uring_enter(), so
+ *   a heartbeat round for every room is a single syscall. One send per
+ *   connection is in flight at a time, the rest waits behind it.
+ * - Submitting, waiting and the timer timeout are one io_uring_enter().
+ *
+ * It needs kernel 6.1: a ring set up with IORING_SETUP_DEFER_TASKRUN (6.1)
+ * also has multishot recv, buffer rings and cancel by file (6.0). Older
+ * kernels, or io_uring switched off, fail init with UV_ENOSYS and
+ * ex_io_init() moves on to the fallback, epoll. So does a build against
+ * kernel headers older than that, with everything but init left out.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ex_io.h"
+
+#ifdef IORING_SETUP_DEFER_TASKRUN
+
+#define EX_IO_URING_ENTRIES   1024
+#define EX_IO_URING_CQ        16384
+#define EX_IO_URING_FILES     16384
+#define EX_IO_URING_BUFS      1024      /* Power of two */
+#define EX_IO_URING_BUF_LEN   16384
+#define EX_IO_URING_BGID      0
+
+/* What a CQE is for, in the low bits of user_data */
+enum {
+  UR_CONNECT = 1,
+  UR_RECV,
+  UR_SEND,
+  UR_CANCEL,
+};
+
+#define UR_TAG_MASK   7UL
+
+static int
+ur_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+ur_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int
+ur_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/* Hands the filled-in SQEs to the kernel without waiting. */
+static int
+ur_submit(ex_io_t *io) {
+  int rc = 0;
+
+  while (io->u.ur.sq_pending) {
+    rc = ur_enter(io->u.ur.fd, io->u.ur.sq_pending, 0, 0, NULL, 0);
+    io->syscalls++;
+    if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return -errno;
+    if (rc > 0)
+      io->u.ur.sq_pending -= rc;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe *
+ur_sqe(ex_io_t *io, ex_io_conn_t *conn, int tag) {
+  struct io_uring_sqe *sqe = NULL;
+  uint32_t tail = *io->u.ur.sq_tail;
+
+  if (tail - __atomic_load_n(io->u.ur.sq_head, __ATOMIC_ACQUIRE) > io->u.ur.sq_mask) {
+    if (ur_submit(io) < 0)
+      return NULL;
+  }
+  sqe = &io->u.ur.sqes[tail & io->u.ur.sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uint64_t)(uintptr_t)conn | tag;
+  __atomic_store_n(io->u.ur.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  io->u.ur.sq_pending++;
+  if (conn)
+    conn->u.ur.inflight++;
+  return sqe;
+}
+
+static void
+ur_buf_recycle(ex_io_t *io, uint16_t bid) {
+  struct io_uring_buf *buf = &io->u.ur.bufs->bufs[io->u.ur.buf_tail & (EX_IO_URING_BUFS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(io->u.ur.buf_base + (size_t)bid * EX_IO_URING_BUF_LEN);
+  buf->len = EX_IO_URING_BUF_LEN;
+  buf->bid = bid;
+  __atomic_store_n(&io->u.ur.bufs->tail, ++io->u.ur.buf_tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_backend_free(ex_io_t *io) {
+  struct io_uring_buf_reg reg;
+
+  if (io->u.ur.bufs) {
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = EX_IO_URING_BGID;
+    ur_register(io->u.ur.fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(io->u.ur.bufs, EX_IO_URING_BUFS * sizeof(struct io_uring_buf));
+  }
+  if (io->u.ur.buf_base)
+    munmap(io->u.ur.buf_base, (size_t)EX_IO_URING_BUFS * EX_IO_URING_BUF_LEN);
+  if (io->u.ur.sqes)
+    munmap(io->u.ur.sqes, io->u.ur.sqes_len);
+  if (io->u.ur.ring)
+    munmap(io->u.ur.ring, io->u.ur.ring_len);
+  if (io->u.ur.fd > 0)
+    close(io->u.ur.fd);
+  free(io->u.ur.free_slots);
+  memset(&io->u.ur, 0, sizeof(io->u.ur));
+}
+
+static int
+uring_backend_init(ex_io_t *io) {
+  const uint32_t need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  struct rlimit rl;
+  unsigned nfiles = EX_IO_URING_FILES;
+  uint8_t *ring = NULL;
+  int *files = NULL;
+  int fd = -1;
+  int rc = 0;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = EX_IO_URING_CQ;
+  fd = ur_setup(EX_IO_URING_ENTRIES, &p);
+  if (fd < 0)
+    return errno == EINVAL || errno == EPERM || errno == ENOSYS ? UV_ENOSYS : -errno;
+  io->u.ur.fd = fd;
+  if ((p.features & need) != need) {
+    rc = UV_ENOSYS;
+    goto fail;
+  }
+
+  /* SQ and CQ rings share one mapping */
+  io->u.ur.ring_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > io->u.ur.ring_len)
+    io->u.ur.ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring = mmap(NULL, io->u.ur.ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    rc = -errno;
+    goto fail;
+  }
+  io->u.ur.ring = ring;
+  io->u.ur.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  io->u.ur.sqes = mmap(NULL, io->u.ur.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (io->u.ur.sqes == MAP_FAILED) {
+    io->u.ur.sqes = NULL;
+    rc = -errno;
+    goto fail;
+  }
+  io->u.ur.sq_head = (uint32_t *)(ring + p.sq_off.head);
+  io->u.ur.sq_tail = (uint32_t *)(ring + p.sq_off.tail);
+  io->u.ur.sq_mask = *(uint32_t *)(ring + p.sq_off.ring_mask);
+  io->u.ur.cq_head = (uint32_t *)(ring + p.cq_off.head);
+  io->u.ur.cq_tail = (uint32_t *)(ring + p.cq_off.tail);
+  io->u.ur.cq_mask = *(uint32_t *)(ring + p.cq_off.ring_mask);
+  io->u.ur.cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+  /* SQEs are always used in ring order */
+  for (uint32_t i = 0; i < p.sq_entries; ++i)
+    ((uint32_t *)(ring + p.sq_off.array))[i] = i;
+
+  /* A sparse table of registered files, filled in as sockets connect.
+   * It may not be larger than RLIMIT_NOFILE. */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < nfiles)
+    nfiles = rl.rlim_cur;
+  files = malloc(nfiles * sizeof(int));
+  io->u.ur.free_slots = malloc(nfiles * sizeof(int));
+  if (!files || !io->u.ur.free_slots) {
+    free(files);
+    rc = UV_ENOMEM;
+    goto fail;
+  }
+  for (unsigned i = 0; i < nfiles; ++i) {
+    files[i] = -1;
+    io->u.ur.free_slots[i] = nfiles - 1 - i;
+  }
+  io->u.ur.nfree_slots = nfiles;
+  rc = ur_register(fd, IORING_REGISTER_FILES, files, nfiles);
+  free(files);
+  if (rc < 0) {
+    rc = -errno;
+    goto fail;
+  }
+
+  /* The ring of provided buffers, and the buffers */
+  io->u.ur.bufs = mmap(NULL, EX_IO_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  io->u.ur.buf_base = mmap(NULL, (size_t)EX_IO_URING_BUFS * EX_IO_URING_BUF_LEN, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (io->u.ur.bufs == MAP_FAILED || io->u.ur.buf_base == MAP_FAILED) {
+    if (io->u.ur.bufs == MAP_FAILED)
+      io->u.ur.bufs = NULL;
+    if (io->u.ur.buf_base == MAP_FAILED)
+      io->u.ur.buf_base = NULL;
+    rc = UV_ENOMEM;
+    goto fail;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)io->u.ur.bufs;
+  reg.ring_entries = EX_IO_URING_BUFS;
+  reg.bgid = EX_IO_URING_BGID;
+  if (ur_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(io->u.ur.bufs, EX_IO_URING_BUFS * sizeof(struct io_uring_buf));
+    io->u.ur.bufs = NULL;
+    rc = errno == EINVAL ? UV_ENOSYS : -errno;
+    goto fail;
+  }
+  for (int i = 0; i < EX_IO_URING_BUFS; ++i)
+    ur_buf_recycle(io, i);
+
+  io->now = ex_io_clock_ms();
+  return 0;
+
+fail:
+  uring_backend_free(io);
+  return rc;
+}
+
+static void
+ur_arm_recv(ex_io_conn_t *conn) {
+  struct io_uring_sqe *sqe = ur_sqe(conn->io, conn, UR_RECV);
+
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->u.ur.slot;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = EX_IO_URING_BGID;
+  conn->u.ur.recv_armed = 1;
+}
+
+static void
+ur_send(ex_io_conn_t *conn) {
+  ex_io_pending_t *sending = &conn->u.ur.sending;
+  struct io_uring_sqe *sqe = ur_sqe(conn->io, conn, UR_SEND);
+
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->u.ur.slot;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)(sending->data + sending->off);
+  sqe->len = sending->len - sending->off;
+  sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+static void
+ur_release(ex_io_conn_t *conn) {
+  ex_io_t *io = conn->io;
+  struct io_uring_files_update up;
+  int fd = -1;
+
+  memset(&up, 0, sizeof(up));
+  up.offset = conn->u.ur.slot;
+  up.fds = (uint64_t)(uintptr_t)&fd;
+  ur_register(io->u.ur.fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+  io->u.ur.free_slots[io->u.ur.nfree_slots++] = conn->u.ur.slot;
+  close(conn->u.ur.fd);
+  conn->u.ur.fd = -1;
+}
+
+/* All requests of a closing connection are done: give back its slot. */
+static void
+ur_finish_close(ex_io_conn_t *conn) {
+  ur_release(conn);
+  ex_io_pending_free(&conn->u.ur.out);
+  ex_io_pending_free(&conn->u.ur.sending);
+  ex_io_list_closed(conn, conn->close_cb);
+}
+
+static void
+ur_recv_done(ex_io_conn_t *conn, const struct io_uring_cqe *cqe) {
+  ex_io_t *io = conn->io;
+  uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    conn->u.ur.recv_armed = 0;
+
+  if (cqe->res > 0) {
+    io->reads++;
+    if (conn->u.ur.reading && !conn->u.ur.closing)
+      conn->read_cb(conn, cqe->res, io->u.ur.buf_base + (size_t)bid * EX_IO_URING_BUF_LEN);
+    ur_buf_recycle(io, bid);
+  }
+  else if (cqe->res == -ENOBUFS) {
+    /* Out of buffers for a moment; they are back by now */
+  }
+  else if (!conn->u.ur.closing && conn->u.ur.reading) {
+    conn->u.ur.reading = 0;
+    io->reads++;
+    conn->read_cb(conn, cqe->res == 0 ? UV_EOF : cqe->res, NULL);
+    return;
+  }
+
+  if (!conn->u.ur.recv_armed && conn->u.ur.reading && !conn->u.ur.closing)
+    ur_arm_recv(conn);
+}
+
+static void
+ur_send_done(ex_io_conn_t *conn, int res) {
+  ex_io_pending_t *sending = &conn->u.ur.sending;
+  ex_io_pending_t swap;
+
+  if (conn->u.ur.closing)
+    return;
+  if (res < 0) {
+    /* Errors surface through the recv */
+    sending->off = sending->len = 0;
+    conn->u.ur.out.off = conn->u.ur.out.len = 0;
+    return;
+  }
+  sending->off += res;
+  if (sending->off < sending->len) {
+    ur_send(conn);
+    return;
+  }
+  sending->off = sending->len = 0;
+  if (conn->u.ur.out.len) {
+    swap = *sending;
+    *sending = conn->u.ur.out;
+    conn->u.ur.out = swap;
+    ur_send(conn);
+  }
+}
+
+static void
+ur_cqe(ex_io_t *io, const struct io_uring_cqe *cqe) {
+  ex_io_conn_t *conn = (ex_io_conn_t *)(uintptr_t)(cqe->user_data & ~UR_TAG_MASK);
+  int tag = cqe->user_data & UR_TAG_MASK;
+
+  switch (tag) {
+  case UR_CONNECT:
+    if (!conn->u.ur.closing)
+      conn->connect_cb(conn, cqe->res);
+    break;
+  case UR_RECV:
+    ur_recv_done(conn, cqe);
+    break;
+  case UR_SEND:
+    ur_send_done(conn, cqe->res);
+    break;
+  default:
+    break;
+  }
+
+  /* A multishot recv stays in flight until its last CQE */
+  if (tag != UR_RECV || !(cqe->flags & IORING_CQE_F_MORE)) {
+    if (--conn->u.ur.inflight == 0 && conn->u.ur.closing)
+      ur_finish_close(conn);
+  }
+}
+
+static int
+uring_backend_run(ex_io_t *io) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  int timeout = 0;
+  int rc = 0;
+
+  io->stopping = 0;
+  while (!io->stopping && (io->conns || io->timers)) {
+    timeout = io->closed ? 0 : ex_io_list_timeout(io);
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    /* Submit what the callbacks queued and wait, in one go */
+    rc = ur_enter(io->u.ur.fd, io->u.ur.sq_pending, timeout == 0 ? 0 : 1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    io->syscalls++;
+    if (rc < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+      return -errno;
+    if (rc > 0)
+      io->u.ur.sq_pending -= rc;
+    io->wakeups++;
+    io->now = ex_io_clock_ms();
+
+    head = *io->u.ur.cq_head;
+    tail = __atomic_load_n(io->u.ur.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      ur_cqe(io, &io->u.ur.cqes[head & io->u.ur.cq_mask]);
+      __atomic_store_n(io->u.ur.cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    ex_io_list_run_timers(io);
+    ex_io_list_run_closed(io);
+  }
+  return ur_submit(io);
+}
+
+static void
+uring_backend_stop(ex_io_t *io) {
+  io->stopping = 1;
+}
+
+static uint64_t
+uring_backend_now(ex_io_t *io) {
+  return io->now;
+}
+
+static int
+uring_backend_connect(ex_io_t *io, ex_io_conn_t *conn, const struct sockaddr *addr, ex_io_connect_cb cb) {
+  struct io_uring_files_update up;
+  struct io_uring_sqe *sqe = NULL;
+  socklen_t len = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  int one = 1;
+  int fd = -1;
+  int rc = 0;
+
+  conn->io = io;
+  conn->connect_cb = cb;
+  memset(&conn->u.ur, 0, sizeof(conn->u.ur));
+  conn->u.ur.fd = -1;
+  if (!io->u.ur.nfree_slots)
+    return UV_EMFILE;
+
+  /* Blocking: io_uring does the waiting */
+  fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  conn->u.ur.slot = io->u.ur.free_slots[--io->u.ur.nfree_slots];
+  memset(&up, 0, sizeof(up));
+  up.offset = conn->u.ur.slot;
+  up.fds = (uint64_t)(uintptr_t)&fd;
+  if (ur_register(io->u.ur.fd, IORING_REGISTER_FILES_UPDATE, &up, 1) < 0) {
+    rc = -errno;
+    io->u.ur.free_slots[io->u.ur.nfree_slots++] = conn->u.ur.slot;
+    close(fd);
+    return rc;
+  }
+  conn->u.ur.fd = fd;
+
+  /* The kernel reads the address at submission, which may be later */
+  memcpy(&conn->u.ur.addr, addr, len);
+  sqe = ur_sqe(io, conn, UR_CONNECT);
+  if (!sqe) {
+    ur_release(conn);
+    return UV_EIO;
+  }
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = conn->u.ur.slot;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)&conn->u.ur.addr;
+  sqe->off = len;
+  io->conns++;
+  return 0;
+}
+
+static int
+uring_backend_read_start(ex_io_conn_t *conn, ex_io_read_cb cb) {
+  conn->read_cb = cb;
+  conn->u.ur.reading = 1;
+  if (!conn->u.ur.recv_armed)
+    ur_arm_recv(conn);
+  return conn->u.ur.recv_armed ? 0 : UV_EIO;
+}
+
+static int
+uring_backend_writev(ex_io_conn_t *conn, const struct iovec *iov, int iovcnt) {
+  int rc = 0;
+
+  if (conn->u.ur.closing)
+    return UV_EBADF;
+  conn->io->writes++;
+  if (conn->u.ur.sending.len)
+    return ex_io_pending_append(&conn->u.ur.out, iov, iovcnt, 0);
+  rc = ex_io_pending_append(&conn->u.ur.sending, iov, iovcnt, 0);
+  if (rc == 0 && conn->u.ur.sending.len)
+    ur_send(conn);
+  return rc;
+}
+
+static void
+uring_backend_close(ex_io_conn_t *conn, ex_io_close_cb cb) {
+  struct io_uring_sqe *sqe = NULL;
+
+  if (conn->u.ur.closing)
+    return;
+  conn->u.ur.closing = 1;
+  conn->u.ur.reading = 0;
+  conn->close_cb = cb;
+  if (!conn->u.ur.inflight) {
+    ur_finish_close(conn);
+    return;
+  }
+
+  /* Everything still in flight on the socket; it ends with ECANCELED */
+  sqe = ur_sqe(conn->io, conn, UR_CANCEL);
+  if (!sqe) {
+    shutdown(conn->u.ur.fd, SHUT_RDWR);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = conn->u.ur.slot;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED | IORING_ASYNC_CANCEL_ALL;
+}
+
+const ex_io_ops_t ex_io_uring_ops = {
+  .name = "uring",
+  .fallback = &ex_io_epoll_ops,
+  .init = uring_backend_init,
+  .free = uring_backend_free,
+  .run = uring_backend_run,
+  .stop = uring_backend_stop,
+  .now = uring_backend_now,
+  .connect = uring_backend_connect,
+  .read_start = uring_backend_read_start,
+  .writev = uring_backend_writev,
+  .close = uring_backend_close,
+  .timer_init = ex_io_list_timer_init,
+  .timer_start = ex_io_list_timer_start,
+  .timer_stop = ex_io_list_timer_stop,
+};
+
+#else
+
+static int
+uring_backend_init(ex_io_t *io) {
+  return UV_ENOSYS;
+}
+
+const ex_io_ops_t ex_io_uring_ops = {
+  .name = "uring",
+  .fallback = &ex_io_epoll_ops,
+  .init = uring_backend_init,
+};
+
+#endif
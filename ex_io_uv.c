@@ -0,0 +1,221 @@
+/* libuv transport backend. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ex_io.h"
+
+/* The part of a write the socket would not take right away */
+typedef struct ex_io_uv_write_s {
+  uv_write_t req;
+  uint8_t data[];
+} ex_io_uv_write_t;
+
+/* Counts loop iterations that polled for I/O, like the other backends */
+static void
+uv_backend_check_cb(uv_check_t *handle) {
+  ex_io_t *io = handle->data;
+
+  io->wakeups++;
+}
+
+static int
+uv_backend_init(ex_io_t *io) {
+  int rc = uv_loop_init(&io->u.uv.loop);
+
+  if (rc < 0)
+    return rc;
+  io->u.uv.loop.data = io;
+  uv_check_init(&io->u.uv.loop, &io->u.uv.check);
+  io->u.uv.check.data = io;
+  uv_check_start(&io->u.uv.check, uv_backend_check_cb);
+  uv_unref((uv_handle_t *)&io->u.uv.check);
+  return 0;
+}
+
+static void
+uv_backend_close_walk(uv_handle_t *handle, void *arg) {
+  if (!uv_is_closing(handle))
+    uv_close(handle, NULL);
+}
+
+static void
+uv_backend_free(ex_io_t *io) {
+  uv_walk(&io->u.uv.loop, uv_backend_close_walk, NULL);
+  uv_run(&io->u.uv.loop, UV_RUN_DEFAULT);
+  uv_loop_close(&io->u.uv.loop);
+}
+
+static int
+uv_backend_run(ex_io_t *io) {
+  int rc = uv_run(&io->u.uv.loop, UV_RUN_DEFAULT);
+
+  return rc < 0 ? rc : 0;
+}
+
+static void
+uv_backend_stop(ex_io_t *io) {
+  uv_stop(&io->u.uv.loop);
+}
+
+static uint64_t
+uv_backend_now(ex_io_t *io) {
+  return uv_now(&io->u.uv.loop);
+}
+
+static void
+uv_backend_connect_cb(uv_connect_t *req, int status) {
+  ex_io_conn_t *conn = req->data;
+
+  if (status == 0)
+    uv_tcp_nodelay(&conn->u.uv.tcp, 1);
+  conn->connect_cb(conn, status);
+}
+
+static int
+uv_backend_connect(ex_io_t *io, ex_io_conn_t *conn, const struct sockaddr *addr, ex_io_connect_cb cb) {
+  int rc = 0;
+
+  conn->io = io;
+  conn->connect_cb = cb;
+  rc = uv_tcp_init(&io->u.uv.loop, &conn->u.uv.tcp);
+  if (rc < 0)
+    return rc;
+  conn->u.uv.tcp.data = conn;
+  conn->u.uv.connector.data = conn;
+  rc = uv_tcp_connect(&conn->u.uv.connector, &conn->u.uv.tcp, addr, uv_backend_connect_cb);
+  if (rc < 0)
+    uv_close((uv_handle_t *)&conn->u.uv.tcp, NULL);
+  return rc;
+}
+
+/* Every connection reads into the one buffer; callbacks never overlap. */
+static void
+uv_backend_alloc_cb(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+  ex_io_conn_t *conn = handle->data;
+
+  buf->base = (char *)conn->io->rdbuf;
+  buf->len = sizeof(conn->io->rdbuf);
+}
+
+static void
+uv_backend_read_cb(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf) {
+  ex_io_conn_t *conn = strm->data;
+
+  if (nread == 0)
+    return;
+  conn->io->reads++;
+  if (nread < 0)
+    uv_read_stop(strm);
+  conn->read_cb(conn, nread, (const uint8_t *)buf->base);
+}
+
+static int
+uv_backend_read_start(ex_io_conn_t *conn, ex_io_read_cb cb) {
+  conn->read_cb = cb;
+  return uv_read_start((uv_stream_t *)&conn->u.uv.tcp, uv_backend_alloc_cb, uv_backend_read_cb);
+}
+
+static void
+uv_backend_write_cb(uv_write_t *req, int status) {
+  free(req->data);
+}
+
+static int
+uv_backend_writev(ex_io_conn_t *conn, const struct iovec *iov, int iovcnt) {
+  uv_stream_t *strm = (uv_stream_t *)&conn->u.uv.tcp;
+  ex_io_uv_write_t *w = NULL;
+  uv_buf_t buf;
+  size_t total = 0;
+  size_t skip = 0;
+  size_t len = 0;
+  int n = 0;
+  int rc = 0;
+
+  /* uv_buf_t is laid out like struct iovec on unix */
+  conn->io->writes++;
+  n = uv_try_write(strm, (const uv_buf_t *)iov, iovcnt);
+  if (n < 0 && n != UV_EAGAIN)
+    return n;
+  skip = n > 0 ? n : 0;
+  for (int i = 0; i < iovcnt; ++i)
+    total += iov[i].iov_len;
+  if (skip == total)
+    return 0;
+
+  w = malloc(sizeof(*w) + total - skip);
+  if (!w)
+    return UV_ENOMEM;
+  for (int i = 0; i < iovcnt; ++i) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    memcpy(w->data + len, (const uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+    len += iov[i].iov_len - skip;
+    skip = 0;
+  }
+  w->req.data = w;
+  buf = uv_buf_init((char *)w->data, len);
+
+  rc = uv_write(&w->req, strm, &buf, 1, uv_backend_write_cb);
+  if (rc < 0)
+    free(w);
+  return rc;
+}
+
+static void
+uv_backend_close_cb(uv_handle_t *handle) {
+  ex_io_conn_t *conn = handle->data;
+
+  if (conn->close_cb)
+    conn->close_cb(conn);
+}
+
+static void
+uv_backend_close(ex_io_conn_t *conn, ex_io_close_cb cb) {
+  conn->close_cb = cb;
+  if (!uv_is_closing((uv_handle_t *)&conn->u.uv.tcp))
+    uv_close((uv_handle_t *)&conn->u.uv.tcp, uv_backend_close_cb);
+}
+
+static void
+uv_backend_timer_cb(uv_timer_t *handle) {
+  ex_io_timer_t *timer = handle->data;
+
+  timer->cb(timer);
+}
+
+static void
+uv_backend_timer_init(ex_io_t *io, ex_io_timer_t *timer) {
+  timer->io = io;
+  uv_timer_init(&io->u.uv.loop, &timer->u.uv);
+  timer->u.uv.data = timer;
+}
+
+static int
+uv_backend_timer_start(ex_io_timer_t *timer, ex_io_timer_cb cb, uint64_t timeout, uint64_t repeat) {
+  timer->cb = cb;
+  return uv_timer_start(&timer->u.uv, uv_backend_timer_cb, timeout, repeat);
+}
+
+static void
+uv_backend_timer_stop(ex_io_timer_t *timer) {
+  uv_timer_stop(&timer->u.uv);
+}
+
+const ex_io_ops_t ex_io_uv_ops = {
+  .name = "uv",
+  .init = uv_backend_init,
+  .free = uv_backend_free,
+  .run = uv_backend_run,
+  .stop = uv_backend_stop,
+  .now = uv_backend_now,
+  .connect = uv_backend_connect,
+  .read_start = uv_backend_read_start,
+  .writev = uv_backend_writev,
+  .close = uv_backend_close,
+  .timer_init = uv_backend_timer_init,
+  .timer_start = uv_backend_timer_start,
+  .timer_stop = uv_backend_timer_stop,
+};
@@ -0,0 +1,303 @@
+/* On-demand JSON field extraction. */
+
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_json.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char *
+skip_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+    p++;
+  return p;
+}
+
+/* First '"' or '\' at or after `p`, or `end`. */
+static const char *
+find_quote(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  __m128i v;
+  int mask = 0;
+
+  for (; end - p >= 16; p += 16) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == '"' || *p == '\\')
+      return p;
+  }
+  return end;
+}
+
+/* First '"', '[', ']', '{' or '}' at or after `p`, or `end`. Brackets and
+ * braces differ only in bit 5, so OR-ing it in folds four compares to two. */
+static const char *
+find_structural(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  const __m128i fold = _mm_set1_epi8(0x20);
+  __m128i v, f;
+  int mask = 0;
+
+  for (; end - p >= 16; p += 16) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    f = _mm_or_si128(v, fold);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+        _mm_or_si128(_mm_cmpeq_epi8(f, open), _mm_cmpeq_epi8(f, close))));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == '"' || (*p | 0x20) == '{' || (*p | 0x20) == '}')
+      return p;
+  }
+  return end;
+}
+
+/* `p` is just past the opening quote. Returns just past the closing one. */
+static const char *
+skip_string(const char *p, const char *end) {
+  for (;;) {
+    p = find_quote(p, end);
+    if (p >= end)
+      return NULL;
+    if (*p == '"')
+      return p + 1;
+    p += 2;
+  }
+}
+
+/* `p` is on the opening bracket or brace. */
+static const char *
+skip_container(const char *p, const char *end) {
+  int depth = 0;
+
+  for (;;) {
+    p = find_structural(p, end);
+    if (p >= end)
+      return NULL;
+    switch (*p) {
+    case '"':
+      p = skip_string(p + 1, end);
+      if (!p)
+        return NULL;
+      continue;
+    case '{':
+    case '[':
+      depth++;
+      break;
+    default:
+      if (--depth == 0)
+        return p + 1;
+      break;
+    }
+    p++;
+  }
+}
+
+static const char *
+parse_literal(const char *p, const char *end, const char *word, size_t len) {
+  if ((size_t)(end - p) < len || memcmp(p, word, len) != 0)
+    return NULL;
+  return p + len;
+}
+
+/* Classifies the value at `p` and returns just past it, or NULL. */
+static const char *
+parse_value(const char *p, const char *end, ex_json_val_t *val) {
+  const char *e = NULL;
+
+  if (p >= end)
+    return NULL;
+
+  switch (*p) {
+  case '"':
+    e = skip_string(p + 1, end);
+    val->type = EX_JSON_STRING;
+    val->data = p + 1;
+    val->len = e ? (size_t)(e - p - 2) : 0;
+    return e;
+  case '{':
+  case '[':
+    val->type = *p == '{' ? EX_JSON_OBJECT : EX_JSON_ARRAY;
+    e = skip_container(p, end);
+    break;
+  case 't':
+    val->type = EX_JSON_TRUE;
+    e = parse_literal(p, end, "true", 4);
+    break;
+  case 'f':
+    val->type = EX_JSON_FALSE;
+    e = parse_literal(p, end, "false", 5);
+    break;
+  case 'n':
+    val->type = EX_JSON_NULL;
+    e = parse_literal(p, end, "null", 4);
+    break;
+  default:
+    val->type = EX_JSON_NUMBER;
+    for (e = p; e < end && ((*e >= '0' && *e <= '9') || *e == '-' || *e == '+' ||
+        *e == '.' || *e == 'e' || *e == 'E'); ++e)
+      ;
+    if (e == p)
+      e = NULL;
+    break;
+  }
+  val->data = p;
+  val->len = e ? (size_t)(e - p) : 0;
+  return e;
+}
+
+/* `*pp` is just past '{'. Leaves it on the member's value if found. */
+static int
+find_member(const char **pp, const char *end, const char *key, size_t klen) {
+  ex_json_val_t skipped;
+  const char *p = skip_ws(*pp, end);
+  const char *k = NULL;
+  int match = 0;
+
+  if (p < end && *p == '}')
+    return 0;
+
+  for (;;) {
+    if (p >= end || *p != '"')
+      return UV_EINVAL;
+    k = p + 1;
+    p = skip_string(k, end);
+    if (!p)
+      return UV_EINVAL;
+    match = (size_t)(p - 1 - k) == klen && memcmp(k, key, klen) == 0;
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != ':')
+      return UV_EINVAL;
+    p = skip_ws(p + 1, end);
+    if (match) {
+      *pp = p;
+      return 1;
+    }
+
+    p = parse_value(p, end, &skipped);
+    if (!p)
+      return UV_EINVAL;
+    p = skip_ws(p, end);
+    if (p < end && *p == '}')
+      return 0;
+    if (p >= end || *p != ',')
+      return UV_EINVAL;
+    p = skip_ws(p + 1, end);
+  }
+}
+
+/* `*pp` is just past '['. Leaves it on element `index` if there is one. */
+static int
+find_index(const char **pp, const char *end, size_t index) {
+  ex_json_val_t skipped;
+  const char *p = skip_ws(*pp, end);
+
+  if (p < end && *p == ']')
+    return 0;
+
+  for (size_t i = 0; ; ++i) {
+    if (i == index) {
+      *pp = p;
+      return 1;
+    }
+    p = parse_value(p, end, &skipped);
+    if (!p)
+      return UV_EINVAL;
+    p = skip_ws(p, end);
+    if (p < end && *p == ']')
+      return 0;
+    if (p >= end || *p != ',')
+      return UV_EINVAL;
+    p = skip_ws(p + 1, end);
+  }
+}
+
+int
+ex_json_get(const char *json, size_t len, const char *path, ex_json_val_t *val) {
+  const char *p = json;
+  const char *end = json + len;
+  const char *name = path;
+  size_t name_len = 0;
+  size_t index = 0;
+  int rc = 0;
+
+  memset(val, 0, sizeof(*val));
+  p = skip_ws(p, end);
+
+  while (*name) {
+    name_len = strcspn(name, ".");
+    if (p >= end)
+      return UV_EINVAL;
+
+    if (*p == '{') {
+      p++;
+      rc = find_member(&p, end, name, name_len);
+    }
+    else if (*p == '[') {
+      if (name_len == 0 || strspn(name, "0123456789") < name_len)
+        return 0;
+      index = 0;
+      for (size_t i = 0; i < name_len; ++i)
+        index = index * 10 + (name[i] - '0');
+      p++;
+      rc = find_index(&p, end, index);
+    }
+    else {
+      /* The path goes on into a scalar */
+      return 0;
+    }
+    if (rc <= 0)
+      return rc;
+
+    name += name_len;
+    if (*name == '.')
+      name++;
+  }
+
+  if (!parse_value(p, end, val)) {
+    memset(val, 0, sizeof(*val));
+    return UV_EINVAL;
+  }
+  return 1;
+}
+
+/* Routing key of a command message. Usually the first member, so this
+ * rarely looks past the first few bytes. */
+int
+ex_json_cmd(const char *json, size_t len, ex_json_val_t *cmd) {
+  int rc = ex_json_get(json, len, "cmd", cmd);
+
+  if (rc == 1 && cmd->type != EX_JSON_STRING) {
+    memset(cmd, 0, sizeof(*cmd));
+    return 0;
+  }
+  return rc;
+}
+
+int
+ex_json_extract(const char *json, size_t len, const char *const *paths, size_t n, ex_json_val_t *vals) {
+  int found = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    if (ex_json_get(json, len, paths[i], &vals[i]) == 1)
+      found++;
+  }
+  return found;
+}
@@ -0,0 +1,46 @@
+/* On-demand JSON field extraction.
+ *
+ * Nothing is parsed up front. A lookup walks the text from the top, steps
+ * over every member it does not need without looking inside, and stops at
+ * the first match. Strings and nested containers are skipped 16 bytes at a
+ * time with SSE2, hunting only for the bytes that can change the state
+ * (quotes, backslashes, brackets and braces). Values come back as views
+ * into the caller's buffer; nothing is allocated or copied.
+ *
+ * Paths are dotted member names, with numbers indexing arrays:
+ * "cmd", "data.uname", "info.2.1". Keys are compared raw, so a key written
+ * with escapes does not match. The text is assumed to be well formed;
+ * malformed input makes a lookup fail, never read past `len`.
+ */
+
+#ifndef EX_JSON_H
+#define EX_JSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum ex_json_type {
+  EX_JSON_NONE = 0,     /* Not found */
+  EX_JSON_STRING,
+  EX_JSON_NUMBER,
+  EX_JSON_OBJECT,
+  EX_JSON_ARRAY,
+  EX_JSON_TRUE,
+  EX_JSON_FALSE,
+  EX_JSON_NULL,
+};
+
+typedef struct ex_json_val_s {
+  int type;
+  const char *data;     /* Strings without their quotes, escapes left in */
+  size_t len;
+} ex_json_val_t;
+
+/* Returns 1 if found, 0 if not, or UV_EINVAL on malformed input. */
+int ex_json_get(const char *json, size_t len, const char *path, ex_json_val_t *val);
+int ex_json_cmd(const char *json, size_t len, ex_json_val_t *cmd);
+
+/* Looks up `n` paths into `vals`. Returns how many were found. */
+int ex_json_extract(const char *json, size_t len, const char *const *paths, size_t n, ex_json_val_t *vals);
+
+#endif
@@ -0,0 +1,342 @@
+/* Asynchronous logger for loop threads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/time.h>
+
+#include <uv.h>
+
+#include "ex_log.h"
+
+#define LOG_PAD     0xffff
+#define LOG_ALIGN   16
+#define LOG_OUT_LEN 65536
+
+typedef struct log_rec_s {
+  uint64_t ts_ns;
+  uint32_t len;
+  uint16_t level;
+  uint16_t unused;
+} log_rec_t;
+
+/* Single producer (the owning thread), single consumer (the flusher). */
+typedef struct log_ring_s {
+  struct log_ring_s *next;
+  uint64_t dropped;
+  uint64_t reported;
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  char data[EX_LOG_RING_LEN] __attribute__((aligned(64)));
+} log_ring_t;
+
+typedef struct log_out_s {
+  int fd;
+  size_t len;
+  char buf[LOG_OUT_LEN];
+} log_out_t;
+
+static uv_once_t log_once = UV_ONCE_INIT;
+static uv_mutex_t log_lock;
+static uv_cond_t log_cond;
+static uv_thread_t log_thread;
+static log_ring_t *log_rings;
+static int log_running;
+static int log_stopping;
+static int log_level = EX_LOG_INFO;
+static uint64_t log_gen;
+static uint64_t log_lost;       /* Records that never got a ring */
+static uint64_t log_hr0;
+static uint64_t log_wall0_us;
+static log_out_t log_outs[2];
+
+static __thread log_ring_t *tls_ring;
+static __thread uint64_t tls_gen;
+
+static void
+log_init_once(void) {
+  uv_mutex_init(&log_lock);
+  uv_cond_init(&log_cond);
+}
+
+static void
+out_write(int fd, const char *data, size_t len) {
+  ssize_t n = 0;
+
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    data += n;
+    len -= n;
+  }
+}
+
+static void
+out_flush(log_out_t *out) {
+  out_write(out->fd, out->buf, out->len);
+  out->len = 0;
+}
+
+static void
+out_append(log_out_t *out, const char *data, size_t len) {
+  if (out->len + len > sizeof(out->buf))
+    out_flush(out);
+  if (len > sizeof(out->buf)) {
+    out_write(out->fd, data, len);
+    return;
+  }
+  memcpy(out->buf + out->len, data, len);
+  out->len += len;
+}
+
+/* "12:34:56.789012 I " with the wall time derived from hrtime. */
+static size_t
+log_prefix(char *out, size_t cap, uint64_t ts_ns, int level) {
+  static time_t last_sec = -1;
+  static char last_hms[16];
+  static const char levels[] = "DIWE";
+  uint64_t us = log_wall0_us + (ts_ns - log_hr0) / 1000;
+  time_t sec = us / 1000000;
+  struct tm tm;
+
+  if (sec != last_sec) {
+    localtime_r(&sec, &tm);
+    strftime(last_hms, sizeof(last_hms), "%H:%M:%S", &tm);
+    last_sec = sec;
+  }
+  return snprintf(out, cap, "%s.%06u %c ", last_hms, (unsigned)(us % 1000000), levels[level & 3]);
+}
+
+static void
+ring_drain(log_ring_t *ring) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t dropped = 0;
+  log_rec_t *rec = NULL;
+  log_out_t *out = NULL;
+  char prefix[64];
+  size_t n = 0;
+
+  while (tail < head) {
+    rec = (log_rec_t *)(ring->data + (tail & (EX_LOG_RING_LEN - 1)));
+    tail += sizeof(*rec) + (rec->len + LOG_ALIGN - 1) / LOG_ALIGN * LOG_ALIGN;
+    if (rec->level == LOG_PAD)
+      continue;
+
+    out = &log_outs[rec->level >= EX_LOG_WARN];
+    n = log_prefix(prefix, sizeof(prefix), rec->ts_ns, rec->level);
+    out_append(out, prefix, n);
+    out_append(out, (const char *)(rec + 1), rec->len);
+    out_append(out, "\n", 1);
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+  dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  if (dropped != ring->reported) {
+    n = log_prefix(prefix, sizeof(prefix), uv_hrtime(), EX_LOG_WARN);
+    n += snprintf(prefix + n, sizeof(prefix) - n, "log: dropped %lu records\n",
+        (unsigned long)(dropped - ring->reported));
+    out_append(&log_outs[1], prefix, n);
+    ring->reported = dropped;
+  }
+}
+
+static void
+log_flusher(void *arg) {
+  log_ring_t *ring = NULL;
+  int stopping = 0;
+
+  uv_mutex_lock(&log_lock);
+  for (;;) {
+    stopping = log_stopping;
+    ring = log_rings;
+    uv_mutex_unlock(&log_lock);
+
+    /* Rings are only ever prepended, so the snapshot stays walkable. */
+    for (; ring; ring = ring->next)
+      ring_drain(ring);
+    out_flush(&log_outs[0]);
+    out_flush(&log_outs[1]);
+
+    uv_mutex_lock(&log_lock);
+    if (stopping)
+      break;
+    if (!log_stopping)
+      uv_cond_timedwait(&log_cond, &log_lock, EX_LOG_FLUSH_MS * 1000000ull);
+  }
+  uv_mutex_unlock(&log_lock);
+}
+
+int
+ex_log_start(int out_fd, int err_fd, int level) {
+  struct timeval tv;
+  int rc = 0;
+
+  uv_once(&log_once, log_init_once);
+  if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+    return UV_EALREADY;
+
+  gettimeofday(&tv, NULL);
+  log_hr0 = uv_hrtime();
+  log_wall0_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  log_outs[0].fd = out_fd;
+  log_outs[1].fd = err_fd;
+  log_stopping = 0;
+  ex_log_set_level(level);
+
+  rc = uv_thread_create(&log_thread, log_flusher, NULL);
+  if (rc < 0)
+    return rc;
+  __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Drains every ring and joins the flusher. Threads must be done logging. */
+void
+ex_log_stop(void) {
+  log_ring_t *ring = NULL;
+
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+    return;
+
+  uv_mutex_lock(&log_lock);
+  log_stopping = 1;
+  uv_cond_signal(&log_cond);
+  uv_mutex_unlock(&log_lock);
+  uv_thread_join(&log_thread);
+
+  __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+  uv_mutex_lock(&log_lock);
+  while ((ring = log_rings)) {
+    log_rings = ring->next;
+    free(ring);
+  }
+  log_gen++;
+  uv_mutex_unlock(&log_lock);
+}
+
+void
+ex_log_set_level(int level) {
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int
+ex_log_enabled(int level) {
+  return level >= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+uint64_t
+ex_log_dropped(void) {
+  uint64_t dropped = __atomic_load_n(&log_lost, __ATOMIC_RELAXED);
+  log_ring_t *ring = NULL;
+
+  uv_once(&log_once, log_init_once);
+  uv_mutex_lock(&log_lock);
+  for (ring = log_rings; ring; ring = ring->next)
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  uv_mutex_unlock(&log_lock);
+  return dropped;
+}
+
+static log_ring_t *
+log_ring_get(void) {
+  log_ring_t *ring = tls_ring;
+
+  if (ring && tls_gen == log_gen)
+    return ring;
+
+  ring = aligned_alloc(64, sizeof(*ring));
+  if (!ring)
+    return NULL;
+  memset(ring, 0, offsetof(log_ring_t, data));
+
+  uv_mutex_lock(&log_lock);
+  ring->next = log_rings;
+  log_rings = ring;
+  tls_gen = log_gen;
+  uv_mutex_unlock(&log_lock);
+
+  tls_ring = ring;
+  return ring;
+}
+
+static int
+ring_push(log_ring_t *ring, int level, const char *data, size_t len) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t need = sizeof(log_rec_t) + (len + LOG_ALIGN - 1) / LOG_ALIGN * LOG_ALIGN;
+  size_t off = head & (EX_LOG_RING_LEN - 1);
+  size_t room = EX_LOG_RING_LEN - off;
+  log_rec_t *rec = NULL;
+
+  if (need > EX_LOG_RING_LEN / 2)
+    return UV_E2BIG;
+  if (head - tail + need + (room < need ? room : 0) > EX_LOG_RING_LEN)
+    return UV_ENOBUFS;
+
+  /* Never split a record across the end: pad to the start instead. */
+  if (room < need) {
+    rec = (log_rec_t *)(ring->data + off);
+    rec->len = room - sizeof(*rec);
+    rec->level = LOG_PAD;
+    head += room;
+    off = 0;
+  }
+
+  rec = (log_rec_t *)(ring->data + off);
+  rec->ts_ns = uv_hrtime();
+  rec->len = len;
+  rec->level = level;
+  memcpy(rec + 1, data, len);
+  __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void
+ex_log_write(int level, const char *data, size_t len) {
+  log_ring_t *ring = NULL;
+
+  if (!ex_log_enabled(level))
+    return;
+
+  /* Not started (or already stopped): write through. */
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+    fprintf(level >= EX_LOG_WARN ? stderr : stdout, "%.*s\n", (int)len, data);
+    return;
+  }
+
+  ring = log_ring_get();
+  if (!ring) {
+    __atomic_fetch_add(&log_lost, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (ring_push(ring, level, data, len) < 0)
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+}
+
+void
+ex_log(int level, const char *fmt, ...) {
+  char line[EX_LOG_LINE_MAX];
+  va_list ap;
+  int n = 0;
+
+  if (!ex_log_enabled(level))
+    return;
+
+  va_start(ap, fmt);
+  n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if ((size_t)n >= sizeof(line))
+    n = sizeof(line) - 1;
+  ex_log_write(level, line, n);
+}
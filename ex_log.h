@@ -0,0 +1,39 @@
+/* Asynchronous logger for loop threads.
+ *
+ * Each thread that logs gets its own single-producer ring. Appending a
+ * record is a format into a stack buffer and a memcpy into the ring, with
+ * no locks and no syscalls. One background thread drains every ring,
+ * prefixes timestamps and levels and writes the lines out in batches,
+ * warnings and errors to one fd, everything else to another.
+ *
+ * A full ring never blocks the caller: the record is dropped and counted,
+ * and the flusher reports the count once it catches up.
+ */
+
+#ifndef EX_LOG_H
+#define EX_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EX_LOG_RING_LEN     (1 << 20)   /* Bytes per thread, a power of two */
+#define EX_LOG_LINE_MAX     1024        /* Formatted records are cut here */
+#define EX_LOG_FLUSH_MS     10
+
+enum ex_log_level {
+  EX_LOG_DEBUG = 0,
+  EX_LOG_INFO,
+  EX_LOG_WARN,
+  EX_LOG_ERROR,
+};
+
+int ex_log_start(int out_fd, int err_fd, int level);
+void ex_log_stop(void);
+void ex_log_set_level(int level);
+int ex_log_enabled(int level);
+uint64_t ex_log_dropped(void);
+
+void ex_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void ex_log_write(int level, const char *data, size_t len);
+
+#endif
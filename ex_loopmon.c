@@ -0,0 +1,127 @@
+/* Event loop monitor: iteration timing and a stall watchdog. */
+
+#include <string.h>
+
+#include "ex_loopmon.h"
+
+static void on_prepare(uv_prepare_t *prepare);
+static void on_check(uv_check_t *check);
+static void watchdog_main(void *arg);
+
+int
+ex_loopmon_init(ex_loopmon_t *mon, uv_loop_t *loop, uint64_t threshold_ms, ex_loopmon_stall_cb stall_cb) {
+  int rc = 0;
+
+  memset(mon, 0, sizeof(*mon));
+  mon->loop = loop;
+  mon->threshold_ns = threshold_ms * 1000000;
+  mon->stall_cb = stall_cb;
+  ex_hist_reset(&mon->iteration);
+  ex_hist_reset(&mon->block);
+  ex_hist_reset(&mon->busy);
+
+  rc = uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+  if (rc < 0)
+    return rc;
+
+  /* Neither hook keeps the loop alive */
+  uv_prepare_init(loop, &mon->prepare);
+  uv_check_init(loop, &mon->check);
+  mon->prepare.data = mon->check.data = mon;
+  uv_prepare_start(&mon->prepare, on_prepare);
+  uv_check_start(&mon->check, on_check);
+  uv_unref((uv_handle_t *)&mon->prepare);
+  uv_unref((uv_handle_t *)&mon->check);
+
+  uv_mutex_init(&mon->lock);
+  uv_cond_init(&mon->cond);
+  mon->watching = 1;
+  rc = uv_thread_create(&mon->watchdog, watchdog_main, mon);
+  if (rc < 0)
+    mon->watching = 0;
+  return 0;
+}
+
+void
+ex_loopmon_close(ex_loopmon_t *mon, uv_close_cb close_cb) {
+  if (mon->watching) {
+    uv_mutex_lock(&mon->lock);
+    mon->watching = 0;
+    uv_cond_signal(&mon->cond);
+    uv_mutex_unlock(&mon->lock);
+    uv_thread_join(&mon->watchdog);
+  }
+  uv_cond_destroy(&mon->cond);
+  uv_mutex_destroy(&mon->lock);
+  uv_close((uv_handle_t *)&mon->check, NULL);
+  uv_close((uv_handle_t *)&mon->prepare, close_cb);
+}
+
+void
+ex_loopmon_leave(ex_loopmon_t *mon) {
+  uint64_t ns = uv_hrtime() - mon->entered_ns;
+
+  __atomic_store_n(&mon->entered_ns, 0, __ATOMIC_RELAXED);
+  if (ns > mon->threshold_ns) {
+    mon->stalls++;
+    if (mon->stall_cb)
+      mon->stall_cb(mon, mon->what, ns, 0);
+  }
+}
+
+/* About to poll: what the loop has slept so far */
+static void
+on_prepare(uv_prepare_t *prepare) {
+  ex_loopmon_t *mon = prepare->data;
+
+  mon->idle_ns = uv_metrics_idle_time(mon->loop);
+}
+
+/* Poll is over and its callbacks have run: one iteration, check to check */
+static void
+on_check(uv_check_t *check) {
+  ex_loopmon_t *mon = check->data;
+  uint64_t now = uv_hrtime();
+  uint64_t iteration = now - mon->check_ns;
+  uint64_t block = uv_metrics_idle_time(mon->loop) - mon->idle_ns;
+  uint64_t busy = iteration > block ? iteration - block : 0;
+
+  if (!mon->check_ns) {
+    mon->check_ns = now;
+    return;
+  }
+  mon->check_ns = now;
+  mon->iterations++;
+  ex_hist_record(&mon->iteration, iteration);
+  ex_hist_record(&mon->block, block);
+  ex_hist_record(&mon->busy, busy);
+
+  if (busy > mon->threshold_ns) {
+    mon->slow_iterations++;
+    if (mon->stall_cb)
+      mon->stall_cb(mon, NULL, busy, 0);
+  }
+}
+
+/* Looks in twice per threshold and reports each stuck callback once. */
+static void
+watchdog_main(void *arg) {
+  ex_loopmon_t *mon = arg;
+  uint64_t period = mon->threshold_ns / 2 ? mon->threshold_ns / 2 : 1000000;
+  uint64_t reported = 0;
+  uint64_t entered = 0;
+  uint64_t now = 0;
+
+  uv_mutex_lock(&mon->lock);
+  while (mon->watching) {
+    uv_cond_timedwait(&mon->cond, &mon->lock, period);
+    entered = __atomic_load_n(&mon->entered_ns, __ATOMIC_ACQUIRE);
+    now = uv_hrtime();
+    if (!entered || entered == reported || now - entered <= mon->threshold_ns)
+      continue;
+    reported = entered;
+    if (mon->stall_cb)
+      mon->stall_cb(mon, __atomic_load_n(&mon->what, __ATOMIC_RELAXED), now - entered, 1);
+  }
+  uv_mutex_unlock(&mon->lock);
+}
@@ -0,0 +1,76 @@
+/* Event loop monitor: iteration timing and a stall watchdog.
+ *
+ * A uv_prepare_t and a uv_check_t bracket the poll phase. With
+ * UV_METRICS_IDLE_TIME on, libuv counts the time the loop spends blocked
+ * in the kernel, so every iteration (check to check) splits into the time
+ * it slept and the time it was busy running callbacks. All three go into
+ * histograms, in nanoseconds.
+ *
+ * I/O callbacks run inside the poll phase, so the hooks alone cannot tell
+ * which one was slow. Callbacks worth watching are bracketed with
+ * ex_loopmon_enter() and ex_loopmon_leave(): one that ran past the
+ * threshold is reported when it returns, and a watchdog thread reports one
+ * that is still running past it, i.e. a loop that has hung.
+ */
+
+#ifndef EX_LOOPMON_H
+#define EX_LOOPMON_H
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "ex_hist.h"
+
+typedef struct ex_loopmon_s ex_loopmon_t;
+
+/* `what` is the watched callback, or NULL for a whole iteration. With
+ * `running` set, the callback has not returned yet and this is called on
+ * the watchdog thread; otherwise on the loop thread. */
+typedef void (*ex_loopmon_stall_cb)(ex_loopmon_t *mon, const char *what, uint64_t ns, int running);
+
+struct ex_loopmon_s {
+  uv_loop_t *loop;
+  uv_prepare_t prepare;
+  uv_check_t check;
+  uint64_t threshold_ns;
+  ex_loopmon_stall_cb stall_cb;
+
+  uint64_t check_ns;      /* End of the last iteration */
+  uint64_t idle_ns;       /* uv_metrics_idle_time() at prepare */
+  ex_hist_t iteration;
+  ex_hist_t block;
+  ex_hist_t busy;
+  uint64_t iterations;
+  uint64_t slow_iterations;
+  uint64_t stalls;        /* Watched callbacks past the threshold */
+
+  /* Shared with the watchdog */
+  const char *what;
+  uint64_t entered_ns;    /* 0 outside a watched callback */
+  uv_thread_t watchdog;
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  int watching;
+
+  void *data;
+};
+
+/* Turns on idle time accounting, so call it before the loop first runs. */
+int ex_loopmon_init(ex_loopmon_t *mon, uv_loop_t *loop, uint64_t threshold_ms, ex_loopmon_stall_cb stall_cb);
+void ex_loopmon_close(ex_loopmon_t *mon, uv_close_cb close_cb);
+
+/* Returns uv_hrtime() on entry, for the caller's own stage timings. Watched
+ * callbacks do not nest. */
+static inline uint64_t
+ex_loopmon_enter(ex_loopmon_t *mon, const char *what) {
+  uint64_t now = uv_hrtime();
+
+  __atomic_store_n(&mon->what, what, __ATOMIC_RELAXED);
+  __atomic_store_n(&mon->entered_ns, now, __ATOMIC_RELEASE);
+  return now;
+}
+
+void ex_loopmon_leave(ex_loopmon_t *mon);
+
+#endif
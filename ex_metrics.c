@@ -0,0 +1,309 @@
+/* Metrics registry and its unix socket endpoint. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ex_metrics.h"
+#include "ex_sock.h"
+
+typedef struct ex_metrics_client_s {
+  uv_pipe_t pipe;
+  uv_write_t req;
+  ex_metrics_t *owner;
+  ex_metrics_buf_t out;
+  char in[EX_METRICS_REQ_MAX];
+  size_t in_len;
+} ex_metrics_client_t;
+
+static void on_connection(uv_stream_t *server, int status);
+static void on_client_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+static void on_client_read(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf);
+static void on_client_write(uv_write_t *req, int status);
+static void on_client_close(uv_handle_t *handle);
+
+int
+ex_metrics_init(ex_metrics_t *m, const ex_metric_def_t *defs, int ndefs, ex_metrics_collect_cb collect) {
+  memset(m, 0, sizeof(*m));
+  m->defs = defs;
+  m->ndefs = ndefs;
+  m->collect = collect;
+  return uv_mutex_init(&m->lock);
+}
+
+void
+ex_metrics_free(ex_metrics_t *m) {
+  uv_mutex_destroy(&m->lock);
+}
+
+int
+ex_metrics_set_init(ex_metrics_t *m, ex_metrics_set_t *set) {
+  memset(set, 0, sizeof(*set));
+  /* A cache line of its own, so sets on different threads never share one */
+  set->values = aligned_alloc(64, (m->ndefs * sizeof(uint64_t) + 63) & ~(size_t)63);
+  if (!set->values)
+    return UV_ENOMEM;
+  memset(set->values, 0, m->ndefs * sizeof(uint64_t));
+  set->owner = m;
+
+  uv_mutex_lock(&m->lock);
+  set->next = m->sets;
+  m->sets = set;
+  uv_mutex_unlock(&m->lock);
+  return 0;
+}
+
+void
+ex_metrics_set_free(ex_metrics_set_t *set) {
+  ex_metrics_t *m = set->owner;
+  ex_metrics_set_t **pp = NULL;
+
+  if (!m)
+    return;
+  uv_mutex_lock(&m->lock);
+  for (pp = &m->sets; *pp; pp = &(*pp)->next) {
+    if (*pp == set) {
+      *pp = set->next;
+      break;
+    }
+  }
+  uv_mutex_unlock(&m->lock);
+  free(set->values);
+  memset(set, 0, sizeof(*set));
+}
+
+static void
+walk_cb(uv_handle_t *handle, void *arg) {
+  uint32_t *handles = arg;
+
+  if (!uv_is_closing(handle))
+    handles[uv_handle_get_type(handle)]++;
+}
+
+void
+ex_metrics_walk(ex_metrics_set_t *set, uv_loop_t *loop) {
+  uint32_t handles[UV_HANDLE_TYPE_MAX] = {0};
+
+  uv_walk(loop, walk_cb, handles);
+  for (int i = 0; i < UV_HANDLE_TYPE_MAX; ++i)
+    __atomic_store_n(&set->handles[i], handles[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&set->active, loop->active_handles, __ATOMIC_RELAXED);
+}
+
+int
+ex_metrics_printf(ex_metrics_buf_t *out, const char *fmt, ...) {
+  va_list ap;
+  size_t cap = 0;
+  char *data = NULL;
+  int n = 0;
+
+  for (;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(out->data ? out->data + out->len : NULL, out->cap - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return UV_EINVAL;
+    if (out->len + n < out->cap) {
+      out->len += n;
+      return 0;
+    }
+    for (cap = out->cap ? out->cap : 4096; cap <= out->len + n; cap *= 2)
+      ;
+    data = realloc(out->data, cap);
+    if (!data)
+      return UV_ENOMEM;
+    out->data = data;
+    out->cap = cap;
+  }
+}
+
+void
+ex_metrics_buf_free(ex_metrics_buf_t *out) {
+  free(out->data);
+  memset(out, 0, sizeof(*out));
+}
+
+static int
+write_family(ex_metrics_buf_t *out, const char *name, const char *help, ex_metric_type_t type) {
+  return ex_metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+      type == EX_METRIC_COUNTER ? "counter" : "gauge");
+}
+
+int
+ex_metrics_write(ex_metrics_t *m, ex_metrics_buf_t *out) {
+  const ex_metric_def_t *def = NULL;
+  uint64_t handles[UV_HANDLE_TYPE_MAX] = {0};
+  uint32_t self[UV_HANDLE_TYPE_MAX] = {0};
+  uint64_t active = 0;
+  uint64_t sum = 0;
+  int rc = 0;
+
+  uv_mutex_lock(&m->lock);
+  for (int i = 0; i < m->ndefs && rc == 0; ++i) {
+    def = &m->defs[i];
+    if (i == 0 || strcmp(def->name, m->defs[i - 1].name) != 0)
+      rc = write_family(out, def->name, def->help, def->type);
+
+    /* Gauges may move between sets; the sum wraps back into range */
+    sum = 0;
+    for (ex_metrics_set_t *set = m->sets; set; set = set->next)
+      sum += __atomic_load_n(&set->values[i], __ATOMIC_RELAXED);
+    if (rc == 0 && def->labels)
+      rc = ex_metrics_printf(out, "%s{%s} %lu\n", def->name, def->labels, sum);
+    else if (rc == 0)
+      rc = ex_metrics_printf(out, "%s %lu\n", def->name, sum);
+  }
+
+  for (ex_metrics_set_t *set = m->sets; set; set = set->next) {
+    for (int i = 0; i < UV_HANDLE_TYPE_MAX; ++i)
+      handles[i] += __atomic_load_n(&set->handles[i], __ATOMIC_RELAXED);
+    active += __atomic_load_n(&set->active, __ATOMIC_RELAXED);
+  }
+  uv_mutex_unlock(&m->lock);
+
+  /* Scrapes run on the serving loop, so that one can be walked right now */
+  if (m->loop) {
+    uv_walk(m->loop, walk_cb, self);
+    for (int i = 0; i < UV_HANDLE_TYPE_MAX; ++i)
+      handles[i] += self[i];
+    active += m->loop->active_handles;
+  }
+
+  if (rc == 0)
+    rc = write_family(out, "ex_uv_handles", "Open libuv handles on all loops, by type.", EX_METRIC_GAUGE);
+  for (int i = 1; i < UV_HANDLE_TYPE_MAX && rc == 0; ++i) {
+    if (handles[i])
+      rc = ex_metrics_printf(out, "ex_uv_handles{type=\"%s\"} %lu\n", uv_handle_type_name(i), handles[i]);
+  }
+  if (rc == 0)
+    rc = write_family(out, "ex_uv_handles_active", "Active libuv handles on all loops.", EX_METRIC_GAUGE);
+  if (rc == 0)
+    rc = ex_metrics_printf(out, "ex_uv_handles_active %lu\n", active);
+
+  if (rc == 0 && m->collect)
+    m->collect(m, out);
+  return rc;
+}
+
+int
+ex_metrics_serve(ex_metrics_t *m, uv_loop_t *loop, const char *path) {
+  int rc = 0;
+
+  if (strlen(path) >= sizeof(m->path))
+    return UV_ENAMETOOLONG;
+  m->loop = loop;
+  rc = uv_pipe_init(loop, &m->server, 0);
+  if (rc < 0)
+    return rc;
+  m->server.data = m;
+
+  /* A socket left behind by an earlier run would fail the bind */
+  rc = ex_sock_unlink_stale(path);
+  if (rc == 0)
+    rc = uv_pipe_bind(&m->server, path);
+  if (rc == 0)
+    rc = uv_listen((uv_stream_t *)&m->server, 16, on_connection);
+  if (rc < 0) {
+    uv_close((uv_handle_t *)&m->server, NULL);
+    return rc;
+  }
+  strcpy(m->path, path);
+  m->serving = 1;
+  return 0;
+}
+
+void
+ex_metrics_close(ex_metrics_t *m) {
+  if (!m->serving)
+    return;
+  m->serving = 0;
+  uv_close((uv_handle_t *)&m->server, NULL);
+  unlink(m->path);
+}
+
+static void
+on_connection(uv_stream_t *server, int status) {
+  ex_metrics_t *m = server->data;
+  ex_metrics_client_t *client = NULL;
+
+  if (status < 0)
+    return;
+  client = calloc(1, sizeof(*client));
+  if (!client)
+    return;
+  client->owner = m;
+  uv_pipe_init(m->loop, &client->pipe, 0);
+  client->pipe.data = client;
+  if (uv_accept(server, (uv_stream_t *)&client->pipe) < 0) {
+    uv_close((uv_handle_t *)&client->pipe, on_client_close);
+    return;
+  }
+  uv_read_start((uv_stream_t *)&client->pipe, on_client_alloc, on_client_read);
+}
+
+static void
+on_client_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+  ex_metrics_client_t *client = handle->data;
+
+  buf->base = client->in + client->in_len;
+  buf->len = sizeof(client->in) - client->in_len;
+}
+
+/* Answers an HTTP GET (curl --unix-socket) once its headers are in, or
+ * anything at all once the peer shuts down its side (nc -U). */
+static void
+client_reply(ex_metrics_client_t *client) {
+  static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+  ex_metrics_t *m = client->owner;
+  uv_buf_t buf;
+  int http = client->in_len >= 4 && memcmp(client->in, "GET ", 4) == 0;
+
+  uv_read_stop((uv_stream_t *)&client->pipe);
+  m->scrapes++;
+  if ((http && ex_metrics_printf(&client->out, "%s", header) < 0) || ex_metrics_write(m, &client->out) < 0) {
+    uv_close((uv_handle_t *)&client->pipe, on_client_close);
+    return;
+  }
+  buf = uv_buf_init(client->out.data, client->out.len);
+  client->req.data = client;
+  if (uv_write(&client->req, (uv_stream_t *)&client->pipe, &buf, 1, on_client_write) < 0)
+    uv_close((uv_handle_t *)&client->pipe, on_client_close);
+}
+
+static void
+on_client_read(uv_stream_t *strm, ssize_t nread, const uv_buf_t *buf) {
+  ex_metrics_client_t *client = strm->data;
+
+  if (nread == UV_EOF) {
+    client_reply(client);
+    return;
+  }
+  if (nread < 0) {
+    uv_close((uv_handle_t *)strm, on_client_close);
+    return;
+  }
+  client->in_len += nread;
+  if (memmem(client->in, client->in_len, "\r\n\r\n", 4) || memmem(client->in, client->in_len, "\n\n", 2))
+    client_reply(client);
+  else if (client->in_len == sizeof(client->in))
+    uv_close((uv_handle_t *)strm, on_client_close);
+}
+
+static void
+on_client_write(uv_write_t *req, int status) {
+  ex_metrics_client_t *client = req->data;
+
+  uv_close((uv_handle_t *)&client->pipe, on_client_close);
+}
+
+static void
+on_client_close(uv_handle_t *handle) {
+  ex_metrics_client_t *client = handle->data;
+
+  ex_metrics_buf_free(&client->out);
+  free(client);
+}
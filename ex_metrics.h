@@ -0,0 +1,113 @@
+/* Metrics registry with a Prometheus text endpoint on a unix socket.
+ *
+ * Metrics are declared once, as a table of ex_metric_def_t. Each thread
+ * that records them owns an ex_metrics_set_t, an array of values only that
+ * thread writes: ex_metrics_add() is a plain load and store, no lock and no
+ * atomic read-modify-write. A scrape sums every set per metric, so the
+ * totals are merged on read, off the hot path.
+ *
+ * Sets also carry a summary of their loop's handles, taken on the loop's
+ * own thread with ex_metrics_walk() since uv_walk() is not thread-safe.
+ *
+ * The registry lock only guards the list of sets: taken to add or remove
+ * one and for the length of a scrape, never when recording.
+ */
+
+#ifndef EX_METRICS_H
+#define EX_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#define EX_METRICS_REQ_MAX  4096
+
+typedef enum {
+  EX_METRIC_COUNTER = 0,
+  EX_METRIC_GAUGE,
+} ex_metric_type_t;
+
+/* Consecutive defs with the same name share a family and differ in
+ * `labels`, e.g. "type=\"tcp\"". */
+typedef struct ex_metric_def_s {
+  const char *name;
+  const char *labels;
+  ex_metric_type_t type;
+  const char *help;
+} ex_metric_def_t;
+
+typedef struct ex_metrics_s ex_metrics_t;
+typedef struct ex_metrics_set_s ex_metrics_set_t;
+
+/* Growable text buffer for the exposition */
+typedef struct ex_metrics_buf_s {
+  char *data;
+  size_t len;
+  size_t cap;
+} ex_metrics_buf_t;
+
+/* Adds lines of its own to a scrape, on the server's loop. */
+typedef void (*ex_metrics_collect_cb)(ex_metrics_t *m, ex_metrics_buf_t *out);
+
+struct ex_metrics_set_s {
+  ex_metrics_t *owner;
+  ex_metrics_set_t *next;
+  uint64_t *values;
+  uint32_t handles[UV_HANDLE_TYPE_MAX];
+  uint32_t active;
+};
+
+struct ex_metrics_s {
+  const ex_metric_def_t *defs;
+  int ndefs;
+  ex_metrics_collect_cb collect;
+
+  uv_mutex_t lock;
+  ex_metrics_set_t *sets;
+
+  uv_loop_t *loop;
+  uv_pipe_t server;
+  int serving;
+  char path[108];
+  uint64_t scrapes;
+
+  void *data;
+};
+
+int ex_metrics_init(ex_metrics_t *m, const ex_metric_def_t *defs, int ndefs, ex_metrics_collect_cb collect);
+void ex_metrics_free(ex_metrics_t *m);
+
+/* Serves the metrics at `path` from `loop`, replacing a stale socket;
+ * UV_EADDRINUSE if anything else is there. */
+int ex_metrics_serve(ex_metrics_t *m, uv_loop_t *loop, const char *path);
+void ex_metrics_close(ex_metrics_t *m);
+
+int ex_metrics_set_init(ex_metrics_t *m, ex_metrics_set_t *set);
+void ex_metrics_set_free(ex_metrics_set_t *set);
+
+/* On the set's own loop thread */
+void ex_metrics_walk(ex_metrics_set_t *set, uv_loop_t *loop);
+
+/* The whole exposition, as one scrape sees it */
+int ex_metrics_write(ex_metrics_t *m, ex_metrics_buf_t *out);
+int ex_metrics_printf(ex_metrics_buf_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void ex_metrics_buf_free(ex_metrics_buf_t *out);
+
+/* Single writer: the set's owner thread. Scrapes read concurrently. */
+static inline void
+ex_metrics_add(ex_metrics_set_t *set, int id, uint64_t n) {
+  __atomic_store_n(&set->values[id], __atomic_load_n(&set->values[id], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void
+ex_metrics_sub(ex_metrics_set_t *set, int id, uint64_t n) {
+  __atomic_store_n(&set->values[id], __atomic_load_n(&set->values[id], __ATOMIC_RELAXED) - n, __ATOMIC_RELAXED);
+}
+
+static inline void
+ex_metrics_gauge(ex_metrics_set_t *set, int id, uint64_t v) {
+  __atomic_store_n(&set->values[id], v, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,147 @@
+/* Frames for the mock live server. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_frame.h"
+#include "ex_mock.h"
+
+static void
+store_header(uint8_t *p, uint32_t packet_len, uint16_t ver, uint32_t op, uint32_t seq) {
+  p[0] = packet_len >> 24; p[1] = packet_len >> 16; p[2] = packet_len >> 8; p[3] = packet_len;
+  p[4] = 0; p[5] = EX_FRAME_HDR_LEN;
+  p[6] = ver >> 8; p[7] = ver;
+  p[8] = op >> 24; p[9] = op >> 16; p[10] = op >> 8; p[11] = op;
+  p[12] = seq >> 24; p[13] = seq >> 16; p[14] = seq >> 8; p[15] = seq;
+}
+
+int
+ex_mock_buf_reserve(ex_mock_buf_t *buf, size_t len) {
+  size_t cap = buf->cap ? buf->cap : 4096;
+  uint8_t *data = NULL;
+
+  if (buf->len + len <= buf->cap)
+    return 0;
+  while (cap < buf->len + len)
+    cap *= 2;
+  data = realloc(buf->data, cap);
+  if (!data)
+    return UV_ENOMEM;
+  buf->data = data;
+  buf->cap = cap;
+  return 0;
+}
+
+void
+ex_mock_buf_free(ex_mock_buf_t *buf) {
+  free(buf->data);
+  memset(buf, 0, sizeof(*buf));
+}
+
+int
+ex_mock_init(ex_mock_t *mock, uint32_t size, uint32_t batch) {
+  memset(mock, 0, sizeof(*mock));
+  mock->size = size < EX_MOCK_MSG_MIN ? EX_MOCK_MSG_MIN : size;
+  mock->batch = batch;
+  if (!batch)
+    return 0;
+
+  if (deflateInit(&mock->zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+    return UV_ENOMEM;
+  mock->zs_on = 1;
+  return 0;
+}
+
+void
+ex_mock_free(ex_mock_t *mock) {
+  if (mock->zs_on)
+    deflateEnd(&mock->zs);
+  ex_mock_buf_free(&mock->raw);
+  mock->zs_on = 0;
+}
+
+int
+ex_mock_reply(ex_mock_buf_t *out, uint32_t op, const void *body, size_t len) {
+  int rc = ex_mock_buf_reserve(out, EX_FRAME_HDR_LEN + len);
+
+  if (rc < 0)
+    return rc;
+  store_header(out->data + out->len, EX_FRAME_HDR_LEN + len, EX_VER_INT, op, 1);
+  memcpy(out->data + out->len + EX_FRAME_HDR_LEN, body, len);
+  out->len += EX_FRAME_HDR_LEN + len;
+  return 0;
+}
+
+static int
+put_message(ex_mock_t *mock, ex_mock_buf_t *out, uint64_t ts_ns) {
+  size_t packet_len = EX_FRAME_HDR_LEN + mock->size;
+  uint8_t *p = NULL;
+  int n = 0;
+  int rc = ex_mock_buf_reserve(out, packet_len + 1);
+
+  if (rc < 0)
+    return rc;
+  p = out->data + out->len;
+  store_header(p, packet_len, EX_VER_JSON, EX_OP_MESSAGE, 0);
+
+  /* Pad to the exact size, closing quote and brace last. */
+  n = snprintf((char*)p + EX_FRAME_HDR_LEN, mock->size + 1,
+      "{\"cmd\":\"BENCH\",\"seq\":%u,\"ts\":%lu,\"pad\":\"", mock->seq++, (unsigned long)ts_ns);
+  memset(p + EX_FRAME_HDR_LEN + n, 'x', mock->size - n - 2);
+  memcpy(p + packet_len - 2, "\"}", 2);
+  out->len += packet_len;
+  return 0;
+}
+
+static int
+put_batch(ex_mock_t *mock, ex_mock_buf_t *out, uint32_t count, uint64_t ts_ns) {
+  uLong bound = 0;
+  uint8_t *p = NULL;
+  int rc = 0;
+
+  mock->raw.len = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    rc = put_message(mock, &mock->raw, ts_ns);
+    if (rc < 0)
+      return rc;
+  }
+
+  bound = deflateBound(&mock->zs, mock->raw.len);
+  rc = ex_mock_buf_reserve(out, EX_FRAME_HDR_LEN + bound);
+  if (rc < 0)
+    return rc;
+  p = out->data + out->len;
+
+  deflateReset(&mock->zs);
+  mock->zs.next_in = mock->raw.data;
+  mock->zs.avail_in = mock->raw.len;
+  mock->zs.next_out = p + EX_FRAME_HDR_LEN;
+  mock->zs.avail_out = bound;
+  if (deflate(&mock->zs, Z_FINISH) != Z_STREAM_END)
+    return UV_EIO;
+
+  store_header(p, EX_FRAME_HDR_LEN + mock->zs.total_out, EX_VER_ZLIB, EX_OP_MESSAGE, 0);
+  out->len += EX_FRAME_HDR_LEN + mock->zs.total_out;
+  return 0;
+}
+
+int
+ex_mock_messages(ex_mock_t *mock, ex_mock_buf_t *out, uint32_t count, uint64_t ts_ns) {
+  uint32_t n = 0;
+  int rc = 0;
+
+  while (count > 0 && rc == 0) {
+    if (!mock->batch) {
+      rc = put_message(mock, out, ts_ns);
+      count--;
+      continue;
+    }
+    n = count < mock->batch ? count : mock->batch;
+    rc = put_batch(mock, out, n, ts_ns);
+    count -= n;
+  }
+  return rc;
+}
@@ -0,0 +1,50 @@
+/* Frames for the mock live server.
+ *
+ * Builds what broadcastlv would send: auth and heartbeat replies, and op=5
+ * command messages, either one per frame or batched into a protover-2
+ * zlib frame. Every message carries its sequence number and the
+ * uv_hrtime() it was built at, so a client on the same host can measure
+ * latency from the body alone:
+ *
+ *   {"cmd":"BENCH","seq":12,"ts":1234567890,"pad":"xxxx..."}
+ *
+ * Frames are appended to a growable byte buffer owned by the caller.
+ */
+
+#ifndef EX_MOCK_H
+#define EX_MOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#define EX_MOCK_PORT        22430
+#define EX_MOCK_MSG_MIN     80        /* Room for the JSON around the padding */
+
+typedef struct ex_mock_buf_s {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+} ex_mock_buf_t;
+
+typedef struct ex_mock_s {
+  uint32_t size;          /* Message body length */
+  uint32_t batch;         /* Messages per zlib frame, 0 for plain frames */
+  uint32_t seq;
+  z_stream zs;
+  int zs_on;
+  ex_mock_buf_t raw;      /* A batch before compression */
+} ex_mock_t;
+
+int ex_mock_init(ex_mock_t *mock, uint32_t size, uint32_t batch);
+void ex_mock_free(ex_mock_t *mock);
+
+/* Append `count` messages, batched as configured. */
+int ex_mock_messages(ex_mock_t *mock, ex_mock_buf_t *out, uint32_t count, uint64_t ts_ns);
+int ex_mock_reply(ex_mock_buf_t *out, uint32_t op, const void *body, size_t len);
+
+int ex_mock_buf_reserve(ex_mock_buf_t *buf, size_t len);
+void ex_mock_buf_free(ex_mock_buf_t *buf);
+
+#endif
@@ -0,0 +1,174 @@
+/* Per-connection outbound queue with write coalescing. */
+
+#include <string.h>
+
+#include "ex_outq.h"
+
+static void on_outq_prepare(uv_prepare_t *prepare);
+static void on_outq_write(uv_write_t *req, int status);
+
+static void
+outq_unlink(ex_outq_t *q) {
+  if (!q->pprev)
+    return;
+  *q->pprev = q->next;
+  if (q->next)
+    q->next->pprev = q->pprev;
+  q->next = NULL;
+  q->pprev = NULL;
+}
+
+static void
+outq_mark(ex_outq_t *q) {
+  ex_outq_loop_t *owner = q->owner;
+
+  if (q->pprev)
+    return;
+  q->next = owner->dirty;
+  if (q->next)
+    q->next->pprev = &q->next;
+  q->pprev = &owner->dirty;
+  owner->dirty = q;
+  uv_prepare_start(&owner->prepare, on_outq_prepare);
+}
+
+int
+ex_outq_loop_init(ex_outq_loop_t *owner, uv_loop_t *loop) {
+  int rc = 0;
+
+  memset(owner, 0, sizeof(*owner));
+  owner->loop = loop;
+  rc = uv_prepare_init(loop, &owner->prepare);
+  if (rc < 0)
+    return rc;
+  owner->prepare.data = owner;
+  return 0;
+}
+
+/* Every queue must have been reset first. */
+void
+ex_outq_loop_close(ex_outq_loop_t *owner, uv_close_cb close_cb) {
+  owner->dirty = NULL;
+  uv_close((uv_handle_t *)&owner->prepare, close_cb);
+}
+
+void
+ex_outq_init(ex_outq_t *q, ex_outq_loop_t *owner, ex_outq_error_cb error_cb, void *data) {
+  memset(q, 0, sizeof(*q));
+  q->owner = owner;
+  q->error_cb = error_cb;
+  q->req.data = q;
+  q->data = data;
+}
+
+void
+ex_outq_attach(ex_outq_t *q, uv_stream_t *stream) {
+  q->stream = stream;
+}
+
+/* Drops whatever has not been handed to the socket yet. A write already in
+ * flight is cancelled when the stream closes. */
+void
+ex_outq_reset(ex_outq_t *q) {
+  outq_unlink(q);
+  q->nbufs = 0;
+  q->bytes = 0;
+  q->stream = NULL;
+}
+
+int
+ex_outq_write(ex_outq_t *q, const void *data, size_t len) {
+  int rc = 0;
+
+  if (!q->stream)
+    return UV_ENOTCONN;
+  if (len == 0)
+    return 0;
+
+  if (q->nbufs == EX_OUTQ_BUFS) {
+    if (q->writing)
+      return UV_ENOBUFS;
+    rc = ex_outq_flush(q);
+    if (rc < 0)
+      return rc;
+  }
+
+  q->bufs[q->nbufs++] = uv_buf_init((char *)data, len);
+  q->bytes += len;
+  q->owner->packets++;
+  outq_mark(q);
+  return 0;
+}
+
+/* Sends everything queued now: one try_write, then a uv_write() for the rest. */
+int
+ex_outq_flush(ex_outq_t *q) {
+  ex_outq_loop_t *owner = q->owner;
+  size_t skip = 0;
+  int first = 0;
+  int n = 0, rc = 0;
+
+  outq_unlink(q);
+  if (q->writing || q->nbufs == 0 || !q->stream)
+    return 0;
+
+  owner->flushes++;
+  owner->try_writes++;
+  n = uv_try_write(q->stream, q->bufs, q->nbufs);
+  if (n == UV_EAGAIN)
+    n = 0;
+  if (n < 0) {
+    q->nbufs = 0;
+    q->bytes = 0;
+    return n;
+  }
+
+  if ((size_t)n < q->bytes) {
+    skip = n;
+    while (skip >= q->bufs[first].len)
+      skip -= q->bufs[first++].len;
+    q->bufs[first].base += skip;
+    q->bufs[first].len -= skip;
+
+    owner->fallbacks++;
+    rc = uv_write(&q->req, q->stream, q->bufs + first, q->nbufs - first, on_outq_write);
+    if (rc == 0)
+      q->writing = 1;
+  }
+
+  q->nbufs = 0;
+  q->bytes = 0;
+  return rc;
+}
+
+static void
+on_outq_prepare(uv_prepare_t *prepare) {
+  ex_outq_loop_t *owner = prepare->data;
+  ex_outq_t *q = NULL;
+  int rc = 0;
+
+  while ((q = owner->dirty)) {
+    rc = ex_outq_flush(q);
+    if (rc < 0 && q->error_cb)
+      q->error_cb(q, rc);
+  }
+  uv_prepare_stop(prepare);
+}
+
+static void
+on_outq_write(uv_write_t *req, int status) {
+  ex_outq_t *q = req->data;
+  int rc = 0;
+
+  q->writing = 0;
+  if (status < 0) {
+    if (status != UV_ECANCELED && q->error_cb)
+      q->error_cb(q, status);
+    return;
+  }
+
+  /* Whatever queued up meanwhile goes out now. */
+  rc = ex_outq_flush(q);
+  if (rc < 0 && q->error_cb)
+    q->error_cb(q, rc);
+}
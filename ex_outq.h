@@ -0,0 +1,65 @@
+/* Per-connection outbound queue with write coalescing.
+ *
+ * Packets queued during a loop iteration are gathered and flushed together
+ * from a uv_prepare_t, i.e. right before the loop would block, as one
+ * vectored uv_try_write(). Only the bytes the socket would not take go out
+ * through a uv_write(), and the queue holds at most one of those in flight.
+ *
+ * Queued bytes are referenced, not copied: they must stay valid until the
+ * write that carries them completes (static packets are the common case).
+ */
+
+#ifndef EX_OUTQ_H
+#define EX_OUTQ_H
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#define EX_OUTQ_BUFS  16
+
+typedef struct ex_outq_s ex_outq_t;
+
+/* Write failures other than cancellation; the caller should close. */
+typedef void (*ex_outq_error_cb)(ex_outq_t *q, int status);
+
+/* Shared by every queue on a loop */
+typedef struct ex_outq_loop_s {
+  uv_loop_t *loop;
+  uv_prepare_t prepare;
+  ex_outq_t *dirty;
+
+  uint64_t packets;
+  uint64_t flushes;
+  uint64_t try_writes;
+  uint64_t fallbacks;   /* Flushes that needed a uv_write() */
+} ex_outq_loop_t;
+
+struct ex_outq_s {
+  ex_outq_loop_t *owner;
+  uv_stream_t *stream;
+  ex_outq_error_cb error_cb;
+
+  ex_outq_t *next;      /* Dirty list */
+  ex_outq_t **pprev;
+
+  uv_buf_t bufs[EX_OUTQ_BUFS];
+  int nbufs;
+  size_t bytes;
+
+  uv_write_t req;
+  int writing;
+
+  void *data;
+};
+
+int ex_outq_loop_init(ex_outq_loop_t *owner, uv_loop_t *loop);
+void ex_outq_loop_close(ex_outq_loop_t *owner, uv_close_cb close_cb);
+
+void ex_outq_init(ex_outq_t *q, ex_outq_loop_t *owner, ex_outq_error_cb error_cb, void *data);
+void ex_outq_attach(ex_outq_t *q, uv_stream_t *stream);
+int ex_outq_write(ex_outq_t *q, const void *data, size_t len);
+int ex_outq_flush(ex_outq_t *q);
+void ex_outq_reset(ex_outq_t *q);
+
+#endif
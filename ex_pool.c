@@ -0,0 +1,118 @@
+/* Fixed-size object pools with a free list, one per loop. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <uv.h>
+
+#include "ex_pool.h"
+
+/* Sits in front of every slot: the owning pool while in use, the next free
+ * slot while on the free list. Padded so the object keeps malloc alignment. */
+typedef union ex_pool_slot_u {
+  ex_pool_t *pool;
+  union ex_pool_slot_u *next;
+  max_align_t align;
+} ex_pool_slot_t;
+
+struct ex_pool_chunk_s {
+  ex_pool_chunk_t *next;
+  max_align_t slots[];
+};
+
+int
+ex_pool_init(ex_pool_t *pool, size_t size, size_t per_chunk) {
+  size_t align = sizeof(max_align_t);
+
+  if (!pool || size == 0)
+    return UV_EINVAL;
+
+  memset(pool, 0, sizeof(*pool));
+  pool->size = sizeof(ex_pool_slot_t) + (size + align - 1) / align * align;
+  pool->per_chunk = per_chunk ? per_chunk : EX_POOL_PER_CHUNK;
+  return 0;
+}
+
+static int
+pool_grow(ex_pool_t *pool) {
+  ex_pool_chunk_t *chunk = NULL;
+  ex_pool_slot_t *slot = NULL;
+  char *base = NULL;
+
+  chunk = malloc(sizeof(*chunk) + pool->size * pool->per_chunk);
+  if (!chunk)
+    return UV_ENOMEM;
+  chunk->next = pool->chunks;
+  pool->chunks = chunk;
+  pool->chunk_allocs++;
+  pool->capacity += pool->per_chunk;
+
+  base = (char *)chunk->slots;
+  for (size_t i = pool->per_chunk; i-- > 0;) {
+    slot = (ex_pool_slot_t *)(base + i * pool->size);
+    slot->next = pool->free;
+    pool->free = slot;
+  }
+  return 0;
+}
+
+/* Grows the pool up front so the first `count` gets never allocate. */
+int
+ex_pool_reserve(ex_pool_t *pool, size_t count) {
+  int rc = 0;
+
+  while (pool->capacity < count) {
+    rc = pool_grow(pool);
+    if (rc < 0)
+      return rc;
+  }
+  return 0;
+}
+
+/* Releases every chunk, including objects still handed out. */
+void
+ex_pool_free(ex_pool_t *pool) {
+  ex_pool_chunk_t *chunk = NULL;
+
+  if (!pool)
+    return;
+  while ((chunk = pool->chunks)) {
+    pool->chunks = chunk->next;
+    free(chunk);
+  }
+  pool->free = NULL;
+  pool->capacity = 0;
+  pool->used = 0;
+}
+
+void *
+ex_pool_get(ex_pool_t *pool) {
+  ex_pool_slot_t *slot = NULL;
+
+  if (!pool->free && pool_grow(pool) < 0)
+    return NULL;
+
+  slot = pool->free;
+  pool->free = slot->next;
+  slot->pool = pool;
+
+  pool->gets++;
+  if (++pool->used > pool->peak)
+    pool->peak = pool->used;
+  return slot + 1;
+}
+
+void
+ex_pool_put(void *obj) {
+  ex_pool_slot_t *slot = NULL;
+  ex_pool_t *pool = NULL;
+
+  if (!obj)
+    return;
+  slot = (ex_pool_slot_t *)obj - 1;
+  pool = slot->pool;
+  slot->next = pool->free;
+  pool->free = slot;
+  pool->used--;
+}
@@ -0,0 +1,41 @@
+/* Fixed-size object pools with a free list, one per loop.
+ *
+ * Objects are carved out of chunks of `per_chunk` slots and never returned
+ * to the allocator until the pool is freed, so a steady-state get/put pair
+ * costs two pointer swaps. Every slot remembers its pool, so an object can
+ * be released without knowing where it came from (e.g. from a close_cb).
+ *
+ * Pools are not thread-safe; use them from the loop that owns them.
+ */
+
+#ifndef EX_POOL_H
+#define EX_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EX_POOL_PER_CHUNK   64
+
+typedef struct ex_pool_s ex_pool_t;
+typedef struct ex_pool_chunk_s ex_pool_chunk_t;
+
+struct ex_pool_s {
+  size_t size;          /* Slot size, header included */
+  size_t per_chunk;
+  void *free;
+  ex_pool_chunk_t *chunks;
+
+  uint64_t gets;
+  uint64_t chunk_allocs;
+  size_t used;
+  size_t peak;
+  size_t capacity;
+};
+
+int ex_pool_init(ex_pool_t *pool, size_t size, size_t per_chunk);
+int ex_pool_reserve(ex_pool_t *pool, size_t count);
+void ex_pool_free(ex_pool_t *pool);
+void *ex_pool_get(ex_pool_t *pool);
+void ex_pool_put(void *obj);
+
+#endif
@@ -0,0 +1,595 @@
+/* Segmented frame recorder, written through mmap, and its reader. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <uv.h>
+
+#include "ex_rec.h"
+
+/* The first free number from *seg_no on, allocated and mapped, and stamped
+ * but not started. Touches nothing else, so it can run off the loop. */
+static int
+seg_create(const char *dir, size_t seg_len, uint32_t *seg_no, int *fdp, uint8_t **basep) {
+  char path[EX_REC_PATH_MAX + 32];
+  ex_rec_seg_t *seg = NULL;
+  void *base = NULL;
+  int fd = -1;
+  int rc = 0;
+
+  for (;;) {
+    snprintf(path, sizeof(path), "%s/%08u.exrec", dir, *seg_no);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0)
+      break;
+    if (errno != EEXIST || *seg_no == UINT32_MAX)
+      return uv_translate_sys_error(errno);
+    (*seg_no)++;
+  }
+
+  /* Blocks up front: a full disk fails here, not as SIGBUS on a store */
+  rc = posix_fallocate(fd, 0, seg_len);
+  if (rc == 0) {
+    base = mmap(NULL, seg_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+      rc = errno;
+  }
+  if (rc != 0) {
+    close(fd);
+    unlink(path);
+    return uv_translate_sys_error(rc);
+  }
+
+  /* Reads back as an empty segment until started */
+  seg = base;
+  memcpy(seg->magic, EX_REC_MAGIC, sizeof(seg->magic));
+  seg->seg_no = *seg_no;
+  seg->seg_len = seg_len;
+  *fdp = fd;
+  *basep = base;
+  return 0;
+}
+
+static void
+seg_start(ex_rec_t *rec, int fd, uint8_t *base, uint32_t seg_no) {
+  ex_rec_seg_t *seg = (ex_rec_seg_t *)base;
+  struct timespec wall;
+
+  clock_gettime(CLOCK_REALTIME, &wall);
+  seg->start_wall_ns = (uint64_t)wall.tv_sec * 1000000000 + wall.tv_nsec;
+  __atomic_store_n(&seg->start_ns, uv_hrtime(), __ATOMIC_RELEASE);
+
+  rec->fd = fd;
+  rec->base = base;
+  rec->seg = seg;
+  rec->seg_no = seg_no;
+  rec->end = sizeof(*seg);
+  rec->limit = rec->seg_len;
+  rec->next_index = rec->end;
+  rec->segments++;
+}
+
+/* Moves the index after the records, in time order, and trims the file.
+ * Like seg_create(), fine off the loop. */
+static int
+seg_finish(int fd, uint8_t *base, size_t seg_len, size_t end, size_t limit) {
+  ex_rec_seg_t *seg = (ex_rec_seg_t *)base;
+  uint32_t n = seg->index_count;
+  ex_rec_index_t *tail = (ex_rec_index_t *)(base + limit);
+  ex_rec_index_t *index = NULL;
+  size_t len = 0;
+  int rc = 0;
+
+  /* The two ends may overlap in a full segment; go through a copy */
+  index = malloc(n * sizeof(*index) + 1);
+  if (index) {
+    for (uint32_t i = 0; i < n; ++i)
+      index[i] = tail[n - 1 - i];
+    memcpy(base + end, index, n * sizeof(*index));
+    seg->index_off = end;
+    len = end + n * sizeof(*index);
+    free(index);
+  } else {
+    rc = UV_ENOMEM;
+    len = seg_len;
+  }
+
+  munmap(base, seg_len);
+  if (ftruncate(fd, len) < 0 && rc == 0)
+    rc = uv_translate_sys_error(errno);
+  close(fd);
+  return rc;
+}
+
+/* On the threadpool: finish the segment rolled away from, make the next */
+static void
+spare_work(uv_work_t *req) {
+  ex_rec_t *rec = req->data;
+  int rc = 0;
+
+  if (rec->old_base)
+    rc = seg_finish(rec->old_fd, rec->old_base, rec->seg_len, rec->old_end, rec->old_limit);
+  rec->old_base = NULL;
+  rec->old_fd = -1;
+  rec->work_rc = seg_create(rec->dir, rec->seg_len, &rec->spare_no, &rec->spare_fd, &rec->spare_base);
+  if (rec->work_rc == 0)
+    rec->work_rc = rc;
+}
+
+static void
+spare_done(uv_work_t *req, int status) {
+  ex_rec_t *rec = req->data;
+
+  rec->working = 0;
+}
+
+/* Hands the old segment, if any, to the threadpool along with making the
+ * next; done inline if the work cannot be queued. */
+static void
+spare_queue(ex_rec_t *rec) {
+  rec->work.data = rec;
+  rec->working = 1;
+  if (uv_queue_work(rec->loop, &rec->work, spare_work, spare_done) == 0)
+    return;
+  rec->working = 0;
+  if (rec->old_base)
+    seg_finish(rec->old_fd, rec->old_base, rec->seg_len, rec->old_end, rec->old_limit);
+  rec->old_base = NULL;
+}
+
+static int
+seg_roll(ex_rec_t *rec) {
+  uint8_t *base = NULL;
+  int fd = -1;
+  int rc = 0;
+
+  if (!rec->loop) {
+    rc = seg_finish(rec->fd, rec->base, rec->seg_len, rec->end, rec->limit);
+    rec->base = NULL;
+    rec->seg = NULL;
+    rec->fd = -1;
+    rec->seg_no++;
+    if (rc == 0)
+      rc = seg_create(rec->dir, rec->seg_len, &rec->seg_no, &fd, &base);
+    if (rc < 0)
+      return rec->error = rc;
+    seg_start(rec, fd, base, rec->seg_no);
+    return 0;
+  }
+
+  /* Still being made: this frame is lost, later ones may make it */
+  if (rec->working)
+    return UV_EAGAIN;
+  if (!rec->spare_base)
+    return rec->error = rec->work_rc < 0 ? rec->work_rc : UV_EIO;
+
+  rec->old_fd = rec->fd;
+  rec->old_base = rec->base;
+  rec->old_end = rec->end;
+  rec->old_limit = rec->limit;
+  seg_start(rec, rec->spare_fd, rec->spare_base, rec->spare_no);
+  rec->spare_base = NULL;
+  rec->spare_fd = -1;
+  rec->spare_no++;
+  spare_queue(rec);
+  return 0;
+}
+
+int
+ex_rec_open(ex_rec_t *rec, uv_loop_t *loop, const char *dir, size_t seg_len) {
+  uint8_t *base = NULL;
+  int fd = -1;
+  int rc = 0;
+
+  memset(rec, 0, sizeof(*rec));
+  rec->fd = rec->old_fd = rec->spare_fd = -1;
+  rec->loop = loop;
+  rec->seg_len = EX_REC_ALIGN(seg_len ? seg_len : EX_REC_SEG_LEN);
+  if (rec->seg_len < sizeof(ex_rec_seg_t) + EX_REC_INDEX_EVERY)
+    return UV_EINVAL;
+  if (strlen(dir) >= sizeof(rec->dir))
+    return UV_ENAMETOOLONG;
+  strcpy(rec->dir, dir);
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return uv_translate_sys_error(errno);
+  rc = seg_create(rec->dir, rec->seg_len, &rec->seg_no, &fd, &base);
+  if (rc < 0)
+    return rc;
+  seg_start(rec, fd, base, rec->seg_no);
+  if (loop) {
+    rec->spare_no = rec->seg_no + 1;
+    spare_queue(rec);
+  }
+  return 0;
+}
+
+int
+ex_rec_frame(ex_rec_t *rec, uint64_t ts_ns, uint32_t room, const uint8_t *data, uint32_t len) {
+  size_t need = sizeof(ex_rec_hdr_t) + EX_REC_ALIGN(len);
+  ex_rec_hdr_t *hdr = NULL;
+  ex_rec_index_t *entry = NULL;
+  int rc = 0;
+
+  if (rec->error) {
+    rec->dropped++;
+    return rec->error;
+  }
+  if (!rec->base)
+    return 0;
+  if (len == 0)
+    return UV_EINVAL;
+
+  /* Room for the record and for an index entry, in case one is due */
+  if (rec->end + need + sizeof(*entry) > rec->limit) {
+    if (need + sizeof(*entry) > rec->seg_len - sizeof(ex_rec_seg_t) - sizeof(*entry)) {
+      rec->dropped++;
+      return UV_E2BIG;
+    }
+    rc = seg_roll(rec);
+    if (rc < 0) {
+      rec->dropped++;
+      return rc;
+    }
+  }
+
+  if (rec->end >= rec->next_index) {
+    rec->limit -= sizeof(*entry);
+    entry = (ex_rec_index_t *)(rec->base + rec->limit);
+    entry->ts_ns = ts_ns;
+    entry->off = rec->end;
+    rec->seg->index_count++;
+    rec->next_index = rec->end + EX_REC_INDEX_EVERY;
+  }
+
+  /* Padding is already zero: the file was allocated that way. The length
+   * goes in last, so a record cut short by a dying writer reads as the end */
+  hdr = (ex_rec_hdr_t *)(rec->base + rec->end);
+  memcpy(hdr + 1, data, len);
+  hdr->ts_ns = ts_ns;
+  hdr->room = room;
+  __atomic_store_n(&hdr->len, len, __ATOMIC_RELEASE);
+  rec->end += need;
+  __atomic_store_n(&rec->seg->data_len, rec->end - sizeof(ex_rec_seg_t), __ATOMIC_RELEASE);
+
+  rec->records++;
+  rec->bytes += need;
+  return 0;
+}
+
+/* The spare was never written to; it goes rather than read back empty */
+int
+ex_rec_close(ex_rec_t *rec) {
+  char path[EX_REC_PATH_MAX + 32];
+  int rc = 0;
+
+  if (rec->working)
+    return UV_EBUSY;
+  if (rec->base)
+    rc = seg_finish(rec->fd, rec->base, rec->seg_len, rec->end, rec->limit);
+  rec->base = NULL;
+  rec->seg = NULL;
+  rec->fd = -1;
+  if (rec->spare_base) {
+    munmap(rec->spare_base, rec->seg_len);
+    close(rec->spare_fd);
+    snprintf(path, sizeof(path), "%s/%08u.exrec", rec->dir, rec->spare_no);
+    unlink(path);
+    rec->spare_base = NULL;
+    rec->spare_fd = -1;
+  }
+  rec->error = 0;
+  return rc;
+}
+
+/* Maps r->seg_no; UV_ENOENT once past the last segment. */
+static int
+reader_map(ex_rec_reader_t *r) {
+  char path[EX_REC_PATH_MAX + 32];
+  const ex_rec_seg_t *seg = NULL;
+  struct stat st;
+  void *base = NULL;
+  int fd = -1;
+
+  snprintf(path, sizeof(path), "%s/%08u.exrec", r->dir, r->seg_no);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return uv_translate_sys_error(errno);
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*seg)) {
+    close(fd);
+    return UV_EINVAL;
+  }
+  /* Shared, so records written after this show up when following */
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return uv_translate_sys_error(errno);
+
+  seg = base;
+  if (memcmp(seg->magic, EX_REC_MAGIC, sizeof(seg->magic)) != 0) {
+    munmap(base, st.st_size);
+    return UV_EINVAL;
+  }
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+  r->base = base;
+  r->len = st.st_size;
+  r->seg = seg;
+  r->mapped = 1;
+  r->off = sizeof(*seg);
+  r->end = seg->data_len < r->len - sizeof(*seg) ? sizeof(*seg) + seg->data_len : r->len;
+  r->segments++;
+  return 0;
+}
+
+/* Records written since, while the segment is still open */
+static void
+reader_refresh(ex_rec_reader_t *r) {
+  uint64_t data_len = __atomic_load_n(&r->seg->data_len, __ATOMIC_ACQUIRE);
+
+  r->end = data_len < r->len - sizeof(ex_rec_seg_t) ? sizeof(ex_rec_seg_t) + data_len : r->len;
+}
+
+/* Whether a writer has moved on to segment `seg_no`; a spare made ahead of
+ * time has no start yet */
+static int
+reader_started(const ex_rec_reader_t *r, uint32_t seg_no) {
+  char path[EX_REC_PATH_MAX + 32];
+  ex_rec_seg_t seg;
+  ssize_t n = 0;
+  int fd = -1;
+
+  snprintf(path, sizeof(path), "%s/%08u.exrec", r->dir, seg_no);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  n = pread(fd, &seg, sizeof(seg), 0);
+  close(fd);
+  return n == sizeof(seg) && memcmp(seg.magic, EX_REC_MAGIC, sizeof(seg.magic)) == 0 && seg.start_ns;
+}
+
+/* The segment a writer went on to after this one. A spare is started
+ * before anything after it is made, so one still unstarted with the next
+ * number started was left by a writer that died, and never will be. */
+static int
+reader_successor(const ex_rec_reader_t *r, uint32_t *seg_no) {
+  if (reader_started(r, r->seg_no + 1)) {
+    *seg_no = r->seg_no + 1;
+    return 1;
+  }
+  if (reader_started(r, r->seg_no + 2) && !reader_started(r, r->seg_no + 1)) {
+    *seg_no = r->seg_no + 2;
+    return 1;
+  }
+  return 0;
+}
+
+static void
+reader_unmap(ex_rec_reader_t *r) {
+  if (r->mapped)
+    munmap((void *)r->base, r->len);
+  r->mapped = 0;
+  r->base = NULL;
+  r->seg = NULL;
+  r->off = r->end = 0;
+}
+
+/* The record at r->off, or NULL at the end of the segment */
+static const ex_rec_hdr_t *
+reader_record(const ex_rec_reader_t *r) {
+  const ex_rec_hdr_t *hdr = NULL;
+
+  if (r->off + sizeof(*hdr) > r->end)
+    return NULL;
+  hdr = (const ex_rec_hdr_t *)(r->base + r->off);
+  if (!__atomic_load_n(&hdr->len, __ATOMIC_ACQUIRE))
+    return NULL;
+  if (EX_REC_ALIGN(hdr->len) > r->end - r->off - sizeof(*hdr))
+    return NULL;
+  return hdr;
+}
+
+/* Entries in time order, wherever this segment keeps them */
+static uint32_t
+reader_index_count(const ex_rec_reader_t *r) {
+  const ex_rec_seg_t *seg = r->seg;
+  size_t bytes = (size_t)seg->index_count * sizeof(ex_rec_index_t);
+
+  if (seg->index_off)
+    return seg->index_off <= r->len && bytes <= r->len - seg->index_off ? seg->index_count : 0;
+  return seg->seg_len <= r->len && seg->seg_len >= r->end && bytes <= seg->seg_len - r->end ? seg->index_count : 0;
+}
+
+static const ex_rec_index_t *
+reader_index(const ex_rec_reader_t *r, uint32_t k) {
+  if (r->seg->index_off)
+    return (const ex_rec_index_t *)(r->base + r->seg->index_off) + k;
+  return (const ex_rec_index_t *)(r->base + r->seg->seg_len) - (k + 1);
+}
+
+int
+ex_rec_reader_open(ex_rec_reader_t *r, const char *dir) {
+  struct dirent *ent = NULL;
+  unsigned long n = 0;
+  int found = 0;
+  DIR *d = NULL;
+
+  memset(r, 0, sizeof(*r));
+  if (strlen(dir) >= sizeof(r->dir))
+    return UV_ENAMETOOLONG;
+  strcpy(r->dir, dir);
+
+  d = opendir(dir);
+  if (!d)
+    return uv_translate_sys_error(errno);
+  while ((ent = readdir(d))) {
+    if (strlen(ent->d_name) != 14 || strspn(ent->d_name, "0123456789") != 8 ||
+        strcmp(ent->d_name + 8, ".exrec") != 0)
+      continue;
+    n = strtoul(ent->d_name, NULL, 10);
+    if (!found || n < r->seg_no)
+      r->seg_no = n;
+    found = 1;
+  }
+  closedir(d);
+
+  return found ? reader_map(r) : UV_ENOENT;
+}
+
+void
+ex_rec_reader_close(ex_rec_reader_t *r) {
+  reader_unmap(r);
+}
+
+int
+ex_rec_reader_next(ex_rec_reader_t *r, const ex_rec_hdr_t **hdr, const uint8_t **data) {
+  const ex_rec_hdr_t *h = NULL;
+  uint32_t next = 0;
+  int rc = 0;
+
+  for (;;) {
+    if (r->mapped && (h = reader_record(r))) {
+      r->off += sizeof(*h) + EX_REC_ALIGN(h->len);
+      r->records++;
+      r->bytes += h->len;
+      *hdr = h;
+      *data = (const uint8_t *)(h + 1);
+      return 1;
+    }
+
+    /* Following, a segment is left only once its writer has left it, and
+     * with whatever went in before that read too */
+    if (r->mapped && r->follow) {
+      reader_refresh(r);
+      if (reader_record(r))
+        continue;
+      if (!reader_successor(r, &next))
+        return 0;
+      reader_refresh(r);
+      if (reader_record(r))
+        continue;
+      reader_unmap(r);
+      r->seg_no = next;
+    }
+
+    /* A later segment may turn up while a recorder is still going */
+    if (r->mapped) {
+      reader_unmap(r);
+      r->seg_no++;
+    }
+    rc = reader_map(r);
+    if (rc < 0)
+      return rc == UV_ENOENT ? 0 : rc;
+  }
+}
+
+int
+ex_rec_reader_tail(ex_rec_reader_t *r) {
+  const ex_rec_hdr_t *hdr = NULL;
+  uint32_t next = 0;
+  int rc = 0;
+
+  /* The last segment a writer has started, going by number */
+  while (reader_successor(r, &next)) {
+    reader_unmap(r);
+    r->seg_no = next;
+  }
+  if (!r->mapped) {
+    rc = reader_map(r);
+    if (rc < 0)
+      return rc == UV_ENOENT ? 0 : rc;
+  }
+
+  reader_refresh(r);
+  while ((hdr = reader_record(r)))
+    r->off += sizeof(*hdr) + EX_REC_ALIGN(hdr->len);
+  return 0;
+}
+
+uint64_t
+ex_rec_reader_wall(const ex_rec_reader_t *r, const ex_rec_hdr_t *hdr) {
+  uint64_t start = __atomic_load_n(&r->seg->start_ns, __ATOMIC_ACQUIRE);
+
+  if (hdr->ts_ns < start)
+    return r->seg->start_wall_ns;
+  return r->seg->start_wall_ns + (hdr->ts_ns - start);
+}
+
+/* `wall_ns` as a `ts_ns` of the segment mapped, from when it started */
+static uint64_t
+reader_wall_ts(const ex_rec_reader_t *r, uint64_t wall_ns) {
+  uint64_t start = __atomic_load_n(&r->seg->start_ns, __ATOMIC_ACQUIRE);
+
+  if (wall_ns <= r->seg->start_wall_ns)
+    return 0;
+  if (wall_ns - r->seg->start_wall_ns > UINT64_MAX - start)
+    return UINT64_MAX;
+  return start + (wall_ns - r->seg->start_wall_ns);
+}
+
+/* `at` is a ts_ns, or with `wall` set a time each segment converts */
+static int
+reader_seek(ex_rec_reader_t *r, uint64_t at, int wall) {
+  const ex_rec_index_t *entry = NULL;
+  const ex_rec_hdr_t *hdr = NULL;
+  uint64_t ts_ns = 0;
+  uint32_t lo = 0;
+  uint32_t hi = 0;
+  uint32_t mid = 0;
+  int rc = 0;
+
+  for (;;) {
+    if (!r->mapped) {
+      rc = reader_map(r);
+      if (rc < 0)
+        return rc == UV_ENOENT ? 0 : rc;
+    }
+    ts_ns = wall ? reader_wall_ts(r, at) : at;
+
+    /* Jump to the last entry at or before `ts_ns`, never backwards */
+    lo = 0;
+    hi = reader_index_count(r);
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (reader_index(r, mid)->ts_ns <= ts_ns)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo > 0) {
+      entry = reader_index(r, lo - 1);
+      if (entry->off > r->off && entry->off < r->end && entry->off % 8 == 0)
+        r->off = entry->off;
+    }
+
+    /* and scan what is left, at most EX_REC_INDEX_EVERY or so */
+    while ((hdr = reader_record(r))) {
+      if (hdr->ts_ns >= ts_ns)
+        return 0;
+      r->off += sizeof(*hdr) + EX_REC_ALIGN(hdr->len);
+    }
+    reader_unmap(r);
+    r->seg_no++;
+  }
+}
+
+int
+ex_rec_reader_seek(ex_rec_reader_t *r, uint64_t ts_ns) {
+  return reader_seek(r, ts_ns, 0);
+}
+
+int
+ex_rec_reader_seek_wall(ex_rec_reader_t *r, uint64_t wall_ns) {
+  return reader_seek(r, wall_ns, 1);
+}
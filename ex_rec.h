@@ -0,0 +1,164 @@
+/* Segmented frame recorder, written through mmap.
+ *
+ * Frames go to numbered segment files in a directory, 00000000.exrec and
+ * on, each EX_REC_SEG_LEN bytes, allocated up front and mapped shared.
+ * Appending a record is a copy of the frame into the mapping and a few
+ * stores: no syscall and no copy other than that one. Existing segments
+ * are never overwritten.
+ *
+ * Given a loop, the next segment is allocated and mapped ahead of time on
+ * the threadpool, and a full one is finished there too, so rolling over is
+ * a swap of mappings. Should a segment fill up before the next is ready,
+ * frames are dropped and counted until it is. Without a loop the roll
+ * happens inline and blocks for as long as the filesystem takes to
+ * allocate EX_REC_SEG_LEN.
+ *
+ *   0        64                                  index_off
+ *   +--------+---------------------------------+---+-----------+
+ *   | header | records ...                     |   | index ... |
+ *   +--------+---------------------------------+---+-----------+
+ *
+ * A record is an ex_rec_hdr_t and the frame exactly as received, padded to
+ * 8 bytes. Its length is stored last and is never 0, so a zero length ends
+ * the records and a segment whose writer died, even halfway through a
+ * record, reads back in full up to there; `data_len` in the header is kept
+ * current too.
+ *
+ * The index is sparse: one ex_rec_index_t for the first record at or past
+ * every EX_REC_INDEX_EVERY bytes of records, enough to seek by time with a
+ * binary search and a short scan. While a segment is open its entries grow
+ * down from the end of the file, newest lowest, and `index_off` is 0. A
+ * finished segment has them in time order at `index_off`, right after the
+ * records, and the file is cut short there.
+ *
+ * All fields are in host byte order.
+ *
+ * ex_rec_reader_t reads a directory back, segment after segment in number
+ * order, each mapped read-only.
+ */
+
+#ifndef EX_REC_H
+#define EX_REC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#define EX_REC_MAGIC        "EXREC001"
+#define EX_REC_SEG_LEN      (64 << 20)
+#define EX_REC_INDEX_EVERY  (64 << 10)
+#define EX_REC_PATH_MAX     4096
+
+typedef struct ex_rec_seg_s {
+  char magic[8];
+  uint32_t seg_no;
+  uint32_t index_count;
+  uint64_t seg_len;         /* Of the file while it is open */
+  uint64_t data_len;        /* Bytes of records after the header */
+  uint64_t index_off;       /* 0 while open */
+  uint64_t start_ns;        /* uv_hrtime() at first use, 0 before, */
+  uint64_t start_wall_ns;   /* and CLOCK_REALTIME at the same moment */
+  uint64_t reserved;
+} ex_rec_seg_t;
+
+typedef struct ex_rec_hdr_s {
+  uint64_t ts_ns;           /* uv_hrtime() of the read */
+  uint32_t room;
+  uint32_t len;
+} ex_rec_hdr_t;
+
+typedef struct ex_rec_index_s {
+  uint64_t ts_ns;
+  uint64_t off;             /* From the start of the file */
+} ex_rec_index_t;
+
+typedef struct ex_rec_s {
+  char dir[EX_REC_PATH_MAX];
+  size_t seg_len;
+  uint32_t seg_no;
+
+  /* The segment being written */
+  int fd;
+  uint8_t *base;
+  ex_rec_seg_t *seg;
+  size_t end;               /* Next record goes here */
+  size_t limit;             /* Lowest index entry; records stay below */
+  size_t next_index;
+
+  int error;                /* A roll failed; recording stopped there */
+
+  /* Off the loop: the segment being finished, and the next one */
+  uv_loop_t *loop;
+  uv_work_t work;
+  int working;
+  int work_rc;
+  int old_fd;
+  uint8_t *old_base;
+  size_t old_end;
+  size_t old_limit;
+  int spare_fd;
+  uint8_t *spare_base;
+  uint32_t spare_no;
+
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t segments;
+  uint64_t dropped;
+} ex_rec_t;
+
+typedef struct ex_rec_reader_s {
+  char dir[EX_REC_PATH_MAX];
+  uint32_t seg_no;          /* Mapped now, or the one to map next */
+  int mapped;
+  int follow;               /* Wait at the end of a segment still written */
+
+  const uint8_t *base;
+  size_t len;
+  const ex_rec_seg_t *seg;
+  size_t off;               /* Next record */
+  size_t end;
+
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t segments;
+} ex_rec_reader_t;
+
+#define EX_REC_ALIGN(n)     (((n) + 7) & ~(size_t)7)
+
+/* `seg_len` 0 for EX_REC_SEG_LEN. Creates `dir` if need be. `loop` NULL
+ * to roll inline. */
+int ex_rec_open(ex_rec_t *rec, uv_loop_t *loop, const char *dir, size_t seg_len);
+int ex_rec_frame(ex_rec_t *rec, uint64_t ts_ns, uint32_t room, const uint8_t *data, uint32_t len);
+
+/* Once the loop has run the work queued; UV_EBUSY before. */
+int ex_rec_close(ex_rec_t *rec);
+
+/* Starts at the lowest numbered segment in `dir`. */
+int ex_rec_reader_open(ex_rec_reader_t *r, const char *dir);
+void ex_rec_reader_close(ex_rec_reader_t *r);
+
+/* Returns 1 with the next record, 0 past the last one. `data` stays valid
+ * until the reader moves on to another segment. With `follow` set, 0 only
+ * means nothing more yet, and a later call picks up what the recorder has
+ * written since, or what one restarted in the same directory has, past the
+ * spare a killed one left unstarted. */
+int ex_rec_reader_next(ex_rec_reader_t *r, const ex_rec_hdr_t **hdr, const uint8_t **data);
+
+/* Past everything recorded so far, to follow what comes next. */
+int ex_rec_reader_tail(ex_rec_reader_t *r);
+
+/* Where the record just read falls in wall-clock time: its segment's
+ * CLOCK_REALTIME at start plus how far into the segment it came. Unlike
+ * `ts_ns`, comparable across segments from different runs or boots. */
+uint64_t ex_rec_reader_wall(const ex_rec_reader_t *r, const ex_rec_hdr_t *hdr);
+
+/* Moves forward to the first record at or after `ts_ns`, going through
+ * the index rather than the records where it can. */
+int ex_rec_reader_seek(ex_rec_reader_t *r, uint64_t ts_ns);
+
+/* The same by ex_rec_reader_wall(), each segment's own `start_wall_ns`
+ * plus the offset into it, so across runs and boots too. */
+int ex_rec_reader_seek_wall(ex_rec_reader_t *r, uint64_t wall_ns);
+
+#endif
@@ -0,0 +1,169 @@
+/* Decoding and dispatch of frames once read. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "ex_json.h"
+#include "ex_log.h"
+#include "ex_route.h"
+
+static void on_cmd_fields(ex_route_src_t *src, const ex_frame_t *frame, int cmd);
+static void on_cmd_default(ex_route_src_t *src, const ex_frame_t *frame, int cmd);
+
+/* Handlers by command id; anything without one goes to on_cmd_default */
+typedef struct ex_cmd_route_s {
+  void (*handler)(ex_route_src_t *src, const ex_frame_t *frame, int cmd);
+  const char *paths[EX_ROUTE_PATHS];
+} ex_cmd_route_t;
+
+static const ex_cmd_route_t cmd_routes[EX_CMD_COUNT] = {
+  [EX_CMD_DANMU_MSG]          = { on_cmd_fields, { "info.2.1", "info.1" } },
+  [EX_CMD_SEND_GIFT]          = { on_cmd_fields, { "data.uname", "data.giftName", "data.num" } },
+  [EX_CMD_SUPER_CHAT_MESSAGE] = { on_cmd_fields, { "data.user_info.uname", "data.price", "data.message" } },
+  [EX_CMD_INTERACT_WORD]      = { on_cmd_fields, { "data.uname" } },
+  [EX_CMD_ONLINE_RANK_COUNT]  = { on_cmd_fields, { "data.count" } },
+  [EX_CMD_WATCHED_CHANGE]     = { on_cmd_fields, { "data.num" } },
+};
+
+/* Known names become a flag per command id; the rest stay in the list. */
+int
+ex_route_init(ex_route_t *route, const char *subscribed, ex_route_control_cb control) {
+  const char *list = subscribed;
+  size_t n = 0;
+  int cmd = 0;
+
+  memset(route, 0, sizeof(*route));
+  route->subscribed = subscribed;
+  route->control = control;
+  memset(route->wanted, list ? 0 : 1, sizeof(route->wanted));
+  for (; list && *list; list += n + (list[n] == ',')) {
+    n = strcspn(list, ",");
+    cmd = ex_cmd_lookup(list, n);
+    if (cmd != EX_CMD_UNKNOWN)
+      route->wanted[cmd] = 1;
+  }
+  ex_hist_reset(&route->read_decode);
+  ex_hist_reset(&route->decode_dispatch);
+  ex_hist_reset(&route->dispatch_done);
+  return ex_inflate_init(&route->inflater, 0);
+}
+
+void
+ex_route_free(ex_route_t *route) {
+  ex_inflate_free(&route->inflater);
+}
+
+void
+ex_route_src_init(ex_route_src_t *src, ex_route_t *route, uint32_t id, void *data) {
+  src->route = route;
+  src->id = id;
+  src->data = data;
+}
+
+static int
+cmd_listed(const char *list, const char *name, size_t len) {
+  size_t n = 0;
+
+  if (!list)
+    return 1;
+  for (; *list; list += n + (list[n] == ',')) {
+    n = strcspn(list, ",");
+    if (n == len && memcmp(list, name, len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Routes on `cmd` alone; the body is only looked at further if wanted. */
+static int
+route_message(ex_route_src_t *src, const ex_frame_t *frame) {
+  ex_route_t *route = src->route;
+  const char *colon = NULL;
+  ex_json_val_t name;
+  size_t name_len = 0;
+  int cmd = EX_CMD_UNKNOWN;
+  int wanted = 0;
+  uint64_t decoded = uv_hrtime();
+  uint64_t dispatched = 0;
+
+  route->messages++;
+  ex_hist_record(&route->read_decode, decoded - route->read_ns);
+  if (ex_json_cmd((const char*)frame->body, frame->body_len, &name) != 1) {
+    ex_log(EX_LOG_DEBUG, "(%u) message without a cmd", src->id);
+    route->unknown++;
+    return 0;
+  }
+
+  /* "DANMU_MSG:4:0:2:2:2:0" routes as DANMU_MSG */
+  colon = memchr(name.data, ':', name.len);
+  name_len = colon ? (size_t)(colon - name.data) : name.len;
+  cmd = ex_cmd_lookup(name.data, name_len);
+  if (cmd == EX_CMD_UNKNOWN)
+    route->unknown++;
+  else
+    route->counts[cmd]++;
+  wanted = cmd != EX_CMD_UNKNOWN ? route->wanted[cmd] : cmd_listed(route->subscribed, name.data, name_len);
+  if (!wanted) {
+    route->skipped++;
+    return 0;
+  }
+
+  dispatched = uv_hrtime();
+  ex_hist_record(&route->decode_dispatch, dispatched - decoded);
+  if (cmd != EX_CMD_UNKNOWN && cmd_routes[cmd].handler)
+    cmd_routes[cmd].handler(src, frame, cmd);
+  else
+    on_cmd_default(src, frame, cmd);
+  ex_hist_record(&route->dispatch_done, uv_hrtime() - dispatched);
+  return 0;
+}
+
+int
+ex_route_frame(const ex_frame_t *frame, void *arg) {
+  ex_route_src_t *src = arg;
+  ex_route_t *route = src->route;
+
+  if (ex_log_enabled(EX_LOG_DEBUG))
+    ex_log(EX_LOG_DEBUG, "(%u) frame op=%u ver=%u seq=%u len=%u",
+        src->id, frame->op, frame->ver, frame->seq, frame->packet_len);
+
+  /* Batch of inner frames, decompressed and split in place. */
+  if (frame->ver == EX_VER_ZLIB)
+    return ex_inflate_frame(&route->inflater, frame, ex_route_frame, src);
+
+  if (frame->op != EX_OP_MESSAGE)
+    return route->control ? route->control(src, frame) : 0;
+  if (route->hub)
+    ex_hub_publish(route->hub, src->id, frame->body - frame->header_len, frame->packet_len);
+  return route_message(src, frame);
+}
+
+/* Logs the fields listed in the route */
+static void
+on_cmd_fields(ex_route_src_t *src, const ex_frame_t *frame, int cmd) {
+  const ex_cmd_route_t *route = &cmd_routes[cmd];
+  ex_json_val_t vals[EX_ROUTE_PATHS];
+  char line[EX_LOG_LINE_MAX];
+  size_t npaths = 0;
+  int n = 0;
+
+  while (npaths < EX_ROUTE_PATHS && route->paths[npaths])
+    npaths++;
+  ex_json_extract((const char*)frame->body, frame->body_len, route->paths, npaths, vals);
+
+  n = snprintf(line, sizeof(line), "(%u) %s", src->id, ex_cmd_name(cmd));
+  for (size_t i = 0; i < npaths && n < (int)sizeof(line); ++i) {
+    n += snprintf(line + n, sizeof(line) - n, " %s=%.*s",
+        route->paths[i], (int)vals[i].len, vals[i].data ? vals[i].data : "");
+  }
+  if (n >= (int)sizeof(line))
+    n = sizeof(line) - 1;
+  ex_log_write(EX_LOG_INFO, line, n);
+}
+
+static void
+on_cmd_default(ex_route_src_t *src, const ex_frame_t *frame, int cmd) {
+  ex_log(EX_LOG_INFO, "(%u) %.*s", src->id, (int)frame->body_len, (const char*)frame->body);
+}
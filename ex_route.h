@@ -0,0 +1,70 @@
+/* Decoding and dispatch of frames once read, shared by ex6 and ex9.
+ *
+ * Frames go in as an ex_frame_decoder hands them out. zlib batches are
+ * inflated through the one z_stream kept here and split in place; message
+ * frames are published to the hub, if any, and routed on `cmd` alone;
+ * anything else goes to `control`.
+ *
+ * Routing looks at nothing but `cmd` unless the command is wanted: the
+ * subscription list, or all when there is none. A wanted command goes to
+ * its handler in ex_route.c, which pulls its fields out with
+ * ex_json_extract() and logs them, or else the whole body is logged.
+ *
+ * Each stage is timed: from the read's start, stamped by the caller in
+ * `read_ns`, to decoded; from there to dispatched; and the handler.
+ */
+
+#ifndef EX_ROUTE_H
+#define EX_ROUTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ex_cmd.h"
+#include "ex_frame.h"
+#include "ex_hist.h"
+#include "ex_hub.h"
+#include "ex_inflate.h"
+
+#define EX_ROUTE_PATHS  3
+
+typedef struct ex_route_s ex_route_t;
+
+/* Where frames come from: a connection, or a recorded one */
+typedef struct ex_route_src_s {
+  ex_route_t *route;
+  uint32_t id;              /* In log lines, and the room published as */
+  void *data;
+} ex_route_src_t;
+
+/* Heartbeat and auth replies and the like; < 0 stops the feed */
+typedef int (*ex_route_control_cb)(ex_route_src_t *src, const ex_frame_t *frame);
+
+struct ex_route_s {
+  ex_inflate_t inflater;    /* One z_stream for every source */
+  ex_hub_t *hub;            /* Messages go out here too, if serving */
+  ex_route_control_cb control;
+
+  const char *subscribed;   /* Comma separated, NULL for all */
+  uint8_t wanted[EX_CMD_COUNT];
+
+  uint64_t messages;
+  uint64_t skipped;         /* Not wanted */
+  uint64_t unknown;         /* No cmd, or one ex_cmd.def does not list */
+  uint64_t counts[EX_CMD_COUNT];
+
+  /* Stage latency, ns */
+  uint64_t read_ns;
+  ex_hist_t read_decode;
+  ex_hist_t decode_dispatch;
+  ex_hist_t dispatch_done;
+};
+
+int ex_route_init(ex_route_t *route, const char *subscribed, ex_route_control_cb control);
+void ex_route_free(ex_route_t *route);
+void ex_route_src_init(ex_route_src_t *src, ex_route_t *route, uint32_t id, void *data);
+
+/* An ex_frame_cb; `arg` is the ex_route_src_t the frame came from. */
+int ex_route_frame(const ex_frame_t *frame, void *arg);
+
+#endif
@@ -0,0 +1,468 @@
+/* Sharded event loops: N threads, each running its own uv_loop_t. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ex_log.h"
+#include "ex_shard.h"
+
+enum ex_shard_cmd_type {
+  EX_SHARD_CMD_ADD,
+  EX_SHARD_CMD_REMOVE,
+  EX_SHARD_CMD_MIGRATE,
+  EX_SHARD_CMD_SHED,
+  EX_SHARD_CMD_STOP,
+};
+
+struct ex_shard_cmd_s {
+  ex_shard_cmd_t *next;
+  int type;
+  ex_shard_item_t *item;
+  ex_shard_t *target;
+  int permille;
+};
+
+static int
+shard_post(ex_shard_t *shard, int type, ex_shard_item_t *item, ex_shard_t *target, int permille) {
+  ex_shard_cmd_t *cmd = NULL;
+  int stopping = 0;
+
+  cmd = malloc(sizeof(*cmd));
+  if (!cmd)
+    return UV_ENOMEM;
+  cmd->next = NULL;
+  cmd->type = type;
+  cmd->item = item;
+  cmd->target = target;
+  cmd->permille = permille;
+
+  uv_mutex_lock(&shard->lock);
+  stopping = shard->stopping;
+  if (!stopping) {
+    if (shard->tail)
+      shard->tail->next = cmd;
+    else
+      shard->head = cmd;
+    shard->tail = cmd;
+    if (type == EX_SHARD_CMD_STOP)
+      shard->stopping = 1;
+  }
+  uv_mutex_unlock(&shard->lock);
+
+  if (stopping) {
+    free(cmd);
+    return UV_ECANCELED;
+  }
+  return uv_async_send(&shard->ctl);
+}
+
+static void
+item_link(ex_shard_t *shard, ex_shard_item_t *item) {
+  item->next = shard->items.next;
+  item->prev = &shard->items;
+  shard->items.next->prev = item;
+  shard->items.next = item;
+  shard->count++;
+  __atomic_store_n(&item->owner, shard, __ATOMIC_RELEASE);
+}
+
+static void
+item_unlink(ex_shard_t *shard, ex_shard_item_t *item) {
+  item->prev->next = item->next;
+  item->next->prev = item->prev;
+  item->next = NULL;
+  item->prev = NULL;
+  shard->count--;
+}
+
+static void
+shard_migrate(ex_shard_t *shard, ex_shard_item_t *item, ex_shard_t *target) {
+  if (item->owner != shard || __atomic_load_n(&item->target, __ATOMIC_ACQUIRE) || !item->next || target == shard)
+    return;
+  __atomic_store_n(&item->target, target, __ATOMIC_RELEASE);
+  shard->group->ops->detach(item, shard);
+}
+
+/* Moves the heaviest items first until `permille` of the load has gone. */
+static void
+shard_shed(ex_shard_t *shard, ex_shard_t *target, int permille) {
+  ex_shard_item_t *heavy[EX_SHARD_MAX_MOVES];
+  ex_shard_item_t *item = NULL;
+  uint64_t total = 0, goal = 0, moved = 0;
+  int n = 0, i = 0;
+
+  /* The EX_SHARD_MAX_MOVES heaviest that can move, heaviest first */
+  for (item = shard->items.next; item != &shard->items; item = item->next) {
+    total += item->load;
+    if (__atomic_load_n(&item->target, __ATOMIC_ACQUIRE) || item->load == 0)
+      continue;
+    if (n == EX_SHARD_MAX_MOVES && item->load <= heavy[n - 1]->load)
+      continue;
+    i = n < EX_SHARD_MAX_MOVES ? n++ : n - 1;
+    for (; i > 0 && heavy[i - 1]->load < item->load; --i)
+      heavy[i] = heavy[i - 1];
+    heavy[i] = item;
+  }
+  goal = total * permille / 1000;
+
+  for (i = 0; i < n && moved < goal; ++i) {
+    if (moved > 0 && heavy[i]->load > goal - moved)
+      continue;
+    moved += heavy[i]->load;
+    shard_migrate(shard, heavy[i], target);
+  }
+}
+
+static void
+shard_stop(ex_shard_t *shard) {
+  ex_shard_item_t *item = NULL;
+
+  while (shard->items.next != &shard->items) {
+    item = shard->items.next;
+    item_unlink(shard, item);
+    shard->group->ops->remove(item, shard);
+  }
+  uv_close((uv_handle_t *)&shard->ctl, NULL);
+  uv_close((uv_handle_t *)&shard->stats, NULL);
+}
+
+static void
+on_ctl(uv_async_t *async) {
+  ex_shard_t *shard = async->data;
+  ex_shard_cmd_t *cmd = NULL, *next = NULL;
+  ex_shard_t *owner = NULL;
+
+  uv_mutex_lock(&shard->lock);
+  cmd = shard->head;
+  shard->head = NULL;
+  shard->tail = NULL;
+  uv_mutex_unlock(&shard->lock);
+
+  for (; cmd; cmd = next) {
+    next = cmd->next;
+    switch (cmd->type) {
+    case EX_SHARD_CMD_ADD:
+      __atomic_store_n(&cmd->item->target, NULL, __ATOMIC_RELEASE);
+      if (cmd->item->remove_pending) {
+        /* Removed on the way here; detached already, so never attached */
+        shard->group->ops->remove(cmd->item, shard);
+        break;
+      }
+      item_link(shard, cmd->item);
+      shard->group->ops->attach(cmd->item, shard);
+      break;
+    case EX_SHARD_CMD_REMOVE:
+      owner = __atomic_load_n(&cmd->item->owner, __ATOMIC_ACQUIRE);
+      if (owner != shard) {
+        /* Moved away since: one hop on to where it is now */
+        if (shard_post(owner, EX_SHARD_CMD_REMOVE, cmd->item, NULL, 0) < 0)
+          ex_log(EX_LOG_WARN, "(%p) ex_shard: lost remove for %p", shard, cmd->item);
+      } else if (__atomic_load_n(&cmd->item->target, __ATOMIC_ACQUIRE)) {
+        /* Detaching, or its ADD still queued here: the ADD carries it out */
+        cmd->item->remove_pending = 1;
+      } else if (cmd->item->next) {
+        item_unlink(shard, cmd->item);
+        shard->group->ops->remove(cmd->item, shard);
+      }
+      break;
+    case EX_SHARD_CMD_MIGRATE:
+      shard_migrate(shard, cmd->item, cmd->target);
+      break;
+    case EX_SHARD_CMD_SHED:
+      shard_shed(shard, cmd->target, cmd->permille);
+      break;
+    case EX_SHARD_CMD_STOP:
+      shard_stop(shard);
+      break;
+    }
+    free(cmd);
+  }
+}
+
+static void
+on_stats(uv_timer_t *timer) {
+  ex_shard_t *shard = timer->data;
+  ex_shard_item_t *item = NULL;
+  uint64_t now = uv_hrtime();
+  uint64_t idle = uv_metrics_idle_time(&shard->loop);
+  int busy = 0;
+
+  if (now > shard->stats_ns)
+    busy = 1000 - (int)((idle - shard->idle_ns) * 1000 / (now - shard->stats_ns));
+  shard->idle_ns = idle;
+  shard->stats_ns = now;
+
+  /* Halve each item's load so it tracks recent work. */
+  for (item = shard->items.next; item != &shard->items; item = item->next)
+    item->load >>= 1;
+
+  __atomic_store_n(&shard->busy_permille, busy < 0 ? 0 : busy, __ATOMIC_RELAXED);
+  __atomic_store_n(&shard->item_count, shard->count, __ATOMIC_RELAXED);
+}
+
+static void
+shard_main(void *arg) {
+  ex_shard_t *shard = arg;
+  const ex_shard_ops_t *ops = shard->group->ops;
+  int rc = 0;
+
+  if (ops->shard_init) {
+    rc = ops->shard_init(shard);
+    if (rc < 0)
+      ex_log(EX_LOG_ERROR, "(%p) shard_init: (%d) %s", shard, rc, uv_strerror(rc));
+  }
+
+  rc = uv_run(&shard->loop, UV_RUN_DEFAULT);
+  if (rc < 0)
+    ex_log(EX_LOG_ERROR, "(%p) uv_run: (%d) %s", shard, rc, uv_strerror(rc));
+
+  if (ops->shard_fini) {
+    ops->shard_fini(shard);
+    uv_run(&shard->loop, UV_RUN_DEFAULT);
+  }
+
+  rc = uv_loop_close(&shard->loop);
+  if (rc < 0)
+    ex_log(EX_LOG_ERROR, "(%p) uv_loop_close: (%d) %s", shard, rc, uv_strerror(rc));
+}
+
+static void
+on_balance(uv_timer_t *timer) {
+  ex_shard_group_balance(timer->data);
+}
+
+/* Undoes the first `steps` of setting up a shard, as counted below */
+static void
+shard_unwind(ex_shard_t *shard, int steps) {
+  if (steps >= 4)
+    uv_close((uv_handle_t *)&shard->stats, NULL);
+  if (steps >= 3)
+    uv_close((uv_handle_t *)&shard->ctl, NULL);
+  if (steps >= 2)
+    uv_mutex_destroy(&shard->lock);
+  if (steps >= 1) {
+    uv_run(&shard->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&shard->loop);
+  }
+}
+
+int
+ex_shard_group_init(ex_shard_group_t *group, uv_loop_t *loop, int nshards, const ex_shard_ops_t *ops) {
+  ex_shard_t *shard = NULL;
+  int steps = 0;
+  int rc = 0;
+  int i = 0;
+
+  if (!group || !loop || nshards <= 0 || !ops || !ops->attach || !ops->detach || !ops->remove)
+    return UV_EINVAL;
+
+  memset(group, 0, sizeof(*group));
+  group->shards = calloc(nshards, sizeof(*group->shards));
+  if (!group->shards)
+    return UV_ENOMEM;
+  group->loop = loop;
+  group->ops = ops;
+  group->nshards = nshards;
+
+  for (i = 0; i < nshards; ++i) {
+    shard = &group->shards[i];
+    shard->id = i;
+    shard->group = group;
+    shard->items.next = &shard->items;
+    shard->items.prev = &shard->items;
+
+    steps = 0;
+    rc = uv_loop_init(&shard->loop);
+    if (rc < 0)
+      goto fail;
+    steps++;
+    rc = uv_loop_configure(&shard->loop, UV_METRICS_IDLE_TIME);
+    if (rc < 0)
+      goto fail;
+    rc = uv_mutex_init(&shard->lock);
+    if (rc < 0)
+      goto fail;
+    steps++;
+    rc = uv_async_init(&shard->loop, &shard->ctl, on_ctl);
+    if (rc < 0)
+      goto fail;
+    steps++;
+    rc = uv_timer_init(&shard->loop, &shard->stats);
+    if (rc < 0)
+      goto fail;
+    steps++;
+    shard->ctl.data = shard;
+    shard->stats.data = shard;
+  }
+
+  steps = 0;
+  rc = uv_timer_init(loop, &group->balancer);
+  if (rc < 0)
+    goto fail;
+  group->balancer.data = group;
+  return 0;
+
+fail:
+  if (i < nshards)
+    shard_unwind(&group->shards[i], steps);
+  while (i-- > 0)
+    shard_unwind(&group->shards[i], 4);
+  free(group->shards);
+  group->shards = NULL;
+  group->nshards = 0;
+  return rc;
+}
+
+int
+ex_shard_group_start(ex_shard_group_t *group) {
+  ex_shard_t *shard = NULL;
+  int rc = 0;
+
+  for (int i = 0; i < group->nshards; ++i) {
+    shard = &group->shards[i];
+    shard->stats_ns = uv_hrtime();
+    uv_timer_start(&shard->stats, on_stats, EX_SHARD_BALANCE_MS, EX_SHARD_BALANCE_MS);
+    rc = uv_thread_create(&shard->thread, shard_main, shard);
+    if (rc < 0)
+      return rc;
+  }
+  return uv_timer_start(&group->balancer, on_balance, EX_SHARD_BALANCE_MS, EX_SHARD_BALANCE_MS);
+}
+
+/* Blocks until every shard thread has exited. */
+void
+ex_shard_group_stop(ex_shard_group_t *group) {
+  for (int i = 0; i < group->nshards; ++i)
+    shard_post(&group->shards[i], EX_SHARD_CMD_STOP, NULL, NULL, 0);
+  for (int i = 0; i < group->nshards; ++i)
+    uv_thread_join(&group->shards[i].thread);
+  if (!uv_is_closing((uv_handle_t *)&group->balancer))
+    uv_close((uv_handle_t *)&group->balancer, NULL);
+}
+
+void
+ex_shard_group_free(ex_shard_group_t *group) {
+  ex_shard_cmd_t *cmd = NULL;
+
+  for (int i = 0; i < group->nshards; ++i) {
+    while ((cmd = group->shards[i].head)) {
+      group->shards[i].head = cmd->next;
+      free(cmd);
+    }
+    uv_mutex_destroy(&group->shards[i].lock);
+  }
+  free(group->shards);
+  group->shards = NULL;
+  group->nshards = 0;
+}
+
+/* Asks the busiest shard to hand part of its load to the idlest one. */
+void
+ex_shard_group_balance(ex_shard_group_t *group) {
+  ex_shard_t *hot = NULL, *cold = NULL;
+  int busy = 0, hot_busy = -1, cold_busy = 1001;
+
+  if (group->cooldown > 0) {
+    group->cooldown--;
+    return;
+  }
+
+  for (int i = 0; i < group->nshards; ++i) {
+    busy = __atomic_load_n(&group->shards[i].busy_permille, __ATOMIC_RELAXED);
+    if (busy > hot_busy) {
+      hot_busy = busy;
+      hot = &group->shards[i];
+    }
+    if (busy < cold_busy) {
+      cold_busy = busy;
+      cold = &group->shards[i];
+    }
+  }
+
+  if (!hot || hot == cold)
+    return;
+  if (hot_busy < EX_SHARD_HOT_PERMILLE || hot_busy - cold_busy < EX_SHARD_GAP_PERMILLE)
+    return;
+
+  /* Move half the gap; the next round corrects any overshoot. */
+  if (ex_shard_shed(hot, cold, (hot_busy - cold_busy) * 1000 / (2 * hot_busy)) == 0) {
+    group->rebalances++;
+    group->cooldown = 2;
+  }
+}
+
+int
+ex_shard_add(ex_shard_group_t *group, ex_shard_item_t *item) {
+  ex_shard_t *shard = NULL;
+
+  if (!group || !item || group->nshards == 0)
+    return UV_EINVAL;
+  shard = &group->shards[group->next++ % group->nshards];
+  return ex_shard_add_to(shard, item);
+}
+
+int
+ex_shard_add_to(ex_shard_t *shard, ex_shard_item_t *item) {
+  if (!shard || !item)
+    return UV_EINVAL;
+  item->next = NULL;
+  item->prev = NULL;
+  item->owner = NULL;
+  item->target = NULL;
+  item->remove_pending = 0;
+  item->load = 0;
+  return shard_post(shard, EX_SHARD_CMD_ADD, item, NULL, 0);
+}
+
+int
+ex_shard_remove(ex_shard_item_t *item) {
+  ex_shard_t *owner = NULL;
+
+  if (!item)
+    return UV_EINVAL;
+  owner = __atomic_load_n(&item->owner, __ATOMIC_ACQUIRE);
+  if (!owner)
+    return UV_ENOENT;
+  return shard_post(owner, EX_SHARD_CMD_REMOVE, item, NULL, 0);
+}
+
+int
+ex_shard_migrate(ex_shard_item_t *item, ex_shard_t *target) {
+  ex_shard_t *owner = NULL;
+
+  if (!item || !target)
+    return UV_EINVAL;
+  owner = __atomic_load_n(&item->owner, __ATOMIC_ACQUIRE);
+  if (!owner)
+    return UV_ENOENT;
+  return shard_post(owner, EX_SHARD_CMD_MIGRATE, item, target, 0);
+}
+
+int
+ex_shard_shed(ex_shard_t *shard, ex_shard_t *target, int permille) {
+  if (!shard || !target || permille <= 0)
+    return UV_EINVAL;
+  return shard_post(shard, EX_SHARD_CMD_SHED, NULL, target, permille > 1000 ? 1000 : permille);
+}
+
+/* Called by the owner once `detach` has closed the item's handles. */
+void
+ex_shard_detached(ex_shard_item_t *item) {
+  ex_shard_t *shard = item->owner;
+  ex_shard_t *target = __atomic_load_n(&item->target, __ATOMIC_ACQUIRE);
+
+  /* The shard stopped while we were detaching; already removed. */
+  if (!item->next)
+    return;
+
+  item_unlink(shard, item);
+  __atomic_add_fetch(&shard->group->migrations, 1, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&item->owner, target, __ATOMIC_RELEASE);
+  if (shard_post(target, EX_SHARD_CMD_ADD, item, NULL, 0) < 0) {
+    /* Target is going away; drop the item here. */
+    __atomic_store_n(&item->owner, shard, __ATOMIC_RELEASE);
+    __atomic_store_n(&item->target, NULL, __ATOMIC_RELEASE);
+    shard->group->ops->remove(item, shard);
+  }
+}
@@ -0,0 +1,102 @@
+/* Sharded event loops: N threads, each running its own uv_loop_t.
+ *
+ * Connections embed an ex_shard_item_t and belong to exactly one shard at a
+ * time. Every cross-thread request (add, remove, migrate, shed, stop) goes
+ * through a mutex-protected command queue drained by a uv_async_t on the
+ * target loop, so connection state is only ever touched by its owner.
+ *
+ * Migration is two-phase: the owner detaches the item (stops I/O, closes
+ * its handles) and calls ex_shard_detached(), which hands it to the target
+ * shard where `attach` runs on the new loop.
+ */
+
+#ifndef EX_SHARD_H
+#define EX_SHARD_H
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#define EX_SHARD_BALANCE_MS     1000
+#define EX_SHARD_HOT_PERMILLE   600     /* Only shed load above 60% busy */
+#define EX_SHARD_GAP_PERMILLE   250     /* ... and 25% busier than the coldest */
+#define EX_SHARD_MAX_MOVES      64
+
+typedef struct ex_shard_s ex_shard_t;
+typedef struct ex_shard_item_s ex_shard_item_t;
+typedef struct ex_shard_group_s ex_shard_group_t;
+typedef struct ex_shard_cmd_s ex_shard_cmd_t;
+
+/* All hooks run on the shard's own thread. */
+typedef struct ex_shard_ops_s {
+  int (*shard_init)(ex_shard_t *shard);
+  void (*shard_fini)(ex_shard_t *shard);
+  void (*attach)(ex_shard_item_t *item, ex_shard_t *shard);
+  void (*detach)(ex_shard_item_t *item, ex_shard_t *shard);   /* Must end in ex_shard_detached() */
+  void (*remove)(ex_shard_item_t *item, ex_shard_t *shard);
+} ex_shard_ops_t;
+
+struct ex_shard_item_s {
+  ex_shard_item_t *next;
+  ex_shard_item_t *prev;
+  ex_shard_t *owner;
+  ex_shard_t *target;     /* Set while migrating */
+  int remove_pending;     /* Removed mid-migration: done where it lands */
+  uint64_t load;          /* Work since the last balance, owner thread only */
+  void *data;
+};
+
+struct ex_shard_s {
+  int id;
+  ex_shard_group_t *group;
+  uv_loop_t loop;
+  uv_thread_t thread;
+  uv_async_t ctl;
+  uv_timer_t stats;
+
+  uv_mutex_t lock;
+  ex_shard_cmd_t *head;
+  ex_shard_cmd_t *tail;
+
+  ex_shard_item_t items;  /* List head */
+  int count;
+  int stopping;
+
+  /* Published for the balancer on the group's loop */
+  uint64_t idle_ns;
+  uint64_t stats_ns;
+  int busy_permille;
+  int item_count;
+
+  void *data;
+};
+
+struct ex_shard_group_s {
+  uv_loop_t *loop;
+  uv_timer_t balancer;
+  const ex_shard_ops_t *ops;
+  ex_shard_t *shards;
+  int nshards;
+  int next;
+  int cooldown;
+
+  uint64_t migrations;
+  uint64_t rebalances;
+
+  void *data;
+};
+
+int ex_shard_group_init(ex_shard_group_t *group, uv_loop_t *loop, int nshards, const ex_shard_ops_t *ops);
+int ex_shard_group_start(ex_shard_group_t *group);
+void ex_shard_group_stop(ex_shard_group_t *group);
+void ex_shard_group_free(ex_shard_group_t *group);
+void ex_shard_group_balance(ex_shard_group_t *group);
+
+int ex_shard_add(ex_shard_group_t *group, ex_shard_item_t *item);
+int ex_shard_add_to(ex_shard_t *shard, ex_shard_item_t *item);
+int ex_shard_remove(ex_shard_item_t *item);
+int ex_shard_migrate(ex_shard_item_t *item, ex_shard_t *target);
+int ex_shard_shed(ex_shard_t *shard, ex_shard_t *target, int permille);
+void ex_shard_detached(ex_shard_item_t *item);
+
+#endif
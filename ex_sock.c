@@ -0,0 +1,41 @@
+/* Unix socket paths left behind by a server that died. */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <uv.h>
+
+#include "ex_sock.h"
+
+int
+ex_sock_unlink_stale(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd = -1;
+  int rc = 0;
+
+  if (lstat(path, &st) < 0)
+    return errno == ENOENT ? 0 : uv_translate_sys_error(errno);
+  if (!S_ISSOCK(st.st_mode) || strlen(path) >= sizeof(addr.sun_path))
+    return UV_EADDRINUSE;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return uv_translate_sys_error(errno);
+
+  /* Non-blocking, so a full backlog reads as in use rather than waits */
+  rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ? errno : 0;
+  close(fd);
+  if (rc != ECONNREFUSED)
+    return UV_EADDRINUSE;
+  if (unlink(path) < 0 && errno != ENOENT)
+    return uv_translate_sys_error(errno);
+  return 0;
+}
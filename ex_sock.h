@@ -0,0 +1,15 @@
+/* Unix socket paths left behind.
+ *
+ * A server that dies leaves its socket file, and binding the path again
+ * fails until it is gone. Only a socket nothing accepts on anymore is
+ * removed: the path must be a socket, and a connect to it must be refused.
+ * A live server, or a file that is not a socket, is left alone.
+ */
+
+#ifndef EX_SOCK_H
+#define EX_SOCK_H
+
+/* 0 once `path` is free to bind, UV_EADDRINUSE if something else has it. */
+int ex_sock_unlink_stale(const char *path);
+
+#endif
@@ -0,0 +1,53 @@
+/* Connection state tables. */
+
+#include <uv.h>
+
+#include "ex_state.h"
+
+#define X -1    /* Event not accepted in this state */
+
+const ex_state_desc_t ex_states[EX_ST_COUNT] = {
+  [EX_ST_IDLE]        = { "idle",        0 },
+  [EX_ST_RESOLVING]   = { "resolving",   EX_RESOLVE_DEADLINE_MS },
+  [EX_ST_CONNECTING]  = { "connecting",  EX_CONNECT_DEADLINE_MS },
+  [EX_ST_HANDSHAKING] = { "handshaking", EX_HANDSHAKE_DEADLINE_MS },
+  [EX_ST_STREAMING]   = { "streaming",   EX_IDLE_DEADLINE_MS },
+  [EX_ST_DRAINING]    = { "draining",    EX_DRAIN_DEADLINE_MS },
+  [EX_ST_CLOSED]      = { "closed",      0 },
+};
+
+static const char *const event_names[EX_EV_COUNT] = {
+  "start", "resolved", "connected", "auth reply", "error", "timeout", "close", "drained",
+};
+
+static const signed char transitions[EX_ST_COUNT][EX_EV_COUNT] = {
+  /*                    start             resolved          connected          auth reply        error         timeout       close            drained */
+  [EX_ST_IDLE]        = { EX_ST_RESOLVING, X,                X,                 X,                X,            X,            EX_ST_CLOSED,    X },
+  [EX_ST_RESOLVING]   = { X,               EX_ST_CONNECTING, X,                 X,                EX_ST_CLOSED, EX_ST_CLOSED, EX_ST_CLOSED,    X },
+  [EX_ST_CONNECTING]  = { X,               X,                EX_ST_HANDSHAKING, X,                EX_ST_CLOSED, EX_ST_CLOSED, EX_ST_CLOSED,    X },
+  [EX_ST_HANDSHAKING] = { X,               X,                X,                 EX_ST_STREAMING,  EX_ST_CLOSED, EX_ST_CLOSED, EX_ST_DRAINING,  X },
+  [EX_ST_STREAMING]   = { X,               X,                X,                 X,                EX_ST_CLOSED, EX_ST_CLOSED, EX_ST_DRAINING,  X },
+  [EX_ST_DRAINING]    = { X,               X,                X,                 X,                EX_ST_CLOSED, EX_ST_CLOSED, X,               EX_ST_CLOSED },
+  [EX_ST_CLOSED]      = { EX_ST_RESOLVING, X,                X,                 X,                X,            X,            X,               X },
+};
+
+/* Returns the state `event` leads to, or UV_EINVAL if it is not accepted. */
+int
+ex_state_next(int state, int event) {
+  int next = X;
+
+  if (state < 0 || state >= EX_ST_COUNT || event < 0 || event >= EX_EV_COUNT)
+    return UV_EINVAL;
+  next = transitions[state][event];
+  return next == X ? UV_EINVAL : next;
+}
+
+const char *
+ex_state_name(int state) {
+  return state >= 0 && state < EX_ST_COUNT ? ex_states[state].name : "?";
+}
+
+const char *
+ex_event_name(int event) {
+  return event >= 0 && event < EX_EV_COUNT ? event_names[event] : "?";
+}
@@ -0,0 +1,59 @@
+/* Connection states, the events that move between them, and how long each
+ * state may last.
+ *
+ *   idle -> resolving -> connecting -> handshaking -> streaming
+ *                                          |              |
+ *                                          +-> draining <-+
+ *                                                 |
+ *   (any error or deadline) ----------------> closed -> resolving ...
+ *
+ * The tables live in ex_state.c; callers keep the current state, feed it
+ * events through ex_state_next() and run their own action on entry.
+ */
+
+#ifndef EX_STATE_H
+#define EX_STATE_H
+
+#include <stdint.h>
+
+#define EX_RESOLVE_DEADLINE_MS    5000
+#define EX_CONNECT_DEADLINE_MS    10000
+#define EX_HANDSHAKE_DEADLINE_MS  5000
+#define EX_IDLE_DEADLINE_MS       75000     /* Heartbeat replies come every 30 s */
+#define EX_DRAIN_DEADLINE_MS      2000
+
+enum ex_state {
+  EX_ST_IDLE = 0,
+  EX_ST_RESOLVING,
+  EX_ST_CONNECTING,
+  EX_ST_HANDSHAKING,
+  EX_ST_STREAMING,
+  EX_ST_DRAINING,
+  EX_ST_CLOSED,
+  EX_ST_COUNT,
+};
+
+enum ex_event {
+  EX_EV_START = 0,
+  EX_EV_RESOLVED,
+  EX_EV_CONNECTED,
+  EX_EV_AUTH_REPLY,
+  EX_EV_ERROR,
+  EX_EV_TIMEOUT,
+  EX_EV_CLOSE,      /* Orderly close requested */
+  EX_EV_DRAINED,
+  EX_EV_COUNT,
+};
+
+typedef struct ex_state_desc_s {
+  const char *name;
+  uint64_t deadline_ms;     /* 0 for none */
+} ex_state_desc_t;
+
+extern const ex_state_desc_t ex_states[EX_ST_COUNT];
+
+int ex_state_next(int state, int event);
+const char *ex_state_name(int state);
+const char *ex_event_name(int event);
+
+#endif
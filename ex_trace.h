@@ -0,0 +1,41 @@
+/* Binary frame trace, cheap enough to leave on in production.
+ *
+ * A trace file is the 8-byte magic "EXTRACE1" followed by records:
+ *
+ *   0               8       12      16
+ *   +---------------+-------+-------+----------------
+ *   |   hrtime ns   | conn  |  len  | raw frame ...
+ *   +---------------+-------+-------+----------------
+ *
+ * Record headers are in host byte order; the frame is stored exactly as
+ * received, header included. Writes go through a large stdio buffer.
+ */
+
+#ifndef EX_TRACE_H
+#define EX_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define EX_TRACE_MAGIC      "EXTRACE1"
+#define EX_TRACE_BUF_LEN    (1 << 20)
+
+typedef struct ex_trace_rec_s {
+  uint64_t ts_ns;
+  uint32_t conn;
+  uint32_t len;
+} ex_trace_rec_t;
+
+typedef struct ex_trace_s {
+  FILE *fp;
+  char *buf;
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t errors;
+} ex_trace_t;
+
+int ex_trace_open(ex_trace_t *trace, const char *path);
+int ex_trace_frame(ex_trace_t *trace, uint32_t conn, const uint8_t *data, uint32_t len);
+int ex_trace_close(ex_trace_t *trace);
+
+#endif
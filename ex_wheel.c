@@ -0,0 +1,288 @@
+/* Hierarchical timing wheel driven by a single uv_timer_t.
+ *
+ * Level 0 holds entries due within 64 ticks, one slot per tick. Each higher
+ * level covers 64 slots of the level below and is cascaded down one slot at
+ * a time whenever the level below wraps. A bitmap per level lets the uv timer
+ * sleep straight to the next occupied level-0 slot or the next wrap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ex_wheel.h"
+
+#define EX_WHEEL_PENDING  0xff
+#define EX_WHEEL_MAX      ((1ULL << (EX_WHEEL_BITS * EX_WHEEL_LEVELS)) - 1)
+
+static void on_tick(uv_timer_t *timer);
+
+static inline void
+list_init(ex_wheel_entry_t *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+static inline void
+list_append(ex_wheel_entry_t *head, ex_wheel_entry_t *entry) {
+  entry->prev = head->prev;
+  entry->next = head;
+  head->prev->next = entry;
+  head->prev = entry;
+}
+
+static uint64_t
+wheel_elapsed(ex_wheel_t *wheel) {
+  return (uv_now(wheel->loop) - wheel->start_ms) / wheel->tick_ms;
+}
+
+static uint64_t
+wheel_rand(ex_wheel_t *wheel) {
+  /* xorshift64 */
+  uint64_t x = wheel->rand;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  wheel->rand = x;
+  return x;
+}
+
+static void
+wheel_place(ex_wheel_t *wheel, ex_wheel_entry_t *entry) {
+  uint64_t expires = entry->expires;
+  uint64_t delta = 0;
+  int level = 0;
+
+  if (expires < wheel->now)
+    expires = wheel->now;
+  delta = expires - wheel->now;
+  if (delta > EX_WHEEL_MAX) {
+    delta = EX_WHEEL_MAX;
+    expires = wheel->now + delta;
+  }
+  entry->expires = expires;
+
+  for (level = 0; level < EX_WHEEL_LEVELS - 1; ++level) {
+    if (delta < (1ULL << (EX_WHEEL_BITS * (level + 1))))
+      break;
+  }
+
+  entry->level = level;
+  entry->slot = (expires >> (EX_WHEEL_BITS * level)) & EX_WHEEL_MASK;
+  list_append(&wheel->slots[level][entry->slot], entry);
+  wheel->occupied[level] |= 1ULL << entry->slot;
+}
+
+static void
+wheel_cascade(ex_wheel_t *wheel, int level, int slot) {
+  ex_wheel_entry_t *head = &wheel->slots[level][slot];
+  ex_wheel_entry_t *entry = head->next;
+  ex_wheel_entry_t *last = head->prev;
+  ex_wheel_entry_t *next = NULL;
+
+  if (entry == head)
+    return;
+
+  list_init(head);
+  wheel->occupied[level] &= ~(1ULL << slot);
+
+  for (;;) {
+    next = entry->next;
+    wheel_place(wheel, entry);
+    if (entry == last)
+      break;
+    entry = next;
+  }
+}
+
+static void
+wheel_schedule(ex_wheel_t *wheel) {
+  uint64_t base = 0, bits = 0, tick = 0, at_ms = 0, now_ms = 0;
+
+  if (wheel->count == 0) {
+    if (wheel->timer_on)
+      uv_timer_stop(&wheel->timer);
+    wheel->timer_on = 0;
+    return;
+  }
+
+  base = wheel->now & EX_WHEEL_MASK;
+  bits = wheel->occupied[0] >> base;
+  if (base == 0 && (wheel->occupied[1] | wheel->occupied[2] | wheel->occupied[3]))
+    tick = wheel->now;    /* Cascade due before anything in level 0 */
+  else if (bits)
+    tick = wheel->now + __builtin_ctzll(bits);
+  else
+    tick = (wheel->now | EX_WHEEL_MASK) + 1;
+
+  if (wheel->timer_on && wheel->wake <= tick)
+    return;
+
+  at_ms = wheel->start_ms + tick * wheel->tick_ms;
+  now_ms = uv_now(wheel->loop);
+  uv_timer_start(&wheel->timer, on_tick, at_ms > now_ms ? at_ms - now_ms : 0, 0);
+  wheel->wake = tick;
+  wheel->timer_on = 1;
+}
+
+static void
+wheel_step(ex_wheel_t *wheel) {
+  ex_wheel_entry_t pending;
+  ex_wheel_entry_t *head = NULL, *entry = NULL;
+  int slot = wheel->now & EX_WHEEL_MASK;
+  int level = 0, lslot = 0;
+
+  if (slot == 0) {
+    for (level = 1; level < EX_WHEEL_LEVELS; ++level) {
+      lslot = (wheel->now >> (EX_WHEEL_BITS * level)) & EX_WHEEL_MASK;
+      wheel_cascade(wheel, level, lslot);
+      if (lslot != 0)
+        break;
+    }
+  }
+
+  /* Detach the slot first so callbacks may re-arm into it. */
+  head = &wheel->slots[0][slot];
+  list_init(&pending);
+  if (head->next != head) {
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+    wheel->occupied[0] &= ~(1ULL << slot);
+    for (entry = pending.next; entry != &pending; entry = entry->next)
+      entry->level = EX_WHEEL_PENDING;
+  }
+  wheel->now++;
+
+  while (pending.next != &pending) {
+    entry = pending.next;
+    ex_wheel_cancel(entry);
+    entry->cb(entry);
+  }
+}
+
+static void
+on_tick(uv_timer_t *timer) {
+  ex_wheel_t *wheel = timer->data;
+  uint64_t target = wheel_elapsed(wheel);
+
+  wheel->timer_on = 0;
+  while (wheel->now <= target && wheel->count > 0)
+    wheel_step(wheel);
+  wheel_schedule(wheel);
+}
+
+int
+ex_wheel_init(ex_wheel_t *wheel, uv_loop_t *loop, uint64_t tick_ms) {
+  int rc = 0;
+
+  if (!wheel || !loop)
+    return UV_EINVAL;
+
+  memset(wheel, 0, sizeof(*wheel));
+  for (int level = 0; level < EX_WHEEL_LEVELS; ++level) {
+    for (int slot = 0; slot < EX_WHEEL_SLOTS; ++slot)
+      list_init(&wheel->slots[level][slot]);
+  }
+
+  rc = uv_timer_init(loop, &wheel->timer);
+  if (rc < 0)
+    return rc;
+
+  wheel->loop = loop;
+  wheel->tick_ms = tick_ms ? tick_ms : EX_WHEEL_TICK_MS;
+  wheel->start_ms = uv_now(loop);
+  wheel->rand = uv_hrtime() | 1;
+  wheel->timer.data = wheel;
+  return 0;
+}
+
+void
+ex_wheel_close(ex_wheel_t *wheel, uv_close_cb cb) {
+  ex_wheel_entry_t *head = NULL;
+
+  if (!wheel)
+    return;
+
+  /* Disarm everything still on the wheel. */
+  for (int level = 0; level < EX_WHEEL_LEVELS; ++level) {
+    for (int slot = 0; slot < EX_WHEEL_SLOTS; ++slot) {
+      head = &wheel->slots[level][slot];
+      while (head->next != head)
+        ex_wheel_cancel(head->next);
+    }
+  }
+  wheel->timer_on = 0;
+  if (!uv_is_closing((uv_handle_t *)&wheel->timer))
+    uv_close((uv_handle_t *)&wheel->timer, cb);
+}
+
+void
+ex_wheel_entry_init(ex_wheel_entry_t *entry, ex_wheel_cb cb, void *data) {
+  memset(entry, 0, sizeof(*entry));
+  entry->cb = cb;
+  entry->data = data;
+}
+
+int
+ex_wheel_arm(ex_wheel_t *wheel, ex_wheel_entry_t *entry, uint64_t timeout_ms) {
+  uint64_t elapsed_ms = 0;
+
+  if (!wheel || !entry || !entry->cb)
+    return UV_EINVAL;
+
+  ex_wheel_cancel(entry);
+
+  /* Nothing to cascade while empty; jump to the present. */
+  if (wheel->count == 0 && wheel->now < wheel_elapsed(wheel))
+    wheel->now = wheel_elapsed(wheel);
+
+  elapsed_ms = uv_now(wheel->loop) - wheel->start_ms;
+  entry->wheel = wheel;
+  entry->expires = (elapsed_ms + timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  wheel_place(wheel, entry);
+  wheel->count++;
+
+  wheel_schedule(wheel);
+  return 0;
+}
+
+int
+ex_wheel_arm_jitter(ex_wheel_t *wheel, ex_wheel_entry_t *entry, uint64_t timeout_ms, uint64_t jitter_ms) {
+  if (!wheel)
+    return UV_EINVAL;
+  if (jitter_ms)
+    timeout_ms += wheel_rand(wheel) % (jitter_ms + 1);
+  return ex_wheel_arm(wheel, entry, timeout_ms);
+}
+
+void
+ex_wheel_cancel(ex_wheel_entry_t *entry) {
+  ex_wheel_t *wheel = entry->wheel;
+  ex_wheel_entry_t *head = NULL;
+
+  if (!entry->next)
+    return;
+
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  if (entry->level != EX_WHEEL_PENDING) {
+    head = &wheel->slots[entry->level][entry->slot];
+    if (head->next == head)
+      wheel->occupied[entry->level] &= ~(1ULL << entry->slot);
+  }
+  entry->next = NULL;
+  entry->prev = NULL;
+
+  /* Let the loop exit once nothing is armed. */
+  if (--wheel->count == 0 && wheel->timer_on) {
+    uv_timer_stop(&wheel->timer);
+    wheel->timer_on = 0;
+  }
+}
+
+int
+ex_wheel_is_armed(const ex_wheel_entry_t *entry) {
+  return entry->next != NULL;
+}
@@ -0,0 +1,62 @@
+/* Hierarchical timing wheel driven by a single uv_timer_t.
+ *
+ * Entries are embedded in their owner and linked into per-slot lists, so
+ * arming and cancelling are O(1) and never touch libuv's timer heap. Four
+ * levels of 64 slots cover 2^24 ticks; with 10 ms ticks that is ~46 hours.
+ */
+
+#ifndef EX_WHEEL_H
+#define EX_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#define EX_WHEEL_BITS     6
+#define EX_WHEEL_SLOTS    (1 << EX_WHEEL_BITS)
+#define EX_WHEEL_MASK     (EX_WHEEL_SLOTS - 1)
+#define EX_WHEEL_LEVELS   4
+#define EX_WHEEL_TICK_MS  10
+
+typedef struct ex_wheel_s ex_wheel_t;
+typedef struct ex_wheel_entry_s ex_wheel_entry_t;
+typedef void (*ex_wheel_cb)(ex_wheel_entry_t *entry);
+
+struct ex_wheel_entry_s {
+  ex_wheel_entry_t *next;
+  ex_wheel_entry_t *prev;
+  ex_wheel_t *wheel;
+  uint64_t expires;       /* In ticks */
+  uint8_t level;
+  uint8_t slot;
+  ex_wheel_cb cb;
+  void *data;
+};
+
+struct ex_wheel_s {
+  uv_loop_t *loop;
+  uv_timer_t timer;
+  uint64_t tick_ms;
+  uint64_t start_ms;
+  uint64_t now;           /* Next tick to be processed */
+  uint64_t wake;          /* Tick the uv timer is armed for */
+  int timer_on;
+  size_t count;
+  uint64_t rand;
+
+  uint64_t occupied[EX_WHEEL_LEVELS];
+  ex_wheel_entry_t slots[EX_WHEEL_LEVELS][EX_WHEEL_SLOTS];
+
+  void *data;
+};
+
+int ex_wheel_init(ex_wheel_t *wheel, uv_loop_t *loop, uint64_t tick_ms);
+void ex_wheel_close(ex_wheel_t *wheel, uv_close_cb cb);
+void ex_wheel_entry_init(ex_wheel_entry_t *entry, ex_wheel_cb cb, void *data);
+int ex_wheel_arm(ex_wheel_t *wheel, ex_wheel_entry_t *entry, uint64_t timeout_ms);
+int ex_wheel_arm_jitter(ex_wheel_t *wheel, ex_wheel_entry_t *entry, uint64_t timeout_ms, uint64_t jitter_ms);
+void ex_wheel_cancel(ex_wheel_entry_t *entry);
+int ex_wheel_is_armed(const ex_wheel_entry_t *entry);
+
+#endif
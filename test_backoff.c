@@ -0,0 +1,93 @@
+/* ex_backoff: delays stay under the ceiling, which resets only after a
+ * session that lasted, and outages are measured once each. */
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "ex_backoff.h"
+
+static void
+test_delays(void) {
+  ex_backoff_t b;
+  uint64_t d = 0;
+  int zeros = 0;
+
+  ex_backoff_init(&b, 100, 1000);
+  for (uint32_t i = 0; i < 200; ++i) {
+    d = ex_backoff_next(&b);
+    assert(d <= (i < 4 ? 100u << i : 1000u));
+  }
+  assert(b.attempt == 200);
+
+  /* Defaults, and a cap below the base */
+  ex_backoff_init(&b, 0, 0);
+  assert(b.base_ms == EX_BACKOFF_BASE_MS && b.cap_ms == EX_BACKOFF_BASE_MS);
+  ex_backoff_init(&b, 500, 10);
+  assert(b.cap_ms == 500);
+  assert(ex_backoff_next(&b) <= 500);
+
+  /* Shifts past 64 bits hold the cap, rather than wrap to nothing */
+  ex_backoff_init(&b, 1000, UINT64_MAX);
+  for (int i = 0; i < 100; ++i)
+    ex_backoff_next(&b);
+  ex_backoff_init(&b, (uint64_t)1 << 40, (uint64_t)1 << 50);
+  for (uint32_t i = 0; i < 32; ++i) {
+    d = ex_backoff_next(&b);
+    assert(d <= (uint64_t)1 << 50);
+    zeros += i >= 24 && d == 0;
+  }
+  assert(zeros < 8);
+}
+
+/* Two instances started together draw different delays */
+static void
+test_seeds(void) {
+  ex_backoff_t a, b;
+  int same = 0;
+
+  ex_backoff_init(&a, 1000, 60000);
+  ex_backoff_init(&b, 1000, 60000);
+  for (int i = 0; i < 16; ++i)
+    same += ex_backoff_next(&a) == ex_backoff_next(&b);
+  assert(same < 16);
+}
+
+static void
+test_outages(void) {
+  ex_outage_t outage;
+  ex_backoff_t b;
+
+  ex_backoff_init(&b, 100, 1000);
+  assert(ex_backoff_up(&b, 10, &outage) == 0);
+
+  /* A short session does not reset the ceiling */
+  ex_backoff_down(&b, 1000);
+  ex_backoff_next(&b);
+  ex_backoff_next(&b);
+  ex_backoff_down(&b, 1500);            /* Failed attempt: same outage */
+  ex_backoff_next(&b);
+  assert(ex_backoff_up(&b, 4000, &outage) == 1);
+  assert(outage.attempts == 3 && outage.end_ms >= outage.start_ms);
+  assert(b.outages == 1 && b.longest_ms == 3000);
+
+  ex_backoff_down(&b, 4000 + EX_BACKOFF_STABLE_MS - 1);
+  assert(b.attempt == 3);
+  ex_backoff_next(&b);
+  assert(ex_backoff_up(&b, 5000 + EX_BACKOFF_STABLE_MS, NULL) == 1);
+  assert(b.outages == 2 && b.longest_ms == 3000);
+
+  /* A stable one does */
+  ex_backoff_down(&b, 5000 + 2 * EX_BACKOFF_STABLE_MS);
+  assert(b.attempt == 0);
+  assert(ex_backoff_up(&b, 5000 + 2 * EX_BACKOFF_STABLE_MS + 9000, &outage) == 1);
+  assert(outage.attempts == 0 && b.longest_ms == 9000);
+}
+
+int
+main(void) {
+  test_delays();
+  test_seeds();
+  test_outages();
+  printf("test_backoff: ok\n");
+  return 0;
+}
@@ -0,0 +1,50 @@
+/* ex_cmd: every name in ex_cmd.def finds its id, and near misses find
+ * nothing. */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ex_cmd.h"
+
+static void
+test_known(void) {
+  const char *name = NULL;
+
+  for (int cmd = 0; cmd < EX_CMD_COUNT; ++cmd) {
+    name = ex_cmd_name(cmd);
+    assert(ex_cmd_lookup(name, strlen(name)) == cmd);
+  }
+  assert(ex_cmd_lookup("DANMU_MSG", 9) == EX_CMD_DANMU_MSG);
+  assert(strcmp(ex_cmd_name(EX_CMD_COUNT), "?") == 0);
+  assert(strcmp(ex_cmd_name(EX_CMD_UNKNOWN), "?") == 0);
+}
+
+static void
+test_unknown(void) {
+  char buf[64];
+  size_t len = 0;
+
+  assert(ex_cmd_lookup("", 0) == EX_CMD_UNKNOWN);
+  assert(ex_cmd_lookup("NOT_A_CMD", 9) == EX_CMD_UNKNOWN);
+  assert(ex_cmd_lookup("danmu_msg", 9) == EX_CMD_UNKNOWN);
+
+  /* Prefixes, one byte longer, one byte changed */
+  for (int cmd = 0; cmd < EX_CMD_COUNT; ++cmd) {
+    len = strlen(ex_cmd_name(cmd));
+    memcpy(buf, ex_cmd_name(cmd), len);
+    assert(ex_cmd_lookup(buf, len - 1) != cmd);
+    buf[len] = 'X';
+    assert(ex_cmd_lookup(buf, len + 1) == EX_CMD_UNKNOWN);
+    buf[len - 1] ^= 1;
+    assert(ex_cmd_lookup(buf, len) == EX_CMD_UNKNOWN);
+  }
+}
+
+int
+main(void) {
+  test_known();
+  test_unknown();
+  printf("test_cmd: ok\n");
+  return 0;
+}
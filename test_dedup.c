@@ -0,0 +1,104 @@
+/* ex_dedup: bucket eviction, bucket independence and the window. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <uv.h>
+
+#include "ex_dedup.h"
+
+/* Low half distinct, high half picks the bucket */
+#define KEY(bucket, n)  (((uint64_t)(bucket) << 32) | ((uint64_t)(n) + 1))
+
+/* One bucket: the ninth key pushes out the first, and only the first */
+static void
+test_eviction(void) {
+  ex_dedup_t d;
+
+  assert(ex_dedup_init(&d, EX_DEDUP_WAYS, 0) == 0);
+  assert(d.mask == 0 && d.window_ms == EX_DEDUP_WINDOW_MS);
+
+  for (int i = 0; i < EX_DEDUP_WAYS; ++i)
+    assert(ex_dedup_first(&d, KEY(0, i), 0) == 1);
+  for (int i = 0; i < EX_DEDUP_WAYS; ++i)
+    assert(ex_dedup_first(&d, KEY(0, i), 1) == 0);
+
+  assert(ex_dedup_first(&d, KEY(0, EX_DEDUP_WAYS), 2) == 1);
+  assert(ex_dedup_first(&d, KEY(0, 0), 3) == 1);   /* Evicted, back as new */
+  for (int i = 3; i < EX_DEDUP_WAYS; ++i)
+    assert(ex_dedup_first(&d, KEY(0, i), 4) == 0);
+  assert(ex_dedup_first(&d, KEY(0, EX_DEDUP_WAYS), 5) == 0);
+
+  /* Re-adding 0 went over 1, then 2 */
+  assert(ex_dedup_first(&d, KEY(0, 1), 6) == 1);
+  assert(ex_dedup_first(&d, KEY(0, 3), 7) == 0);
+  assert(d.firsts == EX_DEDUP_WAYS + 3);
+  ex_dedup_free(&d);
+}
+
+/* Filling one bucket to overflow leaves the others alone */
+static void
+test_buckets(void) {
+  ex_dedup_t d;
+
+  assert(ex_dedup_init(&d, 100, 0) == 0);
+  assert(d.mask == 15);
+
+  for (int i = 0; i < EX_DEDUP_WAYS; ++i)
+    assert(ex_dedup_first(&d, KEY(1, i), 0) == 1);
+  for (int i = 0; i < 4 * EX_DEDUP_WAYS; ++i)
+    assert(ex_dedup_first(&d, KEY(2, 1000 + i), 0) == 1);
+  for (int i = 0; i < EX_DEDUP_WAYS; ++i)
+    assert(ex_dedup_first(&d, KEY(1, i), 0) == 0);
+
+  /* Only the masked bits choose the bucket */
+  assert(ex_dedup_first(&d, KEY(1 + 16, 0), 0) == 1);
+  assert(ex_dedup_first(&d, KEY(1, 2), 0) == 0);
+  assert(ex_dedup_first(&d, KEY(1, 0), 0) == 1);
+  ex_dedup_free(&d);
+}
+
+static void
+test_window(void) {
+  ex_dedup_t d;
+  uint64_t base = UINT32_MAX - 50;   /* Across the truncation's wrap */
+
+  assert(ex_dedup_init(&d, 64, 100) == 0);
+  assert(ex_dedup_first(&d, KEY(3, 0), base) == 1);
+  assert(ex_dedup_first(&d, KEY(3, 0), base + 100) == 0);
+  assert(ex_dedup_first(&d, KEY(3, 0), base + 101) == 1);
+
+  /* From the first arrival, not the latest duplicate */
+  assert(ex_dedup_first(&d, KEY(3, 0), base + 180) == 0);
+  assert(ex_dedup_first(&d, KEY(3, 0), base + 202) == 1);
+  assert(d.firsts == 3 && d.dups == 2);
+  ex_dedup_free(&d);
+}
+
+static void
+test_hash(void) {
+  char buf[64];
+
+  for (size_t len = 0; len <= sizeof(buf); ++len) {
+    for (size_t i = 0; i < len; ++i)
+      buf[i] = (char)i;
+    assert(ex_dedup_hash(buf, len) != 0);
+    if (len) {
+      buf[len - 1] ^= 1;
+      assert(ex_dedup_hash(buf, len) != ex_dedup_hash(buf, len - 1));
+    }
+  }
+  assert(ex_dedup_hash("abc", 3) == ex_dedup_hash("abc", 3));
+  assert(ex_dedup_hash("abc", 3) != ex_dedup_hash("abd", 3));
+}
+
+int
+main(void) {
+  test_eviction();
+  test_buckets();
+  test_window();
+  test_hash();
+  printf("test_dedup: ok\n");
+  return 0;
+}
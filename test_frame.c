@@ -0,0 +1,188 @@
+/* ex_frame: frames come out whole however the stream is cut into reads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <uv.h>
+
+#include "ex_frame.h"
+
+#define MAX_FRAMES  32
+
+typedef struct got_s {
+  int count;
+  uint32_t seq[MAX_FRAMES];
+  uint32_t op[MAX_FRAMES];
+  size_t len[MAX_FRAMES];
+  uint32_t sum[MAX_FRAMES];
+  int stop_at;              /* Fail the callback on this frame, -1 never */
+} got_t;
+
+static uint32_t
+body_sum(const uint8_t *p, size_t len) {
+  uint32_t sum = 0;
+
+  for (size_t i = 0; i < len; ++i)
+    sum = sum * 31 + p[i];
+  return sum;
+}
+
+static int
+on_frame(const ex_frame_t *frame, void *arg) {
+  got_t *got = arg;
+
+  assert(got->count < MAX_FRAMES);
+  if (got->count == got->stop_at)
+    return UV_ECANCELED;
+  got->seq[got->count] = frame->seq;
+  got->op[got->count] = frame->op;
+  got->len[got->count] = frame->body_len;
+  got->sum[got->count] = body_sum(frame->body, frame->body_len);
+  got->count++;
+  return 0;
+}
+
+/* Frames of the given body lengths back to back, bodies patterned by seq */
+static size_t
+make_stream(uint8_t *out, const size_t *lens, int n) {
+  size_t off = 0;
+
+  for (int i = 0; i < n; ++i) {
+    ex_frame_encode(out + off, EX_FRAME_HDR_LEN + lens[i], EX_VER_JSON, EX_OP_MESSAGE, i + 1);
+    for (size_t j = 0; j < lens[i]; ++j)
+      out[off + EX_FRAME_HDR_LEN + j] = (uint8_t)(i * 7 + j);
+    off += EX_FRAME_HDR_LEN + lens[i];
+  }
+  return off;
+}
+
+static void
+check_got(const got_t *got, const uint8_t *stream, const size_t *lens, int n) {
+  size_t off = 0;
+
+  assert(got->count == n);
+  for (int i = 0; i < n; ++i) {
+    assert(got->seq[i] == (uint32_t)i + 1);
+    assert(got->op[i] == EX_OP_MESSAGE);
+    assert(got->len[i] == lens[i]);
+    assert(got->sum[i] == body_sum(stream + off + EX_FRAME_HDR_LEN, lens[i]));
+    off += EX_FRAME_HDR_LEN + lens[i];
+  }
+}
+
+/* Every cut point, and every pair of cut points, over a stream whose bodies
+ * straddle the header, the tail's reuse limit and each other */
+static void
+test_splits(void) {
+  static const size_t lens[] = { 0, 1, 15, 16, 17, EX_FRAME_TAIL_KEEP + 40, 3 };
+  const int n = sizeof(lens) / sizeof(lens[0]);
+  ex_frame_decoder_t dec;
+  uint8_t stream[1024];
+  size_t total = make_stream(stream, lens, n);
+  uint8_t *piece = NULL;
+  got_t got;
+
+  for (size_t a = 0; a <= total; ++a) {
+    for (size_t b = a; b <= total; ++b) {
+      memset(&got, 0, sizeof(got));
+      got.stop_at = -1;
+      assert(ex_frame_decoder_init(&dec, 0) == 0);
+
+      /* Each read in its own allocation, so a view past it would show */
+      piece = malloc(a + 1);
+      memcpy(piece, stream, a);
+      assert(ex_frame_feed(&dec, piece, a, on_frame, &got) == 0);
+      free(piece);
+      piece = malloc(b - a + 1);
+      memcpy(piece, stream + a, b - a);
+      assert(ex_frame_feed(&dec, piece, b - a, on_frame, &got) == 0);
+      free(piece);
+      piece = malloc(total - b + 1);
+      memcpy(piece, stream + b, total - b);
+      assert(ex_frame_feed(&dec, piece, total - b, on_frame, &got) == 0);
+      free(piece);
+
+      check_got(&got, stream, lens, n);
+      assert(dec.tail_len == 0 && dec.need == 0);
+      assert(dec.frames == (uint64_t)n && dec.bytes == total);
+      ex_frame_decoder_free(&dec);
+    }
+  }
+}
+
+/* A frame far larger than the tail keeps, a byte at a time */
+static void
+test_bytewise(void) {
+  static const size_t lens[] = { 70000, 5, 0 };
+  const int n = sizeof(lens) / sizeof(lens[0]);
+  ex_frame_decoder_t dec;
+  uint8_t *stream = malloc(80000);
+  size_t total = make_stream(stream, lens, n);
+  got_t got;
+
+  memset(&got, 0, sizeof(got));
+  got.stop_at = -1;
+  assert(ex_frame_decoder_init(&dec, 0) == 0);
+  for (size_t i = 0; i < total; ++i)
+    assert(ex_frame_feed(&dec, stream + i, 1, on_frame, &got) == 0);
+  check_got(&got, stream, lens, n);
+
+  /* Released once delivered, not kept around */
+  assert(dec.tail_cap <= EX_FRAME_TAIL_KEEP);
+  ex_frame_decoder_free(&dec);
+  free(stream);
+}
+
+static void
+test_errors(void) {
+  ex_frame_decoder_t dec;
+  uint8_t buf[64];
+  got_t got;
+
+  memset(&got, 0, sizeof(got));
+  got.stop_at = -1;
+
+  /* Header shorter than 16 bytes */
+  assert(ex_frame_decoder_init(&dec, 0) == 0);
+  ex_frame_encode(buf, 20, EX_VER_JSON, EX_OP_MESSAGE, 1);
+  buf[5] = 8;
+  assert(ex_frame_feed(&dec, buf, 20, on_frame, &got) == UV_EPROTO);
+  ex_frame_decoder_free(&dec);
+
+  /* Packet shorter than its header, split inside the header */
+  assert(ex_frame_decoder_init(&dec, 0) == 0);
+  ex_frame_encode(buf, 10, EX_VER_JSON, EX_OP_MESSAGE, 1);
+  assert(ex_frame_feed(&dec, buf, 7, on_frame, &got) == 0);
+  assert(ex_frame_feed(&dec, buf + 7, 9, on_frame, &got) == UV_EPROTO);
+  ex_frame_decoder_free(&dec);
+
+  /* Over the limit */
+  assert(ex_frame_decoder_init(&dec, 32) == 0);
+  ex_frame_encode(buf, 33, EX_VER_JSON, EX_OP_MESSAGE, 1);
+  assert(ex_frame_feed(&dec, buf, 16, on_frame, &got) == UV_E2BIG);
+  ex_frame_decoder_free(&dec);
+  assert(got.count == 0);
+
+  /* The callback's error stops the feed and comes back out */
+  assert(ex_frame_decoder_init(&dec, 0) == 0);
+  ex_frame_encode(buf, 16, EX_VER_JSON, EX_OP_MESSAGE, 1);
+  ex_frame_encode(buf + 16, 16, EX_VER_JSON, EX_OP_MESSAGE, 2);
+  ex_frame_encode(buf + 32, 16, EX_VER_JSON, EX_OP_MESSAGE, 3);
+  got.stop_at = 1;
+  assert(ex_frame_feed(&dec, buf, 48, on_frame, &got) == UV_ECANCELED);
+  assert(got.count == 1 && got.seq[0] == 1);
+  ex_frame_decoder_free(&dec);
+
+  assert(ex_frame_feed(&dec, NULL, 1, on_frame, &got) == UV_EINVAL);
+}
+
+int
+main(void) {
+  test_splits();
+  test_bytewise();
+  test_errors();
+  printf("test_frame: ok\n");
+  return 0;
+}
@@ -0,0 +1,59 @@
+/* ex_hex: whichever implementation the CPU picks matches a plain loop, at
+ * every length around its block sizes and at any alignment. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ex_hex.h"
+
+static void
+reference(char *out, const uint8_t *in, size_t len) {
+  for (size_t i = 0; i < len; ++i)
+    sprintf(out + i * 3, "%02X ", in[i]);
+}
+
+static void
+test_encode(void) {
+  uint8_t in[300];
+  char want[sizeof(in) * EX_HEX_CHARS + 1];
+  char *out = NULL;
+
+  for (size_t i = 0; i < sizeof(in); ++i)
+    in[i] = (uint8_t)(i * 151 + 7);
+
+  for (size_t off = 0; off < 4; ++off) {
+    for (size_t len = 0; len + off <= sizeof(in); ++len) {
+      reference(want, in + off, len);
+      out = malloc(len ? len * EX_HEX_CHARS : 1);   /* Exact, for ASan */
+      assert(ex_hex_encode(out, in + off, len) == len * EX_HEX_CHARS);
+      assert(memcmp(out, want, len * EX_HEX_CHARS) == 0);
+      free(out);
+    }
+  }
+}
+
+static void
+test_buf(void) {
+  ex_hexbuf_t buf = { NULL, 0 };
+  uint8_t in[100] = { 0xAB };
+  size_t cap = 0;
+
+  assert(ex_hexbuf_encode(&buf, in, 1) == 3);
+  assert(memcmp(buf.data, "AB ", 3) == 0);
+  assert(ex_hexbuf_encode(&buf, in, sizeof(in)) == sizeof(in) * 3);
+  cap = buf.cap;
+  assert(ex_hexbuf_encode(&buf, in, 2) == 6);
+  assert(buf.cap == cap);
+  ex_hexbuf_free(&buf);
+  assert(buf.data == NULL);
+}
+
+int
+main(void) {
+  test_encode();
+  test_buf();
+  printf("test_hex: ok (%s)\n", ex_hex_impl());
+  return 0;
+}
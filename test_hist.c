@@ -0,0 +1,87 @@
+/* ex_hist: percentiles within a bucket's width of the truth, and merging
+ * the same as recording into one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "ex_hist.h"
+
+static ex_hist_t a, b, all;
+
+/* Never under the value, and over by no more than a bucket */
+static int
+close_to(uint64_t got, uint64_t want) {
+  return got >= want && got - want <= want / EX_HIST_HALF;
+}
+
+static void
+test_exact(void) {
+  ex_hist_reset(&a);
+  assert(ex_hist_percentile(&a, 50) == 0);
+  assert(a.min == UINT64_MAX);
+
+  /* One bucket per value at the bottom */
+  for (uint64_t v = 1; v <= 100; ++v)
+    ex_hist_record(&a, v);
+  assert(ex_hist_percentile(&a, 0) == 1);
+  assert(ex_hist_percentile(&a, 50) == 50);
+  assert(ex_hist_percentile(&a, 99) == 99);
+  assert(ex_hist_percentile(&a, 100) == 100);
+  assert(a.count == 100 && a.sum == 5050 && a.min == 1 && a.max == 100);
+}
+
+static void
+test_range(void) {
+  uint64_t v = 0;
+
+  /* Every power of two, and either side of it */
+  ex_hist_reset(&a);
+  for (int s = 7; s < 64; ++s) {
+    for (int d = -1; d <= 1; ++d) {
+      v = ((uint64_t)1 << s) + d;
+      ex_hist_reset(&b);
+      ex_hist_record(&b, v);
+      ex_hist_record(&b, UINT64_MAX);
+      assert(close_to(ex_hist_percentile(&b, 50), v));
+      ex_hist_record(&a, v);
+    }
+  }
+  ex_hist_record(&a, UINT64_MAX);
+  assert(ex_hist_percentile(&a, 100) == UINT64_MAX);
+  assert(ex_hist_percentile(&a, 0) == 127);
+}
+
+static void
+test_merge(void) {
+  uint64_t v = 0;
+
+  ex_hist_reset(&a);
+  ex_hist_reset(&b);
+  ex_hist_reset(&all);
+  srand(1);
+  for (int i = 0; i < 100000; ++i) {
+    v = (uint64_t)rand() * (i % 7 + 1);
+    ex_hist_record(i % 3 ? &a : &b, v);
+    ex_hist_record(&all, v);
+  }
+  ex_hist_merge(&a, &b);
+  assert(a.count == all.count && a.sum == all.sum);
+  assert(a.min == all.min && a.max == all.max);
+  for (double p = 0; p <= 100; p += 0.5)
+    assert(ex_hist_percentile(&a, p) == ex_hist_percentile(&all, p));
+
+  /* An empty one changes nothing, min included */
+  ex_hist_reset(&b);
+  ex_hist_merge(&a, &b);
+  assert(a.min == all.min && a.count == all.count);
+}
+
+int
+main(void) {
+  test_exact();
+  test_range();
+  test_merge();
+  printf("test_hist: ok\n");
+  return 0;
+}
@@ -0,0 +1,140 @@
+/* ex_inflate: batches come apart into their frames whatever the window
+ * size, and a damaged batch is refused. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <uv.h>
+#include <zlib.h>
+
+#include "ex_inflate.h"
+
+#define INNER   40
+
+typedef struct got_s {
+  ex_inflate_t *inf;
+  int count;
+  int stop_at;              /* Fail the callback on this frame, -1 never */
+  int nested_rc;
+} got_t;
+
+static uint32_t
+inner_len(int i) {
+  return 1 + (i * 53) % 400;
+}
+
+static int
+on_frame(const ex_frame_t *frame, void *arg) {
+  got_t *got = arg;
+  ex_frame_t again;
+
+  if (got->count == got->stop_at)
+    return UV_ECANCELED;
+  assert(frame->seq == (uint32_t)got->count + 1);
+  assert(frame->op == EX_OP_MESSAGE);
+  assert(frame->body_len == inner_len(got->count));
+  for (size_t j = 0; j < frame->body_len; ++j)
+    assert(frame->body[j] == (uint8_t)(got->count + j));
+
+  /* The window is still handed out */
+  memset(&again, 0, sizeof(again));
+  got->nested_rc = ex_inflate_frame(got->inf, &again, on_frame, got);
+  got->count++;
+  return 0;
+}
+
+/* The inner frames, deflated; returns the compressed length */
+static size_t
+make_batch(uint8_t *out, size_t cap, size_t *raw_len) {
+  uint8_t *raw = malloc(INNER * (EX_FRAME_HDR_LEN + 400));
+  uLongf len = cap;
+  size_t off = 0;
+
+  for (int i = 0; i < INNER; ++i) {
+    ex_frame_encode(raw + off, EX_FRAME_HDR_LEN + inner_len(i), EX_VER_JSON, EX_OP_MESSAGE, i + 1);
+    off += EX_FRAME_HDR_LEN;
+    for (uint32_t j = 0; j < inner_len(i); ++j)
+      raw[off++] = (uint8_t)(i + j);
+  }
+  assert(compress(out, &len, raw, off) == Z_OK);
+  free(raw);
+  *raw_len = off;
+  return len;
+}
+
+static int
+run(ex_inflate_t *inf, const uint8_t *body, size_t len, int stop_at, got_t *got) {
+  ex_frame_t frame;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.ver = EX_VER_ZLIB;
+  frame.op = EX_OP_MESSAGE;
+  frame.body = body;
+  frame.body_len = len;
+  memset(got, 0, sizeof(*got));
+  got->inf = inf;
+  got->stop_at = stop_at;
+  return ex_inflate_frame(inf, &frame, on_frame, got);
+}
+
+/* Windows smaller than one frame, than the header, and larger than all */
+static void
+test_windows(void) {
+  static const size_t windows[] = { 1, 7, 16, 100, 401, 0 };
+  uint8_t batch[32768];
+  size_t raw_len = 0;
+  size_t len = make_batch(batch, sizeof(batch), &raw_len);
+  ex_inflate_t inf;
+  got_t got;
+
+  for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w) {
+    assert(ex_inflate_init(&inf, windows[w]) == 0);
+    for (int pass = 0; pass < 2; ++pass) {
+      assert(run(&inf, batch, len, -1, &got) == 0);
+      assert(got.count == INNER && got.nested_rc == UV_EBUSY);
+    }
+    assert(inf.packets == 2 && inf.bytes_out == 2 * raw_len);
+    ex_inflate_free(&inf);
+  }
+}
+
+static void
+test_damage(void) {
+  uint8_t batch[32768], cut[32768], raw[32768];
+  size_t raw_len = 0;
+  size_t len = make_batch(batch, sizeof(batch), &raw_len);
+  uLongf cut_len = sizeof(cut);
+  uLongf raw_out = sizeof(raw);
+  ex_inflate_t inf;
+  got_t got;
+
+  assert(ex_inflate_init(&inf, 256) == 0);
+
+  /* Stream cut short */
+  assert(run(&inf, batch, len / 2, -1, &got) == UV_EPROTO);
+
+  /* Not zlib at all */
+  assert(run(&inf, (const uint8_t *)"not deflate", 11, -1, &got) == UV_EPROTO);
+
+  /* Whole stream, but the last frame in it cut short */
+  assert(uncompress(raw, &raw_out, batch, len) == Z_OK);
+  assert(compress(cut, &cut_len, raw, raw_len - 3) == Z_OK);
+  assert(run(&inf, cut, cut_len, -1, &got) == UV_EPROTO);
+  assert(got.count == INNER - 1);
+
+  /* The callback's error, and the inflater still fine afterwards */
+  assert(run(&inf, batch, len, 5, &got) == UV_ECANCELED);
+  assert(got.count == 5);
+  assert(run(&inf, batch, len, -1, &got) == 0 && got.count == INNER);
+  ex_inflate_free(&inf);
+}
+
+int
+main(void) {
+  test_windows();
+  test_damage();
+  printf("test_inflate: ok\n");
+  return 0;
+}
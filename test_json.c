@@ -0,0 +1,144 @@
+/* ex_json: lookups over strings and containers that cross 16-byte blocks. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <uv.h>
+
+#include "ex_json.h"
+
+/* In an allocation of exactly `len`, so a read past it shows under ASan */
+static int
+get(const char *json, size_t len, const char *path, ex_json_val_t *val, char **copy) {
+  *copy = malloc(len ? len : 1);
+  memcpy(*copy, json, len);
+  return ex_json_get(*copy, len, path, val);
+}
+
+static int
+val_is(const ex_json_val_t *val, int type, const char *text) {
+  return val->type == type && val->len == strlen(text) && memcmp(val->data, text, val->len) == 0;
+}
+
+/* An escaped quote and backslash at every offset into a block, in a string
+ * a lookup must step over, and in one it returns */
+static void
+test_escapes(void) {
+  char json[256], want[128];
+  ex_json_val_t val;
+  char *copy = NULL;
+  size_t len = 0;
+
+  for (int pad = 0; pad <= 40; ++pad) {
+    snprintf(want, sizeof(want), "%.*s\\\"\\\\\\\"}]x", pad, "........................................");
+    len = snprintf(json, sizeof(json), "{\"a\":[1,{\"x\":\"%s\"}],\"b\":\"%s\",\"cmd\":\"go\"}", want, want);
+
+    assert(get(json, len, "cmd", &val, &copy) == 1);
+    assert(val_is(&val, EX_JSON_STRING, "go"));
+    free(copy);
+    assert(get(json, len, "b", &val, &copy) == 1);
+    assert(val_is(&val, EX_JSON_STRING, want));
+    free(copy);
+    assert(get(json, len, "a.1.x", &val, &copy) == 1);
+    assert(val_is(&val, EX_JSON_STRING, want));
+    free(copy);
+  }
+
+  /* A backslash as the last byte of a block escapes the first of the next */
+  for (int pad = 0; pad <= 40; ++pad) {
+    len = snprintf(json, sizeof(json), "{\"s\":\"%.*s\\\"\",\"k\":true}", pad, "0123456789012345678901234567890123456789");
+    assert(get(json, len, "k", &val, &copy) == 1);
+    assert(val.type == EX_JSON_TRUE);
+    free(copy);
+  }
+}
+
+static void
+test_paths(void) {
+  static const char json[] =
+      "{ \"skip\": {\"s\": \"}]{[\", \"n\": [[{\"q\": \"\\\"}\"}]], \"t\": 1},\n"
+      "  \"data\": {\"uname\": \"bob\", \"uid\": 42},\n"
+      "  \"info\": [0, \"one\", [null, -1.5e3, false], {}],\n"
+      "  \"cmd\": \"DANMU_MSG\" }";
+  static const char *const paths[] = { "data.uname", "info.2.1", "info.3", "data.nope", "info.9" };
+  ex_json_val_t val, vals[5];
+  char *copy = NULL;
+
+  assert(get(json, sizeof(json) - 1, "data.uname", &val, &copy) == 1);
+  assert(val_is(&val, EX_JSON_STRING, "bob"));
+  free(copy);
+  assert(get(json, sizeof(json) - 1, "data.uid", &val, &copy) == 1);
+  assert(val_is(&val, EX_JSON_NUMBER, "42"));
+  free(copy);
+  assert(get(json, sizeof(json) - 1, "info.2.1", &val, &copy) == 1);
+  assert(val_is(&val, EX_JSON_NUMBER, "-1.5e3"));
+  free(copy);
+  assert(get(json, sizeof(json) - 1, "info.2.0", &val, &copy) == 1);
+  assert(val.type == EX_JSON_NULL);
+  free(copy);
+  assert(get(json, sizeof(json) - 1, "info.2", &val, &copy) == 1);
+  assert(val_is(&val, EX_JSON_ARRAY, "[null, -1.5e3, false]"));
+  free(copy);
+  assert(get(json, sizeof(json) - 1, "skip.t", &val, &copy) == 1);
+  assert(val_is(&val, EX_JSON_NUMBER, "1"));
+  free(copy);
+
+  /* Not there, or the path runs into a scalar */
+  assert(get(json, sizeof(json) - 1, "info.4", &val, &copy) == 0);
+  assert(val.type == EX_JSON_NONE);
+  free(copy);
+  assert(get(json, sizeof(json) - 1, "data.uname.x", &val, &copy) == 0);
+  free(copy);
+  assert(get(json, sizeof(json) - 1, "info.x", &val, &copy) == 0);
+  free(copy);
+
+  assert(ex_json_extract(json, sizeof(json) - 1, paths, 5, vals) == 3);
+  assert(vals[2].type == EX_JSON_OBJECT && vals[3].type == EX_JSON_NONE);
+
+  assert(ex_json_cmd(json, sizeof(json) - 1, &val) == 1);
+  assert(val_is(&val, EX_JSON_STRING, "DANMU_MSG"));
+  assert(ex_json_cmd("{\"cmd\":5}", 9, &val) == 0);
+  assert(val.type == EX_JSON_NONE);
+  assert(ex_json_cmd("{\"cmd\":{\"a\":1}}", 15, &val) == 0);
+}
+
+/* Every prefix of a document is either found whole or not found */
+static void
+test_truncated(void) {
+  static const char json[] =
+      "{\"a\":{\"b\":[\"x\\\"y\",{\"c\":\"0123456789abcdef0123\"}]},\"cmd\":\"LIVE\"}";
+  ex_json_val_t val;
+  char *copy = NULL;
+  int rc = 0;
+
+  for (size_t len = 0; len < sizeof(json); ++len) {
+    rc = get(json, len, "cmd", &val, &copy);
+    assert(rc == 0 || rc == 1 || rc == UV_EINVAL);
+    if (rc == 1)
+      assert(val_is(&val, EX_JSON_STRING, "LIVE"));
+    free(copy);
+    rc = get(json, len, "a.b.1.c", &val, &copy);
+    assert(rc == 0 || rc == 1 || rc == UV_EINVAL);
+    if (rc == 1)
+      assert(val_is(&val, EX_JSON_STRING, "0123456789abcdef0123"));
+    free(copy);
+  }
+
+  assert(get("", 0, "cmd", &val, &copy) == UV_EINVAL);
+  free(copy);
+  assert(get("{\"cmd\":", 7, "cmd", &val, &copy) == UV_EINVAL);
+  free(copy);
+  assert(get("{\"cmd\":\"ab", 10, "cmd", &val, &copy) == UV_EINVAL);
+  free(copy);
+}
+
+int
+main(void) {
+  test_escapes();
+  test_paths();
+  test_truncated();
+  printf("test_json: ok\n");
+  return 0;
+}
@@ -0,0 +1,72 @@
+/* ex_pool: slots are reused before the pool grows, aligned, and counted. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include <uv.h>
+
+#include "ex_pool.h"
+
+static void
+test_reuse(void) {
+  void *objs[10];
+  ex_pool_t pool;
+  void *obj = NULL;
+
+  assert(ex_pool_init(&pool, 0, 0) == UV_EINVAL);
+  assert(ex_pool_init(&pool, 13, 4) == 0);
+
+  for (int i = 0; i < 10; ++i) {
+    objs[i] = ex_pool_get(&pool);
+    assert(objs[i] && (uintptr_t)objs[i] % _Alignof(max_align_t) == 0);
+    memset(objs[i], i, 13);
+  }
+  assert(pool.chunk_allocs == 3 && pool.capacity == 12);
+  assert(pool.used == 10 && pool.peak == 10);
+
+  /* Writing a whole object leaves the others alone */
+  for (int i = 0; i < 10; ++i)
+    assert(((uint8_t *)objs[i])[0] == i && ((uint8_t *)objs[i])[12] == i);
+
+  /* Last in, first out, with no new chunk */
+  ex_pool_put(objs[3]);
+  ex_pool_put(objs[7]);
+  assert(ex_pool_get(&pool) == objs[7]);
+  assert(ex_pool_get(&pool) == objs[3]);
+  assert(pool.chunk_allocs == 3);
+
+  for (int i = 0; i < 10; ++i)
+    ex_pool_put(objs[i]);
+  ex_pool_put(NULL);
+  assert(pool.used == 0 && pool.peak == 10 && pool.gets == 12);
+
+  obj = ex_pool_get(&pool);
+  assert(obj && pool.chunk_allocs == 3);
+  ex_pool_free(&pool);
+  assert(pool.capacity == 0 && pool.chunks == NULL);
+}
+
+static void
+test_reserve(void) {
+  ex_pool_t pool;
+
+  assert(ex_pool_init(&pool, 64, 0) == 0);
+  assert(ex_pool_reserve(&pool, EX_POOL_PER_CHUNK + 1) == 0);
+  assert(pool.chunk_allocs == 2 && pool.capacity == 2 * EX_POOL_PER_CHUNK);
+  for (int i = 0; i < 2 * EX_POOL_PER_CHUNK; ++i)
+    assert(ex_pool_get(&pool));
+  assert(pool.chunk_allocs == 2);
+  assert(ex_pool_get(&pool) && pool.chunk_allocs == 3);
+  ex_pool_free(&pool);
+}
+
+int
+main(void) {
+  test_reuse();
+  test_reserve();
+  printf("test_pool: ok\n");
+  return 0;
+}
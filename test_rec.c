@@ -0,0 +1,356 @@
+/* ex_rec: records read back across rolls, and up to the damage in a
+ * truncated segment or one whose writer died mid-record; sought by time
+ * and by wall-clock time; followed, past the spare a killed writer left
+ * unstarted. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <uv.h>
+
+#include "ex_rec.h"
+
+#define SEG_LEN     (sizeof(ex_rec_seg_t) + EX_REC_INDEX_EVERY * 2)
+#define RECORDS     3000
+
+/* Where each record landed, from a clean read */
+static uint32_t seg_of[RECORDS];
+static size_t off_of[RECORDS];
+
+static uint32_t
+rec_len(int i) {
+  return 1 + (i * 37) % 300;
+}
+
+static void
+fill(uint8_t *buf, int i, uint32_t len) {
+  for (uint32_t j = 0; j < len; ++j)
+    buf[j] = (uint8_t)(i + j);
+}
+
+static void
+seg_path(char *path, size_t size, const char *dir, uint32_t seg_no) {
+  snprintf(path, size, "%s/%08u.exrec", dir, seg_no);
+}
+
+static void
+write_all(const char *dir, int n) {
+  uint8_t buf[512];
+  ex_rec_t rec;
+
+  assert(ex_rec_open(&rec, NULL, dir, SEG_LEN) == 0);
+  assert(ex_rec_frame(&rec, 1, 0, buf, 0) == UV_EINVAL);
+  assert(ex_rec_frame(&rec, 1, 0, buf, SEG_LEN) == UV_E2BIG);
+  for (int i = 0; i < n; ++i) {
+    fill(buf, i, rec_len(i));
+    assert(ex_rec_frame(&rec, 1000 * (i + 1), i, buf, rec_len(i)) == 0);
+  }
+  assert(rec.records == (uint64_t)n && rec.dropped == 1);
+  assert(ex_rec_close(&rec) == 0);
+}
+
+static void
+check_record(const ex_rec_hdr_t *hdr, const uint8_t *data, int i) {
+  uint8_t want[512];
+
+  assert(hdr->ts_ns == 1000 * (uint64_t)(i + 1));
+  assert(hdr->room == (uint32_t)i);
+  assert(hdr->len == rec_len(i));
+  fill(want, i, hdr->len);
+  assert(memcmp(data, want, hdr->len) == 0);
+}
+
+/* Reads everything, checking records come in order, `skip` aside. Returns
+ * how many, or the error that ended the read. */
+static int
+read_all(const char *dir, int (*skip)(int i), int *rc) {
+  const ex_rec_hdr_t *hdr = NULL;
+  const uint8_t *data = NULL;
+  ex_rec_reader_t r;
+  int i = 0;
+  int n = 0;
+
+  assert(ex_rec_reader_open(&r, dir) == 0);
+  while ((*rc = ex_rec_reader_next(&r, &hdr, &data)) == 1) {
+    while (skip && i < RECORDS && skip(i))
+      i++;
+    assert(i < RECORDS);
+    check_record(hdr, data, i);
+    seg_of[i] = r.seg_no;
+    off_of[i] = (const uint8_t *)hdr - r.base;
+    i++;
+    n++;
+  }
+  ex_rec_reader_close(&r);
+  return n;
+}
+
+static void
+clear_dir(const char *dir) {
+  char path[EX_REC_PATH_MAX + 32];
+  struct dirent *ent = NULL;
+  DIR *d = opendir(dir);
+
+  while (d && (ent = readdir(d))) {
+    if (ent->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    unlink(path);
+  }
+  if (d)
+    closedir(d);
+}
+
+static void
+test_roundtrip(const char *dir) {
+  const ex_rec_hdr_t *hdr = NULL;
+  const uint8_t *data = NULL;
+  ex_rec_reader_t r;
+  int rc = 0;
+
+  write_all(dir, RECORDS);
+  assert(read_all(dir, NULL, &rc) == RECORDS && rc == 0);
+  assert(seg_of[RECORDS - 1] >= 3);
+
+  /* Into a later segment through the index, then to a time between two */
+  assert(ex_rec_reader_open(&r, dir) == 0);
+  assert(ex_rec_reader_seek(&r, 1000 * 2001) == 0);
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 1);
+  check_record(hdr, data, 2000);
+  assert(ex_rec_reader_seek(&r, 1000 * 2500 - 1) == 0);
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 1);
+  check_record(hdr, data, 2499);
+  assert(ex_rec_reader_seek(&r, UINT64_MAX) == 0);
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 0);
+  ex_rec_reader_close(&r);
+}
+
+/* Each segment restamped as if recorded a second after the one before,
+ * from a fresh start of its own clock: ts_ns goes on from one to the next,
+ * wall-clock time does not */
+static void
+test_seek_wall(const char *dir) {
+  const ex_rec_hdr_t *hdr = NULL;
+  const uint8_t *data = NULL;
+  char path[EX_REC_PATH_MAX + 32];
+  const uint64_t wall0 = 1700000000ULL * 1000000000;
+  ex_rec_reader_t r;
+  ex_rec_seg_t seg;
+  int first[8];
+  int segs = 0;
+  int fd = -1;
+
+  for (int i = 0; i < RECORDS; ++i) {
+    if (i == 0 || seg_of[i] != seg_of[i - 1])
+      first[segs++] = i;
+  }
+  assert(segs >= 4 && segs <= 8);
+  for (int s = 0; s < segs; ++s) {
+    seg_path(path, sizeof(path), dir, s);
+    fd = open(path, O_RDWR);
+    assert(fd >= 0 && pread(fd, &seg, sizeof(seg), 0) == sizeof(seg));
+    seg.start_ns = 1000 * (uint64_t)(first[s] + 1);
+    seg.start_wall_ns = wall0 + s * 1000000000ULL;
+    assert(pwrite(fd, &seg, sizeof(seg), 0) == sizeof(seg));
+    close(fd);
+  }
+
+  /* Into segment 2, then to a time between 2 and 3, then before it all */
+  assert(ex_rec_reader_open(&r, dir) == 0);
+  assert(ex_rec_reader_seek_wall(&r, wall0 + 2000000000ULL + 1000 * 5) == 0);
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 1);
+  check_record(hdr, data, first[2] + 5);
+  assert(ex_rec_reader_wall(&r, hdr) == wall0 + 2000000000ULL + 1000 * 5);
+  assert(ex_rec_reader_seek_wall(&r, wall0 + 2500000000ULL) == 0);
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 1);
+  check_record(hdr, data, first[3]);
+  assert(ex_rec_reader_seek_wall(&r, wall0) == 0);
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 1);
+  check_record(hdr, data, first[3] + 1);
+  ex_rec_reader_close(&r);
+}
+
+static size_t cut_seg;
+static size_t cut_off;
+
+static int
+past_cut(int i) {
+  return seg_of[i] == cut_seg && off_of[i] + sizeof(ex_rec_hdr_t) + EX_REC_ALIGN(rec_len(i)) > cut_off;
+}
+
+/* A finished segment cut short, through a record's header and through its
+ * frame: the reader stops there and goes on with the next segment */
+static void
+test_truncated(const char *dir) {
+  char path[EX_REC_PATH_MAX + 32];
+  int mid = 0;
+  int rc = 0;
+  int n = 0;
+
+  for (int k = 0; k < 2; ++k) {
+    clear_dir(dir);
+    write_all(dir, RECORDS);
+    assert(read_all(dir, NULL, &rc) == RECORDS);
+
+    for (mid = 0; seg_of[mid] != 1; ++mid)
+      ;
+    mid += 20;
+    cut_seg = 1;
+    cut_off = off_of[mid] + (k ? sizeof(ex_rec_hdr_t) + 1 : 5);
+    seg_path(path, sizeof(path), dir, 1);
+    assert(truncate(path, cut_off) == 0);
+
+    n = read_all(dir, past_cut, &rc);
+    assert(rc == 0);
+    for (int i = mid; i < RECORDS && seg_of[i] == 1; ++i)
+      n++;
+    assert(n == RECORDS);
+  }
+
+  /* Shorter than its header: an error, after everything before it */
+  clear_dir(dir);
+  write_all(dir, RECORDS);
+  read_all(dir, NULL, &rc);
+  seg_path(path, sizeof(path), dir, seg_of[RECORDS - 1]);
+  assert(truncate(path, sizeof(ex_rec_seg_t) - 1) == 0);
+  n = read_all(dir, NULL, &rc);
+  assert(rc == UV_EINVAL);
+  assert(n > 0 && seg_of[n - 1] == seg_of[RECORDS - 1] - 1);
+}
+
+/* A writer killed between copying a frame and storing its length, leaving
+ * the segment unfinished and full size */
+static void
+test_torn(const char *dir) {
+  const ex_rec_hdr_t *hdr = NULL;
+  const uint8_t *data = NULL;
+  char path[EX_REC_PATH_MAX + 32];
+  ex_rec_reader_t r;
+  uint8_t buf[512];
+  struct stat st;
+  ex_rec_t rec;
+  int status = 0;
+  pid_t pid = 0;
+  int n = 0;
+
+  clear_dir(dir);
+  pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    if (ex_rec_open(&rec, NULL, dir, SEG_LEN) < 0)
+      _exit(1);
+    for (int i = 0; i < 100; ++i) {
+      fill(buf, i, rec_len(i));
+      ex_rec_frame(&rec, 1000 * (i + 1), i, buf, rec_len(i));
+    }
+    ((ex_rec_hdr_t *)(rec.base + rec.end - sizeof(ex_rec_hdr_t) - EX_REC_ALIGN(rec_len(99))))->len = 0;
+    _exit(0);
+  }
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  assert(ex_rec_reader_open(&r, dir) == 0);
+  while (ex_rec_reader_next(&r, &hdr, &data) == 1)
+    check_record(hdr, data, n++);
+  assert(n == 99);
+  ex_rec_reader_close(&r);
+
+  /* Never finished: still full size, nothing after segment 0 */
+  seg_path(path, sizeof(path), dir, 0);
+  assert(stat(path, &st) == 0 && (size_t)st.st_size == SEG_LEN);
+  seg_path(path, sizeof(path), dir, 1);
+  assert(stat(path, &st) < 0);
+}
+
+/* A spare made ahead of time by a writer since killed, as seg_create()
+ * leaves one: stamped, sized and never started */
+static void
+leave_spare(const char *dir, uint32_t seg_no) {
+  char path[EX_REC_PATH_MAX + 32];
+  ex_rec_seg_t seg;
+  int fd = -1;
+
+  memset(&seg, 0, sizeof(seg));
+  memcpy(seg.magic, EX_REC_MAGIC, sizeof(seg.magic));
+  seg.seg_no = seg_no;
+  seg.seg_len = SEG_LEN;
+  seg_path(path, sizeof(path), dir, seg_no);
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+  assert(fd >= 0);
+  assert(write(fd, &seg, sizeof(seg)) == sizeof(seg));
+  assert(ftruncate(fd, SEG_LEN) == 0);
+  close(fd);
+}
+
+static void
+test_follow(const char *dir) {
+  const ex_rec_hdr_t *hdr = NULL;
+  const uint8_t *data = NULL;
+  ex_rec_reader_t r, tail;
+  uint8_t buf[512];
+  ex_rec_t dead, rec;
+  int n = 0;
+
+  clear_dir(dir);
+  assert(ex_rec_open(&dead, NULL, dir, SEG_LEN) == 0);
+  for (; n < 10; ++n) {
+    fill(buf, n, rec_len(n));
+    assert(ex_rec_frame(&dead, 1000 * (n + 1), n, buf, rec_len(n)) == 0);
+  }
+  leave_spare(dir, 1);
+
+  assert(ex_rec_reader_open(&r, dir) == 0);
+  r.follow = 1;
+  for (int i = 0; i < 10; ++i) {
+    assert(ex_rec_reader_next(&r, &hdr, &data) == 1);
+    check_record(hdr, data, i);
+  }
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 0);
+
+  /* Restarted: its first segment goes after the spare */
+  assert(ex_rec_open(&rec, NULL, dir, SEG_LEN) == 0);
+  assert(rec.seg_no == 2);
+  assert(ex_rec_reader_next(&r, &hdr, &data) == 0);
+  for (; n < 20; ++n) {
+    fill(buf, n, rec_len(n));
+    assert(ex_rec_frame(&rec, 1000 * (n + 1), n, buf, rec_len(n)) == 0);
+  }
+  for (int i = 10; i < 20; ++i) {
+    assert(ex_rec_reader_next(&r, &hdr, &data) == 1);
+    check_record(hdr, data, i);
+  }
+  assert(r.seg_no == 2 && ex_rec_reader_next(&r, &hdr, &data) == 0);
+
+  /* Tailing lands there too */
+  assert(ex_rec_reader_open(&tail, dir) == 0);
+  assert(ex_rec_reader_tail(&tail) == 0 && tail.seg_no == 2);
+  assert(ex_rec_reader_next(&tail, &hdr, &data) == 0);
+
+  ex_rec_reader_close(&tail);
+  ex_rec_reader_close(&r);
+  assert(ex_rec_close(&rec) == 0);
+  assert(ex_rec_close(&dead) == 0);
+}
+
+int
+main(void) {
+  char dir[] = "/tmp/test_rec.XXXXXX";
+
+  assert(mkdtemp(dir));
+  test_roundtrip(dir);
+  test_seek_wall(dir);
+  test_truncated(dir);
+  test_torn(dir);
+  test_follow(dir);
+  clear_dir(dir);
+  rmdir(dir);
+  printf("test_rec: ok\n");
+  return 0;
+}
@@ -0,0 +1,68 @@
+/* ex_state: the connection lifecycle through the table, and what it turns
+ * away. */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <uv.h>
+
+#include "ex_state.h"
+
+static void
+test_paths(void) {
+  static const int happy[][2] = {
+    { EX_EV_START,      EX_ST_RESOLVING },
+    { EX_EV_RESOLVED,   EX_ST_CONNECTING },
+    { EX_EV_CONNECTED,  EX_ST_HANDSHAKING },
+    { EX_EV_AUTH_REPLY, EX_ST_STREAMING },
+    { EX_EV_CLOSE,      EX_ST_DRAINING },
+    { EX_EV_DRAINED,    EX_ST_CLOSED },
+    { EX_EV_START,      EX_ST_RESOLVING },
+  };
+  int state = EX_ST_IDLE;
+
+  for (size_t i = 0; i < sizeof(happy) / sizeof(happy[0]); ++i) {
+    state = ex_state_next(state, happy[i][0]);
+    assert(state == happy[i][1]);
+  }
+
+  /* Errors and timeouts close from anywhere connected or on the way */
+  for (int s = EX_ST_RESOLVING; s <= EX_ST_DRAINING; ++s) {
+    assert(ex_state_next(s, EX_EV_ERROR) == EX_ST_CLOSED);
+    assert(ex_state_next(s, EX_EV_TIMEOUT) == EX_ST_CLOSED);
+  }
+}
+
+static void
+test_rejects(void) {
+  assert(ex_state_next(EX_ST_IDLE, EX_EV_CONNECTED) == UV_EINVAL);
+  assert(ex_state_next(EX_ST_STREAMING, EX_EV_START) == UV_EINVAL);
+  assert(ex_state_next(EX_ST_DRAINING, EX_EV_CLOSE) == UV_EINVAL);
+  assert(ex_state_next(EX_ST_CLOSED, EX_EV_ERROR) == UV_EINVAL);
+  assert(ex_state_next(-1, EX_EV_START) == UV_EINVAL);
+  assert(ex_state_next(EX_ST_COUNT, EX_EV_START) == UV_EINVAL);
+  assert(ex_state_next(EX_ST_IDLE, EX_EV_COUNT) == UV_EINVAL);
+}
+
+/* Every state and event named, deadlines only where something is awaited */
+static void
+test_names(void) {
+  for (int s = 0; s < EX_ST_COUNT; ++s)
+    assert(ex_states[s].name && strcmp(ex_state_name(s), "?") != 0);
+  for (int e = 0; e < EX_EV_COUNT; ++e)
+    assert(strcmp(ex_event_name(e), "?") != 0);
+  assert(strcmp(ex_state_name(EX_ST_COUNT), "?") == 0);
+  assert(strcmp(ex_event_name(-1), "?") == 0);
+  assert(ex_states[EX_ST_IDLE].deadline_ms == 0 && ex_states[EX_ST_CLOSED].deadline_ms == 0);
+  assert(ex_states[EX_ST_STREAMING].deadline_ms == EX_IDLE_DEADLINE_MS);
+}
+
+int
+main(void) {
+  test_paths();
+  test_rejects();
+  test_names();
+  printf("test_state: ok\n");
+  return 0;
+}